@@ -113,6 +113,7 @@ LruCachePolicy::LruCachePolicy(const char* index_filename) :
 }
 
 LruCachePolicy::~LruCachePolicy() {
+  pthread_mutex_destroy(&query_mutex_);
 }
 
 // Queues the requested range to be loaded into the cache: ['starting_block_num', 'ending_block_num')
@@ -199,13 +200,15 @@ int LruCachePolicy::QueueBlocks(uint64_t starting_block_num, uint64_t ending_blo
     }
   }
 
-  pthread_mutex_unlock(&query_mutex_);  // Safe to unlock the mutex because from this point on, not modifying any global or classwise structures.
-
+  // The requests must be submitted before the mutex is released. Otherwise, a concurrent query that finds one of these blocks in the cache map could call
+  // GetBlock() and wait on an aiocb that has not been submitted yet. Since we don't wait for completion, this does not hold the lock for long.
   int lio_listio_ret = lio_listio(LIO_NOWAIT, aiocb_list, curr_aiocb_list_item, NULL);
   if (lio_listio_ret < 0) {
     GetErrorLogger().LogErrno("lio_listio() in LruCachePolicy::QueueBlocks()", errno, true);
   }
 
+  pthread_mutex_unlock(&query_mutex_);  // Safe to unlock the mutex because from this point on, not modifying any global or classwise structures.
+
   return num_disk_blocks;
 }
 
@@ -219,38 +222,82 @@ uint32_t* LruCachePolicy::GetBlock(uint64_t block_num) {
   assert(cache_map_.find(block_num) != cache_map_.end());
 
   int cache_block = MoveToBack(cache_map_[block_num], block_num)->first;
+  bool block_ready = cache_block_info_.IsBlockReady(cache_block);
 
   pthread_mutex_unlock(&query_mutex_);  // Safe to unlock mutex.
 
   // Only do this the first time we load the block from disk.
-  if (!cache_block_info_.IsBlockReady(cache_block)) {
+  // Since the block is pinned by us, it can't be evicted (and it's aiocb reused) while we're waiting on it without holding the mutex.
+  if (!block_ready) {
     struct aiocb* cblist[1];
     cblist[0] = cache_block_info_.aiocb(cache_block);
-    int ret = aio_suspend(cblist, 1, NULL);
-    assert(ret == 0);
-
-    // Check whether the request completed successfully.
-    ret = aio_error(cache_block_info_.aiocb(cache_block));
-    assert(ret == 0);
-
-    // Get the return status. Should only be called once, otherwise, result is undefined.
-    ret = aio_return(cache_block_info_.aiocb(cache_block));
-    assert(ret != -1 && ret == static_cast<int>(kBlockSize));
+    // A signal could interrupt the wait before the read completes.
+    int ret;
+    while ((ret = aio_suspend(cblist, 1, NULL)) < 0 && errno == EINTR) {
+    }
+    if (ret < 0) {
+      GetErrorLogger().LogErrno("aio_suspend() in LruCachePolicy::GetBlock()", errno, true);
+    }
 
-    cache_block_info_.ReadyBlock(cache_block);
+    // Several queries could have been waiting on the same block, but only one of them should collect the return status.
+    pthread_mutex_lock(&query_mutex_);
+    if (!cache_block_info_.IsBlockReady(cache_block)) {
+      CompleteBlock(cache_block);
+    }
+    pthread_mutex_unlock(&query_mutex_);
   }
 
   uint32_t* buffer = block_cache_ + (cache_block * kBlockSize / sizeof(*block_cache_));
   return buffer;
 }
 
+// Assumes that the blocks in the range have been previously queued by a call to QueueBlocks() (and are thus pinned).
+// Unlike GetBlock(), this never waits; any blocks whose disk reads have completed in the meantime are marked as ready.
+bool LruCachePolicy::BlocksReady(uint64_t starting_block_num, uint64_t ending_block_num) {
+  pthread_mutex_lock(&query_mutex_);
+
+  bool blocks_ready = true;
+  for (uint64_t block_num = starting_block_num; block_num < ending_block_num; ++block_num) {
+    // The block should be in the cache already.
+    assert(cache_map_.find(block_num) != cache_map_.end());
+
+    int cache_block = cache_map_[block_num]->first;
+    if (!cache_block_info_.IsBlockReady(cache_block)) {
+      if (aio_error(cache_block_info_.aiocb(cache_block)) == EINPROGRESS) {
+        blocks_ready = false;
+        break;
+      }
+      CompleteBlock(cache_block);
+    }
+  }
+
+  pthread_mutex_unlock(&query_mutex_);
+  return blocks_ready;
+}
+
+void LruCachePolicy::CompleteBlock(int cache_block) {
+  // Check whether the request completed successfully.
+  int ret = aio_error(cache_block_info_.aiocb(cache_block));
+  assert(ret == 0);
+
+  // Get the return status. Should only be called once, otherwise, result is undefined.
+  ret = aio_return(cache_block_info_.aiocb(cache_block));
+  assert(ret != -1 && ret == static_cast<int>(kBlockSize));
+
+  cache_block_info_.ReadyBlock(cache_block);
+}
+
 // Unpins the block. Note that for a block to be unpinned, every list sharing this block must unpin it.
 // This handles the case when a block is shared by several lists, which occurs in adjacent lists.
 void LruCachePolicy::FreeBlock(uint64_t block_num) {
+  pthread_mutex_lock(&query_mutex_);  // The pin counts are shared with any concurrently running queries.
+
   assert(cache_map_.find(block_num) != cache_map_.end());
 
   int cache_block = cache_map_[block_num]->first;
   cache_block_info_.UnpinBlock(cache_block);
+
+  pthread_mutex_unlock(&query_mutex_);
 }
 
 LruCachePolicy::LruList::iterator LruCachePolicy::MoveToBack(LruList::iterator lru_list_itr, uint64_t block_num) {
@@ -310,6 +357,11 @@ int MergingCachePolicy::QueueBlocks(uint64_t starting_block_num, uint64_t ending
   return ending_block_num - starting_block_num;
 }
 
+bool MergingCachePolicy::BlocksReady(uint64_t starting_block_num, uint64_t ending_block_num) {
+  // Blocks are read in synchronously.
+  return true;
+}
+
 void MergingCachePolicy::FreeBlock(uint64_t block_num) {
   // Nothing to be done when merging.
 }
@@ -360,6 +412,10 @@ int FullContiguousCachePolicy::QueueBlocks(uint64_t starting_block_num, uint64_t
   return 0;
 }
 
+bool FullContiguousCachePolicy::BlocksReady(uint64_t starting_block_num, uint64_t ending_block_num) {
+  return true;
+}
+
 void FullContiguousCachePolicy::FreeBlock(uint64_t block_num) {
 }
 
@@ -409,5 +465,9 @@ int MemoryMappedCachePolicy::QueueBlocks(uint64_t starting_block_num, uint64_t e
   return 0;
 }
 
+bool MemoryMappedCachePolicy::BlocksReady(uint64_t starting_block_num, uint64_t ending_block_num) {
+  return true;
+}
+
 void MemoryMappedCachePolicy::FreeBlock(uint64_t block_num) {
 }
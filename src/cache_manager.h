@@ -178,6 +178,9 @@ public:
 
   virtual int QueueBlocks(uint64_t starting_block_num, uint64_t ending_block_num) = 0;
 
+  // Returns true if all the blocks in the range (which must have been previously queued) can be gotten without waiting on any disk I/O.
+  virtual bool BlocksReady(uint64_t starting_block_num, uint64_t ending_block_num) = 0;
+
   virtual uint32_t* GetBlock(uint64_t block_num) = 0;
 
   virtual void FreeBlock(uint64_t block_num) = 0;
@@ -224,6 +227,8 @@ public:
 
   int QueueBlocks(uint64_t starting_block_num, uint64_t ending_block_num);
 
+  bool BlocksReady(uint64_t starting_block_num, uint64_t ending_block_num);
+
   uint32_t* GetBlock(uint64_t block_num);
 
   void FreeBlock(uint64_t block_num);
@@ -240,6 +245,9 @@ private:
   // Returns the new iterator to the last element in the list.
   LruList::iterator MoveToBack(LruList::iterator lru_list_itr, uint64_t block_num);
 
+  // Collects the status of the completed disk read into 'cache_block' and marks it as ready. Must be called with the mutex held.
+  void CompleteBlock(int cache_block);
+
   CacheBlockInfo cache_block_info_;
 
   // Access to the block cache must be concurrent safe.
@@ -266,6 +274,8 @@ public:
 
   int QueueBlocks(uint64_t starting_block_num, uint64_t ending_block_num);
 
+  bool BlocksReady(uint64_t starting_block_num, uint64_t ending_block_num);
+
   uint32_t* GetBlock(uint64_t block_num);
 
   void FreeBlock(uint64_t block_num);
@@ -289,6 +299,8 @@ public:
 
   int QueueBlocks(uint64_t starting_block_num, uint64_t ending_block_num);
 
+  bool BlocksReady(uint64_t starting_block_num, uint64_t ending_block_num);
+
   uint32_t* GetBlock(uint64_t block_num);
 
   void FreeBlock(uint64_t block_num);
@@ -310,6 +322,8 @@ public:
 
   int QueueBlocks(uint64_t starting_block_num, uint64_t ending_block_num);
 
+  bool BlocksReady(uint64_t starting_block_num, uint64_t ending_block_num);
+
   uint32_t* GetBlock(uint64_t block_num);
 
   void FreeBlock(uint64_t block_num);
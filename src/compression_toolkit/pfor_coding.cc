@@ -160,17 +160,19 @@ int pfor_coding::pfor_encode(unsigned int** w, unsigned int* p, int num) {
 int pfor_coding::Decompression(unsigned int* input, unsigned int* output, int size) {
   unsigned int* tmp = input;
   int flag = *tmp;
-  b = cnum[((flag >> 12) & 15) + 2];
-  unpack_count = ((flag >> 12) & 15) + 2;
-  t = (flag >> 10) & 3;
-  start = flag & 1023;
 
   tmp++;
   tmp = pfor_decode(output, tmp, flag);
   return tmp - input;
 }
 
+// The decoding parameters are extracted from 'flag' into local variables (rather than members) so that decoding is safe to do from multiple threads.
 unsigned* pfor_coding::pfor_decode(unsigned int* _p, unsigned int* _w, int flag) {
+  int b = cnum[((flag >> 12) & 15) + 2];
+  int unpack_count = ((flag >> 12) & 15) + 2;
+  int t = (flag >> 10) & 3;
+  int start = flag & 1023;
+
   int i, s;
   unsigned int x;
   (unpack[unpack_count])(_p, _w, block_size);
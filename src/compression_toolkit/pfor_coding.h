@@ -60,11 +60,6 @@ private:
 
   float FRAC;  // The percentage of exceptions in the array.
   int cnum[17];
-
-  int b;
-  int start;
-  int t;
-  int unpack_count;
 };
 
 #endif /* PFOR_CODING_H_ */
@@ -88,7 +88,7 @@ int rice_coding::Decompression(unsigned int* input, unsigned int* output, int si
   int i;
   unsigned int bp;
   unsigned int* tmp = input;
-  b = *tmp;
+  int b = *tmp;  // Local (rather than the member) so that decoding is safe to do from multiple threads.
   tmp++;
   for (i = 0, bp = 0; i < size; ++i) {
     output[i] = rice_decode(tmp, &bp, b);
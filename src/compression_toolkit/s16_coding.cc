@@ -114,13 +114,13 @@ int s16_coding::s16_encode(unsigned int* _w, unsigned int* _p, unsigned int m) {
 }
 
 int s16_coding::Decompression(unsigned int* input, unsigned int* output, int size) {
-  _p = output;
+  unsigned int* _p = output;  // Kept local (rather than as a member) so that decoding is safe to do from multiple threads.
   int num;
   unsigned int* tmp = input;
 
   int left = size;
   while (left > 0) {
-    num = s16_decode(tmp);
+    num = s16_decode(tmp, _p);
     tmp++;
     left -= num;
   }
@@ -128,7 +128,7 @@ int s16_coding::Decompression(unsigned int* input, unsigned int* output, int siz
   return tmp - input;
 }
 
-int s16_coding::s16_decode(unsigned int* _w) {
+int s16_coding::s16_decode(unsigned int* _w, unsigned int*& _p) {
   int _k = (*_w) >> 28;
   switch (_k) {
     case 0:
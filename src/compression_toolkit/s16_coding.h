@@ -51,9 +51,8 @@ public:
   void set_size(int size);
 private:
   int s16_encode(unsigned int* _w, unsigned int* _p, unsigned int m);
-  int s16_decode(unsigned int* _w);
+  int s16_decode(unsigned int* _w, unsigned int*& _p);
 
-  unsigned int* _p;
   int coding_type;
   uint32_t cnum[16];
 
@@ -98,13 +98,13 @@ int s9_coding::s9_encode(unsigned int* _w, unsigned int* _p, int M) {
 }
 
 int s9_coding::Decompression(unsigned int* input, unsigned int* output, int size) {
-  _p = output;
+  unsigned int* _p = output;  // Kept local (rather than as a member) so that decoding is safe to do from multiple threads.
   int num;
   unsigned* tmp = input;
 
   int left = size;
   while (left > 0) {
-    num = s9_decode(tmp);
+    num = s9_decode(tmp, _p);
     tmp++;
     left -= num;
   }
@@ -112,7 +112,7 @@ int s9_coding::Decompression(unsigned int* input, unsigned int* output, int size
   return tmp - input;
 }
 
-int s9_coding::s9_decode(unsigned int* _w) {
+int s9_coding::s9_decode(unsigned int* _w, unsigned int*& _p) {
   int _k;
   _k = (*_w) >> 28;
   switch (_k) {
@@ -51,11 +51,10 @@ public:
   void set_size(int size);
 private:
   int s9_encode(unsigned int* _w, unsigned int* _p, int M);
-  int s9_decode(unsigned int* _w);
+  int s9_decode(unsigned int* _w, unsigned int*& _p);
 
   int csize[9];
   int conum[9];
-  unsigned int* _p;
   int coding_type;
   int size;
 };
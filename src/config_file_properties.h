@@ -72,6 +72,16 @@ static const char kIndexingPositionCoding[] = "indexing_position_coding";
 // The coding policy to be used for compressing the block header.
 static const char kIndexingBlockHeaderCoding[] = "indexing_block_header_coding";
 
+// Controls whether a forward index (mapping each docID to the termIDs and frequencies of the terms in the document) will be generated for the final index, for
+// extracting second stage ranking features. It is generated at the end of indexing if the whole collection fits into a single index, or at the end of merging.
+static const char kIncludeForwardIndex[] = "include_forward_index";
+
+// The coding policy to be used for compressing the termID gaps and the frequencies in the forward index.
+static const char kForwardIndexCoding[] = "forward_index_coding";
+
+// The number of postings to collect in main memory in each pass over the index when generating the forward index.
+static const char kForwardIndexBufferSize[] = "forward_index_buffer_size";
+
 /**************************************************************************************************************************************************************
  * Merging Parameters
  *
@@ -104,6 +114,14 @@ static const char kNumLayers[] = "num_layers";
 // Controls the layering strategy. Valid values include 'percentage-lower-bounded', 'percentage-lower-upper-bounded', and 'exponentially-increasing'.
 static const char kLayeringStrategy[] = "layering_strategy";
 
+// Controls whether the layered index stores quantized partial BM25 scores (impacts) in place of the frequencies, so that the query processor can score
+// postings without computing BM25.
+static const char kQuantizeImpacts[] = "quantize_impacts";
+
+// This is subject to 'MAX_LIST_LAYERS' defined in 'index_layout_parameters.h'. It controls the (max) number of impact segments per list in an impact ordered
+// index.
+static const char kNumImpactSegments[] = "num_impact_segments";
+
 /**************************************************************************************************************************************************************
  * Querying Parameters
  *
@@ -121,13 +139,17 @@ static const char kBlockCacheSize[] = "block_cache_size";
 // The number of blocks to read ahead from a list into the cache.
 static const char kReadAheadBlocks[] = "read_ahead_blocks";
 
+// The size (in MiB) of the cache of decoded chunks, which is shared by all queries so that hot chunks don't have to be decoded over and over again.
+// A value of 0 disables the decoded chunk cache. It's not used when positions are being used.
+static const char kDecodedChunkCacheSize[] = "decoded_chunk_cache_size";
+
 // Size of the hash table used for the lexicon.
 static const char kLexiconSize[] = "lexicon_size";
 
 // The maximum number of results returned by the query processor.
 static const char kMaxNumberResults[] = "max_number_results";
 
-// Controls whether positions will be utilized if the index was built with positions.
+// Controls whether positions will be utilized if the index was built with positions. Quoted phrases in queries are only matched when they are.
 static const char kUsePositions[] = "use_positions";
 
 // Controls whether an in-memory block level index will be built on startup and used to skip fetching/decoding unnecessary blocks.
@@ -137,6 +159,68 @@ static const char kUseBlockLevelIndex[] = "use_block_level_index";
 // Valid values are either 'stdin'/'cin' or the path to the batch query file.
 static const char kBatchQueryInputFile[] = "batch_query_input_file";
 
+// Where the query server listens for client connections. Valid values are either the path to a Unix domain socket or a port number, in which case the server
+// listens on that TCP port of the loopback interface.
+static const char kServerAddress[] = "server_address";
+
+// The number of threads that will be executing batch queries concurrently. Note that when the index is not memory resident or memory mapped,
+// the 'block_cache_size' must be large enough to hold the read ahead blocks of the queries running in all the threads.
+static const char kNumQueryThreads[] = "num_query_threads";
+
+// The max number of batch queries each query thread keeps staged, with the first blocks of their lists being read in asynchronously. A thread executes
+// whichever staged query has its blocks in the cache, overlapping the disk I/O of some queries with the CPU work of others. Queries may then complete out of
+// order. A value of 1 disables the query pipeline.
+static const char kQueryPipelineDepth[] = "query_pipeline_depth";
+
+// The file to write a per query execution trace to when running batch queries, one JSON record per line with the counts of the work done by the query
+// (NextGEQ() calls, chunks decoded, blocks and chunks skipped, postings scored, top-k heap insertions, threshold changes, and bytes read). A value of 'none'
+// turns off tracing.
+static const char kQueryTraceFile[] = "query_trace_file";
+
+// The number of threads a single WAND or MaxScore query will be run on. The docID space is split into this many equally sized ranges, each processed by its
+// own thread, with the threads sharing the top-k threshold. A value of 1 disables intra-query parallelism. Any larger value also builds the block level index.
+static const char kNumIntraQueryThreads[] = "num_intra_query_threads";
+
+// Intra-query parallelism is only used for queries whose lists hold at least this many postings in total; shorter queries aren't worth the thread overhead.
+static const char kIntraQueryMinPostings[] = "intra_query_min_postings";
+
+// The max number of postings the score-at-a-time algorithm will process for a single query before returning the results it has so far. 0 means no limit.
+static const char kSaatPostingsBudget[] = "saat_postings_budget";
+
+// The max time (in milliseconds) the score-at-a-time algorithm will spend processing postings for a single query before returning the results it has so far.
+// 0 means no limit.
+static const char kSaatTimeBudget[] = "saat_time_budget";
+
+// Two term AND queries whose longer list has at most this many times the number of docIDs of the shorter list are intersected a chunk at a time with a SIMD
+// block compare kernel. Queries with more skewed list lengths skip through the longer list with NextGEQ() instead. A value of 0 disables the SIMD kernel.
+static const char kSimdIntersectionMaxRatio[] = "simd_intersection_max_ratio";
+
+// The max number of queries whose results are kept in the query result cache, which answers repeated queries without processing them again.
+// A value of 0 disables the result cache.
+static const char kResultCacheSize[] = "result_cache_size";
+
+// The max total number of docIDs held by the intersection cache, which holds the complete list intersections of frequent query term pairs for AND mode
+// queries. A value of 0 disables the intersection cache.
+static const char kIntersectionCacheSize[] = "intersection_cache_size";
+
+// The number of queries a term pair has to appear in before its intersection is admitted into the intersection cache.
+static const char kIntersectionCacheAdmissionCount[] = "intersection_cache_admission_count";
+
+// The number of top BM25 results of an OR mode query that are rescored by the proximity of the query terms in them, when positions are being used.
+// The final results are the top results out of these. A value of 0 disables proximity rescoring.
+static const char kProximityPoolSize[] = "proximity_pool_size";
+
+// The weight of the term proximity score, which is added to the BM25 score of the rescored results.
+static const char kProximityWeight[] = "proximity_weight";
+
+// The file with the sample queries (in the batch query format) that calibrate the cost model used to pick the query algorithm for each query, when the
+// query algorithm is 'auto'. Each query is run with every candidate algorithm when the index is loaded. A value of 'none' skips the calibration, and all
+// queries are then answered with the first candidate algorithm for the index.
+static const char kAutoAlgorithmCalibrationQueries[] = "auto_algorithm_calibration_queries";
+
+// The max number of queries read from the calibration query file.
+static const char kAutoAlgorithmCalibrationMaxQueries[] = "auto_algorithm_calibration_max_queries";
+
 /**************************************************************************************************************************************************************
  * Index DocID Remapping Parameters
  *
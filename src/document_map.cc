@@ -65,15 +65,27 @@ DocumentMapWriter::DocumentMapWriter(const char* basic_document_map_filename, co
 }
 
 DocumentMapWriter::~DocumentMapWriter() {
-  DumpBasicDocMapBuffer();
-  DumpExtendedDocMapBuffer();
+  Close();
   delete[] basic_doc_map_buffer_;
   delete[] extended_doc_map_buffer_;
+}
+
+void DocumentMapWriter::Close() {
+  if (basic_doc_map_fd_ < 0)
+    return;
+
+  DumpBasicDocMapBuffer();
+  basic_doc_map_buffer_len_ = 0;
+  DumpExtendedDocMapBuffer();
+  extended_doc_map_buffer_len_ = 0;
+
   int close_ret;
   close_ret = close(basic_doc_map_fd_);
   assert(close_ret != -1);
   close_ret = close(extended_doc_map_fd_);
   assert(close_ret != -1);
+  basic_doc_map_fd_ = -1;
+  extended_doc_map_fd_ = -1;
 }
 
 void DocumentMapWriter::AddDocLen(int doc_len, uint32_t doc_id) {
@@ -194,20 +206,18 @@ int DocumentMapReader::BasicDocMapSize() {
 }
 
 string DocumentMapReader::DecodeDocumentExtendedInfo(uint32_t doc_id, ExtendedInfoComponent component) const {
-  off_t seek_ret = lseek(extended_doc_map_fd_, basic_doc_map_buffer_[doc_id].extended_file_offset, SEEK_SET);
-  if (seek_ret < 0) {
-    GetErrorLogger().LogErrno("lseek() in DocumentMapReader::GetDocumentUrl()", errno, true);
-  }
-  assert(seek_ret == basic_doc_map_buffer_[doc_id].extended_file_offset);
+  // We use pread() with an explicit offset instead of seeking the shared file descriptor, so that multiple query threads can look up documents concurrently.
+  off_t read_offset = basic_doc_map_buffer_[doc_id].extended_file_offset;
 
   ssize_t read_ret;
 
   int docnum_len;
-  read_ret = read(extended_doc_map_fd_, &docnum_len, sizeof(docnum_len));
+  read_ret = pread(extended_doc_map_fd_, &docnum_len, sizeof(docnum_len), read_offset);
+  read_offset += sizeof(docnum_len);
   if (read_ret < 0) {
-    GetErrorLogger().LogErrno("read() in DocumentMapReader::DecodeDocumentExtendedInfo()", errno, true);
+    GetErrorLogger().LogErrno("pread() in DocumentMapReader::DecodeDocumentExtendedInfo()", errno, true);
   } else if (read_ret != sizeof(docnum_len)) {
-    GetErrorLogger().Log("read() in DocumentMapReader::DecodeDocumentExtendedInfo(): read " + Stringify(read_ret) + " bytes, but requested "
+    GetErrorLogger().Log("pread() in DocumentMapReader::DecodeDocumentExtendedInfo(): read " + Stringify(read_ret) + " bytes, but requested "
         + Stringify(sizeof(docnum_len)) + " bytes.", true);
   }
 
@@ -216,11 +226,12 @@ string DocumentMapReader::DecodeDocumentExtendedInfo(uint32_t doc_id, ExtendedIn
 #endif
 
   char* docnum_buffer = new char[docnum_len];
-  read_ret = read(extended_doc_map_fd_, docnum_buffer, docnum_len);
+  read_ret = pread(extended_doc_map_fd_, docnum_buffer, docnum_len, read_offset);
+  read_offset += docnum_len;
   if (read_ret < 0) {
-    GetErrorLogger().LogErrno("read() in DocumentMapReader::DecodeDocumentExtendedInfo()", errno, true);
+    GetErrorLogger().LogErrno("pread() in DocumentMapReader::DecodeDocumentExtendedInfo()", errno, true);
   } else if (read_ret != docnum_len) {
-    GetErrorLogger().Log("read() in DocumentMapReader::DecodeDocumentExtendedInfo(): read " + Stringify(read_ret) + " bytes, but requested "
+    GetErrorLogger().Log("pread() in DocumentMapReader::DecodeDocumentExtendedInfo(): read " + Stringify(read_ret) + " bytes, but requested "
         + Stringify(docnum_len) + " bytes.", true);
   }
 
@@ -232,11 +243,12 @@ string DocumentMapReader::DecodeDocumentExtendedInfo(uint32_t doc_id, ExtendedIn
   delete[] docnum_buffer;
 
   int url_len;
-  read_ret = read(extended_doc_map_fd_, &url_len, sizeof(url_len));
+  read_ret = pread(extended_doc_map_fd_, &url_len, sizeof(url_len), read_offset);
+  read_offset += sizeof(url_len);
   if (read_ret < 0) {
-    GetErrorLogger().LogErrno("read() in DocumentMapReader::DecodeDocumentExtendedInfo()", errno, true);
+    GetErrorLogger().LogErrno("pread() in DocumentMapReader::DecodeDocumentExtendedInfo()", errno, true);
   } else if (read_ret != sizeof(url_len)) {
-    GetErrorLogger().Log("read() in DocumentMapReader::DecodeDocumentExtendedInfo(): read " + Stringify(read_ret) + " bytes, but requested "
+    GetErrorLogger().Log("pread() in DocumentMapReader::DecodeDocumentExtendedInfo(): read " + Stringify(read_ret) + " bytes, but requested "
         + Stringify(sizeof(url_len)) + " bytes.", true);
   }
 
@@ -245,11 +257,12 @@ string DocumentMapReader::DecodeDocumentExtendedInfo(uint32_t doc_id, ExtendedIn
 #endif
 
   char* url_buffer = new char[url_len];
-  read_ret = read(extended_doc_map_fd_, url_buffer, url_len);
+  read_ret = pread(extended_doc_map_fd_, url_buffer, url_len, read_offset);
+  read_offset += url_len;
   if (read_ret < 0) {
-    GetErrorLogger().LogErrno("read() in DocumentMapReader::DecodeDocumentExtendedInfo()", errno, true);
+    GetErrorLogger().LogErrno("pread() in DocumentMapReader::DecodeDocumentExtendedInfo()", errno, true);
   } else if (read_ret != url_len) {
-    GetErrorLogger().Log("read() in DocumentMapReader::DecodeDocumentExtendedInfo(): read " + Stringify(read_ret) + " bytes, but requested "
+    GetErrorLogger().Log("pread() in DocumentMapReader::DecodeDocumentExtendedInfo(): read " + Stringify(read_ret) + " bytes, but requested "
         + Stringify(url_len) + " bytes.", true);
   }
 
@@ -140,6 +140,9 @@ public:
   DocumentMapWriter(const char* basic_document_map_filename, const char* extended_document_map_filename);
   ~DocumentMapWriter();
 
+  // Writes out whatever is still buffered and closes the document map files, so that they can be read before the writer is destroyed.
+  void Close();
+
   void AddDocLen(int doc_len, uint32_t doc_id);
 
   void AddDocUrl(const char* url, int url_len, uint32_t doc_id);
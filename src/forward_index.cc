@@ -0,0 +1,499 @@
+// Copyright (c) 2010, Roman Khmelichek
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//  2. Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//  3. Neither the name of Roman Khmelichek nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+//==============================================================================================================================================================
+// Author(s): Roman Khmelichek
+//
+//==============================================================================================================================================================
+
+#include "forward_index.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <queue>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cache_manager.h"
+#include "coding_policy_helper.h"
+#include "config_file_properties.h"
+#include "configuration.h"
+#include "globals.h"
+#include "index_configuration.h"
+#include "index_reader.h"
+#include "key_value_store.h"
+#include "logger.h"
+#include "meta_file_properties.h"
+using namespace std;
+
+/**************************************************************************************************************************************************************
+ * ForwardIndexGenerator::RunReader
+ *
+ * Reads back a run of sorted postings, a buffer at a time. The run file is removed once it's no longer needed.
+ **************************************************************************************************************************************************************/
+class ForwardIndexGenerator::RunReader {
+public:
+  RunReader(const string& run_filename);
+  ~RunReader();
+
+  // Advances to the next posting in the run. Returns false if there are no more.
+  bool Next();
+
+  const ForwardPosting& curr_posting() const {
+    return buffer_[buffer_pos_];
+  }
+
+private:
+  static const int kBufferSize = 8192;  // The number of postings read at a time.
+
+  string run_filename_;
+  int run_fd_;
+  ForwardPosting buffer_[kBufferSize];
+  int buffer_len_;
+  int buffer_pos_;
+};
+
+ForwardIndexGenerator::RunReader::RunReader(const string& run_filename) :
+  run_filename_(run_filename),
+  run_fd_(open(run_filename_.c_str(), O_RDONLY)),
+  buffer_len_(0),
+  buffer_pos_(0) {
+  if (run_fd_ < 0) {
+    GetErrorLogger().LogErrno("open() in ForwardIndexGenerator::RunReader::RunReader(), trying to open run '" + run_filename_ + "'", errno, true);
+  }
+}
+
+ForwardIndexGenerator::RunReader::~RunReader() {
+  int close_ret = close(run_fd_);
+  if (close_ret < 0) {
+    GetErrorLogger().LogErrno("close() in ForwardIndexGenerator::RunReader::~RunReader(), trying to close run", errno, false);
+  }
+
+  int remove_ret = remove(run_filename_.c_str());
+  if (remove_ret < 0) {
+    GetErrorLogger().LogErrno("remove() in ForwardIndexGenerator::RunReader::~RunReader(), could not remove run '" + run_filename_ + "'", errno, false);
+  }
+}
+
+bool ForwardIndexGenerator::RunReader::Next() {
+  if (++buffer_pos_ < buffer_len_)
+    return true;
+
+  ssize_t read_ret = read(run_fd_, buffer_, sizeof(buffer_));
+  if (read_ret < 0) {
+    GetErrorLogger().LogErrno("read() in ForwardIndexGenerator::RunReader::Next(), trying to read run", errno, true);
+  }
+  assert(read_ret % sizeof(buffer_[0]) == 0);
+
+  buffer_len_ = read_ret / sizeof(buffer_[0]);
+  buffer_pos_ = 0;
+  return buffer_len_ > 0;
+}
+
+/**************************************************************************************************************************************************************
+ * ForwardIndexGenerator::RunReaderComparison
+ *
+ * Orders the runs being merged so that the run with the lowest current posting is at the top of the heap.
+ **************************************************************************************************************************************************************/
+struct ForwardIndexGenerator::RunReaderComparison {
+  bool operator()(const RunReader* lhs, const RunReader* rhs) const {
+    return rhs->curr_posting() < lhs->curr_posting();
+  }
+};
+
+/**************************************************************************************************************************************************************
+ * ForwardIndexGenerator
+ *
+ **************************************************************************************************************************************************************/
+ForwardIndexGenerator::ForwardIndexGenerator(const IndexFiles& index_files) :
+  index_files_(index_files),
+  forward_index_fd_(-1),
+  coding_policy_str_(Configuration::GetConfiguration().GetValue(config_properties::kForwardIndexCoding)),
+  term_compressor_(CodingPolicy::kFrequency),
+  buffer_size_(Configuration::GetResultValue(Configuration::GetConfiguration().GetNumericalValue(config_properties::kForwardIndexBufferSize))),
+  first_doc_id_in_index_(0),
+  last_doc_id_in_index_(0),
+  index_posting_count_(0),
+  index_supported_(true),
+  num_runs_(0),
+  curr_offset_(0),
+  max_doc_num_terms_(0) {
+  coding_policy_helper::LoadPolicyAndCheck(term_compressor_, coding_policy_str_, "forward index");
+
+  if (buffer_size_ <= 0) {
+    Configuration::ErroneousValue(config_properties::kForwardIndexBufferSize, Stringify(buffer_size_));
+  }
+
+  IndexConfiguration index_meta_info(index_files_.meta_info_filename().c_str());
+  first_doc_id_in_index_ = IndexConfiguration::GetResultValue(index_meta_info.GetNumericalValue(meta_properties::kFirstDocId), true);
+  last_doc_id_in_index_ = IndexConfiguration::GetResultValue(index_meta_info.GetNumericalValue(meta_properties::kLastDocId), true);
+  index_posting_count_ = IndexConfiguration::GetResultValue(index_meta_info.GetNumericalValue(meta_properties::kIndexPostingCount), true);
+
+  // A layered index doesn't have the complete lists in its first layer, and a quantized index stores impacts in place of the frequencies.
+  // These keys are missing from the meta files of standard indices.
+  KeyValueStore::KeyValueResult<long int> layered_index_res = index_meta_info.GetNumericalValue(meta_properties::kLayeredIndex);
+  KeyValueStore::KeyValueResult<long int> quantized_impacts_res = index_meta_info.GetNumericalValue(meta_properties::kQuantizedImpacts);
+  if ((!layered_index_res.error() && layered_index_res.value_t()) || (!quantized_impacts_res.error() && quantized_impacts_res.value_t())) {
+    index_supported_ = false;
+  }
+}
+
+ForwardIndexGenerator::~ForwardIndexGenerator() {
+  if (forward_index_fd_ >= 0) {
+    int close_ret = close(forward_index_fd_);
+    if (close_ret < 0) {
+      GetErrorLogger().LogErrno("close() in ForwardIndexGenerator::~ForwardIndexGenerator(), trying to close forward index", errno, false);
+    }
+  }
+}
+
+void ForwardIndexGenerator::CreateForwardIndex() {
+  if (!index_supported_) {
+    GetErrorLogger().Log("Not generating a forward index for '" + index_files_.meta_info_filename()
+        + "', since it's either layered or stores quantized impacts in place of the frequencies.", false);
+    return;
+  }
+
+  GetDefaultLogger().Log("Generating forward index '" + index_files_.forward_index_filename() + "'...", false);
+
+  forward_index_fd_ = open(index_files_.forward_index_filename().c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (forward_index_fd_ < 0) {
+    GetErrorLogger().LogErrno("open() in ForwardIndexGenerator::CreateForwardIndex(), trying to open forward index for writing", errno, true);
+  }
+
+  doc_record_offsets_.reserve(static_cast<uint64_t> (last_doc_id_in_index_) - first_doc_id_in_index_ + 2);
+
+  CollectPostings();
+
+  if (num_runs_ == 0) {
+    // Everything fit into main memory.
+    sort(postings_.begin(), postings_.end());
+    size_t doc_start_posting = 0;
+    for (size_t i = 1; i <= postings_.size(); ++i) {
+      if (i == postings_.size() || postings_[i].doc_id != postings_[doc_start_posting].doc_id) {
+        WriteDocument(&postings_[doc_start_posting], i - doc_start_posting);
+        doc_start_posting = i;
+      }
+    }
+  } else {
+    if (!postings_.empty())
+      WriteRun();
+    // Free the posting buffer before merging.
+    vector<ForwardPosting>().swap(postings_);
+    MergeRuns();
+  }
+
+  WriteEmptyDocuments(static_cast<uint64_t> (last_doc_id_in_index_) + 1);
+  WriteTrailer();
+}
+
+// Traverses all the lists in termID order, collecting their postings and writing them out in runs whenever the buffer fills up.
+void ForwardIndexGenerator::CollectPostings() {
+  CacheManager* cache_policy = new MergingCachePolicy(index_files_.index_filename().c_str());
+  IndexReader* index_reader = new IndexReader(IndexReader::kMerge, *cache_policy, index_files_.lexicon_filename().c_str(),
+                                              index_files_.document_map_basic_filename().c_str(), index_files_.document_map_extended_filename().c_str(),
+                                              index_files_.meta_info_filename().c_str(), false);
+
+  postings_.reserve(min<uint64_t>(buffer_size_, index_posting_count_));
+
+  LexiconData* lex_data;
+  while ((lex_data = index_reader->lexicon().GetNextEntry()) != NULL) {
+    ListData* list_data = index_reader->OpenList(*lex_data, 0);
+
+    uint32_t doc_id = list_data->NextGEQ(0);
+    while (doc_id != ListData::kNoMoreDocs) {
+      ForwardPosting posting;
+      posting.doc_id = doc_id;
+      posting.term_id = lex_data->term_id();
+      posting.frequency = list_data->GetFreq();
+      postings_.push_back(posting);
+
+      if (postings_.size() == static_cast<size_t> (buffer_size_))
+        WriteRun();
+
+      doc_id = list_data->NextGEQ(doc_id + 1);
+    }
+
+    index_reader->CloseList(list_data);
+    delete lex_data;
+  }
+
+  delete index_reader;
+  delete cache_policy;
+}
+
+void ForwardIndexGenerator::WriteRun() {
+  sort(postings_.begin(), postings_.end());
+
+  string run_filename = RunFilename(num_runs_++);
+  int run_fd = open(run_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (run_fd < 0) {
+    GetErrorLogger().LogErrno("open() in ForwardIndexGenerator::WriteRun(), trying to open run '" + run_filename + "' for writing", errno, true);
+  }
+
+  size_t write_bytes = postings_.size() * sizeof(postings_[0]);
+  ssize_t write_ret = write(run_fd, &postings_[0], write_bytes);
+  if (write_ret < 0) {
+    GetErrorLogger().LogErrno("write() in ForwardIndexGenerator::WriteRun(), trying to write run", errno, true);
+  } else if (static_cast<size_t> (write_ret) != write_bytes) {
+    GetErrorLogger().Log("write() in ForwardIndexGenerator::WriteRun(): wrote " + Stringify(write_ret) + " bytes, but requested " + Stringify(write_bytes)
+        + " bytes.", true);
+  }
+
+  int close_ret = close(run_fd);
+  if (close_ret < 0) {
+    GetErrorLogger().LogErrno("close() in ForwardIndexGenerator::WriteRun(), trying to close run", errno, false);
+  }
+
+  postings_.clear();
+}
+
+// Merges all the runs, writing out each document as soon as all its postings have been merged.
+void ForwardIndexGenerator::MergeRuns() {
+  GetDefaultLogger().Log("Merging " + Stringify(num_runs_) + " forward index runs...", false);
+
+  priority_queue<RunReader*, vector<RunReader*>, RunReaderComparison> run_heap;
+  for (int i = 0; i < num_runs_; ++i) {
+    RunReader* run_reader = new RunReader(RunFilename(i));
+    if (run_reader->Next()) {
+      run_heap.push(run_reader);
+    } else {
+      delete run_reader;
+    }
+  }
+
+  vector<ForwardPosting> doc_postings;
+  while (!run_heap.empty()) {
+    RunReader* run_reader = run_heap.top();
+    run_heap.pop();
+
+    const ForwardPosting& posting = run_reader->curr_posting();
+    if (!doc_postings.empty() && posting.doc_id != doc_postings.front().doc_id) {
+      WriteDocument(&doc_postings[0], doc_postings.size());
+      doc_postings.clear();
+    }
+    doc_postings.push_back(posting);
+
+    if (run_reader->Next()) {
+      run_heap.push(run_reader);
+    } else {
+      delete run_reader;
+    }
+  }
+
+  if (!doc_postings.empty())
+    WriteDocument(&doc_postings[0], doc_postings.size());
+}
+
+// The postings of a document must be in termID order.
+void ForwardIndexGenerator::WriteDocument(const ForwardPosting* postings, int num_postings) {
+  assert(num_postings > 0);
+  WriteEmptyDocuments(postings[0].doc_id);
+  doc_record_offsets_.push_back(curr_offset_);
+
+  uint32_t doc_num_terms = num_postings;
+  if (doc_num_terms > max_doc_num_terms_)
+    max_doc_num_terms_ = doc_num_terms;
+
+  // Blockwise coders need their input padded to the block size.
+  int num_elements = UncompressedInBufferUpperbound(doc_num_terms, term_compressor_.block_size());
+  term_id_gaps_.assign(num_elements, 0);
+  frequencies_.assign(num_elements, 0);
+  uint32_t prev_term_id = 0;
+  for (uint32_t i = 0; i < doc_num_terms; ++i) {
+    term_id_gaps_[i] = postings[i].term_id - prev_term_id;
+    frequencies_[i] = postings[i].frequency;
+    prev_term_id = postings[i].term_id;
+  }
+
+  size_t record_start = write_buffer_.size();
+  compressed_.resize(CompressedOutBufferUpperbound(num_elements));
+  write_buffer_.push_back(doc_num_terms);
+  int compressed_len = term_compressor_.Compress(&term_id_gaps_[0], &compressed_[0], doc_num_terms);
+  write_buffer_.insert(write_buffer_.end(), compressed_.begin(), compressed_.begin() + compressed_len);
+  compressed_len = term_compressor_.Compress(&frequencies_[0], &compressed_[0], doc_num_terms);
+  write_buffer_.insert(write_buffer_.end(), compressed_.begin(), compressed_.begin() + compressed_len);
+  curr_offset_ += write_buffer_.size() - record_start;
+
+  const size_t kWriteBufferSize = 1 << 20;  // In words.
+  if (write_buffer_.size() >= kWriteBufferSize)
+    FlushWriteBuffer();
+}
+
+// Writes empty records for all the documents without any terms before 'end_doc_id'.
+void ForwardIndexGenerator::WriteEmptyDocuments(uint64_t end_doc_id) {
+  while (first_doc_id_in_index_ + doc_record_offsets_.size() < end_doc_id) {
+    doc_record_offsets_.push_back(curr_offset_);
+  }
+}
+
+void ForwardIndexGenerator::WriteTrailer() {
+  FlushWriteBuffer();
+
+  ForwardIndexReader::Trailer trailer;
+  trailer.first_doc_id = first_doc_id_in_index_;
+  trailer.num_docs = doc_record_offsets_.size();
+  trailer.max_doc_num_terms = max_doc_num_terms_;
+  trailer.coding_policy_len = coding_policy_str_.size();
+
+  // The end offset of the last document record.
+  doc_record_offsets_.push_back(curr_offset_);
+
+  // The document record offsets are 8 byte integers, so the table is aligned to 8 bytes for when it's memory mapped.
+  if (curr_offset_ % 2 != 0) {
+    uint32_t padding = 0;
+    WriteWords(&padding, 1);
+    ++curr_offset_;
+  }
+  trailer.doc_record_offsets_offset = curr_offset_;
+  WriteWords(reinterpret_cast<const uint32_t*> (&doc_record_offsets_[0]), doc_record_offsets_.size() * (sizeof(doc_record_offsets_[0]) / sizeof(uint32_t)));
+
+  ssize_t write_ret = write(forward_index_fd_, coding_policy_str_.c_str(), coding_policy_str_.size());
+  if (write_ret < 0 || static_cast<size_t> (write_ret) != coding_policy_str_.size()) {
+    GetErrorLogger().LogErrno("write() in ForwardIndexGenerator::WriteTrailer(), trying to write forward index coding policy", errno, true);
+  }
+
+  write_ret = write(forward_index_fd_, &trailer, sizeof(trailer));
+  if (write_ret < 0 || static_cast<size_t> (write_ret) != sizeof(trailer)) {
+    GetErrorLogger().LogErrno("write() in ForwardIndexGenerator::WriteTrailer(), trying to write forward index trailer", errno, true);
+  }
+}
+
+void ForwardIndexGenerator::FlushWriteBuffer() {
+  if (!write_buffer_.empty())
+    WriteWords(&write_buffer_[0], write_buffer_.size());
+  write_buffer_.clear();
+}
+
+void ForwardIndexGenerator::WriteWords(const uint32_t* words, size_t num_words) {
+  size_t write_bytes = num_words * sizeof(*words);
+  ssize_t write_ret = write(forward_index_fd_, words, write_bytes);
+  if (write_ret < 0) {
+    GetErrorLogger().LogErrno("write() in ForwardIndexGenerator::WriteWords(), trying to write forward index", errno, true);
+  } else if (static_cast<size_t> (write_ret) != write_bytes) {
+    GetErrorLogger().Log("write() in ForwardIndexGenerator::WriteWords(): wrote " + Stringify(write_ret) + " bytes, but requested " + Stringify(write_bytes)
+        + " bytes.", true);
+  }
+}
+
+/**************************************************************************************************************************************************************
+ * ForwardIndexReader
+ *
+ **************************************************************************************************************************************************************/
+ForwardIndexReader::ForwardIndexReader(const char* forward_index_filename) :
+  forward_index_fd_(open(forward_index_filename, O_RDONLY)),
+  forward_index_size_(0),
+  forward_index_(NULL),
+  doc_record_offsets_(NULL),
+  first_doc_id_(0),
+  num_docs_(0),
+  max_doc_num_terms_(0),
+  decode_buffer_size_(0),
+  term_decompressor_(CodingPolicy::kFrequency) {
+  if (forward_index_fd_ < 0) {
+    GetErrorLogger().LogErrno("open() in ForwardIndexReader::ForwardIndexReader(), trying to open forward index '" + string(forward_index_filename) + "'", errno,
+                              true);
+  }
+
+  struct stat stat_buf;
+  if (fstat(forward_index_fd_, &stat_buf) < 0) {
+    GetErrorLogger().LogErrno("fstat() in ForwardIndexReader::ForwardIndexReader()", errno, true);
+  }
+  forward_index_size_ = stat_buf.st_size;
+
+  Trailer trailer;
+  if (forward_index_size_ < sizeof(trailer)) {
+    GetErrorLogger().Log("Forward index '" + string(forward_index_filename) + "' is truncated.", true);
+  }
+
+  void* src;
+  if ((src = mmap(0, forward_index_size_, PROT_READ, MAP_SHARED, forward_index_fd_, 0)) == MAP_FAILED) {
+    GetErrorLogger().LogErrno("mmap() in ForwardIndexReader::ForwardIndexReader()", errno, true);
+  }
+  forward_index_ = static_cast<uint32_t*> (src);
+
+  const char* forward_index_bytes = static_cast<const char*> (src);
+  memcpy(&trailer, forward_index_bytes + forward_index_size_ - sizeof(trailer), sizeof(trailer));
+
+  size_t doc_record_offsets_bytes = (static_cast<size_t> (trailer.num_docs) + 1) * sizeof(*doc_record_offsets_);
+  if (trailer.doc_record_offsets_offset * sizeof(*forward_index_) + doc_record_offsets_bytes + trailer.coding_policy_len + sizeof(trailer)
+      != forward_index_size_) {
+    GetErrorLogger().Log("Forward index '" + string(forward_index_filename) + "' is corrupt.", true);
+  }
+
+  doc_record_offsets_ = reinterpret_cast<const uint64_t*> (forward_index_ + trailer.doc_record_offsets_offset);
+  first_doc_id_ = trailer.first_doc_id;
+  num_docs_ = trailer.num_docs;
+  max_doc_num_terms_ = trailer.max_doc_num_terms;
+
+  string coding_policy_str(forward_index_bytes + forward_index_size_ - sizeof(trailer) - trailer.coding_policy_len, trailer.coding_policy_len);
+  coding_policy_helper::LoadPolicyAndCheck(term_decompressor_, coding_policy_str, "forward index");
+
+  decode_buffer_size_ = UncompressedOutBufferUpperbound(UncompressedInBufferUpperbound(max_doc_num_terms_, term_decompressor_.block_size()));
+}
+
+ForwardIndexReader::~ForwardIndexReader() {
+  if (munmap(forward_index_, forward_index_size_) < 0) {
+    GetErrorLogger().LogErrno("munmap() in ForwardIndexReader::~ForwardIndexReader()", errno, false);
+  }
+
+  int close_ret = close(forward_index_fd_);
+  if (close_ret < 0) {
+    GetErrorLogger().LogErrno("close() in ForwardIndexReader::~ForwardIndexReader(), trying to close forward index", errno, false);
+  }
+}
+
+int ForwardIndexReader::GetDocumentTerms(uint32_t doc_id, vector<uint32_t>* term_ids, vector<uint32_t>* frequencies) const {
+  if (doc_id < first_doc_id_ || doc_id - first_doc_id_ >= num_docs_)
+    return 0;
+
+  uint32_t doc_num = doc_id - first_doc_id_;
+  if (doc_record_offsets_[doc_num] == doc_record_offsets_[doc_num + 1])
+    return 0;
+
+  if (term_ids->size() < static_cast<size_t> (decode_buffer_size_))
+    term_ids->resize(decode_buffer_size_);
+  if (frequencies->size() < static_cast<size_t> (decode_buffer_size_))
+    frequencies->resize(decode_buffer_size_);
+
+  uint32_t* doc_record = forward_index_ + doc_record_offsets_[doc_num];
+  int doc_num_terms = *doc_record++;
+  doc_record += term_decompressor_.Decompress(doc_record, &(*term_ids)[0], doc_num_terms);
+  term_decompressor_.Decompress(doc_record, &(*frequencies)[0], doc_num_terms);
+
+  // The termIDs are gap coded.
+  for (int i = 1; i < doc_num_terms; ++i) {
+    (*term_ids)[i] += (*term_ids)[i - 1];
+  }
+  return doc_num_terms;
+}
@@ -0,0 +1,172 @@
+// Copyright (c) 2010, Roman Khmelichek
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//  2. Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//  3. Neither the name of Roman Khmelichek nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+//==============================================================================================================================================================
+// Author(s): Roman Khmelichek
+//
+// The forward index maps each docID to the (termID, frequency) pairs of the terms in the document. It complements the inverted index for second stage ranking:
+// the features of the top-k documents of a query can be read out of the forward index, instead of opening and traversing every query list a second time.
+//
+// The termID of a term is the position of its entry within the lexicon of the same index, so a forward index is only valid together with the index it was
+// generated from. It can always be derived from the inverted index, so it doesn't need to be merged; a new one is generated for the merged index instead.
+//==============================================================================================================================================================
+
+#ifndef FORWARD_INDEX_H_
+#define FORWARD_INDEX_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "coding_policy.h"
+#include "globals.h"
+#include "index_util.h"
+
+/**************************************************************************************************************************************************************
+ * ForwardIndexGenerator
+ *
+ * Generates the forward index of an existing (single layered, unquantized) index with a single pass over all of its lists. The lists are traversed in termID
+ * order, and their postings are collected into a buffer of 'forward_index_buffer_size' postings. Whenever the buffer fills up, it's sorted by docID and written
+ * out as a run. The runs are then merged, and each document is written out as a separate record, whose offset is stored in a table at the end of the file.
+ * If all the postings fit into the buffer, no runs are written.
+ *
+ * Forward index format: the document records, one per docID starting at the first docID in the index, followed by the table of document record offsets (in
+ * words, one more than the number of documents, as 8 byte integers), the forward index coding policy string, and finally the fixed size trailer. A document
+ * record consists of the number of terms in the document, followed by the compressed termID gaps (in ascending termID order) and the compressed frequencies.
+ * Documents without any terms have an empty record.
+ **************************************************************************************************************************************************************/
+class ForwardIndexGenerator {
+public:
+  ForwardIndexGenerator(const IndexFiles& index_files);
+  ~ForwardIndexGenerator();
+
+  void CreateForwardIndex();
+
+private:
+  struct ForwardPosting {
+    uint32_t doc_id;
+    uint32_t term_id;
+    uint32_t frequency;
+
+    bool operator<(const ForwardPosting& rhs) const {
+      return (doc_id == rhs.doc_id) ? (term_id < rhs.term_id) : (doc_id < rhs.doc_id);
+    }
+  };
+
+  class RunReader;
+  struct RunReaderComparison;
+
+  void CollectPostings();
+  void WriteRun();
+  void MergeRuns();
+  void WriteDocument(const ForwardPosting* postings, int num_postings);
+  void WriteEmptyDocuments(uint64_t end_doc_id);
+  void WriteTrailer();
+  void FlushWriteBuffer();
+  void WriteWords(const uint32_t* words, size_t num_words);
+
+  std::string RunFilename(int run_num) const {
+    return index_files_.forward_index_filename() + ".run." + Stringify(run_num);
+  }
+
+  IndexFiles index_files_;  // The index we're generating the forward index of.
+  int forward_index_fd_;
+
+  std::string coding_policy_str_;
+  CodingPolicy term_compressor_;  // Compresses both the termID gaps and the frequencies.
+  long int buffer_size_;          // The number of postings collected in main memory before they're written out as a run.
+
+  // The following properties are derived from the index meta info file.
+  uint32_t first_doc_id_in_index_;  // The first docID in the index.
+  uint32_t last_doc_id_in_index_;   // The last docID in the index.
+  uint64_t index_posting_count_;    // The total index posting count.
+  bool index_supported_;            // Whether the frequencies of the index are the real term frequencies (it's neither layered nor quantized).
+
+  std::vector<ForwardPosting> postings_;      // The postings collected since the last run was written.
+  int num_runs_;                              // The number of runs written so far.
+  std::vector<uint32_t> write_buffer_;        // The document records not yet written to the forward index.
+  std::vector<uint64_t> doc_record_offsets_;  // The word offsets of the document records written so far.
+  uint64_t curr_offset_;                      // The word offset of the next document record.
+  uint32_t max_doc_num_terms_;                // The largest number of terms in any document.
+
+  // Buffers for compressing a document record.
+  std::vector<uint32_t> term_id_gaps_;
+  std::vector<uint32_t> frequencies_;
+  std::vector<uint32_t> compressed_;
+};
+
+/**************************************************************************************************************************************************************
+ * ForwardIndexReader
+ *
+ * Memory maps the forward index. The reader itself keeps no decoding state, so it can be shared across query threads.
+ **************************************************************************************************************************************************************/
+class ForwardIndexReader {
+public:
+  ForwardIndexReader(const char* forward_index_filename);
+  ~ForwardIndexReader();
+
+  // Decodes the record of 'doc_id' into 'term_ids' (in ascending order) and their 'frequencies', and returns the number of terms in the document. The vectors
+  // are grown as necessary (and may end up larger than the number of terms), so they're best reused across calls.
+  int GetDocumentTerms(uint32_t doc_id, std::vector<uint32_t>* term_ids, std::vector<uint32_t>* frequencies) const;
+
+  uint32_t first_doc_id() const {
+    return first_doc_id_;
+  }
+
+  uint32_t num_docs() const {
+    return num_docs_;
+  }
+
+  uint32_t max_doc_num_terms() const {
+    return max_doc_num_terms_;
+  }
+
+private:
+  // The fixed size trailer at the very end of the forward index.
+  struct Trailer {
+    uint64_t doc_record_offsets_offset;  // The word offset of the document record offsets table.
+    uint32_t first_doc_id;
+    uint32_t num_docs;
+    uint32_t max_doc_num_terms;
+    uint32_t coding_policy_len;
+  };
+
+  friend class ForwardIndexGenerator;
+
+  int forward_index_fd_;
+  size_t forward_index_size_;
+  uint32_t* forward_index_;  // The memory mapped forward index.
+
+  const uint64_t* doc_record_offsets_;
+  uint32_t first_doc_id_;
+  uint32_t num_docs_;
+  uint32_t max_doc_num_terms_;
+  int decode_buffer_size_;  // The size of the termID and frequency buffers needed to decode any document record.
+
+  CodingPolicy term_decompressor_;
+};
+
+#endif /* FORWARD_INDEX_H_ */
@@ -54,6 +54,7 @@
 #include "globals.h"
 #include "index_layout_parameters.h"
 #include "logger.h"
+#include "perf_counters.h"
 using namespace std;
 
 /**************************************************************************************************************************************************************
@@ -92,6 +93,10 @@ void InvertedListMetaData::Init() {
     score_thresholds_[i] = 0.0f;
     external_index_offsets_[i] = 0;
   }
+
+  for (int i = 0; i < NUM_KTH_SCORES; ++i) {
+    kth_scores_[i] = 0.0f;
+  }
 }
 
 /**************************************************************************************************************************************************************
@@ -374,6 +379,7 @@ IndexBuilder::IndexBuilder(const char* lexicon_filename, const char* index_filen
   lexicon_(new InvertedListMetaData*[kLexiconBufferSize]),
   lexicon_offset_(0),
   lexicon_fd_(open(lexicon_filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)),
+  includes_kth_scores_(false),
   block_header_compressor_(block_header_compressor),
   external_index_builder_(external_index_builder),
   total_num_chunks_(0),
@@ -408,6 +414,7 @@ IndexBuilder::~IndexBuilder() {
 
 void IndexBuilder::Add(const ChunkEncoder& chunk, const char* term, int term_len) {
   assert(term != NULL && term_len > 0);
+  START_PERF_COUNTERS(add_counters);
 
   // Update index statistics.
   ++total_num_chunks_;
@@ -510,6 +517,7 @@ void IndexBuilder::Add(const ChunkEncoder& chunk, const char* term, int term_len
   }
 
   ++curr_chunk_number_;
+  STOP_PERF_COUNTERS(add_counters, PerfCounters::kIndexBuildingPhase);
 }
 
 void IndexBuilder::WriteBlocks() {
@@ -570,6 +578,11 @@ void IndexBuilder::FinalizeLayer(float score_threshold) {
   insert_layer_offset_ = true;
 }
 
+void IndexBuilder::SetKthScores(const float* kth_scores) {
+  assert(lexicon_offset_ > 0);
+  lexicon_[lexicon_offset_ - 1]->set_kth_scores(kth_scores);
+}
+
 void IndexBuilder::WriteLexicon() {
   assert(lexicon_fd_ != -1);
 
@@ -625,8 +638,12 @@ void IndexBuilder::WriteLexicon() {
     const uint32_t* external_index_offsets = lexicon_entry->external_index_offsets();
     int external_index_offsets_bytes = num_layers * sizeof(*external_index_offsets);
 
+    // kth_scores (not layer dependent, and only present when the index meta info says so)
+    const float* kth_scores = lexicon_entry->kth_scores();
+    int kth_scores_bytes = includes_kth_scores_ ? (NUM_KTH_SCORES * sizeof(*kth_scores)) : 0;
+
     int total_bytes = term_len_bytes + term_bytes + num_layers_bytes + num_docs_bytes + num_chunks_bytes + num_chunks_last_block_bytes + num_blocks_bytes
-        + block_numbers_bytes + chunk_numbers_bytes + score_thresholds_bytes + external_index_offsets_bytes;
+        + block_numbers_bytes + chunk_numbers_bytes + score_thresholds_bytes + external_index_offsets_bytes + kth_scores_bytes;
     if(total_bytes > kLexiconBufferSize) {
       // Indicates the term is very long.
       // Probably should prune such long terms in the first place, but...
@@ -670,6 +687,9 @@ void IndexBuilder::WriteLexicon() {
       write_ret = write(lexicon_fd_, external_index_offsets, external_index_offsets_bytes);
       assert(write_ret == external_index_offsets_bytes);
 
+      write_ret = write(lexicon_fd_, kth_scores, kth_scores_bytes);
+      assert(write_ret == kth_scores_bytes);
+
       continue;
     }
 
@@ -728,6 +748,10 @@ void IndexBuilder::WriteLexicon() {
     memcpy(lexicon_data + lexicon_data_offset, external_index_offsets, external_index_offsets_bytes);
     lexicon_data_offset += external_index_offsets_bytes;
 
+    // kth_scores
+    memcpy(lexicon_data + lexicon_data_offset, kth_scores, kth_scores_bytes);
+    lexicon_data_offset += kth_scores_bytes;
+
     delete lexicon_entry;
   }
 
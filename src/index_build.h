@@ -96,6 +96,16 @@ public:
     return external_index_offsets_;
   }
 
+  const float* kth_scores() const {
+    return kth_scores_;
+  }
+
+  void set_kth_scores(const float* kth_scores) {
+    for (int i = 0; i < NUM_KTH_SCORES; ++i) {
+      kth_scores_[i] = kth_scores[i];
+    }
+  }
+
   void increase_curr_layer() {
     ++num_layers_;
   }
@@ -173,6 +183,7 @@ private:
   int chunk_numbers_[kMaxLayers];
   float score_thresholds_[kMaxLayers];
   uint32_t external_index_offsets_[kMaxLayers];   // The integer offset into the external index where data for the current term layer starts.
+  float kth_scores_[NUM_KTH_SCORES];              // The kth highest partial BM25 scores of the whole list (0 if the list has less than k postings).
 };
 
 /**************************************************************************************************************************************************************
@@ -371,6 +382,13 @@ public:
 
   void FinalizeLayer(float score_threshold);
 
+  // Sets the kth highest partial BM25 scores of the list that's currently being built. Only written out to the lexicon if 'includes_kth_scores' is set.
+  void SetKthScores(const float* kth_scores);
+
+  void set_includes_kth_scores(bool includes_kth_scores) {
+    includes_kth_scores_ = includes_kth_scores;
+  }
+
   uint64_t total_num_chunks() const {
     return total_num_chunks_;
   }
@@ -425,6 +443,7 @@ private:
   InvertedListMetaData** lexicon_;
   int lexicon_offset_;
   int lexicon_fd_;
+  bool includes_kth_scores_;  // Whether the kth highest partial BM25 scores of each list are written out to the lexicon.
 
   const CodingPolicy& block_header_compressor_;
 
@@ -76,7 +76,7 @@ void IndexCat::Cat(const char* term, int term_len) {
         printf("(%u, %u, <", index_->curr_doc_id(), curr_frequency);
 
         if (includes_positions_) {
-          const uint32_t* curr_positions = index_->curr_list_data()->curr_chunk_decoder().current_positions();
+          const uint32_t* curr_positions = index_->curr_list_data()->GetPositions();
           uint32_t num_positions = index_->curr_list_data()->GetNumDocProperties();
           for (size_t i = 0; i < num_positions; ++i) {
             printf("%u", curr_positions[i]);
@@ -108,8 +108,8 @@ void IndexDiff::Diff(const char* term, int term_len) {
         }
 
         if (includes_positions_) {
-          const uint32_t* curr_positions1 = index1_->curr_list_data()->curr_chunk_decoder().current_positions();
-          const uint32_t* curr_positions2 = index2_->curr_list_data()->curr_chunk_decoder().current_positions();
+          const uint32_t* curr_positions1 = index1_->curr_list_data()->GetPositions();
+          const uint32_t* curr_positions2 = index2_->curr_list_data()->GetPositions();
 
           // This is similar to doing a merge on the positions, since they are in sorted order.
           size_t i1 = 0;
@@ -218,7 +218,7 @@ void IndexDiff::Print(Index* index, const char* term, int term_len) {
     printf("%u, %u, <", index->curr_doc_id(), curr_frequency);
 
     if (includes_positions_) {
-      const uint32_t* curr_positions = index->curr_list_data()->curr_chunk_decoder().current_positions();
+      const uint32_t* curr_positions = index->curr_list_data()->GetPositions();
       uint32_t num_positions = index->curr_list_data()->GetNumDocProperties();
       for (size_t i = 0; i < num_positions; ++i) {
         printf("%u", curr_positions[i]);
@@ -0,0 +1,323 @@
+// Copyright (c) 2010, Roman Khmelichek
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//  2. Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//  3. Neither the name of Roman Khmelichek nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+//==============================================================================================================================================================
+// Author(s): Roman Khmelichek
+//
+// This class takes a standard index as input and generates an impact ordered index from it, meant for score-at-a-time query processing.
+//
+// The partial BM25 score of each posting is linearly quantized into an integer impact against a global score upperbound, so that impacts from different lists
+// can be added together by the query processor. The upperbound is the largest partial BM25 score possible in the collection: the IDF of a term that appears in
+// a single document, times (k1 + 1), the limit of the BM25 term frequency component. The impact takes the place of the frequency in the index.
+//
+// Each list is then split into a number of segments by impact. If a list has no more distinct impacts than the max number of segments, every segment holds
+// exactly one impact value, which is the classic impact ordered layout. Otherwise, the range of impacts in the list is split into equal width bands. Postings
+// within a segment are kept in docID order, so they compress well and can be written out through the standard chunk and block format; each segment is just a
+// (non-overlapping) layer of a layered index, with the layer threshold being the score of the highest impact within it.
+//
+// Like the layered index generator, we assume that any single inverted list can fit completely into main memory.
+//==============================================================================================================================================================
+
+#include "index_impact_order.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+
+#include "coding_policy_helper.h"
+#include "config_file_properties.h"
+#include "configuration.h"
+#include "external_index.h"
+#include "globals.h"
+#include "index_build.h"
+#include "index_layerify.h"
+#include "index_merge.h"
+#include "index_reader.h"
+#include "key_value_store.h"
+#include "logger.h"
+#include "meta_file_properties.h"
+using namespace std;
+
+/**************************************************************************************************************************************************************
+ * ImpactOrderedIndexGenerator
+ *
+ **************************************************************************************************************************************************************/
+ImpactOrderedIndexGenerator::ImpactOrderedIndexGenerator(const IndexFiles& input_index_files, const string& output_index_prefix) :
+  output_index_files_(output_index_prefix),
+  index_(NULL),
+  external_index_builder_(NULL),
+  index_builder_(NULL),
+  includes_contexts_(true),
+  num_segments_(0),
+  impact_score_upperbound_(0),
+  doc_id_compressor_(CodingPolicy::kDocId),
+  frequency_compressor_(CodingPolicy::kFrequency),
+  position_compressor_(CodingPolicy::kPosition),
+  block_header_compressor_(CodingPolicy::kBlockHeader),
+  total_num_docs_(0),
+  total_unique_num_docs_(0),
+  total_document_lengths_(0),
+  document_posting_count_(0),
+  index_posting_count_(0),
+  first_doc_id_in_index_(0),
+  last_doc_id_in_index_(0),
+  posting_count_(0) {
+  external_index_builder_ = new ExternalIndexBuilder(output_index_files_.external_index_filename().c_str());
+  index_builder_ = new IndexBuilder(output_index_files_.lexicon_filename().c_str(), output_index_files_.index_filename().c_str(), block_header_compressor_,
+                                    external_index_builder_);
+
+  CacheManager* cache_policy = new MergingCachePolicy(input_index_files.index_filename().c_str());
+  IndexReader* index_reader = new IndexReader(IndexReader::kMerge, *cache_policy, input_index_files.lexicon_filename().c_str(),
+                                              input_index_files.document_map_basic_filename().c_str(), input_index_files.document_map_extended_filename().c_str(),
+                                              input_index_files.meta_info_filename().c_str(), false);
+
+  // Coding policy for the impact ordered index remains the same as that of the original index.
+  // The impacts are small integers, so whatever coder was good for the frequencies will do a decent job on them as well.
+  coding_policy_helper::LoadPolicyAndCheck(doc_id_compressor_, index_reader->meta_info().GetValue(meta_properties::kIndexDocIdCoding), "docID");
+  coding_policy_helper::LoadPolicyAndCheck(frequency_compressor_, index_reader->meta_info().GetValue(meta_properties::kIndexFrequencyCoding), "frequency");
+  coding_policy_helper::LoadPolicyAndCheck(position_compressor_, index_reader->meta_info().GetValue(meta_properties::kIndexPositionCoding), "position");
+  coding_policy_helper::LoadPolicyAndCheck(block_header_compressor_, index_reader->meta_info().GetValue(meta_properties::kIndexBlockHeaderCoding),
+                                           "block header");
+
+  if (!index_reader->includes_contexts())
+    includes_contexts_ = false;
+
+  // These must match in the impact ordered index.
+  total_num_docs_ = IndexConfiguration::GetResultValue(index_reader->meta_info().GetNumericalValue(meta_properties::kTotalNumDocs), false);
+  total_unique_num_docs_ = IndexConfiguration::GetResultValue(index_reader->meta_info().GetNumericalValue(meta_properties::kTotalUniqueNumDocs), false);
+  total_document_lengths_ = IndexConfiguration::GetResultValue(index_reader->meta_info().GetNumericalValue(meta_properties::kTotalDocumentLengths), false);
+  document_posting_count_ = IndexConfiguration::GetResultValue(index_reader->meta_info().GetNumericalValue(meta_properties::kDocumentPostingCount), false);
+  index_posting_count_ = IndexConfiguration::GetResultValue(index_reader->meta_info().GetNumericalValue(meta_properties::kIndexPostingCount), false);
+  first_doc_id_in_index_ = IndexConfiguration::GetResultValue(index_reader->meta_info().GetNumericalValue(meta_properties::kFirstDocId), false);
+  last_doc_id_in_index_ = IndexConfiguration::GetResultValue(index_reader->meta_info().GetNumericalValue(meta_properties::kLastDocId), false);
+
+  index_ = new Index(cache_policy, index_reader);
+
+  num_segments_ = Configuration::GetResultValue(Configuration::GetConfiguration().GetNumericalValue(config_properties::kNumImpactSegments));
+  if (num_segments_ <= 0 || num_segments_ > MAX_LIST_LAYERS) {
+    Configuration::ErroneousValue(config_properties::kNumImpactSegments, Stringify(num_segments_));
+  }
+
+  impact_score_upperbound_ = DocIdScoreComparison::ImpactScoreUpperbound(total_num_docs_);
+  if (impact_score_upperbound_ <= 0) {
+    GetErrorLogger().Log("Can't quantize scores; the '" + string(meta_properties::kTotalNumDocs) + "' value in the index meta file seems to be incorrect.", true);
+  }
+}
+
+ImpactOrderedIndexGenerator::~ImpactOrderedIndexGenerator() {
+  delete index_;
+  delete index_builder_;
+  delete external_index_builder_;
+}
+
+void ImpactOrderedIndexGenerator::CreateImpactOrderedIndex() {
+  // Need the average document length for computing BM25 scores.
+  int average_doc_length = total_document_lengths_ / total_num_docs_;
+
+  IndexEntry* index_entry_buffer = NULL;
+  IndexEntry* segment_entry_buffer = NULL;
+  int index_entry_buffer_size = 0;
+
+  while (index_->NextTerm()) {
+    int num_docs_in_list = index_->curr_list_data()->num_docs();
+    if (num_docs_in_list > index_entry_buffer_size) {
+      delete[] index_entry_buffer;
+      delete[] segment_entry_buffer;
+      index_entry_buffer_size = num_docs_in_list;
+      index_entry_buffer = new IndexEntry[index_entry_buffer_size];
+      segment_entry_buffer = new IndexEntry[index_entry_buffer_size];
+    }
+
+    DocIdScoreComparison doc_id_score_comparator(index_->index_reader()->document_map(), num_docs_in_list, average_doc_length, total_num_docs_,
+                                                 impact_score_upperbound_);
+
+    // Quantize the score of each posting into an impact; we replace the frequency with the impact.
+    uint32_t min_impact = DocIdScoreComparison::kMaxImpact;
+    uint32_t max_impact = 1;
+    int index_entry_offset = 0;
+    while (index_->NextDocId()) {
+      assert(index_entry_offset < num_docs_in_list);
+      IndexEntry& curr_index_entry = index_entry_buffer[index_entry_offset];
+
+      curr_index_entry.doc_id = index_->curr_doc_id();
+      curr_index_entry.frequency = index_->curr_list_data()->GetFreq();
+      curr_index_entry.positions = NULL;
+
+      // The index builder counts postings based on the frequencies it's given, which will now be the impacts, so we have to keep count ourselves.
+      posting_count_ += min(curr_index_entry.frequency, static_cast<uint32_t> (ChunkEncoder::kMaxProperties));
+
+      uint32_t impact = doc_id_score_comparator.Impact(curr_index_entry);
+      curr_index_entry.frequency = impact;
+
+      min_impact = min(min_impact, impact);
+      max_impact = max(max_impact, impact);
+
+      ++index_entry_offset;
+    }  // No more postings in the list.
+
+    // Assign each posting to a segment; the first segment holds the highest impacts.
+    // With few enough distinct impacts, each segment holds a single impact value; otherwise, the impact range is split into equal width bands.
+    uint32_t impact_range = max_impact - min_impact + 1;
+    int num_list_segments = min(static_cast<uint32_t> (num_segments_), impact_range);
+    int segment_sizes[MAX_LIST_LAYERS];
+    uint32_t segment_max_impacts[MAX_LIST_LAYERS];
+    for (int i = 0; i < num_list_segments; ++i) {
+      segment_sizes[i] = 0;
+      segment_max_impacts[i] = 0;
+    }
+
+    for (int i = 0; i < index_entry_offset; ++i) {
+      uint32_t impact = index_entry_buffer[i].frequency;
+      int segment = ((max_impact - impact) * num_list_segments) / impact_range;
+      assert(segment >= 0 && segment < num_list_segments);
+      ++segment_sizes[segment];
+      segment_max_impacts[segment] = max(segment_max_impacts[segment], impact);
+    }
+
+    // Distribute the postings into their segments. Since the postings are scanned in docID order, each segment remains docID sorted.
+    int segment_offsets[MAX_LIST_LAYERS];
+    int curr_offset = 0;
+    for (int i = 0; i < num_list_segments; ++i) {
+      segment_offsets[i] = curr_offset;
+      curr_offset += segment_sizes[i];
+    }
+
+    for (int i = 0; i < index_entry_offset; ++i) {
+      uint32_t impact = index_entry_buffer[i].frequency;
+      int segment = ((max_impact - impact) * num_list_segments) / impact_range;
+      segment_entry_buffer[segment_offsets[segment]++] = index_entry_buffer[i];
+    }
+
+    // Write out the non-empty segments as the layers of the list.
+    curr_offset = 0;
+    for (int i = 0; i < num_list_segments; ++i) {
+      if (segment_sizes[i] == 0)
+        continue;
+
+      DumpToIndex(segment_entry_buffer + curr_offset, segment_sizes[i], index_->curr_term(), index_->curr_term_len());
+      // Need to call this before writing out the next layer.
+      index_builder_->FinalizeLayer(segment_max_impacts[i] * (impact_score_upperbound_ / DocIdScoreComparison::kMaxImpact));
+      curr_offset += segment_sizes[i];
+    }
+    assert(curr_offset == index_entry_offset);
+  }
+
+  delete[] index_entry_buffer;
+  delete[] segment_entry_buffer;
+
+  index_builder_->Finalize();
+
+  WriteMetaFile(output_index_files_.meta_info_filename());
+}
+
+// This dumps a single segment of a list into the index.
+void ImpactOrderedIndexGenerator::DumpToIndex(IndexEntry* index_entries, int num_index_entries, const char* curr_term, int curr_term_len) {
+  assert(doc_id_compressor_.block_size() == 0 || ChunkEncoder::kChunkSize == doc_id_compressor_.block_size());
+  assert(frequency_compressor_.block_size() == 0 || ChunkEncoder::kChunkSize == frequency_compressor_.block_size());
+
+  uint32_t doc_ids[ChunkEncoder::kChunkSize];
+  uint32_t impacts[ChunkEncoder::kChunkSize];
+  unsigned char contexts[ChunkEncoder::kChunkSize * ChunkEncoder::kMaxProperties];
+
+  uint32_t prev_chunk_last_doc_id = 0;
+  uint32_t prev_doc_id = 0;
+
+  int index_entries_offset = 0;
+  while (index_entries_offset < num_index_entries) {
+    uint32_t chunk_max_impact = 0;
+    int doc_ids_offset = 0;
+    for (doc_ids_offset = 0; doc_ids_offset < ChunkEncoder::kChunkSize && index_entries_offset < num_index_entries; ++doc_ids_offset) {
+      const IndexEntry& curr_index_entry = index_entries[index_entries_offset];
+
+      doc_ids[doc_ids_offset] = curr_index_entry.doc_id - prev_doc_id;
+      // Only the very first docID of the segment can have a 0 d-gap (when it's docID 0).
+      assert(doc_ids[doc_ids_offset] != 0 || (index_entries_offset == 0 && curr_index_entry.doc_id == 0));
+      prev_doc_id = curr_index_entry.doc_id;
+
+      impacts[doc_ids_offset] = curr_index_entry.frequency;
+      chunk_max_impact = max(chunk_max_impact, curr_index_entry.frequency);
+
+      ++index_entries_offset;
+    }
+
+    // Positions are never included, since the frequencies have been replaced by the impacts.
+    ChunkEncoder chunk(doc_ids, impacts, NULL, (includes_contexts_ ? contexts : NULL), doc_ids_offset, 0, prev_chunk_last_doc_id, doc_id_compressor_,
+                       frequency_compressor_, position_compressor_);
+    chunk.set_max_score(chunk_max_impact * (impact_score_upperbound_ / DocIdScoreComparison::kMaxImpact));
+    prev_chunk_last_doc_id = chunk.last_doc_id();
+    index_builder_->Add(chunk, curr_term, curr_term_len);
+  }
+}
+
+void ImpactOrderedIndexGenerator::WriteMetaFile(const std::string& meta_filename) {
+  KeyValueStore index_metafile;
+
+  // The impact segments are stored as non-overlapping layers.
+  index_metafile.AddKeyValuePair(meta_properties::kLayeredIndex, Stringify(true));
+  index_metafile.AddKeyValuePair(meta_properties::kNumLayers, Stringify(num_segments_));
+  index_metafile.AddKeyValuePair(meta_properties::kOverlappingLayers, Stringify(false));
+
+  // Impact ordering properties.
+  index_metafile.AddKeyValuePair(meta_properties::kImpactOrdered, Stringify(true));
+  index_metafile.AddKeyValuePair(meta_properties::kQuantizedImpacts, Stringify(true));
+  index_metafile.AddKeyValuePair(meta_properties::kImpactQuantizationBits, Stringify(DocIdScoreComparison::kImpactBits));
+  index_metafile.AddKeyValuePair(meta_properties::kImpactScoreUpperbound, Stringify(impact_score_upperbound_));
+
+  index_metafile.AddKeyValuePair(meta_properties::kIncludesPositions, Stringify(false));
+  index_metafile.AddKeyValuePair(meta_properties::kIncludesContexts, Stringify(includes_contexts_));
+  index_metafile.AddKeyValuePair(meta_properties::kIndexDocIdCoding, IndexConfiguration::GetResultValue(index_->index_reader()->meta_info().GetStringValue(meta_properties::kIndexDocIdCoding), false));
+  index_metafile.AddKeyValuePair(meta_properties::kIndexFrequencyCoding, IndexConfiguration::GetResultValue(index_->index_reader()->meta_info().GetStringValue(meta_properties::kIndexFrequencyCoding), false));
+  index_metafile.AddKeyValuePair(meta_properties::kIndexPositionCoding, IndexConfiguration::GetResultValue(index_->index_reader()->meta_info().GetStringValue(meta_properties::kIndexPositionCoding), false));
+  index_metafile.AddKeyValuePair(meta_properties::kIndexBlockHeaderCoding, IndexConfiguration::GetResultValue(index_->index_reader()->meta_info().GetStringValue(meta_properties::kIndexBlockHeaderCoding), false));
+
+  index_metafile.AddKeyValuePair(meta_properties::kTotalNumChunks, Stringify(index_builder_->total_num_chunks()));
+  index_metafile.AddKeyValuePair(meta_properties::kTotalNumPerTermBlocks, Stringify(index_builder_->total_num_per_term_blocks()));
+
+  index_metafile.AddKeyValuePair(meta_properties::kTotalDocumentLengths, Stringify(total_document_lengths_));
+  index_metafile.AddKeyValuePair(meta_properties::kTotalNumDocs, Stringify(total_num_docs_));
+  index_metafile.AddKeyValuePair(meta_properties::kTotalUniqueNumDocs, Stringify(total_unique_num_docs_));
+
+  index_metafile.AddKeyValuePair(meta_properties::kFirstDocId, Stringify(first_doc_id_in_index_));
+  index_metafile.AddKeyValuePair(meta_properties::kLastDocId, Stringify(last_doc_id_in_index_));
+  index_metafile.AddKeyValuePair(meta_properties::kDocumentPostingCount, Stringify(document_posting_count_));
+  if (index_posting_count_ != posting_count_) {
+    GetErrorLogger().Log("Inconsistency in the '" + string(meta_properties::kIndexPostingCount) + "' meta file property detected: "
+        + "value from original index meta file doesn't add up to the value calculated by the impact ordered index generator.", false);
+  }
+  index_metafile.AddKeyValuePair(meta_properties::kIndexPostingCount, Stringify(posting_count_));
+  index_metafile.AddKeyValuePair(meta_properties::kNumUniqueTerms, Stringify(index_builder_->num_unique_terms()));
+
+  index_metafile.AddKeyValuePair(meta_properties::kTotalHeaderBytes, Stringify(index_builder_->total_num_block_header_bytes()));
+  index_metafile.AddKeyValuePair(meta_properties::kTotalDocIdBytes, Stringify(index_builder_->total_num_doc_ids_bytes()));
+  index_metafile.AddKeyValuePair(meta_properties::kTotalFrequencyBytes, Stringify(index_builder_->total_num_frequency_bytes()));
+  index_metafile.AddKeyValuePair(meta_properties::kTotalPositionBytes, Stringify(index_builder_->total_num_positions_bytes()));
+  index_metafile.AddKeyValuePair(meta_properties::kTotalWastedBytes, Stringify(index_builder_->total_num_wasted_space_bytes()));
+
+  index_metafile.WriteKeyValueStore(meta_filename.c_str());
+}
@@ -0,0 +1,96 @@
+// Copyright (c) 2010, Roman Khmelichek
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//  2. Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//  3. Neither the name of Roman Khmelichek nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+//==============================================================================================================================================================
+// Author(s): Roman Khmelichek
+//
+//==============================================================================================================================================================
+
+#ifndef INDEX_IMPACT_ORDER_H_
+#define INDEX_IMPACT_ORDER_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "coding_policy.h"
+#include "index_layerify.h"
+#include "index_layout_parameters.h"
+#include "index_util.h"
+
+/**************************************************************************************************************************************************************
+ * ImpactOrderedIndexGenerator
+ *
+ * Creates an impact ordered index for score-at-a-time query processing. The partial BM25 score of every posting is quantized into an integer impact, which is
+ * stored in place of the frequency. Each list is then split into segments of postings with similar impacts, highest impacts first. The segments are written
+ * out as the (non-overlapping) layers of a layered index, so the standard index format, readers, and external index are reused as is.
+ **************************************************************************************************************************************************************/
+class ExternalIndexBuilder;
+class IndexBuilder;
+
+class ImpactOrderedIndexGenerator {
+public:
+  ImpactOrderedIndexGenerator(const IndexFiles& input_index_files, const std::string& output_index_prefix);
+  ~ImpactOrderedIndexGenerator();
+
+  void CreateImpactOrderedIndex();
+
+private:
+  void DumpToIndex(IndexEntry* index_entries, int num_index_entries, const char* curr_term, int curr_term_len);
+  void WriteMetaFile(const std::string& meta_filename);
+
+  IndexFiles output_index_files_;                 // The index filenames for the impact ordered index.
+  Index* index_;                                  // The index we're creating the impact ordered index from.
+  ExternalIndexBuilder* external_index_builder_;  // Responsible for building the external index, which holds the chunk impact upperbounds.
+  IndexBuilder* index_builder_;                   // The impact ordered index we're building.
+
+  // Some index properties.
+  bool includes_contexts_;
+
+  // The max number of impact segments per list (bounded by 'MAX_LIST_LAYERS').
+  int num_segments_;
+
+  // The score that quantizes to the max impact. No partial BM25 score in the collection can be larger than this.
+  float impact_score_upperbound_;
+
+  // Compressors to be used for various parts of the index.
+  CodingPolicy doc_id_compressor_;
+  CodingPolicy frequency_compressor_;
+  CodingPolicy position_compressor_;
+  CodingPolicy block_header_compressor_;
+
+  // The following properties are derived from the original index meta info file.
+  uint32_t total_num_docs_;          // The total number of documents.
+  uint32_t total_unique_num_docs_;   // The total number of unique documents.
+  uint64_t total_document_lengths_;  // The total document lengths of all documents.
+  uint64_t document_posting_count_;  // The total document posting count.
+  uint64_t index_posting_count_;     // The total index posting count.
+  uint32_t first_doc_id_in_index_;   // The first docID in the index.
+  uint32_t last_doc_id_in_index_;    // The last docID in the index.
+
+  uint64_t posting_count_;  // The posting count of the impact ordered index, based on the original frequencies.
+};
+
+#endif /* INDEX_IMPACT_ORDER_H_ */
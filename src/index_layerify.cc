@@ -59,6 +59,13 @@
 #include "meta_file_properties.h"
 using namespace std;
 
+/**************************************************************************************************************************************************************
+ * DocIdScoreComparison
+ *
+ **************************************************************************************************************************************************************/
+const int DocIdScoreComparison::kImpactBits;       // Initialized in the class definition.
+const uint32_t DocIdScoreComparison::kMaxImpact;  // Initialized in the class definition.
+
 /**************************************************************************************************************************************************************
  * LayeredIndexGenerator
  *
@@ -72,6 +79,8 @@ LayeredIndexGenerator::LayeredIndexGenerator(const IndexFiles& input_index_files
   includes_positions_(true),
   overlapping_layers_(false),
   num_layers_(0),
+  quantize_impacts_(false),
+  impact_score_upperbound_(0),
   doc_id_compressor_(CodingPolicy::kDocId),
   frequency_compressor_(CodingPolicy::kFrequency),
   position_compressor_(CodingPolicy::kPosition),
@@ -82,10 +91,12 @@ LayeredIndexGenerator::LayeredIndexGenerator(const IndexFiles& input_index_files
   document_posting_count_(0),
   index_posting_count_(0),
   first_doc_id_in_index_(0),
-  last_doc_id_in_index_(0) {
+  last_doc_id_in_index_(0),
+  posting_count_(0) {
   external_index_builder_ = new ExternalIndexBuilder(output_index_files_.external_index_filename().c_str());
   index_builder_ = new IndexBuilder(output_index_files_.lexicon_filename().c_str(), output_index_files_.index_filename().c_str(), block_header_compressor_,
                                     external_index_builder_);
+  index_builder_->set_includes_kth_scores(true);
 
   CacheManager* cache_policy = new MergingCachePolicy(input_index_files.index_filename().c_str());
   IndexReader* index_reader = new IndexReader(IndexReader::kMerge, *cache_policy, input_index_files.lexicon_filename().c_str(),
@@ -124,6 +135,11 @@ LayeredIndexGenerator::LayeredIndexGenerator(const IndexFiles& input_index_files
   }
   layering_strategy_ = Configuration::GetResultValue(Configuration::GetConfiguration().GetStringValue(config_properties::kLayeringStrategy));
 
+  quantize_impacts_ = Configuration::GetResultValue(Configuration::GetConfiguration().GetBooleanValue(config_properties::kQuantizeImpacts));
+  if (quantize_impacts_) {
+    impact_score_upperbound_ = DocIdScoreComparison::ImpactScoreUpperbound(total_num_docs_);
+  }
+
   assert(includes_positions_ == false);  // TODO: We don't support layered indices with positions yet.
 }
 
@@ -455,7 +471,8 @@ void LayeredIndexGenerator::CreateLayeredIndex() {
     int average_doc_length = total_document_lengths / total_num_docs;
 
     // First, we sort by docID score.
-    DocIdScoreComparison doc_id_score_comparator(index_->index_reader()->document_map(), num_docs_in_list, average_doc_length, total_num_docs);
+    DocIdScoreComparison doc_id_score_comparator(index_->index_reader()->document_map(), num_docs_in_list, average_doc_length, total_num_docs,
+                                                 impact_score_upperbound_);
 #ifdef INDEX_LAYERIFY_DEBUG
     // For a particular term, print all the docIDs in the list and their partial BM25 scores, and group them in chunks.
     // This is before we sort the docIDs by score.
@@ -473,6 +490,12 @@ void LayeredIndexGenerator::CreateLayeredIndex() {
 #endif
     sort(index_entry_buffer, index_entry_buffer + index_entry_offset, doc_id_score_comparator);
 
+    // With the list sorted by score, the kth highest partial BM25 scores can be read off directly. They're stored for the whole list, not per layer.
+    float kth_scores[NUM_KTH_SCORES];
+    for (int i = 0; i < NUM_KTH_SCORES; ++i) {
+      kth_scores[i] = (kKthScoreRanks[i] <= index_entry_offset) ? doc_id_score_comparator.Bm25Score(index_entry_buffer[kKthScoreRanks[i] - 1]) : 0;
+    }
+
     // For the exponentially increasing bucket size implementation.
     float base = pow(index_entry_offset, 1.0 / num_layers_);
 
@@ -623,6 +646,7 @@ void LayeredIndexGenerator::CreateLayeredIndex() {
                   index_->curr_term_len());
       index_builder_->FinalizeLayer(score_threshold);  // Need to call this before writing out the next layer.
     }
+    index_builder_->SetKthScores(kth_scores);
 
     delete[] index_entry_buffer;
   }
@@ -669,7 +693,9 @@ void LayeredIndexGenerator::DumpToIndex(const DocIdScoreComparison& doc_id_score
       assert(doc_ids[doc_ids_offset] != 0 || (index_entries_offset == 0 && curr_index_entry.doc_id == 0));
       prev_doc_id = curr_index_entry.doc_id;
 
-      frequencies[doc_ids_offset] = curr_index_entry.frequency;
+      // When quantizing, the impact takes the place of the frequency.
+      frequencies[doc_ids_offset] = quantize_impacts_ ? doc_id_score_comparator.Impact(curr_index_entry) : curr_index_entry.frequency;
+      posting_count_ += min(curr_index_entry.frequency, static_cast<uint32_t> (ChunkEncoder::kMaxProperties));
 
       if (includes_positions_) {
         uint32_t num_positions = min(curr_index_entry.frequency, static_cast<uint32_t> (ChunkEncoder::kMaxProperties));
@@ -701,6 +727,14 @@ void LayeredIndexGenerator::WriteMetaFile(const std::string& meta_filename) {
   index_metafile.AddKeyValuePair(meta_properties::kLayeredIndex, Stringify(true));
   index_metafile.AddKeyValuePair(meta_properties::kNumLayers, Stringify(num_layers_));
   index_metafile.AddKeyValuePair(meta_properties::kOverlappingLayers, Stringify(overlapping_layers_));
+  index_metafile.AddKeyValuePair(meta_properties::kLexiconKthScores, Stringify(true));
+
+  // Impact quantization properties.
+  index_metafile.AddKeyValuePair(meta_properties::kQuantizedImpacts, Stringify(quantize_impacts_));
+  if (quantize_impacts_) {
+    index_metafile.AddKeyValuePair(meta_properties::kImpactQuantizationBits, Stringify(DocIdScoreComparison::kImpactBits));
+    index_metafile.AddKeyValuePair(meta_properties::kImpactScoreUpperbound, Stringify(impact_score_upperbound_));
+  }
 
   index_metafile.AddKeyValuePair(meta_properties::kIncludesPositions, Stringify(includes_positions_));
   index_metafile.AddKeyValuePair(meta_properties::kIncludesContexts, Stringify(includes_contexts_));
@@ -719,12 +753,12 @@ void LayeredIndexGenerator::WriteMetaFile(const std::string& meta_filename) {
   index_metafile.AddKeyValuePair(meta_properties::kFirstDocId, Stringify(first_doc_id_in_index_));
   index_metafile.AddKeyValuePair(meta_properties::kLastDocId, Stringify(last_doc_id_in_index_));
   index_metafile.AddKeyValuePair(meta_properties::kDocumentPostingCount, Stringify(document_posting_count_));
-  if ((!overlapping_layers_ && index_posting_count_ != index_builder_->posting_count()) ||
-      (overlapping_layers_ && index_posting_count_ > index_builder_->posting_count())) {
+  if ((!overlapping_layers_ && index_posting_count_ != posting_count_) ||
+      (overlapping_layers_ && index_posting_count_ > posting_count_)) {
     GetErrorLogger().Log("Inconsistency in the '" + string(meta_properties::kIndexPostingCount) + "' meta file property detected: "
         + "value from original index meta file doesn't add up to the value calculated by the index builder.", false);
   }
-  index_metafile.AddKeyValuePair(meta_properties::kIndexPostingCount, Stringify(index_builder_->posting_count()));
+  index_metafile.AddKeyValuePair(meta_properties::kIndexPostingCount, Stringify(posting_count_));
   index_metafile.AddKeyValuePair(meta_properties::kNumUniqueTerms, Stringify(index_builder_->num_unique_terms()));
 
   index_metafile.AddKeyValuePair(meta_properties::kTotalHeaderBytes, Stringify(index_builder_->total_num_block_header_bytes()));
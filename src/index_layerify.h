@@ -38,6 +38,8 @@
 #include <cmath>
 #include <stdint.h>
 
+#include <algorithm>
+
 #ifdef INDEX_LAYERIFY_DEBUG
 #include <iostream>
 #endif
@@ -83,6 +85,10 @@ private:
   int num_layers_;
   std::string layering_strategy_;
 
+  // When set, the frequencies are replaced by quantized partial BM25 scores (impacts), quantized against 'impact_score_upperbound_'.
+  bool quantize_impacts_;
+  float impact_score_upperbound_;
+
   // Compressors to be used for various parts of the index.
   CodingPolicy doc_id_compressor_;
   CodingPolicy frequency_compressor_;
@@ -97,28 +103,49 @@ private:
   uint64_t index_posting_count_;     // The total index posting count.
   uint32_t first_doc_id_in_index_;   // The first docID in the index.
   uint32_t last_doc_id_in_index_;    // The last docID in the index.
+
+  uint64_t posting_count_;  // The posting count of the layered index, based on the original frequencies (the index builder would count impacts instead).
 };
 
 /**************************************************************************************************************************************************************
  * DocIdScoreComparison
  *
  * Uses the partial BM25 score to compare two documents from the same list.
+ *
+ * Optionally, scores can be quantized into integer impacts. In that case, 'Bm25Score()' returns the score the impact stands for, so that everything derived
+ * from the scores (the layer thresholds, chunk max scores, and the score ordering) is consistent with the scores computed from the impacts at query time.
  **************************************************************************************************************************************************************/
 class DocIdScoreComparison {
 public:
-  DocIdScoreComparison(const DocumentMapReader& doc_map_reader, int num_docs_t, int average_doc_len, int total_num_docs) :
+  // The number of bits each quantized impact takes up. Impacts are in the range [1, 2^kImpactBits - 1].
+  static const int kImpactBits = 8;
+  static const uint32_t kMaxImpact = (1 << kImpactBits) - 1;
+
+  // An 'impact_score_upperbound' of 0 means that scores are not quantized.
+  DocIdScoreComparison(const DocumentMapReader& doc_map_reader, int num_docs_t, int average_doc_len, int total_num_docs, float impact_score_upperbound = 0) :
     kBm25K1(2.0), kBm25B(0.75), kBm25NumeratorMul(kBm25K1 + 1), kBm25DenominatorAdd(kBm25K1 * (1 - kBm25B)),
     kBm25DenominatorDocLenMul(kBm25K1 * kBm25B / average_doc_len), kIdfT(log10(1 + (total_num_docs - num_docs_t + 0.5) / (num_docs_t + 0.5))),
-      doc_map_reader_(doc_map_reader) {
+      impact_score_upperbound_(impact_score_upperbound), doc_map_reader_(doc_map_reader) {
+  }
+
+  // The largest partial BM25 score possible in a collection: the IDF of a term that appears in a single document, times (k1 + 1), the limit of the BM25 term
+  // frequency component. Scores from all lists are quantized against this value, so that impacts from different lists can be added together.
+  static float ImpactScoreUpperbound(int total_num_docs) {
+    const float kBm25K1 = 2.0;
+    return log10(1 + (total_num_docs - 1 + 0.5) / (1 + 0.5)) * (kBm25K1 + 1);
   }
 
   float Bm25Score(const IndexEntry& entry) const {
-    uint32_t f_d_t = entry.frequency;
-    int doc_len = doc_map_reader_.GetDocumentLength(entry.doc_id);
-    float bm25 = kIdfT * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+    if (impact_score_upperbound_ != 0)
+      return Impact(entry) * (impact_score_upperbound_ / kMaxImpact);
+    return ExactBm25Score(entry);
+  }
 
-    assert(!isnan(bm25));
-    return bm25;
+  // Linearly quantizes the partial BM25 score. Every posting gets an impact of at least 1, so that it still counts as a match during query processing.
+  uint32_t Impact(const IndexEntry& entry) const {
+    assert(impact_score_upperbound_ > 0);
+    uint32_t impact = static_cast<uint32_t> (ExactBm25Score(entry) / impact_score_upperbound_ * kMaxImpact + 0.5);
+    return std::max(1U, std::min(impact, kMaxImpact));
   }
 
   bool operator()(const IndexEntry& lhs, const IndexEntry& rhs) const {
@@ -126,6 +153,15 @@ public:
   }
 
 private:
+  float ExactBm25Score(const IndexEntry& entry) const {
+    uint32_t f_d_t = entry.frequency;
+    int doc_len = doc_map_reader_.GetDocumentLength(entry.doc_id);
+    float bm25 = kIdfT * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+
+    assert(!isnan(bm25));
+    return bm25;
+  }
+
   // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
   const float kBm25K1;  // k1
   const float kBm25B;   // b
@@ -136,6 +172,8 @@ private:
   const float kBm25DenominatorDocLenMul;
   const float kIdfT;  // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for the entire list.
 
+  const float impact_score_upperbound_;  // The score corresponding to the max impact; 0 when scores are not quantized.
+
   const DocumentMapReader& doc_map_reader_;
 };
 
@@ -59,4 +59,11 @@
 // Maximum number of layers that can be part of a single inverted list.
 #define MAX_LIST_LAYERS 8
 
+// The number of kth highest partial BM25 scores stored per inverted list in the lexicon (for indices that store them).
+// The ranks k they're stored for are defined in 'kKthScoreRanks' below.
+#define NUM_KTH_SCORES 3
+
+// The ranks k for which the kth highest partial BM25 score of each inverted list is stored in the lexicon, in increasing order.
+static const int kKthScoreRanks[NUM_KTH_SCORES] = { 10, 100, 1000 };
+
 #endif /* INDEX_LAYOUT_PARAMETERS_H_ */
@@ -44,9 +44,12 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <unistd.h>
+
 #include "coding_policy_helper.h"
 #include "config_file_properties.h"
 #include "configuration.h"
+#include "forward_index.h"
 #include "globals.h"
 #include "index_build.h"
 #include "index_reader.h"
@@ -262,7 +265,7 @@ void IndexMerger::MergeOneHeap() {
       uint32_t curr_frequency = top_list->curr_list_data()->GetFreq();
 
       if (includes_positions_) {
-        const uint32_t* curr_positions = top_list->curr_list_data()->curr_chunk_decoder().current_positions();
+        const uint32_t* curr_positions = top_list->curr_list_data()->GetPositions();
         uint32_t num_positions = top_list->curr_list_data()->GetNumDocProperties();
         // Copy the positions.
         for (uint32_t i = 0; i < num_positions; ++i) {
@@ -437,7 +440,7 @@ void IndexMerger::MergeLists(Index** posting_heap, int posting_heap_size, const
 
     uint32_t curr_frequency = top_list->curr_list_data()->GetFreq();
     if (includes_positions_) {
-      const uint32_t* curr_positions = top_list->curr_list_data()->curr_chunk_decoder().current_positions();
+      const uint32_t* curr_positions = top_list->curr_list_data()->GetPositions();
       uint32_t num_positions = top_list->curr_list_data()->GetNumDocProperties();
       // Copy the positions.
       for (uint32_t i = 0; i < num_positions; ++i) {
@@ -625,7 +628,8 @@ CollectionMerger::CollectionMerger(const vector<IndexFiles>& input_index_files,
                          false);
 
   if (kDeleteMergedFiles && input_index_files.size() == 1) {
-    RenameIndexFiles(input_index_files.front(), output_index_files);
+    if (!RenameIndexFiles(input_index_files.front(), output_index_files))
+      CreateForwardIndex(output_index_files);
     return;
   }
 
@@ -636,6 +640,8 @@ CollectionMerger::CollectionMerger(const vector<IndexFiles>& input_index_files,
   delete curr_merger_;
   curr_merger_ = NULL;
 
+  CreateForwardIndex(output_index_files);
+
   if (kDeleteMergedFiles) {
     // Delete files we no longer need to conserve disk space.
     for (size_t i = 0; i < input_index_files.size(); ++i) {
@@ -653,7 +659,8 @@ void CollectionMerger::Partition(const vector<IndexFiles>& input_index_files, in
   if ((kDeleteMergedFiles || pass_num != 1) && input_index_files.size() == 1) {
     IndexFiles final_index_files;
     const IndexFiles& curr_index_files = input_index_files.front();
-    RenameIndexFiles(curr_index_files, final_index_files);
+    if (!RenameIndexFiles(curr_index_files, final_index_files))
+      CreateForwardIndex(final_index_files);
     return;
   }
 
@@ -741,9 +748,20 @@ void CollectionMerger::RemoveIndexFiles(const IndexFiles& index_files) {
     GetErrorLogger().LogErrno("remove() in CollectionMerger::RemoveIndexFiles(), could not remove meta info file '" + index_files.meta_info_filename() + "'",
                               errno, false);
   }
+
+  // Only an index built by the indexer in a single run could have a forward index.
+  if (access(index_files.forward_index_filename().c_str(), F_OK) == 0) {
+    remove_ret = remove(index_files.forward_index_filename().c_str());
+    if (remove_ret < 0) {
+      GetErrorLogger().LogErrno("remove() in CollectionMerger::RemoveIndexFiles(), could not remove forward index file '"
+          + index_files.forward_index_filename() + "'", errno, false);
+    }
+  }
 }
 
-void CollectionMerger::RenameIndexFiles(const IndexFiles& curr_index_files, const IndexFiles& final_index_files) {
+// Returns true if the index had a forward index, which was renamed along with the rest of the index files.
+// The forward index stays valid, since renaming doesn't change the termIDs or the docIDs.
+bool CollectionMerger::RenameIndexFiles(const IndexFiles& curr_index_files, const IndexFiles& final_index_files) {
   int rename_ret;
 
   rename_ret = rename(curr_index_files.index_filename().c_str(), final_index_files.index_filename().c_str());
@@ -775,6 +793,26 @@ void CollectionMerger::RenameIndexFiles(const IndexFiles& curr_index_files, cons
     GetErrorLogger().LogErrno("rename() in CollectionMerger::RenameIndexFiles(), could not rename meta info file '" + curr_index_files.meta_info_filename()
         + "' to '" + final_index_files.meta_info_filename() + "'", errno, false);
   }
+
+  if (access(curr_index_files.forward_index_filename().c_str(), F_OK) != 0)
+    return false;
+
+  rename_ret = rename(curr_index_files.forward_index_filename().c_str(), final_index_files.forward_index_filename().c_str());
+  if (rename_ret < 0) {
+    GetErrorLogger().LogErrno("rename() in CollectionMerger::RenameIndexFiles(), could not rename forward index file '"
+        + curr_index_files.forward_index_filename() + "' to '" + final_index_files.forward_index_filename() + "'", errno, false);
+    return false;
+  }
+  return true;
+}
+
+// Generates the forward index of the final merged index, if one was requested.
+void CollectionMerger::CreateForwardIndex(const IndexFiles& index_files) {
+  if (!Configuration::GetResultValue(Configuration::GetConfiguration().GetBooleanValue(config_properties::kIncludeForwardIndex)))
+    return;
+
+  ForwardIndexGenerator forward_index_generator(index_files);
+  forward_index_generator.CreateForwardIndex();
 }
 
 // Can be used to monitor progress of the merge in the future.
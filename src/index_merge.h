@@ -99,7 +99,8 @@ public:
 private:
   int GetNumPasses(int num_indices, int merge_degree) const;
   void RemoveIndexFiles(const IndexFiles& index_files);
-  void RenameIndexFiles(const IndexFiles& curr_index_files, const IndexFiles& final_index_files);
+  bool RenameIndexFiles(const IndexFiles& curr_index_files, const IndexFiles& final_index_files);
+  void CreateForwardIndex(const IndexFiles& index_files);
 
   const int kMergeDegree;
   const bool kDeleteMergedFiles;
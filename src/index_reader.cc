@@ -47,11 +47,16 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>  // SSE2
+#endif
+
 #include "config_file_properties.h"
 #include "configuration.h"
 #include "globals.h"
 #include "logger.h"
 #include "meta_file_properties.h"
+#include "perf_counters.h"
 #include "timer.h"
 using namespace std;
 
@@ -69,6 +74,7 @@ ChunkDecoder::ChunkDecoder() :
   prev_decoded_doc_id_(0),
   decoded_doc_ids_(false),
   decoded_properties_(false),
+  decoded_positions_(false),
   chunk_max_score_(numeric_limits<float>::max()),
   num_positions_(0),
   prev_document_offset_(0),
@@ -85,6 +91,7 @@ void ChunkDecoder::InitChunk(int num_docs, const uint32_t* buffer) {
   prev_decoded_doc_id_ = 0;
   decoded_doc_ids_ = false;
   decoded_properties_ = false;
+  decoded_positions_ = false;
 
   prev_document_offset_ = 0;
   curr_position_offset_ = 0;
@@ -98,8 +105,65 @@ void ChunkDecoder::DecodeDocIds(const CodingPolicy& doc_id_decompressor) {
     assert(doc_id_decompressor.block_size() == kChunkSize);
 
   // Advance the current buffer position by the number of words we decompressed.
+  START_PERF_COUNTERS(decode_counters);
   curr_buffer_position_ += doc_id_decompressor.Decompress(const_cast<uint32_t*> (curr_buffer_position_), doc_ids_, num_docs_);
+  STOP_PERF_COUNTERS(decode_counters, PerfCounters::kDocIdDecodingPhase);
+  decoded_doc_ids_ = true;
+}
+
+void ChunkDecoder::DecodeDocIdGaps(uint32_t doc_id_offset) {
+  assert(decoded_doc_ids_ == true);
+
+  int i = 0;
+#ifdef __SSE2__
+  // Prefix sum of 4 gaps at a time: two shifted adds sum up the gaps within the register, and the last docID of the previous 4 is then added to all of them.
+  __m128i prev_doc_ids = _mm_set1_epi32(doc_id_offset);
+  for (; i + 4 <= num_docs_; i += 4) {
+    __m128i* curr_doc_ids_ptr = reinterpret_cast<__m128i*> (doc_ids_ + i);
+    __m128i curr_doc_ids = _mm_loadu_si128(curr_doc_ids_ptr);
+    curr_doc_ids = _mm_add_epi32(curr_doc_ids, _mm_slli_si128(curr_doc_ids, 4));
+    curr_doc_ids = _mm_add_epi32(curr_doc_ids, _mm_slli_si128(curr_doc_ids, 8));
+    curr_doc_ids = _mm_add_epi32(curr_doc_ids, prev_doc_ids);
+    _mm_storeu_si128(curr_doc_ids_ptr, curr_doc_ids);
+    prev_doc_ids = _mm_shuffle_epi32(curr_doc_ids, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  if (i > 0)
+    doc_id_offset = doc_ids_[i - 1];
+#endif
+
+  for (; i < num_docs_; ++i) {
+    doc_id_offset += doc_ids_[i];
+    doc_ids_[i] = doc_id_offset;
+  }
+}
+
+int ChunkDecoder::FindDocIdGEQ(int doc_offset, uint32_t doc_id) const {
+  int i = doc_offset;
+#ifdef __SSE2__
+  // Compares 4 docIDs at a time against 'doc_id'. Since the docIDs are in ascending order, the mask of docIDs less than 'doc_id' is a run of set bits,
+  // and the first unset bit is the one we're looking for. SSE2 only has signed integer comparisons, so we flip the sign bits to compare unsigned integers.
+  const __m128i kSignBits = _mm_set1_epi32(0x80000000);
+  __m128i target_doc_id = _mm_xor_si128(_mm_set1_epi32(doc_id), kSignBits);
+  for (; i + 4 <= num_docs_; i += 4) {
+    __m128i curr_doc_ids = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*> (doc_ids_ + i)), kSignBits);
+    int less_mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target_doc_id, curr_doc_ids)));
+    if (less_mask != 0xF)
+      return i + __builtin_ctz(~less_mask);
+  }
+#endif
+
+  for (; i < num_docs_; ++i) {
+    if (doc_ids_[i] >= doc_id)
+      return i;
+  }
+  return num_docs_;
+}
+
+void ChunkDecoder::LoadDecodedChunk(const uint32_t* doc_ids, const uint32_t* frequencies) {
+  memcpy(doc_ids_, doc_ids, num_docs_ * sizeof(*doc_ids_));
+  memcpy(frequencies_, frequencies, num_docs_ * sizeof(*frequencies_));
   decoded_doc_ids_ = true;
+  decoded_properties_ = true;
 }
 
 void ChunkDecoder::DecodeFrequencies(const CodingPolicy& frequency_decompressor) {
@@ -107,7 +171,9 @@ void ChunkDecoder::DecodeFrequencies(const CodingPolicy& frequency_decompressor)
     assert(frequency_decompressor.block_size() == kChunkSize);
 
   // Advance the current buffer position by the number of words we decompressed.
+  START_PERF_COUNTERS(decode_counters);
   curr_buffer_position_ += frequency_decompressor.Decompress(const_cast<uint32_t*> (curr_buffer_position_), frequencies_, num_docs_);
+  STOP_PERF_COUNTERS(decode_counters, PerfCounters::kFrequencyDecodingPhase);
 }
 
 void ChunkDecoder::DecodePositions(const CodingPolicy& position_decompressor) {
@@ -123,7 +189,9 @@ void ChunkDecoder::DecodePositions(const CodingPolicy& position_decompressor) {
     assert(position_decompressor.block_size() >= kChunkSize);
 
   // Advance the current buffer position by the number of words we decompressed.
+  START_PERF_COUNTERS(decode_counters);
   curr_buffer_position_ += position_decompressor.Decompress(const_cast<uint32_t*> (curr_buffer_position_), positions_, num_positions_);
+  STOP_PERF_COUNTERS(decode_counters, PerfCounters::kPositionDecodingPhase);
 }
 
 void ChunkDecoder::UpdatePropertiesOffset() {
@@ -135,6 +203,145 @@ void ChunkDecoder::UpdatePropertiesOffset() {
   prev_document_offset_ = curr_document_offset_;
 }
 
+/**************************************************************************************************************************************************************
+ * DecodedChunkCache
+ *
+ **************************************************************************************************************************************************************/
+const int DecodedChunkCache::kNumShards;  // Initialized in the class definition.
+
+DecodedChunkCache::DecodedChunkCache(uint64_t cache_size_bytes) :
+  kCapacity(cache_size_bytes / sizeof(CachedChunk)) {
+  for (int i = 0; i < kNumShards; ++i) {
+    Shard& shard = shards_[i];
+    // Spread the capacity evenly over the shards.
+    shard.capacity = kCapacity / kNumShards + ((static_cast<uint64_t> (i) < kCapacity % kNumShards) ? 1 : 0);
+    pthread_mutex_init(&shard.mutex, NULL);
+    shard.num_hits = 0;
+    shard.num_misses = 0;
+    shard.num_evictions = 0;
+    shard.decode_time = 0;
+    shard.decode_time_saved = 0;
+  }
+}
+
+DecodedChunkCache::~DecodedChunkCache() {
+  for (int i = 0; i < kNumShards; ++i) {
+    pthread_mutex_destroy(&shards_[i].mutex);
+  }
+}
+
+bool DecodedChunkCache::Lookup(uint64_t block_num, int chunk_num, ChunkDecoder* chunk_decoder) {
+  Shard& shard = GetShard(block_num, chunk_num);
+  pthread_mutex_lock(&shard.mutex);
+  CacheMap::iterator cache_map_itr = shard.cache_map.find(GetKey(block_num, chunk_num));
+  bool cache_hit = (cache_map_itr != shard.cache_map.end());
+  if (cache_hit) {
+    // It's now the most recently used chunk.
+    shard.lru_list.splice(shard.lru_list.end(), shard.lru_list, cache_map_itr->second);
+
+    const CachedChunk& cached_chunk = *cache_map_itr->second;
+    chunk_decoder->LoadDecodedChunk(cached_chunk.doc_ids, cached_chunk.frequencies);
+    ++shard.num_hits;
+    shard.decode_time_saved += cached_chunk.decode_time;
+  } else {
+    ++shard.num_misses;
+  }
+  pthread_mutex_unlock(&shard.mutex);
+  return cache_hit;
+}
+
+void DecodedChunkCache::Insert(uint64_t block_num, int chunk_num, const ChunkDecoder& chunk_decoder, double decode_time) {
+  Shard& shard = GetShard(block_num, chunk_num);
+  if (shard.capacity == 0)
+    return;
+
+  uint64_t key = GetKey(block_num, chunk_num);
+  pthread_mutex_lock(&shard.mutex);
+  shard.decode_time += decode_time;
+  // Another query thread might have cached the same chunk in the meantime.
+  if (shard.cache_map.find(key) == shard.cache_map.end()) {
+    if (shard.cache_map.size() == shard.capacity) {
+      // Reuse the least recently used chunk for the new chunk.
+      shard.cache_map.erase(shard.lru_list.front().key);
+      shard.lru_list.splice(shard.lru_list.end(), shard.lru_list, shard.lru_list.begin());
+      ++shard.num_evictions;
+    } else {
+      shard.lru_list.push_back(CachedChunk());
+    }
+
+    CachedChunk& cached_chunk = shard.lru_list.back();
+    cached_chunk.key = key;
+    cached_chunk.decode_time = decode_time;
+    memcpy(cached_chunk.doc_ids, chunk_decoder.doc_ids(), chunk_decoder.num_docs() * sizeof(*cached_chunk.doc_ids));
+    memcpy(cached_chunk.frequencies, chunk_decoder.frequencies(), chunk_decoder.num_docs() * sizeof(*cached_chunk.frequencies));
+    shard.cache_map.insert(make_pair(key, --shard.lru_list.end()));
+  }
+  pthread_mutex_unlock(&shard.mutex);
+}
+
+void DecodedChunkCache::Clear() {
+  for (int i = 0; i < kNumShards; ++i) {
+    Shard& shard = shards_[i];
+    pthread_mutex_lock(&shard.mutex);
+    shard.lru_list.clear();
+    shard.cache_map.clear();
+    pthread_mutex_unlock(&shard.mutex);
+  }
+}
+
+void DecodedChunkCache::ResetStats() {
+  for (int i = 0; i < kNumShards; ++i) {
+    Shard& shard = shards_[i];
+    pthread_mutex_lock(&shard.mutex);
+    shard.num_hits = 0;
+    shard.num_misses = 0;
+    shard.num_evictions = 0;
+    shard.decode_time = 0;
+    shard.decode_time_saved = 0;
+    pthread_mutex_unlock(&shard.mutex);
+  }
+}
+
+uint64_t DecodedChunkCache::num_hits() const {
+  uint64_t num_hits = 0;
+  for (int i = 0; i < kNumShards; ++i) {
+    num_hits += shards_[i].num_hits;
+  }
+  return num_hits;
+}
+
+uint64_t DecodedChunkCache::num_misses() const {
+  uint64_t num_misses = 0;
+  for (int i = 0; i < kNumShards; ++i) {
+    num_misses += shards_[i].num_misses;
+  }
+  return num_misses;
+}
+
+uint64_t DecodedChunkCache::num_evictions() const {
+  uint64_t num_evictions = 0;
+  for (int i = 0; i < kNumShards; ++i) {
+    num_evictions += shards_[i].num_evictions;
+  }
+  return num_evictions;
+}
+
+double DecodedChunkCache::decode_time() const {
+  double decode_time = 0;
+  for (int i = 0; i < kNumShards; ++i) {
+    decode_time += shards_[i].decode_time;
+  }
+  return decode_time;
+}
+
+double DecodedChunkCache::decode_time_saved() const {
+  double decode_time_saved = 0;
+  for (int i = 0; i < kNumShards; ++i) {
+    decode_time_saved += shards_[i].decode_time_saved;
+  }
+  return decode_time_saved;
+}
+
 /**************************************************************************************************************************************************************
  * BlockDecoder
  *
@@ -204,7 +411,7 @@ ListData::ListData(CacheManager& cache_manager, const CodingPolicy& doc_id_decom
                    const CodingPolicy& position_decompressor, const CodingPolicy& block_header_decompressor, int layer_num, uint32_t initial_block_num,
                    uint32_t initial_chunk_num, int num_docs, int num_docs_complete_list, int num_chunks_last_block, int num_blocks,
                    const uint32_t* last_doc_ids, float score_threshold, uint32_t external_index_offset, const ExternalIndexReader* external_index_reader,
-                   bool use_positions, bool single_term_query, bool block_skipping) :
+                   bool use_positions, bool single_term_query, bool block_skipping, DecodedChunkCache* decoded_chunk_cache) :
   kNumLeftoverDocs(num_docs % ChunkDecoder::kChunkSize),
   single_term_query_(single_term_query),
   layer_num_(layer_num),
@@ -219,6 +426,7 @@ ListData::ListData(CacheManager& cache_manager, const CodingPolicy& doc_id_decom
   block_skipping_(block_skipping),
   use_positions_(use_positions),
   num_chunks_last_block_left_(num_chunks_last_block_),
+  chunk_doc_ids_offset_(0),
   score_threshold_(score_threshold),
   term_num_(-1),
   doc_id_decompressor_(doc_id_decompressor),
@@ -239,7 +447,13 @@ ListData::ListData(CacheManager& cache_manager, const CodingPolicy& doc_id_decom
   last_queued_block_num_(curr_block_num_),
   cached_bytes_read_(0),
   disk_bytes_read_(0),
-  num_blocks_skipped_(0) {
+  num_blocks_skipped_(0),
+  num_next_geq_calls_(0),
+  num_chunks_decoded_(0),
+  decoded_chunk_cache_(use_positions ? NULL : decoded_chunk_cache),
+  open_cycles_(0),
+  block_fetch_cycles_(0),
+  decode_cycles_(0) {
   if (kReadAheadBlocks <= 0) {
     Configuration::ErroneousValue(config_properties::kReadAheadBlocks, Configuration::GetConfiguration().GetValue(config_properties::kReadAheadBlocks));
   }
@@ -291,9 +505,6 @@ void ListData::ResetList(bool single_term_query) {
   prev_block_last_doc_id_ = 0;
   curr_block_num_ = initial_block_num_;
   last_queued_block_num_ = curr_block_num_;
-  cached_bytes_read_ = 0;
-  disk_bytes_read_ = 0;
-  num_blocks_skipped_ = 0;
 
   external_index_pointer_.Reset();
 
@@ -315,7 +526,7 @@ int ListData::GetList(RetrieveDataType data_type, uint32_t* index_data, int inde
   if (data_type == kPosition && curr_chunk_decoder_.decoded_doc_ids()) {
     curr_frequency = GetFreq();
     curr_num_positions = GetNumDocProperties();
-    curr_positions = curr_chunk_decoder_.current_positions();
+    curr_positions = GetPositions();
     if (static_cast<int> (curr_num_positions) <= index_data_size) {
       // Copy the positions.
       for (i = 0; i < curr_num_positions; ++i) {
@@ -345,7 +556,7 @@ int ListData::GetList(RetrieveDataType data_type, uint32_t* index_data, int inde
       case kPosition:
         curr_frequency = GetFreq();
         curr_num_positions = GetNumDocProperties();
-        curr_positions = curr_chunk_decoder_.current_positions();
+        curr_positions = GetPositions();
 
         // We need to make sure we don't consume positions unless *all* of them fit into the supplied array.
         if (static_cast<int> (curr_index_data_idx + curr_num_positions) <= index_data_size) {
@@ -409,7 +620,7 @@ int ListData::LoopOverList(RetrieveDataType data_type) {
             curr_chunk_decoder_.set_curr_document_offset(k);  // Offset for the frequency.
             curr_frequency = GetFreq();
             curr_num_positions = GetNumDocProperties();
-            curr_chunk_decoder_.current_positions();
+            GetPositions();
             count += curr_num_positions;
             break;
 
@@ -432,15 +643,12 @@ int ListData::LoopOverList(RetrieveDataType data_type) {
 }
 
 uint32_t ListData::NextGEQ(uint32_t doc_id) {
-  // For standard DAAT OR mode processing, setting this parameter to 'false' resulted in an improvement of a few milliseconds in terms of average query latency,
-  // which was a little surprising.
-  const bool kDecodeAllChunkDGaps = false;
-
   // Since we now have the capability to skip over multiple blocks without even decoding the block header,
   // we can't tell how many documents or chunks are left in the list. For this reason, we now count the number of blocks remaining to be processed
   // in the list as well as how many chunks are present in the last remaining block of the list.
   // Additionally, we have to determine the number of chunks present in the last chunk of a list through the total number
   // of documents present in the list.
+  ++num_next_geq_calls_;
 
   // In-memory block level index has been built, so we can do block skipping.
   if (block_skipping_) {
@@ -448,12 +656,9 @@ uint32_t ListData::NextGEQ(uint32_t doc_id) {
     AdvanceBlock(doc_id);
   }
 
-  int i;
   int num_chunk_docs;
   int curr_chunk_num;
   int curr_document_offset;
-  uint32_t curr_doc_id;
-  uint32_t prev_doc_id;
 
   while (has_more()) {
     curr_chunk_num = curr_block_decoder_.curr_chunk();
@@ -478,57 +683,30 @@ uint32_t ListData::NextGEQ(uint32_t doc_id) {
           // num_chunk_docs = min(ChunkDecoder::kChunkSize, num_docs_left());
           num_chunk_docs = ((final_block() && final_chunk()) ? num_docs_last_chunk_ : ChunkDecoder::kChunkSize);
           curr_chunk_decoder_.InitChunk(num_chunk_docs, curr_block_decoder_.curr_block_data());
-          curr_chunk_decoder_.DecodeDocIds(doc_id_decompressor_);
-
-          // Need to do these offsets only if we haven't done them before for this chunk. This is to handle d-gap coding.
-          // List is across blocks and we need offset from previous block.
-          if (!initial_block() && curr_chunk_num == 0) {
-            curr_chunk_decoder_.update_prev_decoded_doc_id(prev_block_last_doc_id_);
-          }
-
-          // We need offset from previous chunk if this is not the first chunk in the list.
-          if (curr_chunk_num > curr_block_decoder_.starting_chunk()) {
-            curr_chunk_decoder_.update_prev_decoded_doc_id(curr_block_decoder_.chunk_last_doc_id(curr_chunk_num - 1));
-          }
 
-          // We always decode the first d-gap in the chunk.
-          curr_chunk_decoder_.update_prev_decoded_doc_id(curr_chunk_decoder_.doc_id(0));
-
-          if (kDecodeAllChunkDGaps) {
-            // Can decode all d-gaps in one swoop.
-            prev_doc_id = curr_chunk_decoder_.prev_decoded_doc_id();
-            curr_chunk_decoder_.set_doc_id(0, prev_doc_id);
-            for (i = 1; i < curr_chunk_decoder_.num_docs(); ++i) {
-              prev_doc_id += curr_chunk_decoder_.doc_id(i);
-              curr_chunk_decoder_.set_doc_id(i, prev_doc_id);
+          START_STAGE_TIMER(decode_time);
+          if (decoded_chunk_cache_ != NULL) {
+            if (!decoded_chunk_cache_->Lookup(curr_block_num_, curr_chunk_num, &curr_chunk_decoder_)) {
+              // The frequencies are decoded right away too, so that the whole chunk can be cached.
+              Timer decode_time;
+              DecodeChunkDocIds(curr_chunk_num);
+              curr_chunk_decoder_.DecodeFrequencies(frequency_decompressor_);
+              curr_chunk_decoder_.set_decoded_properties(true);
+              decoded_chunk_cache_->Insert(curr_block_num_, curr_chunk_num, curr_chunk_decoder_, decode_time.GetElapsedTime());
             }
+          } else {
+            DecodeChunkDocIds(curr_chunk_num);
           }
-        }
-
-        if (!kDecodeAllChunkDGaps) {
-          curr_doc_id = curr_chunk_decoder_.prev_decoded_doc_id();
+          STOP_STAGE_TIMER(decode_time, decode_cycles_);
         }
 
         // We always start the chunk offset from the last returned (or first, if this is a newly decoded chunk) document.
-        curr_document_offset = curr_chunk_decoder_.curr_document_offset();
-        for (i = curr_document_offset; i < curr_chunk_decoder_.num_docs(); ++i) {
-          if (kDecodeAllChunkDGaps) {
-            curr_doc_id = curr_chunk_decoder_.doc_id(i);
-          } else {
-            if (i != curr_document_offset)
-              curr_doc_id += curr_chunk_decoder_.doc_id(i);  // Necessary for d-gap coding.
-          }
-
-          // Found the docID we're looking for.
-          if (curr_doc_id >= doc_id) {
-            curr_chunk_decoder_.set_curr_document_offset(i);  // Offset for the frequency.
-            if (!kDecodeAllChunkDGaps) {
-              curr_chunk_decoder_.set_prev_decoded_doc_id(curr_doc_id);
-            }
+        curr_document_offset = curr_chunk_decoder_.FindDocIdGEQ(curr_chunk_decoder_.curr_document_offset(), doc_id);
 
-            return curr_doc_id;
-          }
-        }
+        // Found the docID we're looking for. It must be in this chunk, since it's not greater than the last docID of the chunk.
+        assert(curr_document_offset < curr_chunk_decoder_.num_docs());
+        curr_chunk_decoder_.set_curr_document_offset(curr_document_offset);  // Offset for the frequency.
+        return curr_chunk_decoder_.doc_id(curr_document_offset);
       } else {
         // Need to advance the external index since we're skipping a chunk (only if we have not already decoded it above).
         if (external_index_reader_ != NULL && curr_chunk_decoder_.decoded_doc_ids() == false) {
@@ -549,24 +727,96 @@ uint32_t ListData::NextGEQ(uint32_t doc_id) {
   return kNoMoreDocs;
 }
 
-uint32_t ListData::GetFreq() {
-  if (use_positions_) {
-    // Decode the frequencies and positions if we haven't already.
-    if (!curr_chunk_decoder_.decoded_properties()) {
-      curr_chunk_decoder_.DecodeFrequencies(frequency_decompressor_);
-      curr_chunk_decoder_.DecodePositions(position_decompressor_);
-      curr_chunk_decoder_.set_decoded_properties(true);
-    }
-    // Need to set the correct offset for the positions and other frequency dependent properties.
-    curr_chunk_decoder_.UpdatePropertiesOffset();
-  } else {
-    // Decode the frequencies if we haven't already.
-    if (!curr_chunk_decoder_.decoded_properties()) {
-      curr_chunk_decoder_.DecodeFrequencies(frequency_decompressor_);
-      curr_chunk_decoder_.set_decoded_properties(true);
+void ListData::DecodeChunkDocIds(int chunk_num) {
+  curr_chunk_decoder_.DecodeDocIds(doc_id_decompressor_);
+  ++num_chunks_decoded_;
+
+  // The docID the first d-gap of the chunk is relative to.
+  uint32_t doc_id_offset = 0;
+
+  // List is across blocks and we need offset from previous block.
+  if (!initial_block() && chunk_num == 0) {
+    doc_id_offset += prev_block_last_doc_id_;
+  }
+
+  // We need offset from previous chunk if this is not the first chunk in the list.
+  if (chunk_num > curr_block_decoder_.starting_chunk()) {
+    doc_id_offset += curr_block_decoder_.chunk_last_doc_id(chunk_num - 1);
+  }
+
+  // Decoding all the d-gaps of the chunk in one swoop (vectorized) is cheaper than decoding them one at a time as we move through the chunk,
+  // and it allows us to search the chunk for the docID we're looking for with SIMD comparisons.
+  curr_chunk_decoder_.DecodeDocIdGaps(doc_id_offset);
+}
+
+int ListData::NextGEQChunk(uint32_t doc_id, uint32_t* doc_ids) {
+  uint32_t curr_doc_id = NextGEQ(doc_id);
+  if (curr_doc_id == kNoMoreDocs)
+    return 0;
+
+  // NextGEQ() has already decoded the d-gaps of the whole chunk.
+  chunk_doc_ids_offset_ = curr_chunk_decoder_.curr_document_offset();
+  int num_chunk_doc_ids = curr_chunk_decoder_.num_docs() - chunk_doc_ids_offset_;
+  for (int i = 0; i < num_chunk_doc_ids; ++i) {
+    doc_ids[i] = curr_chunk_decoder_.doc_id(chunk_doc_ids_offset_ + i);
+  }
+  return num_chunk_doc_ids;
+}
+
+int ListData::NextGEQChunk(uint32_t doc_id, uint32_t* doc_ids, uint32_t* frequencies) {
+  int num_chunk_doc_ids = NextGEQChunk(doc_id, doc_ids);
+  if (num_chunk_doc_ids == 0)
+    return 0;
+
+  GetFreq();  // Makes sure the frequencies of the chunk are decoded.
+  const uint32_t* chunk_frequencies = curr_chunk_decoder_.frequencies() + chunk_doc_ids_offset_;
+  for (int i = 0; i < num_chunk_doc_ids; ++i) {
+    frequencies[i] = chunk_frequencies[i];
+  }
+  return num_chunk_doc_ids;
+}
+
+uint32_t ListData::ShallowNextGEQ(uint32_t doc_id) {
+  if (block_skipping_) {
+    AdvanceBlock(doc_id);
+  }
+
+  int curr_chunk_num;
+  while (has_more()) {
+    curr_chunk_num = curr_block_decoder_.curr_chunk();
+    if (curr_chunk_num < curr_block_decoder_.num_chunks()) {
+      if (doc_id <= curr_block_decoder_.chunk_last_doc_id(curr_chunk_num)) {
+        // If the chunk was already decoded, the max score of the chunk was set at that time.
+        if (external_index_reader_ != NULL && curr_chunk_decoder_.decoded_doc_ids() == false) {
+          external_index_reader_->AdvanceToChunk(curr_chunk_num, &external_index_pointer_);
+          curr_chunk_decoder_.set_chunk_max_score(external_index_pointer_.chunk_max_score);
+        }
+        return curr_block_decoder_.chunk_last_doc_id(curr_chunk_num);
+      }
+
+      // Need to advance the external index since we're skipping a chunk (only if we have not already decoded it).
+      if (external_index_reader_ != NULL && curr_chunk_decoder_.decoded_doc_ids() == false) {
+        external_index_reader_->AdvanceToChunk(curr_chunk_num, &external_index_pointer_);
+      }
+
+      AdvanceChunk();
+    } else {
+      AdvanceBlock();
     }
   }
 
+  return kNoMoreDocs;
+}
+
+uint32_t ListData::GetFreq() {
+  // Decode the frequencies if we haven't already. The positions are only decoded when they're asked for, by GetPositions().
+  if (!curr_chunk_decoder_.decoded_properties()) {
+    START_STAGE_TIMER(decode_time);
+    curr_chunk_decoder_.DecodeFrequencies(frequency_decompressor_);
+    curr_chunk_decoder_.set_decoded_properties(true);
+    STOP_STAGE_TIMER(decode_time, decode_cycles_);
+  }
+
   return curr_chunk_decoder_.current_frequency();
 }
 
@@ -574,6 +824,23 @@ uint32_t ListData::GetNumDocProperties() {
   return min(GetFreq(), static_cast<uint32_t> (ChunkDecoder::kMaxProperties));
 }
 
+const uint32_t* ListData::GetPositions() {
+  assert(use_positions_);
+
+  // The positions are stored right after the frequencies in the chunk, and we need the frequencies to know how many positions there are.
+  GetFreq();
+  if (!curr_chunk_decoder_.decoded_positions()) {
+    START_STAGE_TIMER(decode_time);
+    curr_chunk_decoder_.DecodePositions(position_decompressor_);
+    curr_chunk_decoder_.set_decoded_positions(true);
+    STOP_STAGE_TIMER(decode_time, decode_cycles_);
+  }
+
+  // Need to set the correct offset for the positions of the current docID.
+  curr_chunk_decoder_.UpdatePropertiesOffset();
+  return curr_chunk_decoder_.current_positions();
+}
+
 uint32_t ListData::NextGreaterBlockScore(float min_score) {
   assert(external_index_reader_ != NULL);
   assert(block_skipping_ == false);
@@ -616,8 +883,7 @@ uint32_t ListData::NextGreaterChunkScore(float min_score) {
       }
 
 #ifdef INDEX_READER_DEBUG
-      // Note that this assumes that 'kDecodeAllChunkDGaps' in NextGEQ() is set to true.
-      // It also assumes we use the number of chunks in the last block to determine the number of docIDs per chunk.
+      // Note that this assumes we use the number of chunks in the last block to determine the number of docIDs per chunk.
       cout << "Skipping chunk with the following docIDs." << endl;
       if (curr_chunk_decoder_.decoded_doc_ids() == false) {
         int num_chunk_docs = ((final_block() && final_chunk()) ? num_docs_last_chunk_ : ChunkDecoder::kChunkSize);
@@ -691,6 +957,7 @@ void ListData::SkipBlocks(int num_blocks, uint32_t initial_chunk_num) {
     // Read ahead the next several MBs worth of blocks, but not past the length of the list.
     // We also take into account that 'curr_block_num' could be greater than the 'last_queued_block_num_'
     // if the we're using an in-memory block level index.
+    CycleTimer block_fetch_time;
     if (curr_block_num_ >= last_queued_block_num_) {
       last_queued_block_num_ = curr_block_num_ + min(kReadAheadBlocks, num_blocks_left_);
       int disk_blocks_read = cache_manager_.QueueBlocks(curr_block_num_, last_queued_block_num_);
@@ -699,7 +966,10 @@ void ListData::SkipBlocks(int num_blocks, uint32_t initial_chunk_num) {
       cached_bytes_read_ += cached_blocks_read * CacheManager::kBlockSize;
     }
 
-    curr_block_decoder_.InitBlock(block_header_decompressor_, initial_chunk_num, cache_manager_.GetBlock(curr_block_num_));
+    uint32_t* block_data = cache_manager_.GetBlock(curr_block_num_);
+    block_fetch_cycles_ += block_fetch_time.GetElapsedCycles();
+
+    curr_block_decoder_.InitBlock(block_header_decompressor_, initial_chunk_num, block_data);
     curr_chunk_decoder_.set_decoded_doc_ids(false);
 
     if (external_index_reader_ != NULL) {
@@ -735,6 +1005,12 @@ void ListData::AdvanceBlock(uint32_t doc_id) {
   }
 }
 
+void ListData::SkipToBlockContaining(uint32_t doc_id) {
+  if (last_doc_ids_ != NULL) {
+    BlockBinarySearch(doc_id);
+  }
+}
+
 // TODO: We can also bias this binary search towards the lower half of the array,
 //       since that's where we expect our search to end (you can divide by 4, for example).
 //       We always expect to go forward into the inverted list, so this seems like a reasonable optimization.
@@ -820,10 +1096,14 @@ void ListData::AdvanceChunk() {
 LexiconData::LexiconData(const char* term, int term_len) :
   term_len_(term_len),
   term_(new char[term_len_]),
+  term_id_(0),
   num_layers_(0),
   additional_layers_(NULL),
   next_(NULL) {
   memcpy(term_, term, term_len);
+  for (int i = 0; i < NUM_KTH_SCORES; ++i) {
+    kth_scores_[i] = 0;
+  }
 }
 
 LexiconData::~LexiconData() {
@@ -864,24 +1144,34 @@ void LexiconData::InitLayers(int num_layers, const int* num_docs, const int* num
   }
 }
 
+void LexiconData::InitKthScores(const float* kth_scores) {
+  for (int i = 0; i < NUM_KTH_SCORES; ++i) {
+    kth_scores_[i] = kth_scores[i];
+  }
+}
+
 /**************************************************************************************************************************************************************
  * Lexicon
  *
  * Reads the lexicon file in smallish chunks and inserts entries into an in-memory hash table (when querying) or returns the next sequential entry (when
  * merging).
  **************************************************************************************************************************************************************/
-Lexicon::Lexicon(int hash_table_size, const char* lexicon_filename, bool random_access) :
+Lexicon::Lexicon(int hash_table_size, const char* lexicon_filename, bool random_access, bool includes_kth_scores) :
   lexicon_(random_access ? new MoveToFrontHashTable<LexiconData> (hash_table_size) : NULL),
+  includes_kth_scores_(includes_kth_scores),
   kLexiconBufferSize(1 << 20),
   lexicon_buffer_(new char[kLexiconBufferSize]),
   lexicon_buffer_ptr_(lexicon_buffer_),
   lexicon_fd_(-1),
   lexicon_file_size_(0),
-  num_bytes_read_(0) {
+  num_bytes_read_(0),
+  num_entries_read_(0) {
+  pthread_mutex_init(&lookup_mutex_, NULL);
   Open(lexicon_filename, random_access);
 }
 
 Lexicon::~Lexicon() {
+  pthread_mutex_destroy(&lookup_mutex_);
   delete[] lexicon_buffer_;
   delete lexicon_;
 
@@ -918,6 +1208,10 @@ void Lexicon::Open(const char* lexicon_filename, bool random_access) {
       lex_data->InitLayers(lexicon_entry.num_layers, lexicon_entry.num_docs, lexicon_entry.num_chunks, lexicon_entry.num_chunks_last_block,
                            lexicon_entry.num_blocks, lexicon_entry.block_numbers, lexicon_entry.chunk_numbers, lexicon_entry.score_thresholds,
                            lexicon_entry.external_index_offsets);
+      if (lexicon_entry.kth_scores != NULL) {
+        lex_data->InitKthScores(lexicon_entry.kth_scores);
+      }
+      lex_data->set_term_id(num_entries_read_++);
 
       ++num_terms;
     }
@@ -930,7 +1224,10 @@ void Lexicon::Open(const char* lexicon_filename, bool random_access) {
 }
 
 LexiconData* Lexicon::GetEntry(const char* term, int term_len) {
-  return lexicon_->Find(term, term_len);
+  pthread_mutex_lock(&lookup_mutex_);
+  LexiconData* lex_data = lexicon_->Find(term, term_len);
+  pthread_mutex_unlock(&lookup_mutex_);
+  return lex_data;
 }
 
 // Returns a pointer to the next lexicon entry lexicographically, or NULL if no more.
@@ -944,6 +1241,10 @@ LexiconData* Lexicon::GetNextEntry() {
     lex_data->InitLayers(lexicon_entry.num_layers, lexicon_entry.num_docs, lexicon_entry.num_chunks, lexicon_entry.num_chunks_last_block,
                          lexicon_entry.num_blocks, lexicon_entry.block_numbers, lexicon_entry.chunk_numbers, lexicon_entry.score_thresholds,
                          lexicon_entry.external_index_offsets);
+    if (lexicon_entry.kth_scores != NULL) {
+      lex_data->InitKthScores(lexicon_entry.kth_scores);
+    }
+    lex_data->set_term_id(num_entries_read_++);
     return lex_data;
   } else {
     delete [] lexicon_buffer_;
@@ -963,8 +1264,12 @@ void Lexicon::GetNext(LexiconEntry* lexicon_entry) {
       + sizeof(*lexicon_entry->num_chunks_last_block) + sizeof(*lexicon_entry->num_blocks) + sizeof(*lexicon_entry->block_numbers)
       + sizeof(*lexicon_entry->chunk_numbers) + sizeof(*lexicon_entry->score_thresholds) + sizeof(*lexicon_entry->external_index_offsets));
 
+  // The kth scores are stored once per entry, after all the layer dependent fields.
+  const int kLexiconEntryKthScoresBytes = includes_kth_scores_ ? (NUM_KTH_SCORES * sizeof(*lexicon_entry->kth_scores)) : 0;
+
   // We definitely need to load more data in this case.
-  if (lexicon_buffer_ptr_ + (kLexiconEntryFixedLengthFieldsBytes + kLexiconEntryLayerDependentFieldsBytes) > lexicon_buffer_ + kLexiconBufferSize) {
+  if (lexicon_buffer_ptr_ + (kLexiconEntryFixedLengthFieldsBytes + kLexiconEntryLayerDependentFieldsBytes + kLexiconEntryKthScoresBytes)
+      > lexicon_buffer_ + kLexiconBufferSize) {
     lseek(lexicon_fd_, num_bytes_read_, SEEK_SET);  // Seek just past where we last read data.
     int read_ret = read(lexicon_fd_, lexicon_buffer_, kLexiconBufferSize);
     if (read_ret < 0) {
@@ -990,7 +1295,8 @@ void Lexicon::GetNext(LexiconEntry* lexicon_entry) {
   num_bytes_read_ += term_len_bytes;
 
   // The term plus the rest of the fields do not fit into the buffer, so we need to increase it.
-  int lexicon_entry_size = term_len + kLexiconEntryFixedLengthFieldsBytes + kLexiconEntryLayerDependentFieldsBytes * num_layers;
+  int lexicon_entry_size = term_len + kLexiconEntryFixedLengthFieldsBytes + kLexiconEntryLayerDependentFieldsBytes * num_layers
+      + kLexiconEntryKthScoresBytes;
   if (lexicon_entry_size > kLexiconBufferSize) {
     kLexiconBufferSize = lexicon_entry_size;
     delete[] lexicon_buffer_;
@@ -1004,7 +1310,8 @@ void Lexicon::GetNext(LexiconEntry* lexicon_entry) {
   }
 
   // We couldn't read the whole term plus the rest of the integer fields of a lexicon entry into the buffer.
-  if (lexicon_buffer_ptr_ + (kLexiconEntryLayerDependentFieldsBytes * num_layers) + term_len > lexicon_buffer_ + kLexiconBufferSize) {
+  if (lexicon_buffer_ptr_ + (kLexiconEntryLayerDependentFieldsBytes * num_layers) + kLexiconEntryKthScoresBytes + term_len
+      > lexicon_buffer_ + kLexiconBufferSize) {
     lseek(lexicon_fd_, num_bytes_read_, SEEK_SET);  // Seek just past where we last read data.
     int read_ret = read(lexicon_fd_, lexicon_buffer_, kLexiconBufferSize);
     if (read_ret < 0) {
@@ -1076,6 +1383,12 @@ void Lexicon::GetNext(LexiconEntry* lexicon_entry) {
   lexicon_buffer_ptr_ += external_index_offsets_bytes;
   num_bytes_read_ += external_index_offsets_bytes;
 
+  // kth_scores
+  float* kth_scores = includes_kth_scores_ ? reinterpret_cast<float*> (lexicon_buffer_ptr_) : NULL;
+  assert((lexicon_buffer_ptr_+kLexiconEntryKthScoresBytes) <= (lexicon_buffer_ + kLexiconBufferSize));
+  lexicon_buffer_ptr_ += kLexiconEntryKthScoresBytes;
+  num_bytes_read_ += kLexiconEntryKthScoresBytes;
+
   lexicon_entry->term = term;
   lexicon_entry->term_len = term_len;
   lexicon_entry->num_layers = num_layers;
@@ -1087,6 +1400,7 @@ void Lexicon::GetNext(LexiconEntry* lexicon_entry) {
   lexicon_entry->chunk_numbers = chunk_numbers;
   lexicon_entry->score_thresholds = score_thresholds;
   lexicon_entry->external_index_offsets = external_index_offsets;
+  lexicon_entry->kth_scores = kth_scores;
 }
 
 /**************************************************************************************************************************************************************
@@ -1095,19 +1409,28 @@ void Lexicon::GetNext(LexiconEntry* lexicon_entry) {
  * Initiates loading of several MBs worth of blocks ahead since we don't know exactly how many blocks are in the list. Each block is processed as soon as it's
  * needed and we know it has been loaded into memory.
  **************************************************************************************************************************************************************/
+__thread ListAccessStatistics* IndexReader::thread_list_access_stats_ = NULL;
+
+// Indices built before the kth scores were introduced don't have this key in their meta info file, in which case the lexicon doesn't store them.
+static bool LexiconIncludesKthScores(const IndexConfiguration& meta_info) {
+  KeyValueStore::KeyValueResult<long int> kth_scores_res = meta_info.GetNumericalValue(meta_properties::kLexiconKthScores);
+  return kth_scores_res.error() ? false : kth_scores_res.value_t();
+}
+
 IndexReader::IndexReader(Purpose purpose, CacheManager& cache_manager, const char* lexicon_filename, const char* doc_map_basic_filename,
                          const char* doc_map_extended_filename, const char* meta_info_filename, bool use_positions,
                          const ExternalIndexReader* external_index_reader) :
   purpose_(purpose),
   kLexiconSize(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kLexiconSize))),
-  lexicon_(kLexiconSize, lexicon_filename, (purpose_ == kRandomQuery)),
+  meta_info_(meta_info_filename),
+  lexicon_(kLexiconSize, lexicon_filename, (purpose_ == kRandomQuery), LexiconIncludesKthScores(meta_info_)),
   document_map_(doc_map_basic_filename, doc_map_extended_filename),
   cache_manager_(cache_manager),
-  meta_info_(meta_info_filename),
   includes_contexts_(IndexConfiguration::GetResultValue(meta_info_.GetNumericalValue(meta_properties::kIncludesContexts), true)),
   includes_positions_(IndexConfiguration::GetResultValue(meta_info_.GetNumericalValue(meta_properties::kIncludesPositions), true)),
   use_positions_(use_positions && includes_positions_),
   block_skipping_enabled_(false),
+  read_ahead_blocks_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kReadAheadBlocks))),
   external_index_reader_(external_index_reader),
   doc_id_decompressor_(CodingPolicy::kDocId),
   frequency_decompressor_(CodingPolicy::kFrequency),
@@ -1116,11 +1439,33 @@ IndexReader::IndexReader(Purpose purpose, CacheManager& cache_manager, const cha
   total_cached_bytes_read_(0),
   total_disk_bytes_read_(0),
   total_num_lists_accessed_(0),
-  total_num_blocks_skipped_(0) {
+  total_num_blocks_skipped_(0),
+  total_num_next_geq_calls_(0),
+  total_num_chunks_decoded_(0),
+  total_list_open_cycles_(0),
+  total_block_fetch_cycles_(0),
+  total_decode_cycles_(0),
+  decoded_chunk_cache_(NULL) {
+  pthread_mutex_init(&stats_mutex_, NULL);
+
   if (kLexiconSize <= 0) {
     Configuration::ErroneousValue(config_properties::kLexiconSize, Configuration::GetConfiguration().GetValue(config_properties::kLexiconSize));
   }
 
+  // The decoded chunk cache only holds docIDs and frequencies, so it's not used when positions are needed.
+  if (purpose_ == kRandomQuery && !use_positions_) {
+    long int decoded_chunk_cache_size =
+        Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kDecodedChunkCacheSize));
+    if (decoded_chunk_cache_size < 0) {
+      Configuration::ErroneousValue(config_properties::kDecodedChunkCacheSize,
+                                    Configuration::GetConfiguration().GetValue(config_properties::kDecodedChunkCacheSize));
+    }
+
+    if (decoded_chunk_cache_size > 0) {
+      decoded_chunk_cache_ = new DecodedChunkCache(static_cast<uint64_t> (decoded_chunk_cache_size) << 20);
+    }
+  }
+
   coding_policy_helper::LoadPolicyAndCheck(doc_id_decompressor_, meta_info_.GetValue(meta_properties::kIndexDocIdCoding), "docID");
   coding_policy_helper::LoadPolicyAndCheck(frequency_decompressor_, meta_info_.GetValue(meta_properties::kIndexFrequencyCoding), "frequency");
   coding_policy_helper::LoadPolicyAndCheck(position_decompressor_, meta_info_.GetValue(meta_properties::kIndexPositionCoding), "position");
@@ -1135,8 +1480,14 @@ IndexReader::IndexReader(Purpose purpose, CacheManager& cache_manager, const cha
   }
 }
 
+IndexReader::~IndexReader() {
+  pthread_mutex_destroy(&stats_mutex_);
+  delete decoded_chunk_cache_;
+}
+
 ListData* IndexReader::OpenList(const LexiconData& lex_data, int layer_num, bool single_term_query) {
   assert(lex_data.layer_block_number(layer_num) >= 0 && lex_data.layer_chunk_number(layer_num) >= 0 && lex_data.layer_num_docs(layer_num) >= 0);
+  CycleTimer open_time;
 
   // TODO: If there are errors reading the values for these keys (most likely missing value), we assume they're false
   // (because that would require updating the index meta file generation in some places, which should be done eventually).
@@ -1170,7 +1521,11 @@ ListData* IndexReader::OpenList(const LexiconData& lex_data, int layer_num, bool
                                      external_index_reader_,
                                      use_positions_,
                                      single_term_query,
-                                     block_skipping_enabled_);
+                                     block_skipping_enabled_,
+                                     decoded_chunk_cache_);
+
+  // Opening the list also fetches its first block, which is accounted for separately.
+  list_data->set_open_cycles(open_time.GetElapsedCycles() - list_data->block_fetch_cycles());
   return list_data;
 }
 
@@ -1180,11 +1535,42 @@ ListData* IndexReader::OpenList(const LexiconData& lex_data, int layer_num, bool
   return list;
 }
 
+// Safe to call concurrently from multiple query threads. Folds the list's access counters and cycle counts into the reader totals under 'stats_mutex_'
+// (and into the calling thread's list access statistics, if any), then frees the list.
 void IndexReader::CloseList(ListData* list_data) {
+  pthread_mutex_lock(&stats_mutex_);
   total_cached_bytes_read_ += list_data->cached_bytes_read();
   total_disk_bytes_read_ += list_data->disk_bytes_read();
   ++total_num_lists_accessed_;
   total_num_blocks_skipped_ += list_data->num_blocks_skipped();
+  total_num_next_geq_calls_ += list_data->num_next_geq_calls();
+  total_num_chunks_decoded_ += list_data->num_chunks_decoded();
+  total_list_open_cycles_ += list_data->open_cycles();
+  total_block_fetch_cycles_ += list_data->block_fetch_cycles();
+  total_decode_cycles_ += list_data->decode_cycles();
+  pthread_mutex_unlock(&stats_mutex_);
+
+  if (thread_list_access_stats_ != NULL)
+    thread_list_access_stats_->Add(*list_data);
 
   delete list_data;
 }
+
+// The range covers the same blocks that the list would queue up first when opened, so the list finds them already in the cache (or on their way there).
+int IndexReader::PrefetchList(const LexiconData& lex_data, int layer_num, BlockRange* blocks) {
+  blocks->first = lex_data.layer_block_number(layer_num);
+  blocks->second = blocks->first + min<long int> (read_ahead_blocks_, lex_data.layer_num_blocks(layer_num));
+  return cache_manager_.QueueBlocks(blocks->first, blocks->second);
+}
+
+bool IndexReader::PrefetchedBlocksReady(const BlockRange& blocks) {
+  return cache_manager_.BlocksReady(blocks.first, blocks.second);
+}
+
+void IndexReader::FreePrefetchedBlocks(const BlockRange& blocks) {
+  for (uint64_t i = blocks.first; i < blocks.second; ++i) {
+    // Like when freeing the blocks queued by a list, we must make sure no disk I/O is still in progress into the block (in case it gets evicted).
+    cache_manager_.GetBlock(i);
+    cache_manager_.FreeBlock(i);
+  }
+}
@@ -40,6 +40,11 @@
 
 #include <climits>
 
+#include <pthread.h>
+
+#include <list>
+#include <map>
+
 #ifdef INDEX_READER_DEBUG
 #include <iostream>
 #endif
@@ -66,6 +71,18 @@ public:
 
   void DecodeDocIds(const CodingPolicy& doc_id_decompressor);
 
+  // Turns the decoded docID gaps into docIDs (with a prefix sum), where 'doc_id_offset' is the docID the first gap is relative to.
+  // Requires 'doc_ids_' to have been already decoded.
+  void DecodeDocIdGaps(uint32_t doc_id_offset);
+
+  // Returns the offset of the first docID >= 'doc_id', searching from the offset 'doc_offset', or 'num_docs_' if there is no such docID in this chunk.
+  // Requires the docID gaps to have been already decoded by DecodeDocIdGaps().
+  int FindDocIdGEQ(int doc_offset, uint32_t doc_id) const;
+
+  // Copies in the docIDs (with the gaps already decoded) and the frequencies of an already decoded chunk, instead of decoding them.
+  // Since the chunk data won't be decoded, positions can't be decoded for this chunk afterwards.
+  void LoadDecodedChunk(const uint32_t* doc_ids, const uint32_t* frequencies);
+
   void DecodeFrequencies(const CodingPolicy& frequency_decompressor);
 
   void DecodePositions(const CodingPolicy& position_decompressor);
@@ -140,6 +157,22 @@ public:
     decoded_properties_ = decoded_properties;
   }
 
+  bool decoded_positions() const {
+    return decoded_positions_;
+  }
+
+  void set_decoded_positions(bool decoded_positions) {
+    decoded_positions_ = decoded_positions;
+  }
+
+  const uint32_t* doc_ids() const {
+    return doc_ids_;
+  }
+
+  const uint32_t* frequencies() const {
+    return frequencies_;
+  }
+
   float chunk_max_score() const {
     return chunk_max_score_;
   }
@@ -159,6 +192,8 @@ private:
   bool decoded_doc_ids_;                  // True when we have decoded the docIDs.
   bool decoded_properties_;               // True when we have decoded the document properties (that is, frequencies, positions, etc). Necessary because we
                                           // don't want to decode the frequencies/contexts/positions until we're certain we actually need them.
+  bool decoded_positions_;                // True when we have decoded the positions. They're decoded separately from (and after) the frequencies, since
+                                          // most queries only need the frequencies.
   float chunk_max_score_;                 // The maximum partial docID score contained within this chunk.
   int num_positions_;                     // Total number of decoded positions in this list.
   int prev_document_offset_;              // The position we last stopped at when updating the 'curr_position_offset_'.
@@ -167,13 +202,98 @@ private:
   const uint32_t* curr_buffer_position_;  // Pointer to the raw data of stuff we have to decode next.
 
   // These buffers are used for decompression of chunks.
-  uint32_t doc_ids_[UncompressedOutBufferUpperbound(kChunkSize)];                     // Array of decompressed docIDs. If stored gap coded,
-                                                                                      // the gaps are not decoded here, but rather during query processing.
+  uint32_t doc_ids_[UncompressedOutBufferUpperbound(kChunkSize)];                     // Array of decompressed docIDs. If stored gap coded, the gaps are
+                                                                                      // decoded on demand by DecodeDocIdGaps() during query processing.
   uint32_t frequencies_[UncompressedOutBufferUpperbound(kChunkSize)];                 // Array of decompressed frequencies.
   uint32_t positions_[UncompressedOutBufferUpperbound(kChunkSize * kMaxProperties)];  // Array of decomrpessed positions. The position gaps are not decoded
                                                                                       // here, but rather during query processing, if necessary at all.
 };
 
+/**************************************************************************************************************************************************************
+ * DecodedChunkCache
+ *
+ * Caches decoded chunks (docIDs with the gaps decoded, and frequencies) across queries, keyed by the block number and the chunk number within the block.
+ * While the CacheManager saves us from reading the compressed blocks of popular lists over and over again, this saves us from decoding their hot chunks
+ * over and over again. Holds up to a fixed number of chunks, evicting the least recently used chunk when full. It is concurrent safe for multiple queries
+ * running simultaneously. Since every chunk lookup goes through the cache, the chunks are spread over a number of shards by their key, each with its own
+ * lock, share of the capacity and LRU order, so that the query threads don't serialize on a single lock.
+ **************************************************************************************************************************************************************/
+class DecodedChunkCache {
+public:
+  DecodedChunkCache(uint64_t cache_size_bytes);
+  ~DecodedChunkCache();
+
+  // On a cache hit, loads the cached chunk into 'chunk_decoder' (which must have been initialized for the chunk) and returns true.
+  // Returns false on a cache miss.
+  bool Lookup(uint64_t block_num, int chunk_num, ChunkDecoder* chunk_decoder);
+
+  // Caches the decoded docIDs and frequencies of 'chunk_decoder'. 'decode_time' is the time it took to decode the chunk, which is what a cache hit saves.
+  void Insert(uint64_t block_num, int chunk_num, const ChunkDecoder& chunk_decoder, double decode_time);
+
+  // Drops all the cached chunks (but keeps the cache statistics).
+  void Clear();
+
+  // Resets the cache statistics (but keeps the cached chunks).
+  void ResetStats();
+
+  uint64_t capacity() const {
+    return kCapacity;
+  }
+
+  // The cache statistics, summed over all the shards.
+  uint64_t num_hits() const;
+  uint64_t num_misses() const;
+  uint64_t num_evictions() const;
+  double decode_time() const;
+  double decode_time_saved() const;
+
+private:
+  struct CachedChunk {
+    uint64_t key;
+    double decode_time;
+    uint32_t doc_ids[ChunkDecoder::kChunkSize];
+    uint32_t frequencies[ChunkDecoder::kChunkSize];
+  };
+
+  typedef std::list<CachedChunk> LruList;
+  typedef std::map<uint64_t, LruList::iterator> CacheMap;
+
+  struct Shard {
+    uint64_t capacity;  // The max number of chunks that can be cached in this shard.
+
+    // Access to the shard must be concurrent safe.
+    pthread_mutex_t mutex;
+
+    // Stores the cached chunks, in LRU order (the most recently used is at the back).
+    LruList lru_list;
+
+    // Maps a cache key to the cached chunk.
+    CacheMap cache_map;
+
+    // Cache statistics.
+    uint64_t num_hits;
+    uint64_t num_misses;
+    uint64_t num_evictions;
+    double decode_time;        // The total time spent decoding the chunks that missed the cache.
+    double decode_time_saved;  // The total time it took to decode the chunks that hit the cache (when they were first decoded).
+  };
+
+  static const int kNumShards = 64;
+
+  static uint64_t GetKey(uint64_t block_num, int chunk_num) {
+    return (block_num << 32) | chunk_num;
+  }
+
+  // The chunks of a block go to consecutive shards, and the blocks are spread out over the shards as well.
+  Shard& GetShard(uint64_t block_num, int chunk_num) {
+    return shards_[(block_num * 31 + chunk_num) % kNumShards];
+  }
+
+  const uint64_t kCapacity;  // The max number of chunks that can be cached.
+
+  Shard shards_[kNumShards];
+};
+
 /**************************************************************************************************************************************************************
  * BlockDecoder
  *
@@ -280,10 +400,11 @@ public:
            const CodingPolicy& position_decompressor, const CodingPolicy& block_header_decompressor, int layer_num, uint32_t initial_block_num,
            uint32_t initial_chunk_num, int num_docs, int num_docs_complete_list, int num_chunks_last_block, int num_blocks, const uint32_t* last_doc_ids,
            float score_threshold, uint32_t external_index_offset, const ExternalIndexReader* external_index_reader, bool use_positions, bool single_term_query,
-           bool block_skipping);
+           bool block_skipping, DecodedChunkCache* decoded_chunk_cache = NULL);
   ~ListData();
 
   // Resets the inverted list to it's initial state. After resetting, we can start decoding the list from the beginning again.
+  // The access statistics are kept, so that the work done before the reset is still accounted for when the list is closed.
   void ResetList(bool single_term_query);
 
   // 'data_type' represents the type of index information we want to retrieve.
@@ -300,12 +421,37 @@ public:
   // Returns the next greater than or equal docID to that of 'doc_id'.
   uint32_t NextGEQ(uint32_t doc_id);
 
+  // Moves to the chunk that could contain the next greater than or equal docID to that of 'doc_id', without decoding the chunk.
+  // Returns the last docID of that chunk, or the sentinel value if there are no more docIDs >= 'doc_id' in the list. The upperbound score of the chunk is then
+  // available through GetChunkScoreBound() (requires the external index). Only a NextGEQ() with a docID >= 'doc_id' may follow this call.
+  uint32_t ShallowNextGEQ(uint32_t doc_id);
+
+  // Moves to the next greater than or equal docID to that of 'doc_id' (as NextGEQ() does) and copies out the fully decoded docIDs starting with that docID
+  // up to the end of its chunk into 'doc_ids', which must be able to hold 'ChunkDecoder::kChunkSize' docIDs.
+  // Returns the number of docIDs copied, or 0 if there are no more docIDs >= 'doc_id' in the list.
+  // This allows whole chunks of the list to be processed at once (e.g. for SIMD list intersection).
+  int NextGEQChunk(uint32_t doc_id, uint32_t* doc_ids);
+
+  // As above, but also copies out the frequencies of the same docIDs into 'frequencies', which must be able to hold 'ChunkDecoder::kChunkSize' frequencies.
+  // The list is left positioned on the first docID copied.
+  int NextGEQChunk(uint32_t doc_id, uint32_t* doc_ids, uint32_t* frequencies);
+
+  // Positions the list on the docID stored at index 'doc_id_idx' of the array filled in by the last call to NextGEQChunk(), so that GetFreq() and
+  // friends can be called for it. Positions can only move forward within the chunk.
+  void SkipToChunkDoc(int doc_id_idx) {
+    curr_chunk_decoder_.set_curr_document_offset(chunk_doc_ids_offset_ + doc_id_idx);
+  }
+
   // Returns the frequency for the current docID.
   uint32_t GetFreq();
 
   // Returns the number of per document properties (e.g. number of positions) for the current docID.
   uint32_t GetNumDocProperties();
 
+  // Returns the positions for the current docID (gap coded, 'GetNumDocProperties()' of them). Requires the list to have been opened with positions.
+  // The positions of a chunk are only decoded the first time they're requested for one of its docIDs.
+  const uint32_t* GetPositions();
+
   // Returns the next docID that has a score greater than 'min_score'. Skips ahead by blocks.
   uint32_t NextGreaterBlockScore(float min_score);
 
@@ -324,6 +470,10 @@ public:
   // Advances to the next block.
   void AdvanceBlock();
 
+  // Jumps to the first block that can contain 'doc_id' using a binary search over the in-memory block level index. Meant for moving far ahead in the list
+  // (i.e. to the start of a docID range), where the sequential block search done by NextGEQ() would be slow. Does nothing if there is no block level index.
+  void SkipToBlockContaining(uint32_t doc_id);
+
   // Advances to the next chunk.
   void AdvanceChunk();
 
@@ -379,11 +529,38 @@ public:
     return num_blocks_skipped_;
   }
 
+  uint64_t num_next_geq_calls() const {
+    return num_next_geq_calls_;
+  }
+
+  uint64_t num_chunks_decoded() const {
+    return num_chunks_decoded_;
+  }
+
+  uint64_t open_cycles() const {
+    return open_cycles_;
+  }
+
+  void set_open_cycles(uint64_t open_cycles) {
+    open_cycles_ = open_cycles;
+  }
+
+  uint64_t block_fetch_cycles() const {
+    return block_fetch_cycles_;
+  }
+
+  uint64_t decode_cycles() const {
+    return decode_cycles_;
+  }
+
   static const uint32_t kNoMoreDocs;  // Sentinel value indicating that there are no more docs available in the list.
 
 private:
   void Init();
 
+  // Decodes the docIDs of the current chunk 'chunk_num' (which has been initialized), including the d-gaps.
+  void DecodeChunkDocIds(int chunk_num);
+
   void FreeQueuedBlocks();
 
   void SkipBlocks(int num_blocks, uint32_t initial_chunk_num);
@@ -434,6 +611,7 @@ private:
   bool use_positions_;               // Determines whether position information will be decoded and made available.
   int num_chunks_last_block_left_;   // The number of chunks left to traverse from the last block (only updated when in the last block).
   ChunkDecoder curr_chunk_decoder_;  // The current chunk being processed in this inverted list.
+  int chunk_doc_ids_offset_;         // The chunk document offset of the first docID copied out by the last call to NextGEQChunk().
   // This is algorithm dependent, but could potentially be used often.
   float score_threshold_;            // The maximum scoring partial score of any docID in this list.
   int term_num_;                     // May be used by the query processor to map this object back to the term it corresponds to.
@@ -465,6 +643,14 @@ private:
   uint64_t cached_bytes_read_;                     // Keeps track of the number of bytes read from the cache for this list.
   uint64_t disk_bytes_read_;                       // Keeps track of the number of bytes read from the disk for this list.
   uint32_t num_blocks_skipped_;                    // Keeps track of the number of blocks we were able to skip (when using in-memory block index).
+  uint64_t num_next_geq_calls_;                    // Keeps track of the number of NextGEQ() calls made on this list.
+  uint64_t num_chunks_decoded_;                    // Keeps track of the number of chunks whose docIDs we decoded (not counting decoded chunk cache hits).
+  DecodedChunkCache* decoded_chunk_cache_;         // Caches decoded chunks across queries (NULL if not used).
+
+  // Time spent on this list (in cycles, see 'CycleTimer'). Like the other statistics, these are not reset when the list is reset.
+  uint64_t open_cycles_;                           // Opening the list, not counting fetching the first block.
+  uint64_t block_fetch_cycles_;                    // Queuing up blocks and waiting for them to be read in.
+  uint64_t decode_cycles_;                         // Decoding chunks (only timed when compiled with 'IRTK_STAGE_TIMING').
 };
 
 /**************************************************************************************************************************************************************
@@ -484,6 +670,7 @@ public:
   void InitLayers();
   void InitLayers(int num_layers, const int* num_docs, const int* num_chunks, const int* num_chunks_last_block, const int* num_blocks,
                   const int* block_numbers, const int* chunk_numbers, const float* score_thresholds, const uint32_t* external_index_offsets);
+  void InitKthScores(const float* kth_scores);
 
   const char* term() const {
     return term_;
@@ -493,6 +680,15 @@ public:
     return term_len_;
   }
 
+  // The position of this entry within the lexicon; this is the termID used by the forward index.
+  uint32_t term_id() const {
+    return term_id_;
+  }
+
+  void set_term_id(uint32_t term_id) {
+    term_id_ = term_id;
+  }
+
   int num_layers() const {
     return num_layers_;
   }
@@ -569,6 +765,13 @@ public:
     }
   }
 
+  // The partial BM25 score of the posting ranked 'kKthScoreRanks[kth_score_num]' by score in the whole list.
+  // It's 0 if the list has less postings than that, or if the index doesn't store these scores.
+  float kth_score(int kth_score_num) const {
+    assert(kth_score_num < NUM_KTH_SCORES);
+    return kth_scores_[kth_score_num];
+  }
+
   const uint32_t* layer_last_doc_ids(int layer_num) const {
     assert(layer_num < num_layers_);
     if (layer_num == 0) {
@@ -598,6 +801,7 @@ public:
 private:
   int term_len_;  // The length of the 'term_', since it's not NULL terminated.
   char* term_;    // Pointer to the term this lexicon entry holds (it is not NULL terminated!).
+  uint32_t term_id_;  // The position of this entry within the lexicon (the lexicon is sorted by term).
 
   int num_layers_;  // Number of layers this list consists of.
 
@@ -618,6 +822,8 @@ private:
   LayerInfo first_layer_;            // Every list has at least one layer (and most will have only one). Any additional layers will be allocated dynamically.
   LayerInfo* additional_layers_;     // Dynamically allocated for any additional layers.
 
+  float kth_scores_[NUM_KTH_SCORES]; // The kth highest partial BM25 scores of the whole list, for the ranks in 'kKthScoreRanks'.
+
   LexiconData* next_;                // Pointer to the next lexicon entry.
 };
 
@@ -632,7 +838,7 @@ private:
  **************************************************************************************************************************************************************/
 class Lexicon {
 public:
-  Lexicon(int hash_table_size, const char* lexicon_filename, bool random_access);
+  Lexicon(int hash_table_size, const char* lexicon_filename, bool random_access, bool includes_kth_scores = false);
   ~Lexicon();
 
   void Open(const char* lexicon_filename, bool random_access);
@@ -664,17 +870,46 @@ private:
     int* chunk_numbers;
     float* score_thresholds;
     uint32_t* external_index_offsets;
+    float* kth_scores;  // NULL if the lexicon doesn't store them.
   };
 
   void GetNext(LexiconEntry* lexicon_entry);
 
   MoveToFrontHashTable<LexiconData>* lexicon_;  // The pointer to the hash table for randomly querying the lexicon.
+  pthread_mutex_t lookup_mutex_;                // Lookups move the found entry to the front of its' hash chain, so they must be serialized between query threads.
+  bool includes_kth_scores_;                    // Whether each lexicon entry ends with the kth highest partial BM25 scores of the list.
   int kLexiconBufferSize;                       // Size of buffer used for reading parts of the lexicon.
   char* lexicon_buffer_;                        // Pointer to the current portion of the lexicon we're buffering.
   char* lexicon_buffer_ptr_;                    // Current position in the lexicon buffer.
   int lexicon_fd_;                              // File descriptor for the lexicon.
   off_t lexicon_file_size_;                     // The size of the on disk lexicon file.
   off_t num_bytes_read_;                        // Number of bytes of lexicon read so far.
+  uint32_t num_entries_read_;                   // Number of lexicon entries read so far; the termID of the next entry.
+};
+
+/**************************************************************************************************************************************************************
+ * ListAccessStatistics
+ *
+ * How much work was done traversing lists, summed up over a set of lists (for example, all the lists of a single query).
+ **************************************************************************************************************************************************************/
+struct ListAccessStatistics {
+  ListAccessStatistics() :
+    num_next_geq_calls(0), num_chunks_decoded(0), num_blocks_skipped(0), cached_bytes_read(0), disk_bytes_read(0) {
+  }
+
+  void Add(const ListData& list_data) {
+    num_next_geq_calls += list_data.num_next_geq_calls();
+    num_chunks_decoded += list_data.num_chunks_decoded();
+    num_blocks_skipped += list_data.num_blocks_skipped();
+    cached_bytes_read += list_data.cached_bytes_read();
+    disk_bytes_read += list_data.disk_bytes_read();
+  }
+
+  uint64_t num_next_geq_calls;
+  uint64_t num_chunks_decoded;
+  uint64_t num_blocks_skipped;
+  uint64_t cached_bytes_read;
+  uint64_t disk_bytes_read;
 };
 
 /**************************************************************************************************************************************************************
@@ -691,19 +926,45 @@ public:
   IndexReader(Purpose purpose, CacheManager& cache_manager, const char* lexicon_filename, const char* doc_map_basic_filename,
               const char* doc_map_extended_filename, const char* meta_info_filename, bool use_positions,
               const ExternalIndexReader* external_index_reader = NULL);
+  ~IndexReader();
 
   ListData* OpenList(const LexiconData& lex_data, int layer_num, bool single_term_query = false);
   ListData* OpenList(const LexiconData& lex_data, int layer_num, bool single_term_query, int term_num);
   void CloseList(ListData* list_data);
 
+  // Sets the statistics that the lists closed by the calling thread are added to, in addition to the totals kept by the index reader. This lets the
+  // statistics of a single query be collected while other threads are running their own queries. Set to NULL to stop collecting.
+  static void SetThreadListAccessStatistics(ListAccessStatistics* list_access_stats) {
+    thread_list_access_stats_ = list_access_stats;
+  }
+
+  // A range of index blocks: [first block, one past the last block).
+  typedef std::pair<uint64_t, uint64_t> BlockRange;
+
+  // Starts reading in the first blocks (up to the read ahead amount) of a list layer, without waiting for them, so that a query can be staged ahead of its
+  // execution. The blocks stay pinned in the cache until they're freed. Returns the number of blocks that had to be read in from the disk.
+  int PrefetchList(const LexiconData& lex_data, int layer_num, BlockRange* blocks);
+  bool PrefetchedBlocksReady(const BlockRange& blocks);
+  void FreePrefetchedBlocks(const BlockRange& blocks);
+
   Lexicon& lexicon() {
     return lexicon_;
   }
 
   void ResetStats() {
+    pthread_mutex_lock(&stats_mutex_);
     total_cached_bytes_read_ = 0;
     total_disk_bytes_read_ = 0;
     total_num_lists_accessed_ = 0;
+    total_num_next_geq_calls_ = 0;
+    total_num_chunks_decoded_ = 0;
+    total_list_open_cycles_ = 0;
+    total_block_fetch_cycles_ = 0;
+    total_decode_cycles_ = 0;
+    pthread_mutex_unlock(&stats_mutex_);
+
+    if (decoded_chunk_cache_ != NULL)
+      decoded_chunk_cache_->ResetStats();
   }
 
   const DocumentMapReader& document_map() const {
@@ -766,18 +1027,49 @@ public:
     return total_num_blocks_skipped_;
   }
 
+  uint64_t total_num_next_geq_calls() const {
+    return total_num_next_geq_calls_;
+  }
+
+  uint64_t total_num_chunks_decoded() const {
+    return total_num_chunks_decoded_;
+  }
+
+  uint64_t total_list_open_cycles() const {
+    return total_list_open_cycles_;
+  }
+
+  uint64_t total_block_fetch_cycles() const {
+    return total_block_fetch_cycles_;
+  }
+
+  uint64_t total_decode_cycles() const {
+    return total_decode_cycles_;
+  }
+
+  // Returns the decoded chunk cache, or NULL if it's not used.
+  const DecodedChunkCache* decoded_chunk_cache() const {
+    return decoded_chunk_cache_;
+  }
+
+  void ClearDecodedChunkCache() {
+    if (decoded_chunk_cache_ != NULL)
+      decoded_chunk_cache_->Clear();
+  }
+
 private:
   Purpose purpose_;                    // Changes index reader behavior based on what we're using it for.
   const char* kLexiconSizeKey;         // The key in the configuration file used to define the lexicon size.
   const long int kLexiconSize;         // The size of the hash table for the lexicon.
+  IndexConfiguration meta_info_;       // The index meta information (loaded before the lexicon, since it describes the lexicon format).
   Lexicon lexicon_;                    // The lexicon data structure.
   DocumentMapReader document_map_;     // The document map data structure.
   CacheManager& cache_manager_;        // Manages the block cache.
-  IndexConfiguration meta_info_;       // The index meta information.
   bool includes_contexts_;             // True if the index contains context data.
   bool includes_positions_;            // True if the index contains position data.
   bool use_positions_;                 // A hint from an external source that allows us to speed up processing a bit if it doesn't require positions.
   bool block_skipping_enabled_;        // An in-memory block level index has been built that we should use to skip entire blocks.
+  long int read_ahead_blocks_;         // The number of blocks of a list read ahead when it's opened (or prefetched).
 
   const ExternalIndexReader* external_index_reader_;
 
@@ -787,10 +1079,20 @@ private:
   CodingPolicy position_decompressor_;
   CodingPolicy block_header_decompressor_;
 
+  pthread_mutex_t stats_mutex_;        // Lists can be closed concurrently by multiple query threads, so updates to the statistics below are protected.
   uint64_t total_cached_bytes_read_;   // Keeps track of the number of bytes read from the cache.
   uint64_t total_disk_bytes_read_;     // Keeps track of the number of bytes read from the disk.
   uint64_t total_num_lists_accessed_;  // Keeps track of the total number of inverted lists that were accessed (updated at the time that the list is closed).
   uint32_t total_num_blocks_skipped_;  // Keeps track of the total number of blocks that were skipped due to the in-memory block index.
+  uint64_t total_num_next_geq_calls_;  // Keeps track of the total number of NextGEQ() calls made on all lists.
+  uint64_t total_num_chunks_decoded_;  // Keeps track of the total number of chunks whose docIDs were decoded.
+  uint64_t total_list_open_cycles_;    // The total time (in cycles) spent opening lists, not counting fetching their first blocks.
+  uint64_t total_block_fetch_cycles_;  // The total time (in cycles) spent queuing up blocks and waiting for them to be read in.
+  uint64_t total_decode_cycles_;       // The total time (in cycles) spent decoding chunks (only timed when compiled with 'IRTK_STAGE_TIMING').
+
+  DecodedChunkCache* decoded_chunk_cache_;  // Caches decoded chunks across queries (NULL if not used).
+
+  static __thread ListAccessStatistics* thread_list_access_stats_;  // The statistics the lists closed by the current thread are added to (if any).
 };
 
 /**************************************************************************************************************************************************************
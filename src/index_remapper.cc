@@ -240,7 +240,7 @@ bool IndexRemapper::CopyToIndexEntry(IndexEntry* index_entry, PositionsPool* pos
   curr_index_entry.frequency = index_->curr_list_data()->GetFreq();
 
   if (includes_positions_) {
-    const uint32_t* curr_positions = index_->curr_list_data()->curr_chunk_decoder().current_positions();
+    const uint32_t* curr_positions = index_->curr_list_data()->GetPositions();
     uint32_t num_positions = index_->curr_list_data()->GetNumDocProperties();
     if ((curr_index_entry.positions = positions_pool->StorePositions(curr_positions, num_positions)) == NULL) {
       // Positions buffer out of space.
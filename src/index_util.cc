@@ -49,7 +49,8 @@ IndexFiles::IndexFiles() :
   document_map_basic_filename_("index.dmap_basic"),
   document_map_extended_filename_("index.dmap_extended"),
   meta_info_filename_(prefix_ + ".meta"),
-  external_index_filename_(prefix_ + ".ext") {
+  external_index_filename_(prefix_ + ".ext"),
+  forward_index_filename_(prefix_ + ".fwd") {
 }
 
 IndexFiles::IndexFiles(const string& prefix) :
@@ -59,7 +60,8 @@ IndexFiles::IndexFiles(const string& prefix) :
   document_map_basic_filename_("index.dmap_basic"),
   document_map_extended_filename_("index.dmap_extended"),
   meta_info_filename_(prefix_ + ".meta"),
-  external_index_filename_(prefix_ + ".ext") {
+  external_index_filename_(prefix_ + ".ext"),
+  forward_index_filename_(prefix_ + ".fwd") {
 }
 
 IndexFiles::IndexFiles(int group_num, int file_num) :
@@ -87,6 +89,7 @@ void IndexFiles::SetDirectory(const string& dir) {
   document_map_extended_filename_ = dir + separator + document_map_extended_filename_;
   meta_info_filename_ = dir + separator + meta_info_filename_;
   external_index_filename_ = dir + separator + external_index_filename_;
+  forward_index_filename_ = dir + separator + forward_index_filename_;
 }
 
 void IndexFiles::InitIndexFiles(const string& prefix, int group_num, int file_num) {
@@ -98,6 +101,7 @@ void IndexFiles::InitIndexFiles(const string& prefix, int group_num, int file_nu
   document_map_extended_filename_ = "index.dmap_extended";
   meta_info_filename_ = prefix + ".meta." + suffix;
   external_index_filename_ = prefix + ".ext." + suffix;
+  forward_index_filename_ = prefix + ".fwd." + suffix;
 }
 
 /**************************************************************************************************************************************************************
@@ -80,6 +80,10 @@ public:
     return external_index_filename_;
   }
 
+  const std::string& forward_index_filename() const {
+    return forward_index_filename_;
+  }
+
 private:
   void InitIndexFiles(const std::string& prefix, int group_num, int file_num);
 
@@ -90,6 +94,7 @@ private:
   std::string document_map_extended_filename_;
   std::string meta_info_filename_;
   std::string external_index_filename_;
+  std::string forward_index_filename_;
 };
 
 /**************************************************************************************************************************************************************
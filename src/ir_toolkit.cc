@@ -87,9 +87,11 @@
 #include "config_file_properties.h"
 #include "configuration.h"
 #include "document_collection.h"
+#include "forward_index.h"
 #include "globals.h"
 #include "index_cat.h"
 #include "index_diff.h"
+#include "index_impact_order.h"
 #include "index_layerify.h"
 #include "index_merge.h"
 #include "index_reader.h"
@@ -97,6 +99,7 @@
 #include "index_util.h"
 #include "key_value_store.h"
 #include "logger.h"
+#include "perf_counters.h"
 #include "query_processor.h"
 #include "test_compression.h"
 #include "timer.h"
@@ -123,7 +126,7 @@ struct CommandLineArgs {
   }
 
   enum Mode {
-    kIndex, kMergeInitial, kMergeInput, kQuery, kRemap, kLayerify, kCat, kDiff, kRetrieveIndexData, kLoopOverIndexData, kNoIdea
+    kIndex, kMergeInitial, kMergeInput, kQuery, kRemap, kLayerify, kImpactOrder, kCat, kDiff, kRetrieveIndexData, kLoopOverIndexData, kNoIdea
   };
 
   IndexFiles index_files1;
@@ -223,6 +226,14 @@ void Index() {
 
   collection_indexer.OutputDocumentCollectionDocIdRanges(document_collections_doc_id_ranges_filename);
 
+  // When the whole collection fit into a single index, it's the final index, so we generate its forward index here (the document map has been closed by
+  // now). Otherwise, it's generated for the index output by the merger.
+  if (GetPostingCollectionController().num_indices() == 1
+      && Configuration::GetResultValue(Configuration::GetConfiguration().GetBooleanValue(config_properties::kIncludeForwardIndex))) {
+    ForwardIndexGenerator forward_index_generator((IndexFiles(0, 0)));
+    forward_index_generator.CreateForwardIndex();
+  }
+
   uint64_t posting_count = GetPostingCollectionController().posting_count();
 
   cout << "Collection Statistics:\n";
@@ -533,6 +544,15 @@ void Layerify() {
   GetDefaultLogger().Log("Time Elapsed: " + Stringify(layering_time.GetElapsedTime()), false);
 }
 
+void ImpactOrder() {
+  GetDefaultLogger().Log("Creating impact ordered index...", false);
+  const char* output_index_prefix = (command_line_args.output_index_prefix != NULL ? command_line_args.output_index_prefix : "index_impact");
+  ImpactOrderedIndexGenerator impact_ordered_index_generator(command_line_args.index_files1, output_index_prefix);
+  Timer impact_ordering_time;
+  impact_ordered_index_generator.CreateImpactOrderedIndex();
+  GetDefaultLogger().Log("Time Elapsed: " + Stringify(impact_ordering_time.GetElapsedTime()), false);
+}
+
 void GenerateUrlSortedDocIdMappingFile(const char* document_urls_filename) {
   GetDefaultLogger().Log("Generating URL sorted docID mapping file...", false);
   CollectionUrlExtractor collection_url_extractor;
@@ -593,6 +613,9 @@ void Help() {
   cout << "query: 'irtk --query'\n";
   cout << "  queries the final index generated by the merging process\n";
   cout << "\n";
+  cout << "serve: 'irtk --serve'\n";
+  cout << "  loads the index once and answers queries from clients connecting to the configured 'server_address'\n";
+  cout << "\n";
 
   cout << "Please see the reference manual at 'http://code.google.com/p/poly-ir-toolkit/wiki/ReferenceManual' for more detailed usage information." << endl;
 }
@@ -822,9 +845,18 @@ int main(int argc, char** argv) {
                                       // Set which query mode we want to use.
                                       { "query-mode", required_argument, NULL, 0 },
 
+                                      // Load an index once and answer queries from clients (same as '--query --query-mode=serve').
+                                      { "serve", no_argument, NULL, 0 },
+
                                       // Use the following stop word list at query time.
                                       { "query-stop-list-file", required_argument, NULL, 0 },
 
+                                      // Set the number of threads that will be executing batch queries concurrently.
+                                      { "query-threads", required_argument, NULL, 0 },
+
+                                      // Set the number of threads a single (WAND or MaxScore) query will be run on.
+                                      { "intra-query-threads", required_argument, NULL, 0 },
+
                                       // Set which result format we want to use.
                                       { "result-format", required_argument, NULL, 0 },
 
@@ -846,6 +878,9 @@ int main(int argc, char** argv) {
                                       // Creates a layered index.
                                       { "layerify", no_argument, NULL, 0 },
 
+                                      // Creates an impact ordered index, for use with the score-at-a-time query algorithm.
+                                      { "impact-order", no_argument, NULL, 0 },
+
                                       // Retrieves index data for an inverted list into an in-memory array. See function 'RetrieveIndexData()'.
                                       { "retrieve-index-data", required_argument, NULL, 0 },
 
@@ -939,12 +974,18 @@ int main(int argc, char** argv) {
             command_line_args.query_algorithm = QueryProcessor::kWand;
           else if (strcmp("dual-layered-wand", optarg) == 0)
             command_line_args.query_algorithm = QueryProcessor::kDualLayeredWand;
+          else if (strcmp("block-max-wand", optarg) == 0)
+            command_line_args.query_algorithm = QueryProcessor::kBlockMaxWand;
           else if (strcmp("max-score", optarg) == 0)
             command_line_args.query_algorithm = QueryProcessor::kMaxScore;
           else if (strcmp("dual-layered-max-score", optarg) == 0)
             command_line_args.query_algorithm = QueryProcessor::kDualLayeredMaxScore;
           else if (strcmp("daat-and-top-positions", optarg) == 0)
             command_line_args.query_algorithm = QueryProcessor::kDaatAndTopPositions;
+          else if (strcmp("saat-anytime", optarg) == 0)
+            command_line_args.query_algorithm = QueryProcessor::kSaatAnytime;
+          else if (strcmp("auto", optarg) == 0)
+            command_line_args.query_algorithm = QueryProcessor::kAuto;
           else
             UnrecognizedOptionValue(long_opts[long_index].name, optarg);
         } else if (strcmp("query-mode", long_opts[long_index].name) == 0) {
@@ -956,10 +997,19 @@ int main(int argc, char** argv) {
             command_line_args.query_mode = QueryProcessor::kBatch;
           else if (strcmp("batch-bench", optarg) == 0)
             command_line_args.query_mode = QueryProcessor::kBatchBench;
+          else if (strcmp("serve", optarg) == 0)
+            command_line_args.query_mode = QueryProcessor::kServe;
           else
             UnrecognizedOptionValue(long_opts[long_index].name, optarg);
+        } else if (strcmp("serve", long_opts[long_index].name) == 0) {
+          command_line_args.mode = CommandLineArgs::kQuery;
+          command_line_args.query_mode = QueryProcessor::kServe;
         } else if (strcmp("query-stop-list-file", long_opts[long_index].name) == 0) {
           command_line_args.query_stop_words_list_file = optarg;
+        } else if (strcmp("query-threads", long_opts[long_index].name) == 0) {
+          SetConfigurationOption(string(config_properties::kNumQueryThreads) + string("=") + string(optarg));
+        } else if (strcmp("intra-query-threads", long_opts[long_index].name) == 0) {
+          SetConfigurationOption(string(config_properties::kNumIntraQueryThreads) + string("=") + string(optarg));
         } else if (strcmp("result-format", long_opts[long_index].name) == 0) {
           if (strcmp("trec", optarg) == 0)
             command_line_args.result_format = QueryProcessor::kTrec;
@@ -967,6 +1017,8 @@ int main(int argc, char** argv) {
             command_line_args.result_format = QueryProcessor::kCompare;
           else if (strcmp("discard", optarg) == 0)
             command_line_args.result_format = QueryProcessor::kDiscard;
+          else if (strcmp("features", optarg) == 0)
+            command_line_args.result_format = QueryProcessor::kFeatures;
           else
             UnrecognizedOptionValue(long_opts[long_index].name, optarg);
         } else if (strcmp("remap", long_opts[long_index].name) == 0) {
@@ -974,6 +1026,8 @@ int main(int argc, char** argv) {
           command_line_args.doc_mapping_file = optarg;
         } else if (strcmp("layerify", long_opts[long_index].name) == 0) {
           command_line_args.mode = CommandLineArgs::kLayerify;
+        } else if (strcmp("impact-order", long_opts[long_index].name) == 0) {
+          command_line_args.mode = CommandLineArgs::kImpactOrder;
         } else if (strcmp("cat-term", long_opts[long_index].name) == 0 || strcmp("diff-term", long_opts[long_index].name) == 0) {
           command_line_args.term_len = strlen(optarg);
           command_line_args.term = optarg;
@@ -1035,6 +1089,7 @@ int main(int argc, char** argv) {
 
     // These take an index name to operate on and an output index name as the arguments.
     case CommandLineArgs::kLayerify:
+    case CommandLineArgs::kImpactOrder:
     case CommandLineArgs::kRemap:
       for (int i = 0; i < num_input_files; ++i) {
         switch (i) {
@@ -1092,6 +1147,9 @@ int main(int argc, char** argv) {
     case CommandLineArgs::kLayerify:
       Layerify();
       break;
+    case CommandLineArgs::kImpactOrder:
+      ImpactOrder();
+      break;
     case CommandLineArgs::kCat:
       Cat();
       break;
@@ -1109,5 +1167,9 @@ int main(int argc, char** argv) {
       break;
   }
 
+#ifdef IRTK_PERF_COUNTERS
+  PerfCounters::PrintPhaseTotals(cout);
+#endif
+
   return EXIT_SUCCESS;
 }
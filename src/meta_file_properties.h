@@ -48,6 +48,24 @@ static const char kNumLayers[] = "num_layers";
 // Whether the index layers are overlapping (only for layered indices).
 static const char kOverlappingLayers[] = "overlapping_layers";
 
+// Whether the lexicon stores the kth highest partial BM25 score of each inverted list, for the ranks k defined in 'index_layout_parameters.h'.
+// They're a lower bound on the kth highest document score of any disjunctive query containing the term, so they're used to seed the top-k threshold.
+static const char kLexiconKthScores[] = "lexicon_kth_scores";
+
+// Whether the index is impact ordered. The frequencies are replaced by quantized partial BM25 scores (impacts) and each list is split into segments by impact,
+// which are stored as non-overlapping layers.
+static const char kImpactOrdered[] = "impact_ordered";
+
+// Whether the frequencies in the index have been replaced by quantized partial BM25 scores (impacts). The lists are still in docID order.
+static const char kQuantizedImpacts[] = "quantized_impacts";
+
+// The number of bits the impacts were quantized to (only for indices with quantized impacts or impact ordered indices).
+static const char kImpactQuantizationBits[] = "impact_quantization_bits";
+
+// The partial BM25 score that corresponds to the max impact; scores were quantized linearly against this value (only for indices with quantized impacts or
+// impact ordered indices).
+static const char kImpactScoreUpperbound[] = "impact_score_upperbound";
+
 // Whether the index was indexed with position data.
 static const char kIncludesPositions[] = "includes_positions";
 
@@ -0,0 +1,311 @@
+// Copyright (c) 2010, Roman Khmelichek
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//  2. Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//  3. Neither the name of Roman Khmelichek nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+//==============================================================================================================================================================
+// Author(s): Roman Khmelichek
+//
+//==============================================================================================================================================================
+
+#include "perf_counters.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include <iostream>
+
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "globals.h"
+#include "logger.h"
+using namespace std;
+
+/**************************************************************************************************************************************************************
+ * PerfCounters
+ *
+ **************************************************************************************************************************************************************/
+__thread PerfCounters* PerfCounters::thread_counters_ = NULL;
+vector<PerfCounters*> PerfCounters::all_counters_;
+pthread_mutex_t PerfCounters::all_counters_mutex_ = PTHREAD_MUTEX_INITIALIZER;
+bool PerfCounters::logged_unavailable_ = false;
+int PerfCounters::available_events_ = 0;
+
+#ifdef __linux__
+static void SetEventAttributes(PerfCounters::Event event, perf_event_attr* attr) {
+  // The cache events count read misses only.
+  const uint64_t kCacheReadMiss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+  switch (event) {
+    case PerfCounters::kCycles:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case PerfCounters::kInstructions:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PerfCounters::kBranchMisses:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+    case PerfCounters::kL1dMisses:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_L1D | kCacheReadMiss;
+      break;
+    case PerfCounters::kLlcMisses:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_LL | kCacheReadMiss;
+      break;
+    case PerfCounters::kDtlbMisses:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_DTLB | kCacheReadMiss;
+      break;
+    default:
+      assert(false);
+      break;
+  }
+}
+#endif
+
+// Opens the counters for the calling thread. All the events are opened as a single group, so that they're scheduled onto the processor together and can be read
+// with a single system call. The counters stay open for the life of the program.
+PerfCounters::PerfCounters() :
+  group_fd_(-1), num_open_events_(0) {
+  memset(phase_totals_, 0, sizeof(phase_totals_));
+  memset(phase_num_samples_, 0, sizeof(phase_num_samples_));
+
+#ifdef __linux__
+  int open_errno = 0;
+  for (int i = 0; i < kNumEvents; ++i) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    SetEventAttributes(static_cast<Event> (i), &attr);
+    attr.disabled = (group_fd_ == -1);  // The group leader starts disabled, and enables the whole group once all events are added.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // Counts the calling thread on any CPU.
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, group_fd_, 0);
+    if (fd == -1) {
+      open_errno = errno;
+      continue;
+    }
+
+    if (group_fd_ == -1)
+      group_fd_ = fd;
+    open_events_[num_open_events_++] = static_cast<Event> (i);
+  }
+
+  if (group_fd_ != -1) {
+    if (ioctl(group_fd_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
+      GetErrorLogger().LogErrno("ioctl() in PerfCounters::PerfCounters(), trying to enable the counters", errno, false);
+    }
+  }
+
+  pthread_mutex_lock(&all_counters_mutex_);
+  for (int i = 0; i < num_open_events_; ++i) {
+    available_events_ |= (1 << open_events_[i]);
+  }
+
+  if (group_fd_ == -1 && !logged_unavailable_) {
+    GetErrorLogger().LogErrno("perf_event_open() in PerfCounters::PerfCounters(), hardware performance counters are not available", open_errno, false);
+    logged_unavailable_ = true;
+  }
+  pthread_mutex_unlock(&all_counters_mutex_);
+#else
+  pthread_mutex_lock(&all_counters_mutex_);
+  if (!logged_unavailable_) {
+    GetErrorLogger().Log("Hardware performance counters are only supported on Linux.", false);
+    logged_unavailable_ = true;
+  }
+  pthread_mutex_unlock(&all_counters_mutex_);
+#endif
+}
+
+PerfCounters* PerfCounters::GetThreadCounters() {
+  if (thread_counters_ == NULL) {
+    thread_counters_ = new PerfCounters();
+
+    pthread_mutex_lock(&all_counters_mutex_);
+    all_counters_.push_back(thread_counters_);
+    pthread_mutex_unlock(&all_counters_mutex_);
+  }
+  return thread_counters_;
+}
+
+void PerfCounters::Read(Sample* sample) {
+  memset(sample->counts, 0, sizeof(sample->counts));
+  if (group_fd_ == -1)
+    return;
+
+  // The group is read as the number of events, the times the group was enabled and running, followed by the count of each event.
+  uint64_t values[3 + kNumEvents];
+  ssize_t read_ret = read(group_fd_, values, sizeof(values));
+  if (read_ret < static_cast<ssize_t> ((3 + num_open_events_) * sizeof(values[0]))) {
+    GetErrorLogger().LogErrno("read() in PerfCounters::Read(), trying to read the counters", errno, false);
+    return;
+  }
+
+  // When there are more events (over all processes) than hardware counters, the kernel multiplexes them, and we scale the counts up to the whole time.
+  uint64_t time_enabled = values[1];
+  uint64_t time_running = values[2];
+  if (time_running == 0)
+    return;
+
+  for (int i = 0; i < num_open_events_; ++i) {
+    uint64_t count = values[3 + i];
+    if (time_running < time_enabled)
+      count = static_cast<uint64_t> (static_cast<double> (count) * time_enabled / time_running);
+    sample->counts[open_events_[i]] = count;
+  }
+}
+
+void PerfCounters::Start(Sample* sample) {
+  GetThreadCounters()->Read(sample);
+}
+
+void PerfCounters::Stop(Sample* sample, Phase phase) {
+  PerfCounters* counters = GetThreadCounters();
+
+  Sample end;
+  counters->Read(&end);
+  for (int i = 0; i < kNumEvents; ++i) {
+    // Scaled counts are estimates, so they're not necessarily increasing.
+    sample->counts[i] = (end.counts[i] > sample->counts[i]) ? (end.counts[i] - sample->counts[i]) : 0;
+    counters->phase_totals_[phase][i] += sample->counts[i];
+  }
+  ++counters->phase_num_samples_[phase];
+}
+
+void PerfCounters::ResetPhaseTotals() {
+  pthread_mutex_lock(&all_counters_mutex_);
+  for (size_t i = 0; i < all_counters_.size(); ++i) {
+    memset(all_counters_[i]->phase_totals_, 0, sizeof(all_counters_[i]->phase_totals_));
+    memset(all_counters_[i]->phase_num_samples_, 0, sizeof(all_counters_[i]->phase_num_samples_));
+  }
+  pthread_mutex_unlock(&all_counters_mutex_);
+}
+
+void PerfCounters::PrintSample(const Sample& sample, ostream& os) {
+  bool first = true;
+  for (int i = 0; i < kNumEvents; ++i) {
+    if (available_events_ & (1 << i)) {
+      os << (first ? "" : ", ") << GetEventName(static_cast<Event> (i)) << ": " << sample.counts[i];
+      first = false;
+    }
+  }
+
+  if ((available_events_ & (1 << kCycles)) && (available_events_ & (1 << kInstructions)) && sample.counts[kCycles] != 0) {
+    os << ", IPC: " << static_cast<double> (sample.counts[kInstructions]) / sample.counts[kCycles];
+  }
+
+  if (first)
+    os << "not available";
+}
+
+void PerfCounters::PrintPhaseTotals(ostream& os) {
+  os << "Hardware Performance Counters:\n";
+
+  pthread_mutex_lock(&all_counters_mutex_);
+  if (available_events_ == 0) {
+    os << "  Not available (see the error log).\n";
+  }
+
+  for (int i = 0; i < kNumPhases && available_events_ != 0; ++i) {
+    Sample total;
+    memset(total.counts, 0, sizeof(total.counts));
+    uint64_t num_samples = 0;
+    for (size_t j = 0; j < all_counters_.size(); ++j) {
+      for (int k = 0; k < kNumEvents; ++k) {
+        total.counts[k] += all_counters_[j]->phase_totals_[i][k];
+      }
+      num_samples += all_counters_[j]->phase_num_samples_[i];
+    }
+
+    if (num_samples == 0)
+      continue;
+
+    Sample average;
+    for (int k = 0; k < kNumEvents; ++k) {
+      average.counts[k] = total.counts[k] / num_samples;
+    }
+
+    os << "  " << GetPhaseName(static_cast<Phase> (i)) << " (" << num_samples << " calls):\n";
+    os << "    Total: ";
+    PrintSample(total, os);
+    os << "\n";
+    os << "    Per call: ";
+    PrintSample(average, os);
+    os << "\n";
+  }
+  pthread_mutex_unlock(&all_counters_mutex_);
+
+  os << endl;
+}
+
+const char* PerfCounters::GetEventName(Event event) {
+  switch (event) {
+    case kCycles:
+      return "cycles";
+    case kInstructions:
+      return "instructions";
+    case kBranchMisses:
+      return "branch misses";
+    case kL1dMisses:
+      return "L1d misses";
+    case kLlcMisses:
+      return "LLC misses";
+    case kDtlbMisses:
+      return "dTLB misses";
+    default:
+      assert(false);
+      return "";
+  }
+}
+
+const char* PerfCounters::GetPhaseName(Phase phase) {
+  switch (phase) {
+    case kQueryPhase:
+      return "Query processing";
+    case kDocIdDecodingPhase:
+      return "DocID decoding";
+    case kFrequencyDecodingPhase:
+      return "Frequency decoding";
+    case kPositionDecodingPhase:
+      return "Position decoding";
+    case kIndexBuildingPhase:
+      return "Index building";
+    default:
+      assert(false);
+      return "";
+  }
+}
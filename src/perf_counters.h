@@ -0,0 +1,119 @@
+// Copyright (c) 2010, Roman Khmelichek
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//  2. Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//  3. Neither the name of Roman Khmelichek nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+//==============================================================================================================================================================
+// Author(s): Roman Khmelichek
+//
+// Reads the hardware performance counters of the calling thread, so that the query and indexing hot paths can be profiled from within the program.
+//==============================================================================================================================================================
+
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include <stdint.h>
+
+#include <iosfwd>
+#include <vector>
+
+#include <pthread.h>
+
+/**************************************************************************************************************************************************************
+ * PerfCounters
+ *
+ * Counts hardware events (cycles, instructions, branch misses, and L1 data cache, last level cache, and data TLB misses) through the Linux 'perf_event_open()'
+ * interface. This lets us see why a piece of code is slow, for example whether decoding is stalling on memory, without attaching an external profiler. Only
+ * events in user space are counted.
+ *
+ * The counters are per thread; each thread opens its own the first time it profiles a section of code. The counts of every profiled section are added to the
+ * totals of its phase, and the totals are summed up over all threads when printed. Phases may be nested (the query phase includes the decoding phases).
+ *
+ * Events the processor (or virtual machine) doesn't support are left out, and if no events are available at all, profiling is silently a no-op after logging
+ * a warning once.
+ **************************************************************************************************************************************************************/
+class PerfCounters {
+public:
+  enum Event {
+    kCycles, kInstructions, kBranchMisses, kL1dMisses, kLlcMisses, kDtlbMisses, kNumEvents
+  };
+
+  enum Phase {
+    kQueryPhase, kDocIdDecodingPhase, kFrequencyDecodingPhase, kPositionDecodingPhase, kIndexBuildingPhase, kNumPhases
+  };
+
+  // The counter values at some point in time, or the number of events between two such points.
+  struct Sample {
+    uint64_t counts[kNumEvents];
+  };
+
+  // Reads the counters of the calling thread into 'sample'.
+  static void Start(Sample* sample);
+
+  // Sets 'sample' (read by 'Start()') to the number of events since it was read, and adds them to the totals of 'phase'.
+  static void Stop(Sample* sample, Phase phase);
+
+  // Clears the totals of all phases, for all threads. Should only be called while no other threads are profiling.
+  static void ResetPhaseTotals();
+
+  static void PrintSample(const Sample& sample, std::ostream& os);
+  static void PrintPhaseTotals(std::ostream& os);
+
+  static const char* GetEventName(Event event);
+  static const char* GetPhaseName(Phase phase);
+
+private:
+  PerfCounters();
+
+  static PerfCounters* GetThreadCounters();
+
+  void Read(Sample* sample);
+
+  int group_fd_;                  // The file descriptor of the group leader, through which all the counters are read at once; -1 if no events are available.
+  int num_open_events_;           // The number of events in the group.
+  Event open_events_[kNumEvents]; // The events in the group, in the order their counts are read.
+
+  uint64_t phase_totals_[kNumPhases][kNumEvents];
+  uint64_t phase_num_samples_[kNumPhases];
+
+  static __thread PerfCounters* thread_counters_;
+
+  // The counters of all threads, for summing up the totals. Guarded by 'all_counters_mutex_', which is only taken when a thread opens its counters.
+  static std::vector<PerfCounters*> all_counters_;
+  static pthread_mutex_t all_counters_mutex_;
+
+  static bool logged_unavailable_;  // Whether we've already warned that the counters could not be opened.
+  static int available_events_;     // Bitmask of the events that could be opened by any thread.
+};
+
+// Compiling with 'make PERF_COUNTERS=YES' profiles query processing, chunk decoding, and index building with the hardware performance counters. Reading the
+// counters is a system call, which is too costly to do for every chunk decoded by default.
+#ifdef IRTK_PERF_COUNTERS
+#define START_PERF_COUNTERS(sample) PerfCounters::Sample sample; PerfCounters::Start(&sample)
+#define STOP_PERF_COUNTERS(sample, phase) PerfCounters::Stop(&sample, phase)
+#else
+#define START_PERF_COUNTERS(sample)
+#define STOP_PERF_COUNTERS(sample, phase)
+#endif
+
+#endif /* PERF_COUNTERS_H_ */
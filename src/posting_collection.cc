@@ -582,6 +582,9 @@ void PostingCollectionController::Finish() {
   posting_count_ += posting_collection_->posting_count();
   delete posting_collection_;
   posting_collection_ = NULL;
+
+  // No more documents will be added, and the document map must be complete on disk before any of the indices are read back.
+  document_map_writer_.Close();
 }
 
 void PostingCollectionController::InsertPosting(const Posting& posting) {
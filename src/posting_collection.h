@@ -367,6 +367,11 @@ public:
     return posting_count_;
   }
 
+  // The number of mini indices built so far.
+  int num_indices() const {
+    return index_count_ + 1;
+  }
+
 private:
   int index_count_;  // The current mini index we're working on building.
   PostingCollection* posting_collection_;  // The posting collection for the current mini index.
@@ -29,6 +29,7 @@
 //==============================================================================================================================================================
 #include "query_processor.h"
 
+#include <cerrno>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
@@ -40,20 +41,470 @@
 #include <limits>
 #include <sstream>
 
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>  // SSE2
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>  // AVX2
+#endif
+
 #include "cache_manager.h"
 #include "config_file_properties.h"
 #include "configuration.h"
 #include "external_index.h"
+#include "forward_index.h"
 #include "globals.h"
 #include "logger.h"
 #include "meta_file_properties.h"
+#include "perf_counters.h"
 #include "timer.h"
 using namespace std;
 
+/**************************************************************************************************************************************************************
+ * QueryStatistics
+ *
+ **************************************************************************************************************************************************************/
+QueryStatistics::QueryStatistics() :
+  total_querying_time(0),
+  total_num_queries(0),
+  num_early_terminated_queries(0),
+  num_single_term_queries(0),
+
+  not_enough_results_definitely(0),
+  not_enough_results_possibly(0),
+  num_queries_containing_single_layered_terms(0),
+  num_queries_kth_result_meeting_threshold(0),
+  num_queries_kth_result_not_meeting_threshold(0),
+
+  num_postings_scored(0),
+  num_postings_skipped(0),
+  num_heap_insertions(0),
+  num_threshold_changes(0),
+  num_score_bound_skips(0),
+
+  num_result_cache_hits(0),
+  num_result_cache_misses(0),
+  num_result_cache_evictions(0),
+
+  num_intersection_cache_hits(0),
+  num_intersection_cache_misses(0),
+  num_intersection_cache_admissions(0),
+  num_intersection_cache_evictions(0),
+
+  num_prefetched_disk_blocks(0),
+  num_pipeline_reorders(0),
+  num_pipeline_stalls(0),
+
+  lexicon_lookup_cycles(0),
+  top_k_cycles(0) {
+}
+
+void QueryStatistics::Add(const QueryStatistics& query_stats) {
+  total_querying_time += query_stats.total_querying_time;
+  total_num_queries += query_stats.total_num_queries;
+  num_early_terminated_queries += query_stats.num_early_terminated_queries;
+  num_single_term_queries += query_stats.num_single_term_queries;
+
+  not_enough_results_definitely += query_stats.not_enough_results_definitely;
+  not_enough_results_possibly += query_stats.not_enough_results_possibly;
+  num_queries_containing_single_layered_terms += query_stats.num_queries_containing_single_layered_terms;
+  num_queries_kth_result_meeting_threshold += query_stats.num_queries_kth_result_meeting_threshold;
+  num_queries_kth_result_not_meeting_threshold += query_stats.num_queries_kth_result_not_meeting_threshold;
+
+  num_postings_scored += query_stats.num_postings_scored;
+  num_postings_skipped += query_stats.num_postings_skipped;
+  num_heap_insertions += query_stats.num_heap_insertions;
+  num_threshold_changes += query_stats.num_threshold_changes;
+  num_score_bound_skips += query_stats.num_score_bound_skips;
+
+  num_result_cache_hits += query_stats.num_result_cache_hits;
+  num_result_cache_misses += query_stats.num_result_cache_misses;
+  num_result_cache_evictions += query_stats.num_result_cache_evictions;
+
+  num_intersection_cache_hits += query_stats.num_intersection_cache_hits;
+  num_intersection_cache_misses += query_stats.num_intersection_cache_misses;
+  num_intersection_cache_admissions += query_stats.num_intersection_cache_admissions;
+  num_intersection_cache_evictions += query_stats.num_intersection_cache_evictions;
+
+  num_prefetched_disk_blocks += query_stats.num_prefetched_disk_blocks;
+  num_pipeline_reorders += query_stats.num_pipeline_reorders;
+  num_pipeline_stalls += query_stats.num_pipeline_stalls;
+
+  latencies.Add(query_stats.latencies);
+  for (map<int, LatencyDistribution>::const_iterator itr = query_stats.latencies_by_num_terms.begin(); itr != query_stats.latencies_by_num_terms.end(); ++itr) {
+    latencies_by_num_terms[itr->first].Add(itr->second);
+  }
+  for (map<int, LatencyDistribution>::const_iterator itr = query_stats.latencies_by_algorithm.begin(); itr != query_stats.latencies_by_algorithm.end(); ++itr) {
+    latencies_by_algorithm[itr->first].Add(itr->second);
+  }
+
+  lexicon_lookup_cycles += query_stats.lexicon_lookup_cycles;
+  top_k_cycles += query_stats.top_k_cycles;
+}
+
+/**************************************************************************************************************************************************************
+ * LatencyDistribution
+ *
+ **************************************************************************************************************************************************************/
+void LatencyDistribution::Add(const LatencyDistribution& latency_distribution) {
+  latencies_.insert(latencies_.end(), latency_distribution.latencies_.begin(), latency_distribution.latencies_.end());
+  sorted_ = false;
+}
+
+// Uses the nearest rank method: the smallest latency such that at least 'percentile' percent of the latencies are less than or equal to it.
+double LatencyDistribution::Percentile(double percentile) {
+  if (latencies_.empty())
+    return 0;
+
+  if (!sorted_) {
+    sort(latencies_.begin(), latencies_.end());
+    sorted_ = true;
+  }
+
+  size_t rank = static_cast<size_t> (ceil(percentile / 100 * latencies_.size()));
+  return latencies_[max<size_t> (rank, 1) - 1];
+}
+
+void LatencyDistribution::Print(ostream& os) {
+  os << "n: " << latencies_.size() << ", p50: " << (Percentile(50) * 1000) << " ms, p90: " << (Percentile(90) * 1000) << " ms, p99: "
+      << (Percentile(99) * 1000) << " ms, p99.9: " << (Percentile(99.9) * 1000) << " ms, max: " << (Percentile(100) * 1000) << " ms";
+}
+
+/**************************************************************************************************************************************************************
+ * LoserTree
+ *
+ **************************************************************************************************************************************************************/
+LoserTree::LoserTree(const uint32_t* doc_ids, int num_lists) :
+  num_lists_(num_lists), doc_ids_(doc_ids, doc_ids + num_lists), losers_(num_lists), winner_(0) {
+  // Play the initial tournament bottom up. List 'i' is at leaf 'num_lists + i'; node 'n' has children '2n' and '2n + 1'.
+  vector<int> winners(2 * num_lists);
+  for (int i = 0; i < num_lists; ++i) {
+    winners[num_lists + i] = i;
+  }
+  for (int node = num_lists - 1; node > 0; --node) {
+    int left = winners[2 * node];
+    int right = winners[2 * node + 1];
+    if (Beats(left, right)) {
+      winners[node] = left;
+      losers_[node] = right;
+    } else {
+      winners[node] = right;
+      losers_[node] = left;
+    }
+  }
+  if (num_lists > 1)
+    winner_ = winners[1];
+}
+
+/**************************************************************************************************************************************************************
+ * SharedThreshold
+ *
+ **************************************************************************************************************************************************************/
+SharedThreshold::SharedThreshold(float threshold) :
+  threshold_(threshold) {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+SharedThreshold::~SharedThreshold() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+void SharedThreshold::Raise(float threshold) {
+  // Check before locking; the threshold only ever goes up, so if we're not above it now, we won't be after acquiring the lock.
+  if (threshold <= threshold_)
+    return;
+
+  pthread_mutex_lock(&mutex_);
+  if (threshold > threshold_)
+    threshold_ = threshold;
+  pthread_mutex_unlock(&mutex_);
+}
+
+/**************************************************************************************************************************************************************
+ * QueryResultCache
+ *
+ **************************************************************************************************************************************************************/
+QueryResultCache::QueryResultCache(int capacity) :
+  kCapacity(capacity) {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+QueryResultCache::~QueryResultCache() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+string QueryResultCache::GetKey(const vector<string>& terms, int query_algorithm, int num_results) {
+  // Terms can't contain spaces, so they can be separated by them.
+  ostringstream key;
+  for (size_t i = 0; i < terms.size(); ++i) {
+    key << terms[i] << ' ';
+  }
+  key << '#' << query_algorithm << '#' << num_results;
+  return key.str();
+}
+
+bool QueryResultCache::Lookup(const string& key, Result* results, int* num_results, int* total_num_results) {
+  pthread_mutex_lock(&mutex_);
+  CacheMap::iterator cache_map_itr = cache_map_.find(key);
+  bool cache_hit = (cache_map_itr != cache_map_.end());
+  if (cache_hit) {
+    // It's now the most recently used query.
+    lru_list_.splice(lru_list_.end(), lru_list_, cache_map_itr->second);
+
+    const CacheEntry& cache_entry = *cache_map_itr->second;
+    *num_results = cache_entry.results.size();
+    *total_num_results = cache_entry.total_num_results;
+    copy(cache_entry.results.begin(), cache_entry.results.end(), results);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return cache_hit;
+}
+
+bool QueryResultCache::Insert(const string& key, const Result* results, int num_results, int total_num_results) {
+  if (kCapacity <= 0)
+    return false;
+
+  bool evicted = false;
+  pthread_mutex_lock(&mutex_);
+  // Another query thread might have cached the same query in the meantime.
+  if (cache_map_.find(key) == cache_map_.end()) {
+    if (cache_map_.size() == static_cast<size_t> (kCapacity)) {
+      // Evict the least recently used query.
+      cache_map_.erase(lru_list_.front().key);
+      lru_list_.pop_front();
+      evicted = true;
+    }
+
+    lru_list_.push_back(CacheEntry());
+    CacheEntry& cache_entry = lru_list_.back();
+    cache_entry.key = key;
+    cache_entry.results.assign(results, results + num_results);
+    cache_entry.total_num_results = total_num_results;
+    cache_map_.insert(make_pair(key, --lru_list_.end()));
+  }
+  pthread_mutex_unlock(&mutex_);
+  return evicted;
+}
+
+void QueryResultCache::Clear() {
+  pthread_mutex_lock(&mutex_);
+  lru_list_.clear();
+  cache_map_.clear();
+  pthread_mutex_unlock(&mutex_);
+}
+
+/**************************************************************************************************************************************************************
+ * IntersectionCache
+ *
+ **************************************************************************************************************************************************************/
+const size_t IntersectionCache::kMaxTrackedPairs;  // Initialized in the class definition.
+
+IntersectionCache::IntersectionCache(long int capacity, int admission_count) :
+  kCapacity(capacity),
+  kAdmissionCount(admission_count),
+  size_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+}
+
+IntersectionCache::~IntersectionCache() {
+  pthread_mutex_destroy(&mutex_);
+}
+
+string IntersectionCache::GetKey(const LexiconData& first_term, const LexiconData& second_term) {
+  string first(first_term.term(), first_term.term_len());
+  string second(second_term.term(), second_term.term_len());
+  return (first < second) ? (first + ' ' + second) : (second + ' ' + first);
+}
+
+bool IntersectionCache::InKeyOrder(const LexiconData& first_term, const LexiconData& second_term) {
+  return string(first_term.term(), first_term.term_len()) < string(second_term.term(), second_term.term_len());
+}
+
+bool IntersectionCache::RecordPair(const string& key) {
+  pthread_mutex_lock(&mutex_);
+  if (oversized_pairs_.find(key) != oversized_pairs_.end()) {
+    pthread_mutex_unlock(&mutex_);
+    return false;
+  }
+
+  // Start counting from scratch when we're tracking too many pairs. The frequent pairs will quickly make up their counts again.
+  if (pair_counts_.size() >= kMaxTrackedPairs && pair_counts_.find(key) == pair_counts_.end()) {
+    pair_counts_.clear();
+  }
+  bool admit = (++pair_counts_[key] >= kAdmissionCount);
+  pthread_mutex_unlock(&mutex_);
+  return admit;
+}
+
+const IntersectionCache::Intersection* IntersectionCache::Lookup(const string& key) {
+  const Intersection* intersection = NULL;
+  pthread_mutex_lock(&mutex_);
+  CacheMap::iterator cache_map_itr = cache_map_.find(key);
+  if (cache_map_itr != cache_map_.end()) {
+    // It's now the most recently used intersection.
+    lru_list_.splice(lru_list_.end(), lru_list_, cache_map_itr->second);
+    ++cache_map_itr->second->num_pins;
+    intersection = &cache_map_itr->second->intersection;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return intersection;
+}
+
+const IntersectionCache::Intersection* IntersectionCache::Insert(const string& key, Intersection* intersection, int* num_evictions) {
+  *num_evictions = 0;
+  long int intersection_size = intersection->size();
+
+  const Intersection* cached_intersection = NULL;
+  pthread_mutex_lock(&mutex_);
+  if (intersection_size > kCapacity) {
+    // Make sure this pair is never admitted again.
+    oversized_pairs_.insert(key);
+    pair_counts_.erase(key);
+    pthread_mutex_unlock(&mutex_);
+    return NULL;
+  }
+
+  CacheMap::iterator cache_map_itr = cache_map_.find(key);
+  if (cache_map_itr != cache_map_.end()) {
+    // Another query thread has cached the same intersection in the meantime.
+    ++cache_map_itr->second->num_pins;
+    cached_intersection = &cache_map_itr->second->intersection;
+  } else {
+    // Evict the least recently used intersections that are not in use until we have enough room.
+    LruList::iterator lru_list_itr = lru_list_.begin();
+    while (size_ + intersection_size > kCapacity && lru_list_itr != lru_list_.end()) {
+      if (lru_list_itr->num_pins == 0) {
+        size_ -= lru_list_itr->intersection.size();
+        cache_map_.erase(lru_list_itr->key);
+        pair_counts_.erase(lru_list_itr->key);
+        lru_list_itr = lru_list_.erase(lru_list_itr);
+        ++*num_evictions;
+      } else {
+        ++lru_list_itr;
+      }
+    }
+
+    if (size_ + intersection_size <= kCapacity) {
+      lru_list_.push_back(CacheEntry());
+      CacheEntry& cache_entry = lru_list_.back();
+      cache_entry.key = key;
+      cache_entry.intersection.swap(*intersection);
+      cache_entry.num_pins = 1;
+      cache_map_.insert(make_pair(key, --lru_list_.end()));
+      size_ += intersection_size;
+      cached_intersection = &cache_entry.intersection;
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+  return cached_intersection;
+}
+
+void IntersectionCache::Release(const string& key) {
+  pthread_mutex_lock(&mutex_);
+  CacheMap::iterator cache_map_itr = cache_map_.find(key);
+  assert(cache_map_itr != cache_map_.end() && cache_map_itr->second->num_pins > 0);
+  --cache_map_itr->second->num_pins;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void IntersectionCache::Clear() {
+  pthread_mutex_lock(&mutex_);
+  lru_list_.clear();
+  cache_map_.clear();
+  pair_counts_.clear();
+  size_ = 0;
+  pthread_mutex_unlock(&mutex_);
+}
+
+/**************************************************************************************************************************************************************
+ * AlgorithmCostModel
+ *
+ **************************************************************************************************************************************************************/
+void AlgorithmCostModel::AddSample(const QueryShape& query_shape, int query_algorithm, double elapsed_time) {
+  for (int i = 0; i < kNumClassLevels; ++i) {
+    Cost& cost = costs_[i][make_pair(GetClassKey(query_shape, i), query_algorithm)];
+    cost.total_time += elapsed_time;
+    ++cost.num_samples;
+  }
+}
+
+// Uses the finest class of the query in which all the candidates have enough samples, so that the algorithms are compared on the same kind of queries.
+int AlgorithmCostModel::SelectAlgorithm(const QueryShape& query_shape, const vector<int>& candidate_algorithms) const {
+  assert(candidate_algorithms.size() > 0);
+
+  for (int i = 0; i < kNumClassLevels; ++i) {
+    uint32_t class_key = GetClassKey(query_shape, i);
+    int min_cost_algorithm = -1;
+    double min_cost = numeric_limits<double>::max();
+    for (size_t j = 0; j < candidate_algorithms.size(); ++j) {
+      CostMap::const_iterator cost_itr = costs_[i].find(make_pair(class_key, candidate_algorithms[j]));
+      if (cost_itr == costs_[i].end() || cost_itr->second.num_samples < kMinClassSamples) {
+        min_cost_algorithm = -1;
+        break;
+      }
+
+      double cost = cost_itr->second.total_time / cost_itr->second.num_samples;
+      if (cost < min_cost) {
+        min_cost = cost;
+        min_cost_algorithm = candidate_algorithms[j];
+      }
+    }
+
+    if (min_cost_algorithm != -1)
+      return min_cost_algorithm;
+  }
+
+  return candidate_algorithms[0];
+}
+
+double AlgorithmCostModel::AverageCost(int query_algorithm) const {
+  // The coarsest level has a single class holding all the samples.
+  CostMap::const_iterator cost_itr = costs_[kNumClassLevels - 1].find(make_pair(0U, query_algorithm));
+  if (cost_itr == costs_[kNumClassLevels - 1].end())
+    return 0;
+  return cost_itr->second.total_time / cost_itr->second.num_samples;
+}
+
+// The class key packs the number of terms, the log2 bucket of the number of postings, the score spread bucket (under 2, under 4, and the rest), and whether
+// the terms are multi-layered. The coarser class levels leave out the latter fields.
+uint32_t AlgorithmCostModel::GetClassKey(const QueryShape& query_shape, int class_level) {
+  if (class_level >= kNumClassLevels - 1)
+    return 0;
+
+  uint32_t class_key = ((query_shape.num_terms < kMaxClassTerms) ? query_shape.num_terms : kMaxClassTerms) << 16;
+  if (class_level >= 2)
+    return class_key;
+
+  uint32_t postings_bucket = 0;
+  for (uint64_t num_postings = query_shape.num_postings; num_postings > 1; num_postings >>= 1) {
+    ++postings_bucket;
+  }
+  class_key |= postings_bucket << 8;
+  if (class_level >= 1)
+    return class_key;
+
+  uint32_t spread_bucket = (query_shape.score_spread < 2) ? 0 : ((query_shape.score_spread < 4) ? 1 : 2);
+  class_key |= (spread_bucket << 1) | (query_shape.multi_layered ? 1 : 0);
+  return class_key;
+}
+
 /**************************************************************************************************************************************************************
  * QueryProcessor
  *
  **************************************************************************************************************************************************************/
+__thread QueryStatistics* QueryProcessor::thread_query_stats_ = NULL;
+__thread ostringstream* QueryProcessor::thread_query_output_ = NULL;
+
 QueryProcessor::QueryProcessor(const IndexFiles& input_index_files, const char* stop_words_list_filename, QueryAlgorithm query_algorithm, QueryMode query_mode,
                                ResultFormat result_format) :
   query_algorithm_(query_algorithm),
@@ -63,9 +514,12 @@ QueryProcessor::QueryProcessor(const IndexFiles& input_index_files, const char*
   silent_mode_(false),
   warm_up_mode_(false),
   use_positions_(Configuration::GetResultValue(Configuration::GetConfiguration().GetBooleanValue(config_properties::kUsePositions))),
+  phrase_queries_(false),
+  proximity_rescoring_(false),
   collection_average_doc_len_(0),
   collection_total_num_docs_(0),
   external_index_reader_(GetExternalIndexReader(query_algorithm_, input_index_files.external_index_filename().c_str())),
+  forward_index_reader_(NULL),
   cache_policy_(GetCacheManager(input_index_files.index_filename().c_str())),
   index_reader_(IndexReader::kRandomQuery,
                 *cache_policy_,
@@ -78,27 +532,109 @@ QueryProcessor::QueryProcessor(const IndexFiles& input_index_files, const char*
   index_layered_(false),
   index_overlapping_layers_(false),
   index_num_layers_(1),
-  total_querying_time_(0),
-  total_num_queries_(0),
-  num_early_terminated_queries_(0),
-  num_single_term_queries_(0),
-
-  not_enough_results_definitely_(0),
-  not_enough_results_possibly_(0),
-  num_queries_containing_single_layered_terms_(0),
-  num_queries_kth_result_meeting_threshold_(0),
-  num_queries_kth_result_not_meeting_threshold_(0),
-
-  num_postings_scored_(0),
-  num_postings_skipped_(0) {
+  index_impact_ordered_(false),
+  index_quantized_impacts_(false),
+  impact_score_(0),
+  num_dense_accumulators_(0),
+  num_query_threads_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kNumQueryThreads))),
+  next_batch_query_(0),
+  batch_querying_time_(0),
+  query_pipeline_depth_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kQueryPipelineDepth))),
+  server_stopping_(false),
+  num_server_connections_(0),
+  server_wakeup_fd_(-1),
+  num_intra_query_threads_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kNumIntraQueryThreads))),
+  intra_query_min_postings_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kIntraQueryMinPostings))),
+  saat_postings_budget_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kSaatPostingsBudget))),
+  saat_time_budget_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kSaatTimeBudget))),
+  simd_intersection_max_ratio_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kSimdIntersectionMaxRatio))),
+  proximity_pool_size_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kProximityPoolSize))),
+  proximity_weight_(Configuration::GetResultValue<double>(Configuration::GetConfiguration().GetFloatingValue(config_properties::kProximityWeight))),
+  result_cache_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kResultCacheSize))),
+  intersection_cache_(Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kIntersectionCacheSize)),
+                      Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kIntersectionCacheAdmissionCount))) {
+  // Queries processed by the main thread update the combined statistics directly.
+  thread_query_stats_ = &query_stats_;
+
+  pthread_mutex_init(&batch_query_mutex_, NULL);
+  pthread_mutex_init(&output_mutex_, NULL);
+  pthread_mutex_init(&query_trace_mutex_, NULL);
+  pthread_mutex_init(&dense_accumulators_mutex_, NULL);
+  pthread_mutex_init(&server_mutex_, NULL);
+  pthread_cond_init(&server_cond_, NULL);
+
   if (max_num_results_ <= 0) {
     Configuration::ErroneousValue(config_properties::kMaxNumberResults, Configuration::GetConfiguration().GetValue(config_properties::kMaxNumberResults));
   }
 
+  if (num_query_threads_ <= 0) {
+    Configuration::ErroneousValue(config_properties::kNumQueryThreads, Configuration::GetConfiguration().GetValue(config_properties::kNumQueryThreads));
+  }
+
+  if (query_pipeline_depth_ <= 0) {
+    Configuration::ErroneousValue(config_properties::kQueryPipelineDepth, Configuration::GetConfiguration().GetValue(config_properties::kQueryPipelineDepth));
+  }
+
+  if (num_intra_query_threads_ <= 0) {
+    Configuration::ErroneousValue(config_properties::kNumIntraQueryThreads, Configuration::GetConfiguration().GetValue(config_properties::kNumIntraQueryThreads));
+  }
+
+  if (intra_query_min_postings_ < 0) {
+    Configuration::ErroneousValue(config_properties::kIntraQueryMinPostings, Configuration::GetConfiguration().GetValue(config_properties::kIntraQueryMinPostings));
+  }
+
+  if (saat_postings_budget_ < 0) {
+    Configuration::ErroneousValue(config_properties::kSaatPostingsBudget, Configuration::GetConfiguration().GetValue(config_properties::kSaatPostingsBudget));
+  }
+
+  if (saat_time_budget_ < 0) {
+    Configuration::ErroneousValue(config_properties::kSaatTimeBudget, Configuration::GetConfiguration().GetValue(config_properties::kSaatTimeBudget));
+  }
+
+  if (simd_intersection_max_ratio_ < 0) {
+    Configuration::ErroneousValue(config_properties::kSimdIntersectionMaxRatio,
+                                  Configuration::GetConfiguration().GetValue(config_properties::kSimdIntersectionMaxRatio));
+  }
+
+  if (proximity_pool_size_ < 0) {
+    Configuration::ErroneousValue(config_properties::kProximityPoolSize, Configuration::GetConfiguration().GetValue(config_properties::kProximityPoolSize));
+  }
+
+  if (proximity_weight_ < 0) {
+    Configuration::ErroneousValue(config_properties::kProximityWeight, Configuration::GetConfiguration().GetValue(config_properties::kProximityWeight));
+  }
+
+  if (result_cache_.capacity() < 0) {
+    Configuration::ErroneousValue(config_properties::kResultCacheSize, Configuration::GetConfiguration().GetValue(config_properties::kResultCacheSize));
+  }
+
+  if (intersection_cache_.capacity() < 0) {
+    Configuration::ErroneousValue(config_properties::kIntersectionCacheSize, Configuration::GetConfiguration().GetValue(config_properties::kIntersectionCacheSize));
+  }
+
+  if (Configuration::GetResultValue<long int>(Configuration::GetConfiguration().GetNumericalValue(config_properties::kIntersectionCacheAdmissionCount)) <= 0) {
+    Configuration::ErroneousValue(config_properties::kIntersectionCacheAdmissionCount,
+                                  Configuration::GetConfiguration().GetValue(config_properties::kIntersectionCacheAdmissionCount));
+  }
+
   if (stop_words_list_filename != NULL) {
     LoadStopWordsList(stop_words_list_filename);
   }
   LoadIndexProperties();
+  if (result_format_ == kFeatures) {
+    // The forward index is only generated for standard indices; for layered (and impact ordered) indices, and those storing quantized impacts in place of
+    // frequencies, the document term frequencies can't be recovered.
+    if (index_layered_ || index_quantized_impacts_) {
+      GetErrorLogger().Log("The 'features' result format is not supported for layered, impact ordered, or quantized impact indices.", true);
+    }
+
+    string forward_index_filename = input_index_files.forward_index_filename();
+    if (access(forward_index_filename.c_str(), R_OK) != 0) {
+      GetErrorLogger().Log("The 'features' result format requires the forward index '" + forward_index_filename
+          + "'; regenerate the index with '" + string(config_properties::kIncludeForwardIndex) + "' enabled.", true);
+    }
+    forward_index_reader_ = new ForwardIndexReader(forward_index_filename.c_str());
+  }
   PrintQueryingParameters();
 
   /*bool in_memory_index = IndexConfiguration::GetResultValue(Configuration::GetConfiguration().GetBooleanValue(config_properties::kMemoryResidentIndex), false);
@@ -109,10 +645,18 @@ QueryProcessor::QueryProcessor(const IndexFiles& input_index_files, const char*
   //       Sequential block search performs better than binary block search in this case.
   //       This might be a better speed up for when the index is on disk and we are I/O bounded. Then we should also configure so we don't read ahead many blocks at a time.
   //       If the index is in main memory, the only improvement would be to avoid decoding the block header, and the overhead of that should be small.
-  if (use_block_level_index) {
+  //
+  // Intra-query parallelism needs the block level index regardless, since it's the only way the lists of a docID range can skip ahead to the start of the
+  // range. Without it, each range would decode its lists from the start, redoing the work of all the ranges before it.
+  if (use_block_level_index || num_intra_query_threads_ > 1) {
     cout << "Building in-memory block level index." << endl;
     BuildBlockLevelIndex();
   }
+
+  // The benchmark must run under the same conditions as the queries, so it's only run once the block level index (if any) is in place.
+  if (query_algorithm_ == kAuto) {
+    CalibrateAlgorithmCostModel();
+  }
   /*if (memory_mapped_index || in_memory_index) {
     if (query_algorithm_ != kDaatOr && query_algorithm_ != kTaatOr) {
       cout << "Building in-memory block level index." << endl;
@@ -148,41 +692,183 @@ QueryProcessor::QueryProcessor(const IndexFiles& input_index_files, const char*
       RunBatchQueries(batch_query_input, true, 1);
       break;
 
+    // In this mode, the index is loaded only once, and queries from any number of clients are answered until we're interrupted. This way, the cost of loading
+    // the index and warming up the caches is not paid again for every batch. The output format is the same as for the batch mode.
+    case kServe:
+      if (result_format_ == kTrec)
+        silent_mode_ = true;
+      else
+        silent_mode_ = false;
+      ServeQueries(Configuration::GetResultValue(Configuration::GetConfiguration().GetStringValue(config_properties::kServerAddress)));
+      break;
+
     default:
       assert(false);
       break;
   }
 
   // Output some querying statistics.
-  double total_num_queries_issued = total_num_queries_;
+  double total_num_queries_issued = query_stats_.total_num_queries;
 
-  cout << "Number of queries executed: " << total_num_queries_ << endl;
-  cout << "Number of single term queries: " << num_single_term_queries_ << endl;
-  cout << "Total querying time: " << total_querying_time_ << " seconds\n";
+  cout << "Number of queries executed: " << query_stats_.total_num_queries << endl;
+  cout << "Number of single term queries: " << query_stats_.num_single_term_queries << endl;
+  cout << "Total querying time: " << query_stats_.total_querying_time << " seconds\n";
 
   cout << "\n";
   cout << "Early Termination Statistics:\n";
-  cout << "Number of early terminated queries: " << num_early_terminated_queries_ << endl;
-  cout << "not_enough_results_definitely_: " << not_enough_results_definitely_ << endl;
-  cout << "not_enough_results_possibly_: " << not_enough_results_possibly_ << endl;
-  cout << "num_queries_containing_single_layered_terms_: " << num_queries_containing_single_layered_terms_ << endl;
-  cout << "num_queries_kth_result_meeting_threshold_: " << num_queries_kth_result_meeting_threshold_ << endl;
-  cout << "num_queries_kth_result_not_meeting_threshold_: " << num_queries_kth_result_not_meeting_threshold_ << endl;
-
-  cout << "Average postings scored: " << (num_postings_scored_ / total_num_queries_issued) << endl;
-  cout << "Average postings skipped: " << (num_postings_skipped_ / total_num_queries_issued) << endl;
+  cout << "Number of early terminated queries: " << query_stats_.num_early_terminated_queries << endl;
+  cout << "not_enough_results_definitely_: " << query_stats_.not_enough_results_definitely << endl;
+  cout << "not_enough_results_possibly_: " << query_stats_.not_enough_results_possibly << endl;
+  cout << "num_queries_containing_single_layered_terms_: " << query_stats_.num_queries_containing_single_layered_terms << endl;
+  cout << "num_queries_kth_result_meeting_threshold_: " << query_stats_.num_queries_kth_result_meeting_threshold << endl;
+  cout << "num_queries_kth_result_not_meeting_threshold_: " << query_stats_.num_queries_kth_result_not_meeting_threshold << endl;
+
+  cout << "Average postings scored: " << (query_stats_.num_postings_scored / total_num_queries_issued) << endl;
+  cout << "Average postings skipped: " << (query_stats_.num_postings_skipped / total_num_queries_issued) << endl;
+  cout << "Average heap insertions: " << (query_stats_.num_heap_insertions / total_num_queries_issued) << endl;
+  cout << "Average threshold changes: " << (query_stats_.num_threshold_changes / total_num_queries_issued) << endl;
+  cout << "Average score bound skips: " << (query_stats_.num_score_bound_skips / total_num_queries_issued) << endl;
 
   cout << "\n";
   cout << "Per Query Statistics:\n";
   cout << "  Average data read from cache: " << (index_reader_.total_cached_bytes_read() / total_num_queries_issued / (1 << 20)) << " MiB\n";
   cout << "  Average data read from disk: " << (index_reader_.total_disk_bytes_read() / total_num_queries_issued / (1 << 20)) << " MiB\n";
   cout << "  Average number of blocks skipped: " << (index_reader_.total_num_blocks_skipped() / total_num_queries_issued) << "\n";
+  cout << "  Average number of NextGEQ() calls: " << (index_reader_.total_num_next_geq_calls() / total_num_queries_issued) << "\n";
+  cout << "  Average number of chunks decoded: " << (index_reader_.total_num_chunks_decoded() / total_num_queries_issued) << "\n";
+
+  cout << "  Average query running time (latency): " << (query_stats_.total_querying_time / total_num_queries_issued * (1000)) << " ms\n";
+
+  if (query_stats_.latencies.size() > 0) {
+    cout << "\n";
+    cout << "Query Latency Percentiles:\n";
+    cout << "  All queries: ";
+    query_stats_.latencies.Print(cout);
+    cout << "\n";
+    for (map<int, LatencyDistribution>::iterator itr = query_stats_.latencies_by_algorithm.begin(); itr != query_stats_.latencies_by_algorithm.end(); ++itr) {
+      cout << "  Algorithm '" << GetQueryAlgorithmName(static_cast<QueryAlgorithm> (itr->first)) << "': ";
+      itr->second.Print(cout);
+      cout << "\n";
+    }
+    for (map<int, LatencyDistribution>::iterator itr = query_stats_.latencies_by_num_terms.begin(); itr != query_stats_.latencies_by_num_terms.end(); ++itr) {
+      cout << "  " << itr->first << " term queries: ";
+      itr->second.Print(cout);
+      cout << "\n";
+    }
+
+    // The list stages are timed as part of the query running time, while the lexicon lookup happens before it. Whatever isn't accounted for by any of the
+    // other stages is the time spent traversing the lists and scoring. With intra-query parallelism, the stage times are summed up over all the threads.
+    double list_open_time = CycleTimer::CyclesToSeconds(index_reader_.total_list_open_cycles());
+    double block_fetch_time = CycleTimer::CyclesToSeconds(index_reader_.total_block_fetch_cycles());
+    double decode_time = CycleTimer::CyclesToSeconds(index_reader_.total_decode_cycles());
+    double top_k_time = CycleTimer::CyclesToSeconds(query_stats_.top_k_cycles);
+    double scoring_time = max(0.0, query_stats_.total_querying_time - list_open_time - block_fetch_time - decode_time - top_k_time);
+
+    cout << "\n";
+    cout << "Query Stage Times (average per query):\n";
+    cout << "  Lexicon lookup: " << (CycleTimer::CyclesToSeconds(query_stats_.lexicon_lookup_cycles) / total_num_queries_issued * 1000) << " ms\n";
+    cout << "  List open: " << (list_open_time / total_num_queries_issued * 1000) << " ms\n";
+    cout << "  Block fetch/wait: " << (block_fetch_time / total_num_queries_issued * 1000) << " ms\n";
+#ifdef IRTK_STAGE_TIMING
+    cout << "  Chunk decoding: " << (decode_time / total_num_queries_issued * 1000) << " ms\n";
+    cout << "  Top-k maintenance: " << (top_k_time / total_num_queries_issued * 1000) << " ms\n";
+#else
+    cout << "  Chunk decoding and top-k maintenance: not timed (build with 'make STAGE_TIMING=YES')\n";
+#endif
+    cout << "  Scoring and list traversal: " << (scoring_time / total_num_queries_issued * 1000) << " ms\n";
+  }
+
+  const DecodedChunkCache* decoded_chunk_cache = index_reader_.decoded_chunk_cache();
+  if (decoded_chunk_cache != NULL) {
+    uint64_t num_chunk_lookups = max<uint64_t> (1, decoded_chunk_cache->num_hits() + decoded_chunk_cache->num_misses());
+    cout << "\n";
+    cout << "Decoded Chunk Cache Statistics:\n";
+    cout << "  Cache size: " << decoded_chunk_cache->capacity() << " chunks\n";
+    cout << "  Hits: " << decoded_chunk_cache->num_hits() << "\n";
+    cout << "  Misses: " << decoded_chunk_cache->num_misses() << "\n";
+    cout << "  Evictions: " << decoded_chunk_cache->num_evictions() << "\n";
+    cout << "  Hit ratio: " << (decoded_chunk_cache->num_hits() / static_cast<double> (num_chunk_lookups)) << "\n";
+    cout << "  Decoding time: " << decoded_chunk_cache->decode_time() << " seconds\n";
+    cout << "  Decoding time saved: " << decoded_chunk_cache->decode_time_saved() << " seconds\n";
+  }
+
+  if (result_cache_.capacity() > 0) {
+    cout << "\n";
+    cout << "Result Cache Statistics:\n";
+    cout << "  Cache size: " << result_cache_.capacity() << " queries\n";
+    cout << "  Hits: " << query_stats_.num_result_cache_hits << "\n";
+    cout << "  Misses: " << query_stats_.num_result_cache_misses << "\n";
+    cout << "  Evictions: " << query_stats_.num_result_cache_evictions << "\n";
+    cout << "  Hit ratio: " << (query_stats_.num_result_cache_hits / static_cast<double> (max<uint64_t> (1, query_stats_.num_result_cache_hits
+        + query_stats_.num_result_cache_misses))) << "\n";
+  }
+
+  if (intersection_cache_.capacity() > 0) {
+    cout << "\n";
+    cout << "Intersection Cache Statistics:\n";
+    cout << "  Cache size: " << intersection_cache_.capacity() << " docIDs\n";
+    cout << "  Hits: " << query_stats_.num_intersection_cache_hits << "\n";
+    cout << "  Misses: " << query_stats_.num_intersection_cache_misses << "\n";
+    cout << "  Admissions: " << query_stats_.num_intersection_cache_admissions << "\n";
+    cout << "  Evictions: " << query_stats_.num_intersection_cache_evictions << "\n";
+  }
 
-  cout << "  Average query running time (latency): " << (total_querying_time_ / total_num_queries_issued * (1000)) << " ms\n";
+  if (query_pipeline_depth_ > 1 && (query_mode_ == kBatch || query_mode_ == kBatchBench)) {
+    cout << "\n";
+    cout << "Query Pipeline Statistics:\n";
+    cout << "  Pipeline depth: " << query_pipeline_depth_ << " queries\n";
+    cout << "  Blocks prefetched from disk: " << query_stats_.num_prefetched_disk_blocks << "\n";
+    cout << "  Queries executed out of order: " << query_stats_.num_pipeline_reorders << "\n";
+    cout << "  Stalls (no staged query ready): " << query_stats_.num_pipeline_stalls << "\n";
+  }
+
+  if (query_mode_ == kServe) {
+    cout << "\n";
+    cout << "Server Statistics:\n";
+    cout << "  Number of query threads: " << num_query_threads_ << "\n";
+    cout << "  Number of client connections: " << num_server_connections_ << "\n";
+
+    for (int i = 0; i < static_cast<int> (query_thread_stats_.size()); ++i) {
+      const QueryStatistics& thread_stats = query_thread_stats_[i];
+      cout << "  Thread #" << i << ": " << thread_stats.total_num_queries << " queries, " << thread_stats.total_querying_time << " seconds querying\n";
+    }
+  }
+
+  if (query_mode_ == kBatchBench) {
+    // Since queries could be running concurrently, the throughput is based on the wall clock time of the whole timed run,
+    // and not on the sum of the individual query running times.
+    cout << "\n";
+    cout << "Throughput Statistics:\n";
+    cout << "  Number of query threads: " << num_query_threads_ << "\n";
+    cout << "  Number of intra-query threads: " << num_intra_query_threads_ << "\n";
+    cout << "  Total batch querying time (wall clock): " << batch_querying_time_ << " seconds\n";
+    cout << "  Throughput: " << (total_num_queries_issued / batch_querying_time_) << " queries/sec\n";
+
+    for (int i = 0; i < static_cast<int> (query_thread_stats_.size()); ++i) {
+      const QueryStatistics& thread_stats = query_thread_stats_[i];
+      // A thread might not have picked up any queries at all.
+      double average_latency = (thread_stats.total_num_queries > 0) ? (thread_stats.total_querying_time / thread_stats.total_num_queries) : 0;
+      cout << "  Thread #" << i << ": " << thread_stats.total_num_queries << " queries, " << thread_stats.total_querying_time << " seconds querying, "
+          << (average_latency * (1000)) << " ms average latency, " << (thread_stats.total_num_queries / batch_querying_time_) << " queries/sec\n";
+    }
+  }
+  cout << flush;
 }
 
 QueryProcessor::~QueryProcessor() {
+  for (size_t i = 0; i < free_dense_accumulators_.size(); ++i) {
+    delete[] free_dense_accumulators_[i];
+  }
+
+  pthread_mutex_destroy(&batch_query_mutex_);
+  pthread_mutex_destroy(&output_mutex_);
+  pthread_mutex_destroy(&query_trace_mutex_);
+  pthread_mutex_destroy(&dense_accumulators_mutex_);
+  pthread_mutex_destroy(&server_mutex_);
+  pthread_cond_destroy(&server_cond_);
+
   delete external_index_reader_;
+  delete forward_index_reader_;
   delete cache_policy_;
 }
 
@@ -280,14 +966,13 @@ void QueryProcessor::AcceptQuery() {
   }
 }
 
-int QueryProcessor::ProcessQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results) {
+int QueryProcessor::ProcessQuery(QueryAlgorithm query_algorithm, LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results) {
   const int kMaxNumResults = *num_results;
   ListData* list_data_pointers[num_query_terms];  // Using a variable length array here.
 
   bool single_term_query = false;
   if (num_query_terms == 1) {
-    if (!warm_up_mode_)
-      ++num_single_term_queries_;
+    ++thread_query_stats_->num_single_term_queries;
     single_term_query = true;
   }
 
@@ -297,14 +982,27 @@ int QueryProcessor::ProcessQuery(LexiconData** query_term_data, int num_query_te
     // TODO: This only applies to indices with overlapping layers; need to check that first.
     //       Also need to override that the index is not layered, so that this function will be called.
     list_data_pointers[i] = index_reader_.OpenList(*query_term_data[i], query_term_data[i]->num_layers() - 1, single_term_query);
+    list_data_pointers[i]->set_term_num(i);
   }
 
   int total_num_results;
-  switch (query_algorithm_) {
+  switch (query_algorithm) {
     case kDaatAnd:
       // Query terms must be arranged in order from shortest list to longest list.
       sort(list_data_pointers, list_data_pointers + num_query_terms, ListCompare());
-      total_num_results = IntersectLists(list_data_pointers, num_query_terms, results, kMaxNumResults);
+      if (intersection_cache_.capacity() > 0
+          && IntersectListsCached(query_term_data, list_data_pointers, num_query_terms, results, kMaxNumResults, &total_num_results)) {
+        break;
+      }
+
+      // When the two lists are of comparable length, most chunks of the longer list would be decoded anyway, so it's cheaper to intersect whole chunks
+      // at once. Otherwise, we let the shorter list skip through the longer one.
+      if (num_query_terms == 2 && simd_intersection_max_ratio_ != 0
+          && list_data_pointers[1]->num_docs() <= simd_intersection_max_ratio_ * list_data_pointers[0]->num_docs()) {
+        total_num_results = IntersectTwoListsChunked(list_data_pointers[0], list_data_pointers[1], results, kMaxNumResults);
+      } else {
+        total_num_results = IntersectLists(list_data_pointers, num_query_terms, results, kMaxNumResults);
+      }
       break;
     case kDaatOr:
       total_num_results = MergeLists(list_data_pointers, num_query_terms, results, kMaxNumResults);
@@ -340,8 +1038,7 @@ void QueryProcessor::OpenListLayers(LexiconData** query_term_data, int num_query
 
   *single_term_query = false;
   if (num_query_terms == 1) {
-    if (!warm_up_mode_)
-      ++num_single_term_queries_;
+    ++thread_query_stats_->num_single_term_queries;
     *single_term_query = true;
   }
 
@@ -460,6 +1157,7 @@ int QueryProcessor::ProcessMultiLayeredDaatOrMaxScoreQuery(LexiconData** query_t
   }
 
   int total_num_results = 0;
+  TopKCollector<Result, ResultCompare> top_k(results, kMaxNumResults);
 
   float threshold = 0;
 
@@ -552,10 +1250,14 @@ int QueryProcessor::ProcessMultiLayeredDaatOrMaxScoreQuery(LexiconData** query_t
       if (lists_curr_postings[curr_list_idx] == curr_doc_id) {
         // Compute BM25 score from frequencies.
         f_d_t = list_data_pointers[curr_list_idx]->GetFreq();
-        doc_len = index_reader_.document_map().GetDocumentLength(lists_curr_postings[curr_list_idx]);
-        bm25_sum += idf_t[curr_list_idx] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+        if (index_quantized_impacts_) {
+          bm25_sum += f_d_t * impact_score_;
+        } else {
+          doc_len = index_reader_.document_map().GetDocumentLength(lists_curr_postings[curr_list_idx]);
+          bm25_sum += idf_t[curr_list_idx] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+        }
 
-        ++num_postings_scored_;
+        ++thread_query_stats_->num_postings_scored;
 
         // Can now move the list pointer further.
         lists_curr_postings[curr_list_idx] = list_data_pointers[curr_list_idx]->NextGEQ(lists_curr_postings[curr_list_idx] + 1);
@@ -579,27 +1281,22 @@ int QueryProcessor::ProcessMultiLayeredDaatOrMaxScoreQuery(LexiconData** query_t
     }
 
     // Need to keep track of the top-k documents.
-    if (total_num_results < kMaxNumResults) {
-      // We insert a document if we don't have k documents yet.
-      results[total_num_results] = make_pair(bm25_sum, curr_doc_id);
-      push_heap(results, results + total_num_results + 1, ResultCompare());
-    } else {
-      if (bm25_sum > results->first) {
-        // We insert a document only if it's score is greater than the minimum scoring document in the heap.
-        pop_heap(results, results + kMaxNumResults, ResultCompare());
-        results[kMaxNumResults - 1].first = bm25_sum;
-        results[kMaxNumResults - 1].second = curr_doc_id;
-        push_heap(results, results + kMaxNumResults, ResultCompare());
-
-        // Update the threshold.
-        threshold = results->first;
+    START_STAGE_TIMER(top_k_time);
+    if (top_k.Insert(make_pair(bm25_sum, curr_doc_id))) {
+      ++thread_query_stats_->num_heap_insertions;
+
+      // Update the threshold once we have k documents.
+      if (top_k.full() && top_k.threshold() > threshold) {
+        ++thread_query_stats_->num_threshold_changes;
+        threshold = top_k.threshold();
       }
     }
+    STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
     ++total_num_results;
   }
 
   // Sort top-k results in descending order by document score.
-  sort(results, results + min(kMaxNumResults, total_num_results), ResultCompare());
+  top_k.Sort();
 
   *num_results = min(total_num_results, kMaxNumResults);
   for (int i = 0; i < total_num_layers; ++i) {
@@ -678,11 +1375,9 @@ int QueryProcessor::ProcessLayeredTaatPrunedEarlyTerminatedQuery(LexiconData** q
   // -----------------------------------------------------------------------------------------------------------------------------------------------------------
   // Another solution is to use a select (quick-select) algorithm to find the k-th largest score from the accumulators. This can be done after finishing
   // processing a layer. This is a O(n) operation, where n is the number of accumulators. Note: after testing, this does not work too well in practice.
-#ifdef HASH_HEAP_METHOD_OR
-  pair<uint32_t, float> top_k[kMaxNumResults];  // Using a variable length array here.
-#endif
+  pair<uint32_t, float> top_k_entries[kMaxNumResults] __attribute__((aligned(64)));  // Using a variable length array here.
+  AccumulatorTopK top_k(top_k_entries, kMaxNumResults);  // Only used with the hash heap method.
   TopKTable top_k_table(kMaxNumResults);  // Indicates whether a docID is present in the top-k heap.
-  int num_top_k = 0;
 
   float term_upperbounds[num_query_terms];  // Using a variable length array here.
 
@@ -716,20 +1411,11 @@ int QueryProcessor::ProcessLayeredTaatPrunedEarlyTerminatedQuery(LexiconData** q
     //       Binary search is a good option here since we always start with a sorted accumulator array.
     switch (curr_processing_mode) {
       case kOr:
-#ifdef HASH_HEAP_METHOD_OR
-        threshold = ProcessListLayerOr(max_score_sorted_list_data_pointers[i], &accumulators, &accumulators_size, &num_accumulators, top_k, num_top_k,
-                                       top_k_table, kMaxNumResults, &total_num_accumulators_created);
-#else
-        threshold = ProcessListLayerOr(max_score_sorted_list_data_pointers[i], &accumulators, &accumulators_size, &num_accumulators, NULL, num_top_k,
-                                       top_k_table, kMaxNumResults, &total_num_accumulators_created);
-#endif
+        threshold = ProcessListLayerOr(max_score_sorted_list_data_pointers[i], &accumulators, &accumulators_size, &num_accumulators, top_k, top_k_table,
+                                       &total_num_accumulators_created);
         break;
       case kAnd:
-#ifdef HASH_HEAP_METHOD_OR
-        threshold = ProcessListLayerAnd(max_score_sorted_list_data_pointers[i], accumulators, num_accumulators, top_k, num_top_k, top_k_table, kMaxNumResults);
-#else
-        threshold = ProcessListLayerAnd(max_score_sorted_list_data_pointers[i], accumulators, num_accumulators, NULL, num_top_k, top_k_table, kMaxNumResults);
-#endif
+        threshold = ProcessListLayerAnd(max_score_sorted_list_data_pointers[i], accumulators, num_accumulators, top_k, top_k_table);
         break;
       default:
         assert(false);
@@ -858,12 +1544,15 @@ int QueryProcessor::ProcessLayeredTaatPrunedEarlyTerminatedQuery(LexiconData** q
     }
   }
 
-  // Sort accumulators by score and return the top-k.
-  sort(accumulators, accumulators + num_accumulators, AccumulatorScoreDescendingCompare());
-  for (int i = 0; i < min(kMaxNumResults, num_accumulators); ++i) {
-    results[i].first = accumulators[i].curr_score;
-    results[i].second = accumulators[i].doc_id;
+  // Select the top-k accumulators by score and return them sorted.
+  TopKCollector<Result, ResultCompare> top_k_results(results, kMaxNumResults);
+  START_STAGE_TIMER(top_k_time);
+  for (int i = 0; i < num_accumulators; ++i) {
+    if (top_k_results.Insert(make_pair(accumulators[i].curr_score, accumulators[i].doc_id)))
+      ++thread_query_stats_->num_heap_insertions;
   }
+  STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+  top_k_results.Sort();
 
   delete[] accumulators;
 
@@ -883,15 +1572,16 @@ int QueryProcessor::ProcessLayeredTaatPrunedEarlyTerminatedQuery(LexiconData** q
 }
 
 float QueryProcessor::ProcessListLayerOr(ListData* list, Accumulator** accumulators_array, int* accumulators_array_size, int* num_accumulators,
-                                         pair<uint32_t, float>* top_k, int& num_top_k, TopKTable& top_k_table, int k, int* total_num_accumulators_created) {
+                                         AccumulatorTopK& top_k, TopKTable& top_k_table, int* total_num_accumulators_created) {
   assert(list != NULL);
   assert(accumulators_array != NULL && *accumulators_array != NULL);
   assert(accumulators_array_size != NULL && *accumulators_array_size > 0);
   assert(*num_accumulators <= *accumulators_array_size);
 
 #ifndef HASH_HEAP_METHOD_OR
-  float top_k_scores[k];  // Using a variable length array here.
-  int num_top_k_scores = 0;
+  // Keeps the top-k scores of this layer, to get the threshold.
+  float top_k_score_entries[top_k.capacity()];  // Using a variable length array here.
+  TopKCollector<float, greater<float> > top_k_scores(top_k_score_entries, top_k.capacity());
 #endif
 
   Accumulator* accumulators = *accumulators_array;
@@ -926,7 +1616,7 @@ float QueryProcessor::ProcessListLayerOr(ListData* list, Accumulator** accumulat
 #ifndef HASH_HEAP_METHOD_OR
       // Maintain the threshold score.
       // This is for all the old accumulators, whose scores we won't be updating, but still need to be accounted for.
-      KthScore(accumulators[curr_accumulator_idx].curr_score, top_k_scores, num_top_k_scores++, k);
+      top_k_scores.Insert(accumulators[curr_accumulator_idx].curr_score);
 #endif
 
       ++curr_accumulator_idx;
@@ -934,8 +1624,13 @@ float QueryProcessor::ProcessListLayerOr(ListData* list, Accumulator** accumulat
 
     // Compute partial BM25 sum.
     f_d_t = list->GetFreq();
-    doc_len = index_reader_.document_map().GetDocumentLength(curr_doc_id);
-    partial_bm25_sum = idf_t * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+    if (index_quantized_impacts_) {
+      partial_bm25_sum = f_d_t * impact_score_;
+    } else {
+      doc_len = index_reader_.document_map().GetDocumentLength(curr_doc_id);
+      partial_bm25_sum = idf_t * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+    }
+    ++thread_query_stats_->num_postings_scored;
 
     if (curr_accumulator_idx < num_sorted_accumulators && accumulators[curr_accumulator_idx].doc_id == curr_doc_id) {  // Found a matching accumulator.
       accumulators[curr_accumulator_idx].curr_score += partial_bm25_sum;
@@ -944,7 +1639,7 @@ float QueryProcessor::ProcessListLayerOr(ListData* list, Accumulator** accumulat
 #ifndef HASH_HEAP_METHOD_OR
       // Maintain the threshold score.
       // This is for the updated accumulator scores.
-      KthScore(accumulators[curr_accumulator_idx].curr_score, top_k_scores, num_top_k_scores++, k);
+      top_k_scores.Insert(accumulators[curr_accumulator_idx].curr_score);
 #else
       // Must rebuild the heap after we update the score, only if this accumulator is already in the heap.
 #ifdef CUSTOM_HASH
@@ -952,21 +1647,19 @@ float QueryProcessor::ProcessListLayerOr(ListData* list, Accumulator** accumulat
 #else
       if (top_k_table.find(accumulators[curr_accumulator_idx].doc_id) != top_k_table.end()) {
 #endif
-        // Already in the heap, so find it's score in the heap, update it, and make the heap again, so it satisfies the heap property.
+        // Already in the heap, so find it's score in the heap, update it, and sift it down, so the heap property is satisfied again.
         // This is expensive, hopefully, we won't do it much.
-        int heap_size = min(num_top_k, k);
-        for (int i = 0; i < heap_size; ++i) {
-          if (top_k[i].first == accumulators[curr_accumulator_idx].doc_id) {
-            top_k[i].second = accumulators[curr_accumulator_idx].curr_score;
-            BubbleDownHeap(top_k, heap_size, i);
+        pair<uint32_t, float>* top_k_entries = top_k.entries();
+        for (int i = 0; i < top_k.size(); ++i) {
+          if (top_k_entries[i].first == accumulators[curr_accumulator_idx].doc_id) {
+            top_k_entries[i].second = accumulators[curr_accumulator_idx].curr_score;
+            top_k.SiftDown(i);
             break;
           }
         }
       } else {
         // Insert it, because it's score has been updated, and it's not currently in the top-k heap, so it might make it there now (with the updated score).
-        // Don't need to update 'num_top_k' in this case, because we must have seen this accumulator before, and since it's not in the top-k, it must have
-        // been evicted, so 'num_top_k' must be >= 'k' already.
-        KthAccumulator(accumulators[curr_accumulator_idx], top_k, num_top_k, top_k_table, k);
+        KthAccumulator(accumulators[curr_accumulator_idx], top_k, top_k_table);
       }
 #endif
 
@@ -993,9 +1686,9 @@ float QueryProcessor::ProcessListLayerOr(ListData* list, Accumulator** accumulat
 #ifndef HASH_HEAP_METHOD_OR
       // Maintain the threshold score.
       // This is for the new accumulator scores.
-      KthScore(accumulators[*num_accumulators].curr_score, top_k_scores, num_top_k_scores++, k);
+      top_k_scores.Insert(accumulators[*num_accumulators].curr_score);
 #else
-      KthAccumulator(accumulators[*num_accumulators], top_k, num_top_k++, top_k_table, k);
+      KthAccumulator(accumulators[*num_accumulators], top_k, top_k_table);
 #endif
 
       ++(*num_accumulators);
@@ -1022,31 +1715,24 @@ float QueryProcessor::ProcessListLayerOr(ListData* list, Accumulator** accumulat
   delete[] *accumulators_array;
   *accumulators_array = merged_accumulators;*/
 
-#ifdef HASH_HEAP_METHOD_OR
   // We return the threshold score.
-  if (num_top_k < k) {
-    return -numeric_limits<float>::max();
-  }
-
-  return top_k[0].second;
+#ifdef HASH_HEAP_METHOD_OR
+  return top_k.threshold();
 #else
-  if (num_top_k_scores < k) {
-    return -numeric_limits<float>::max();
-  }
-
-  return top_k_scores[0];
+  return top_k_scores.threshold();
 #endif
 }
 
-float QueryProcessor::ProcessListLayerAnd(ListData* list, Accumulator* accumulators, int num_accumulators, pair<uint32_t, float>* top_k, int& num_top_k,
-                                          TopKTable& top_k_table, int k) {
+float QueryProcessor::ProcessListLayerAnd(ListData* list, Accumulator* accumulators, int num_accumulators, AccumulatorTopK& top_k,
+                                          TopKTable& top_k_table) {
   assert(list != NULL);
   assert(accumulators != NULL);
   assert(num_accumulators >= 0);
 
 #ifndef HASH_HEAP_METHOD_AND
-  float top_k_scores[k];  // Using a variable length array here.
-  int num_top_k_scores = 0;
+  // Keeps the top-k scores of this layer, to get the threshold.
+  float top_k_score_entries[top_k.capacity()];  // Using a variable length array here.
+  TopKCollector<float, greater<float> > top_k_scores(top_k_score_entries, top_k.capacity());
 #endif
 
   // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
@@ -1075,8 +1761,13 @@ float QueryProcessor::ProcessListLayerAnd(ListData* list, Accumulator* accumulat
     if (curr_doc_id == accumulators[accumulator_offset].doc_id) {
       // Compute partial BM25 sum.
       f_d_t = list->GetFreq();
-      doc_len = index_reader_.document_map().GetDocumentLength(curr_doc_id);
-      partial_bm25_sum = idf_t * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+      if (index_quantized_impacts_) {
+        partial_bm25_sum = f_d_t * impact_score_;
+      } else {
+        doc_len = index_reader_.document_map().GetDocumentLength(curr_doc_id);
+        partial_bm25_sum = idf_t * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+      }
+      ++thread_query_stats_->num_postings_scored;
 
       // Update accumulator with the document score.
       accumulators[accumulator_offset].curr_score += partial_bm25_sum;
@@ -1085,7 +1776,7 @@ float QueryProcessor::ProcessListLayerAnd(ListData* list, Accumulator* accumulat
 #ifndef HASH_HEAP_METHOD_AND
       // Maintain the threshold score.
       // This is for the updated accumulator scores.
-      KthScore(accumulators[accumulator_offset].curr_score, top_k_scores, num_top_k_scores++, k);
+      top_k_scores.Insert(accumulators[accumulator_offset].curr_score);
 #else
       // Must rebuild the heap after we update the score, only if this accumulator is already in the heap.
 #ifdef CUSTOM_HASH
@@ -1093,131 +1784,57 @@ float QueryProcessor::ProcessListLayerAnd(ListData* list, Accumulator* accumulat
 #else
       if (top_k_table.find(accumulators[accumulator_offset].doc_id) != top_k_table.end()) {
 #endif
-        // Already in the heap, so find it's score in the heap, update it, and make the heap again, so it satisfies the heap property.
+        // Already in the heap, so find it's score in the heap, update it, and sift it down, so the heap property is satisfied again.
         // This is expensive, hopefully, we won't do it much.
-        int heap_size = min(num_top_k, k);
-        for (int i = 0; i < heap_size; ++i) {
-          if (top_k[i].first == accumulators[accumulator_offset].doc_id) {
-            top_k[i].second = accumulators[accumulator_offset].curr_score;
-            BubbleDownHeap(top_k, heap_size, i);
+        pair<uint32_t, float>* top_k_entries = top_k.entries();
+        for (int i = 0; i < top_k.size(); ++i) {
+          if (top_k_entries[i].first == accumulators[accumulator_offset].doc_id) {
+            top_k_entries[i].second = accumulators[accumulator_offset].curr_score;
+            top_k.SiftDown(i);
             break;
           }
         }
       } else {
         // Insert it, because it's score has been updated, and it's not currently in the top-k heap, so it might make it there now (with the updated score).
-        // Don't need to update 'num_top_k' in this case, because we must have seen this accumulator before, and since it's not in the top-k, it must have
-        // been evicted, so 'num_top_k' must be >= 'k' already.
-        KthAccumulator(accumulators[accumulator_offset], top_k, num_top_k, top_k_table, k);
+        KthAccumulator(accumulators[accumulator_offset], top_k, top_k_table);
       }
 #endif
     } else {
 #ifndef HASH_HEAP_METHOD_AND
       // Maintain the threshold score.
       // This is for all the old accumulators, whose scores we won't be updating, but still need to be accounted for.
-      KthScore(accumulators[accumulator_offset].curr_score, top_k_scores, num_top_k_scores++, k);
+      top_k_scores.Insert(accumulators[accumulator_offset].curr_score);
 #endif
     }
 
     ++accumulator_offset;
   }
 
-#ifdef HASH_HEAP_METHOD_AND
   // We return the threshold score.
-  if (num_top_k < k) {
-    return -numeric_limits<float>::max();
-  }
-
-  return top_k[0].second;
+#ifdef HASH_HEAP_METHOD_AND
+  return top_k.threshold();
 #else
-  if (num_top_k_scores < k) {
-    return -numeric_limits<float>::max();
-  }
-
-  return top_k_scores[0];
+  return top_k_scores.threshold();
 #endif
 }
 
-void QueryProcessor::KthAccumulator(const Accumulator& new_accumulator, std::pair<uint32_t, float>* accumulators, int num_accumulators, TopKTable& top_k_table, int kth_score) {
-  // We use a min heap to determine the k-th largest score (the lowest score of the k scores we keep).
-  // Notice that we don't have to explicitly make the heap, since it's assumed to be maintained from the start.
-  if (num_accumulators < kth_score) {  // We insert a document score if we don't have k documents yet.
-    // Mark that this docID has been inserted into the top-k heap.
-#ifdef CUSTOM_HASH
-    top_k_table.Insert(new_accumulator.doc_id);
-#else
-    top_k_table.insert(new_accumulator.doc_id);
-#endif
-    accumulators[num_accumulators++] = make_pair(new_accumulator.doc_id, new_accumulator.curr_score);
-    push_heap(accumulators, accumulators + num_accumulators, DocIdScorePairScoreDescendingCompare());
-  } else {
-    if (new_accumulator.curr_score > accumulators[0].second) {  // We insert a score only if it is greater than the minimum score in the heap.
-      // Mark that this accumulator has been inserted into the top-k heap.
-#ifdef CUSTOM_HASH
-      top_k_table.Insert(new_accumulator.doc_id);
-#else
-      top_k_table.insert(new_accumulator.doc_id);
-#endif
-      pop_heap(accumulators, accumulators + kth_score, DocIdScorePairScoreDescendingCompare());
-      // Unmark this accumulator (no longer in the heap).
+// Offers an accumulator to the top-k heap, keeping 'top_k_table' in sync with the docIDs in the heap.
+void QueryProcessor::KthAccumulator(const Accumulator& new_accumulator, AccumulatorTopK& top_k, TopKTable& top_k_table) {
+  pair<uint32_t, float> entry(new_accumulator.doc_id, new_accumulator.curr_score);
+  if (!top_k.Accepts(entry))
+    return;
+
+  // Unmark the accumulator we'll be pushing out of the top-k heap (if the heap is full), and mark that this docID has been inserted into the heap.
 #ifdef CUSTOM_HASH
-      top_k_table.Remove(accumulators[kth_score - 1].first);
+  if (top_k.full())
+    top_k_table.Remove(top_k.top().first);
+  top_k_table.Insert(new_accumulator.doc_id);
 #else
-      top_k_table.erase(accumulators[kth_score - 1].first);
+  if (top_k.full())
+    top_k_table.erase(top_k.top().first);
+  top_k_table.insert(new_accumulator.doc_id);
 #endif
-      accumulators[kth_score - 1].first = new_accumulator.doc_id;
-      accumulators[kth_score - 1].second = new_accumulator.curr_score;
-      push_heap(accumulators, accumulators + kth_score, DocIdScorePairScoreDescendingCompare());
-    }
-  }
-}
-
-// A function that does a bubble down operation on the min heap 'top_k' with size 'top_k_size', on the node at index 'node_idx'.
-// The score of the accumulator represented at 'node_idx' could only have increased.
-// So we push it down (in place of it's lowest scoring child) if it's greater than either of its children.
-void QueryProcessor::BubbleDownHeap(pair<uint32_t, float>* top_k, int top_k_size, int node_idx) {
-  while (true) {
-    int left_child_idx = (node_idx << 1) + 1;
-    if (left_child_idx >= top_k_size) {
-      // No more children.
-      break;
-    }
-
-    int right_child_idx = left_child_idx + 1;
-    int lowest_scoring_idx;
-    if (right_child_idx >= top_k_size) {  // The right child does not exist.
-      lowest_scoring_idx = left_child_idx;
-    } else {  // Find the lower scoring of the children
-      lowest_scoring_idx = (top_k[left_child_idx].second < top_k[right_child_idx].second) ? left_child_idx : right_child_idx;
-    }
-
-    pair<uint32_t, float> node = top_k[node_idx];
-    if (node.second > top_k[lowest_scoring_idx].second) {
-      top_k[node_idx] = top_k[lowest_scoring_idx];
-      top_k[lowest_scoring_idx] = node;
-      node_idx = lowest_scoring_idx;
-      continue;
-    }
-    break;
-  }
-}
-
-// This is used to keep track of the threshold value (the score of the k-th highest scoring accumulator).
-// The 'max_scores' array is assumed to be the size of at least 'kth_score'.
-void QueryProcessor::KthScore(float new_score, float* scores, int num_scores, int kth_score) {
-  // We use a min heap to determine the k-th largest score (the lowest score of the k scores we keep).
-  // Notice that we don't have to explicitly make the heap, since it's assumed to be maintained from the start.
-  if (num_scores < kth_score) {
-    // We insert a document score if we don't have k documents yet.
-    scores[num_scores++] = new_score;
-    push_heap(scores, scores + num_scores, greater<float> ());
-  } else {
-    if (new_score > scores[0]) {
-      // We insert a score only if it is greater than the minimum score in the heap.
-      pop_heap(scores, scores + kth_score, greater<float> ());
-      scores[kth_score - 1] = new_score;
-      push_heap(scores, scores + kth_score, greater<float> ());
-    }
-  }
+  top_k.Insert(entry);
 }
 
 // This is for querying indices with dual overlapping layers.
@@ -1336,9 +1953,9 @@ int QueryProcessor::ProcessLayeredQuery(LexiconData** query_term_data, int num_q
         // Print results of individual intersections for debugging.
         if (!silent_mode_) {
           for (int j = 0; j < num_intersection_results[i]; ++j) {
-            cout << all_results[i][j].second << ", score: " << all_results[i][j].first << endl;
+            QueryOutput() << all_results[i][j].second << ", score: " << all_results[i][j].first << "\n";
           }
-          cout << endl;
+          QueryOutput() << "\n";
         }
       }
 
@@ -1349,8 +1966,7 @@ int QueryProcessor::ProcessLayeredQuery(LexiconData** query_term_data, int num_q
       int result_heap_size = 0;
       for (int i = 0; i < num_query_terms; ++i) {
         if (num_intersection_results[i] > 0) {
-          result_heap[i] = make_pair(all_results[i][0], make_pair(i, 1));
-          ++result_heap_size;
+          result_heap[result_heap_size++] = make_pair(all_results[i][0], make_pair(i, 1));
           --num_intersection_results[i];
         }
       }
@@ -1363,10 +1979,17 @@ int QueryProcessor::ProcessLayeredQuery(LexiconData** query_term_data, int num_q
         Result& curr_top_result = result_heap[result_heap_size - 1].first;
         pair<int, int>& curr_top_result_idx = result_heap[result_heap_size - 1].second;
 
-        // If the previous result we stored is the same as the current, we don't need to insert it.
+        // If we already stored the current result, we don't need to insert it.
         // We only compare the docIDs because the scores could be different when the order of the addition of the partial BM25 sums is different.
-        // This is due to floating point rounding errors.
-        if (curr_result == 0 || results[curr_result - 1].second != curr_top_result.second) {
+        // This is due to floating point rounding errors. A duplicate isn't necessarily the previous result though, since there are often many documents
+        // with the same score, so we look through all the previous results with (nearly) the same score.
+        const float kDuplicateScoreSlack = 1.0001f;
+        int prev_result = curr_result - 1;
+        while (prev_result >= 0 && results[prev_result].second != curr_top_result.second
+            && results[prev_result].first <= curr_top_result.first * kDuplicateScoreSlack) {
+          --prev_result;
+        }
+        if (prev_result < 0 || results[prev_result].second != curr_top_result.second) {
           results[curr_result++] = curr_top_result;
         }
 
@@ -1407,31 +2030,30 @@ int QueryProcessor::ProcessLayeredQuery(LexiconData** query_term_data, int num_q
         //        }
         ////////////////
 
-        ++num_queries_kth_result_meeting_threshold_;
+        ++thread_query_stats_->num_queries_kth_result_meeting_threshold;
         if (!silent_mode_)
-          cout << "Early termination possible!" << endl;
+          QueryOutput() << "Early termination possible!\n";
 
-        if (!warm_up_mode_)
-          ++num_early_terminated_queries_;
+        ++thread_query_stats_->num_early_terminated_queries;
       } else {
-        ++num_queries_kth_result_not_meeting_threshold_;
+        ++thread_query_stats_->num_queries_kth_result_not_meeting_threshold;
         if (!silent_mode_)
-          cout << "Cannot early terminate due to score thresholds." << endl;
+          QueryOutput() << "Cannot early terminate due to score thresholds.\n";
 
         run_standard_intersection = true;
       }
 
     } else {
       // Don't have enough results from the first layers, execute query on the 2nd layer.
-      if (!warm_up_mode_ && *num_results < kMaxNumResults) {
+      if (*num_results < kMaxNumResults) {
         if (total_num_results < kMaxNumResults) {
-          ++not_enough_results_definitely_;
+          ++thread_query_stats_->not_enough_results_definitely;
           if (!silent_mode_)
-            cout << "Definitely don't have enough results." << endl;
+            QueryOutput() << "Definitely don't have enough results.\n";
         } else {
-          ++not_enough_results_possibly_;
+          ++thread_query_stats_->not_enough_results_possibly;
           if (!silent_mode_)
-            cout << "Potentially don't have enough results." << endl;
+            QueryOutput() << "Potentially don't have enough results.\n";
         }
       }
 
@@ -1440,27 +2062,42 @@ int QueryProcessor::ProcessLayeredQuery(LexiconData** query_term_data, int num_q
   } else {
     // If we have at least one term in the query that has only a single layer,
     // we can get away with doing only on intersection on the last layers of each inverted list.
-    ++num_queries_containing_single_layered_terms_;
+    ++thread_query_stats_->num_queries_containing_single_layered_terms;
     if (!silent_mode_)
-      cout << "Query includes term with only a single layer." << endl;
+      QueryOutput() << "Query includes term with only a single layer.\n";
 
     run_standard_intersection = true;
 
     // We count this as an early terminated query.
-    if (!warm_up_mode_)
-      ++num_early_terminated_queries_;
+    ++thread_query_stats_->num_early_terminated_queries;
   }
 
   if (run_standard_intersection) {
-    // Need to re-run the query on the last layers for each list (this is actually the standard DAAT approach).
+    // Need to run the query on the last layers for each list (this is actually the standard DAAT approach).
     for (int i = 0; i < num_query_terms; ++i) {
-      // Before we rerun the query, we need to reset the list information so we start from the beginning.
+      // Before we run the query, we need to reset the list information so we start from the beginning.
       list_data_pointers[i][query_term_data[i]->num_layers() - 1]->ResetList(single_term_query);
       curr_intersection_list_data_pointers[i] = list_data_pointers[i][query_term_data[i]->num_layers() - 1];
+      curr_intersection_list_data_pointers[i]->set_term_num(i);
     }
 
     sort(curr_intersection_list_data_pointers, curr_intersection_list_data_pointers + num_query_terms, ListCompare());
-    total_num_results = IntersectLists(curr_intersection_list_data_pointers, num_query_terms, results, kMaxNumResults);
+    // The last layers hold the complete lists, so a cached intersection of a pair of terms can stand in for two of them.
+    if (intersection_cache_.capacity() == 0
+        || !IntersectListsCached(query_term_data, curr_intersection_list_data_pointers, num_query_terms, results, kMaxNumResults, &total_num_results)) {
+      if (single_layer_list_idx == -1) {
+        // We already have the results from the first layers, so instead of starting over, we only look for the documents that are in none of them.
+        float remainder_score_upperbounds[num_query_terms];  // Using a variable length array here.
+        for (int i = 0; i < num_query_terms; ++i) {
+          LexiconData* term_data = query_term_data[curr_intersection_list_data_pointers[i]->term_num()];
+          remainder_score_upperbounds[i] = term_data->layer_score_threshold(term_data->num_layers() - 1);
+        }
+        total_num_results = IntersectRemainingLists(curr_intersection_list_data_pointers, num_query_terms, remainder_score_upperbounds, results,
+                                                    *num_results, kMaxNumResults);
+      } else {
+        total_num_results = IntersectLists(curr_intersection_list_data_pointers, num_query_terms, results, kMaxNumResults);
+      }
+    }
     *num_results = min(total_num_results, kMaxNumResults);
   }
 
@@ -1518,27 +2155,50 @@ int QueryProcessor::MergeLists(ListData** lists, int num_lists, uint32_t* merged
   return i;
 }
 
+// The per list state of the query kernels below. In the kernels specialized for a fixed number of lists, it's a fixed size array on the stack. The generic
+// kernel (instantiated with 'kFixedNumLists' of 0) allocates it for the actual number of lists.
+template<typename T, int kFixedNumLists>
+class KernelListArray {
+public:
+  explicit KernelListArray(int num_lists) {
+    assert(num_lists == kFixedNumLists);
+  }
+
+  T& operator[](int i) {
+    return array_[i];
+  }
+
+private:
+  T array_[kFixedNumLists];
+};
+
+template<typename T>
+class KernelListArray<T, 0> {
+public:
+  explicit KernelListArray(int num_lists) :
+    array_(num_lists) {
+  }
+
+  T& operator[](int i) {
+    return array_[i];
+  }
+
+private:
+  vector<T> array_;
+};
+
 // Standard DAAT OR mode processing for comparison purposes.
-int QueryProcessor::MergeLists(ListData** lists, int num_lists, Result* results, int num_results) {
-  // Setting this option to 'true' makes a considerable difference in average query latency (> 100ms).
-  // When we score the complete doc, we first find the lowest docID in the array, and then scan the array for that docID, and completely score it.
-  // All lists from which the docID was scored have their list pointers moved forward.
-  // When we don't score the complete doc, at each turn of the while loop, we find a partial score of the lowest docID posting.
-  // We add these together for a particular docID to get the complete score -- but it requires several iterations of the main while loop.
-  // This is less efficient, since we have to do a complete linear search through the array for every posting.
-  // On the other hand, when we score the complete doc right away, we only have to do one more linear search through all postings to score all the lists.
-  // Clearly, if the majority of the docIDs are present in more than one list, we'll be getting a speedup.
-  const bool kScoreCompleteDoc = true;
-
-  // Use an array instead of a heap for selecting the list with the lowest docID at each step.
-  // Using a heap for picking the list with the lowest docID is only implemented for when 'kScoreCompleteDoc' is false.
-  // For compatibility with 'kScoreCompleteDoc' equal to true, you'd need to use the heap to choose the next list to score, instead of iterating through the array, which is what's done now.
-  // Array based method is faster than the heap based method for choosing the lowest docID from all the lists, so this option should be set to 'true'.
-  // TODO: Try another array based strategy: keep a sorted array of docIDs. When updating, only need to find the spot for the new docID and re-sort the array up to that spot.
-  // TODO: Can also use a linked list for this. Then can just find the right spot, and do pointer changes. The locality here wouldn't be too good though.
-  const bool kUseArrayInsteadOfHeapList = true;
+// At each step, we find the lowest docID among the lists, score it completely, and move forward all the lists it was found in. When most docIDs are present
+// in more than one list, this beats adding up the partial score of one posting at a time, which takes a linear search through the lists for every posting.
+// The lists stay in place once they run out of postings (at the 'kNoMoreDocs' sentinel), so that every loop runs over exactly 'num_lists' lists; in the
+// kernels specialized for a fixed number of lists, the compiler can fully unroll them. The partial scores are summed in the order of the lists.
+template<int kFixedNumLists>
+int QueryProcessor::MergeListsKernel(ListData** lists, int runtime_num_lists, Result* results, int num_results) {
+  // In the kernels specialized for a fixed number of lists, this is a compile time constant.
+  const int num_lists = (kFixedNumLists > 0) ? kFixedNumLists : runtime_num_lists;
 
   int total_num_results = 0;
+  TopKCollector<Result, ResultCompare> top_k(results, num_results);
 
   // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
   const float kBm25K1 =  2.0;  // k1
@@ -1550,201 +2210,197 @@ int QueryProcessor::MergeLists(ListData** lists, int num_lists, Result* results,
   const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
 
   // BM25 components.
-  float bm25_sum = 0;  // The BM25 sum for the current document we're processing in the intersection.
-  float partial_bm25_sum;
+  float bm25_sum;  // The BM25 sum for the current document we're processing.
   int doc_len;
   uint32_t f_d_t;
 
   // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for each list.
-  float idf_t[num_lists];  // Using a variable length array here.
+  KernelListArray<float, kFixedNumLists> idf_t(num_lists);
   int num_docs_t;
   for (int i = 0; i < num_lists; ++i) {
     num_docs_t = lists[i]->num_docs_complete_list();
     idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
   }
 
-  // We use this to get the next lowest docID from all the lists.
-  pair<uint32_t, int> lists_curr_postings[num_lists];  // Using a variable length array here.
-  int num_lists_remaining = 0;  // The number of lists with postings remaining.
+  // The current docID of each list.
+  KernelListArray<uint32_t, kFixedNumLists> lists_curr_doc_ids(num_lists);
   for (int i = 0; i < num_lists; ++i) {
-    uint32_t curr_doc_id;
-    if ((curr_doc_id = lists[i]->NextGEQ(0)) < ListData::kNoMoreDocs) {
-      lists_curr_postings[num_lists_remaining++] = make_pair(curr_doc_id, i);
-    }
-  }
-
-  if (num_lists_remaining > 0) {
-    if (!kUseArrayInsteadOfHeapList) {
-      // We use our own comparator, that only checks the docID part.
-      make_heap(lists_curr_postings, lists_curr_postings + num_lists_remaining, ListMaxDocIdCompare());
-    }
-  } else {
-    return total_num_results;
+    lists_curr_doc_ids[i] = lists[i]->NextGEQ(0);
   }
 
-  // For the heap based method, the lowest element will always be the first element in the array.
-  // So we can keep 'top' constant since it's just a pointer to the first element and just push/pop the heap.
-  // For the array based method, we need to initialize it to the first element in the array, and then find the lowest value at the top of the while loop.
-  // We have to find the lowest element here as well, since we need to initialize 'curr_doc_id' to the right value before we start the loop.
-  pair<uint32_t, int>* top = &lists_curr_postings[0];
-  if (kUseArrayInsteadOfHeapList) {
-    for (int i = 1; i < num_lists_remaining; ++i) {
-      if (lists_curr_postings[i].first < top->first) {
-        top = &lists_curr_postings[i];
+  int i;
+  uint32_t curr_doc_id;  // Current docID we're processing the score for.
+  while (true) {
+    curr_doc_id = lists_curr_doc_ids[0];
+    for (i = 1; i < num_lists; ++i) {
+      if (lists_curr_doc_ids[i] < curr_doc_id) {
+        curr_doc_id = lists_curr_doc_ids[i];
       }
     }
-  }
 
-  int i;
-  uint32_t curr_doc_id = top->first;  // Current docID we're processing the score for.
+    if (curr_doc_id == ListData::kNoMoreDocs)
+      break;
 
-  while (num_lists_remaining) {
-    if (kUseArrayInsteadOfHeapList) {
-      top = &lists_curr_postings[0];
-      for (i = 1; i < num_lists_remaining; ++i) {
-        if (lists_curr_postings[i].first < top->first) {
-          top = &lists_curr_postings[i];
+    bm25_sum = 0;
+    for (i = 0; i < num_lists; ++i) {
+      if (lists_curr_doc_ids[i] == curr_doc_id) {
+        // Compute BM25 score from frequencies.
+        f_d_t = lists[i]->GetFreq();
+        if (index_quantized_impacts_) {
+          bm25_sum += f_d_t * impact_score_;
+        } else {
+          doc_len = index_reader_.document_map().GetDocumentLength(curr_doc_id);
+          bm25_sum += idf_t[i] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
         }
+
+        ++thread_query_stats_->num_postings_scored;
+
+        lists_curr_doc_ids[i] = lists[i]->NextGEQ(curr_doc_id + 1);
       }
     }
 
-    if (kScoreCompleteDoc) {
-      curr_doc_id = top->first;
-      bm25_sum = 0;
-      // Can start searching from the position of 'top' since it'll be the first lowest element in the array.
-      while (top != &lists_curr_postings[num_lists_remaining]) {
-        if (top->first == curr_doc_id) {
-          // Compute BM25 score from frequencies.
-          f_d_t = lists[top->second]->GetFreq();
-          doc_len = index_reader_.document_map().GetDocumentLength(top->first);
-          bm25_sum += idf_t[top->second] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
-
-          ++num_postings_scored_;
-
-          if ((top->first = lists[top->second]->NextGEQ(top->first + 1)) == ListData::kNoMoreDocs) {
-            // Need to compact the array by one.
-            // Just copy over the last value in the array and overwrite the top value, since we'll be removing it.
-            // Now, we can declare our list one shorter.
-            // If top happens to already point to the last value in the array, this step is superfluous.
-          --num_lists_remaining;
-            *top = lists_curr_postings[num_lists_remaining];
-            --top;
-          }
-        }
-        ++top;
-      }
+    // Need to keep track of the top-k documents.
+    START_STAGE_TIMER(top_k_time);
+    if (top_k.Insert(make_pair(bm25_sum, curr_doc_id)))
+      ++thread_query_stats_->num_heap_insertions;
+    STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+    ++total_num_results;
+  }
 
-      // Need to keep track of the top-k documents.
-      if (total_num_results < num_results) {
-        // We insert a document if we don't have k documents yet.
-        results[total_num_results] = make_pair(bm25_sum, curr_doc_id);
-        push_heap(results, results + total_num_results + 1, ResultCompare());
-      } else {
-        if (bm25_sum > results->first) {
-          // We insert a document only if it's score is greater than the minimum scoring document in the heap.
-          pop_heap(results, results + num_results, ResultCompare());
-          results[num_results - 1].first = bm25_sum;
-          results[num_results - 1].second = curr_doc_id;
-          push_heap(results, results + num_results, ResultCompare());
-        }
-      }
-      ++total_num_results;
-    } else {
-      // Compute BM25 score from frequencies.
-      f_d_t = lists[top->second]->GetFreq();
-      doc_len = index_reader_.document_map().GetDocumentLength(top->first);
-      partial_bm25_sum = idf_t[top->second] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+  // Sort top-k results in descending order by document score.
+  top_k.Sort();
 
-      ++num_postings_scored_;
+  return total_num_results;
+}
 
-#ifdef QUERY_PROCESSOR_DEBUG
-      // Set 'kScoreCompleteDoc' to false to use this code path.
-      cout << "doc_id: " << top->first << ", bm25: " << partial_bm25_sum << endl;
-#endif
+// DAAT OR mode processing for long queries. This scores the complete doc just like MergeListsKernel(), but picks the lists positioned at the lowest docID
+// through a loser tree. The array scan in MergeListsKernel() has to look at every list once to find the lowest docID and then once more to score it, so its
+// cost per document grows linearly with the number of query terms; here, each posting we score only costs a replay of the tournament from its leaf to the
+// root.
+int QueryProcessor::MergeListsLoserTree(ListData** lists, int num_lists, Result* results, int num_results) {
+  int total_num_results = 0;
+  TopKCollector<Result, ResultCompare> top_k(results, num_results);
 
-      // When we encounter the same docID as the current we'be been processing, we update it's score.
-      // Otherwise, we know we're processing a new docID.
-      if (top->first == curr_doc_id) {
-        bm25_sum += partial_bm25_sum;
-      } else if (top->first > curr_doc_id) {
-        // Need to keep track of the top-k documents.
-        if (total_num_results < num_results) {
-          // We insert a document if we don't have k documents yet.
-          results[total_num_results] = make_pair(bm25_sum, curr_doc_id);
-          push_heap(results, results + total_num_results + 1, ResultCompare());
-        } else {
-          if (bm25_sum > results->first) {
-            // We insert a document only if it's score is greater than the minimum scoring document in the heap.
-            pop_heap(results, results + num_results, ResultCompare());
-            results[num_results - 1].first = bm25_sum;
-            results[num_results - 1].second = curr_doc_id;
-            push_heap(results, results + num_results, ResultCompare());
-          }
-        }
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
 
-        curr_doc_id = top->first;
-        bm25_sum = partial_bm25_sum;
-        ++total_num_results;
-      } else {
-        assert(false);
-      }
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
 
-      uint32_t next_doc_id;
-      if ((next_doc_id = lists[top->second]->NextGEQ(top->first + 1)) < ListData::kNoMoreDocs) {
-        if (kUseArrayInsteadOfHeapList) {
-          top->first = next_doc_id;
-        } else {
-          // Need to pop and push to make sure heap property is maintained.
-          pop_heap(lists_curr_postings, lists_curr_postings + num_lists_remaining, ListMaxDocIdCompare());
-          lists_curr_postings[num_lists_remaining - 1].first = next_doc_id;
-          push_heap(lists_curr_postings, lists_curr_postings + num_lists_remaining, ListMaxDocIdCompare());
-        }
-      } else {
-        if (kUseArrayInsteadOfHeapList) {
-          // Need to compact the array by one.
-          // Just copy over the last value in the array and overwrite the top value, since we'll be removing it.
-          // Now, we can declare our list one shorter.
-          // If top happens to already point to the last value in the array, this step is superfluous.
-          *top = lists_curr_postings[num_lists_remaining - 1];
-        } else {
-          pop_heap(lists_curr_postings, lists_curr_postings + num_lists_remaining, ListMaxDocIdCompare());
-        }
+  // BM25 components.
+  float bm25_sum;  // The BM25 sum for the current document we're processing.
+  int doc_len;
+  uint32_t f_d_t;
 
-        --num_lists_remaining;
-      }
-    }
+  // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for each list.
+  float idf_t[num_lists];  // Using a variable length array here.
+  int num_docs_t;
+  for (int i = 0; i < num_lists; ++i) {
+    num_docs_t = lists[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
   }
 
-  if (!kScoreCompleteDoc) {
-    // We always have a leftover result that we need to insert.
-    // Note that there is no need to push the heap since we'll just be sorting all the results by their score next.
-    if (total_num_results < num_results) {
-      // We insert a document if we don't have k documents yet.
-      results[total_num_results] = make_pair(bm25_sum, curr_doc_id);
-    } else {
-      if (bm25_sum > results->first) {
-        // We insert a document only if it's score is greater than the minimum scoring document in the heap.
-        pop_heap(results, results + num_results, ResultCompare());
-        results[num_results - 1].first = bm25_sum;
-        results[num_results - 1].second = curr_doc_id;
+  // Exhausted lists stay in the tree with a docID of 'ListData::kNoMoreDocs', which loses against every real docID.
+  uint32_t first_doc_ids[num_lists];  // Using a variable length array here.
+  for (int i = 0; i < num_lists; ++i) {
+    first_doc_ids[i] = lists[i]->NextGEQ(0);
+  }
+  LoserTree loser_tree(first_doc_ids, num_lists);
+
+  uint32_t curr_doc_id;  // Current docID we're processing the score for.
+  while ((curr_doc_id = loser_tree.winner_doc_id()) < ListData::kNoMoreDocs) {
+    bm25_sum = 0;
+    // All the lists positioned at 'curr_doc_id' come out of the tree one after another.
+    do {
+      int list = loser_tree.winner();
+
+      // Compute BM25 score from frequencies.
+      f_d_t = lists[list]->GetFreq();
+      if (index_quantized_impacts_) {
+        bm25_sum += f_d_t * impact_score_;
+      } else {
+        doc_len = index_reader_.document_map().GetDocumentLength(curr_doc_id);
+        bm25_sum += idf_t[list] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
       }
-    }
+
+      ++thread_query_stats_->num_postings_scored;
+
+      loser_tree.ReplaceWinner(lists[list]->NextGEQ(curr_doc_id + 1));
+    } while (loser_tree.winner_doc_id() == curr_doc_id);
+
+    // Need to keep track of the top-k documents.
+    START_STAGE_TIMER(top_k_time);
+    if (top_k.Insert(make_pair(bm25_sum, curr_doc_id)))
+      ++thread_query_stats_->num_heap_insertions;
+    STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
     ++total_num_results;
   }
 
   // Sort top-k results in descending order by document score.
-  sort(results, results + min(num_results, total_num_results), ResultCompare());
+  top_k.Sort();
 
   return total_num_results;
 }
 
+// Most queries have only a few terms, so we have kernels specialized for up to 6 lists, and fall back to the generic kernel for longer queries.
+// Past 'kLoserTreeMinNumLists' lists, picking the lowest docID through a loser tree beats scanning the array of docIDs.
+int QueryProcessor::MergeLists(ListData** lists, int num_lists, Result* results, int num_results) {
+  const int kLoserTreeMinNumLists = 16;
+
+  switch (num_lists) {
+    case 1:
+      return MergeListsKernel<1>(lists, num_lists, results, num_results);
+    case 2:
+      return MergeListsKernel<2>(lists, num_lists, results, num_results);
+    case 3:
+      return MergeListsKernel<3>(lists, num_lists, results, num_results);
+    case 4:
+      return MergeListsKernel<4>(lists, num_lists, results, num_results);
+    case 5:
+      return MergeListsKernel<5>(lists, num_lists, results, num_results);
+    case 6:
+      return MergeListsKernel<6>(lists, num_lists, results, num_results);
+    default:
+      if (num_lists >= kLoserTreeMinNumLists)
+        return MergeListsLoserTree(lists, num_lists, results, num_results);
+      return MergeListsKernel<0>(lists, num_lists, results, num_results);
+  }
+}
+
+// Returns a starting top-k threshold for a disjunctive query, derived from the kth highest partial BM25 scores stored in the lexicon. If a single list has k
+// postings with a partial score of at least 's', then at least k documents score at least 's' on the whole query (partial scores are never negative), so
+// a docID that can't score above 's' can't make it into the top-k, and the pruning stays rank safe. For each term, we use the score stored for the smallest
+// rank that's at least k, and we take the max over all the terms.
+// The bound is lowered by a tiny fraction, since the BM25 computation at index time can round differently from the one at query time.
+// Returns 0 (no pruning) when the index doesn't store these scores, when the lists are too short, or when k is larger than the largest rank stored.
+float QueryProcessor::KthScoreThreshold(LexiconData** query_term_data, int num_query_terms, int k) const {
+  const float kRoundingSlack = 1e-4f;
+
+  int kth_score_num = 0;
+  while (kth_score_num < NUM_KTH_SCORES && kKthScoreRanks[kth_score_num] < k) {
+    ++kth_score_num;
+  }
+  if (kth_score_num == NUM_KTH_SCORES) {
+    return 0;
+  }
+
+  float kth_score = 0;
+  for (int i = 0; i < num_query_terms; ++i) {
+    kth_score = max(kth_score, query_term_data[i]->kth_score(kth_score_num));
+  }
+  return kth_score * (1 - kRoundingSlack);
+}
+
 // The two tiered WAND first merges (OR mode) and scores the top docs lists, so that we know the k-th threshold (a better approximation of the lower bound).
 // TODO: It seems to me that a two tiered WAND doesn't save us any computation. We'll be evaluating the top docs lists and then we'll be able to skip some docIDs from the 2nd layers.
 //       NOTE: It WOULD save computation if the number of crappy, low scoring docIDs we'll be able to skip (due to an initially high threshold)
 //             exceeds the extra number of top docs docIDs we had to compute scores for.
 //       It would be really beneficial if you could decrease the upperbounds on the term lists for the 2nd layers
 //       (which you can't unless you don't discard the top docs and store them in accumulators).
-// In standard WAND, the k-th threshold is initialized to 0.
+// In standard WAND, the k-th threshold is initialized to 0; we initialize it from the kth highest partial scores in the lexicon, when available.
 int QueryProcessor::MergeListsWand(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results, bool two_tiered) {
   // Constraints on the type of index we expect.
   assert(index_layered_);
@@ -1801,7 +2457,8 @@ int QueryProcessor::MergeListsWand(LexiconData** query_term_data, int num_query_
      * TODO: What are some ways of decreasing the upperbound on the 2nd layers...?
      */
 
-    float threshold = 0;
+    // The kth highest partial scores stored in the lexicon let pruning kick in right away, instead of only after k documents have been scored.
+    float threshold = KthScoreThreshold(query_term_data, num_query_terms, kMaxNumResults);
     if (two_tiered) {
       // It's possible that after processing the top docs, there is an unresolved docID (only present in some of the top docs lists, but not in others)
       // that could have a score higher than the top-k threshold we derive here.
@@ -1813,8 +2470,10 @@ int QueryProcessor::MergeListsWand(LexiconData** query_term_data, int num_query_
 
       // The k-th score in the heap we get from the union of the top docs layers is our starting threshold.
       // It is a lower bound for the score necessary for a new docID to make it into our top-k.
-      // The threshold is 0 if we didn't get k results from the top docs layers, meaning any docID can make it into the top-k.
-      threshold = (top_docs_num_results >= kMaxNumResults) ? results[kMaxNumResults - 1].first : 0;
+      // If we didn't get k results from the top docs layers, we keep the threshold we started with.
+      if (top_docs_num_results >= kMaxNumResults) {
+        threshold = max(threshold, results[kMaxNumResults - 1].first);
+      }
 #ifdef IRTK_DEBUG
       cout << "Threshold from top docs lists: " << threshold << endl;
 #endif
@@ -1843,161 +2502,221 @@ int QueryProcessor::MergeListsWand(LexiconData** query_term_data, int num_query_
 #endif
     }
 
-    const bool kMWand = true;
+    if (UseIntraQueryParallelism(list_data_pointers, num_query_terms)) {
+      total_num_results = MergeListsRanges(false, query_term_data, list_data_pointers, num_query_terms, list_thresholds, threshold, results, kMaxNumResults);
+    } else {
+      total_num_results = MergeListsWandRange(list_data_pointers, num_query_terms, list_thresholds, 0, ListData::kNoMoreDocs, threshold, NULL, results,
+                                              kMaxNumResults);
+    }
+  }
+
+  // Sort top-k results in descending order by document score.
+  sort(results, results + min(kMaxNumResults, total_num_results), ResultCompare());
+
+  *num_results = min(total_num_results, kMaxNumResults);
+  for (int i = 0; i < num_query_terms; ++i) {
+    index_reader_.CloseList(list_data_pointers[i]);
+  }
+  return total_num_results;
+}
+
+// Block-Max WAND. Pivot selection is the same as in WAND, using the term upperbounds on the whole lists. Before evaluating the pivot docID, we do a shallow
+// move of all the lists up to the pivot onto the chunks that could contain the pivot docID. This only requires the chunk last docIDs from the block headers,
+// and the chunk max scores from the external index; the chunks themselves are not decoded. If the sum of the chunk upperbounds can't reach the threshold,
+// no docID up to the end of the shortest of these chunks can make it into the top-k either, so we skip past it. Otherwise, we continue as in WAND.
+// This is rank safe, since the chunk max scores are upperbounds on the scores of all the postings within the chunks.
+//
+// We only need the last layer of each list (which contains all the postings for an overlapping layered index), but the term upperbounds come from the
+// first layers.
+int QueryProcessor::MergeListsBlockMaxWand(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results) {
+  // Constraints on the type of index we expect.
+  assert(index_layered_);
+  assert(index_overlapping_layers_);
+  assert(external_index_reader_ != NULL);
+
+  const int kMaxNumResults = *num_results;
 
-    // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
-    const float kBm25K1 =  2.0;  // k1
-    const float kBm25B = 0.75;  // b
+  // Holds a pointer to the list for each corresponding query term.
+  ListData* list_data_pointers[num_query_terms];  // Using a variable length array here.
 
-    // We can precompute a few of the BM25 values here.
-    const float kBm25NumeratorMul = kBm25K1 + 1;
-    const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
-    const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+  // For WAND to work correctly, need term upperbounds on the whole list.
+  float list_thresholds[num_query_terms];  // Using a variable length array here.
 
-    // BM25 components.
-    float bm25_sum;  // The BM25 sum for the current document we're processing in the intersection.
-    int doc_len;
-    uint32_t f_d_t;
+  bool single_term_query = false;
+  if (num_query_terms == 1) {
+    single_term_query = true;
+  }
 
-    // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for each list.
-    float idf_t[num_query_terms];  // Using a variable length array here.
-    int num_docs_t;
-    for (int i = 0; i < num_query_terms; ++i) {
-      num_docs_t = list_data_pointers[i]->num_docs_complete_list();
-      idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  for (int i = 0; i < num_query_terms; ++i) {
+    list_data_pointers[i] = index_reader_.OpenList(*query_term_data[i], query_term_data[i]->num_layers() - 1, single_term_query);
+    list_thresholds[i] = query_term_data[i]->layer_score_threshold(0);
+  }
+
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;  // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  // BM25 components.
+  float bm25_sum;  // The BM25 sum for the current document we're processing in the intersection.
+  int doc_len;
+  uint32_t f_d_t;
+
+  // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for each list.
+  float idf_t[num_query_terms];  // Using a variable length array here.
+  int num_docs_t;
+  for (int i = 0; i < num_query_terms; ++i) {
+    num_docs_t = list_data_pointers[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  }
+
+  // We use this to get the next lowest docID from all the lists.
+  pair<uint32_t, int> lists_curr_postings[num_query_terms]; // Using a variable length array here.
+  int num_lists_remaining = 0; // The number of lists with postings remaining.
+  uint32_t curr_doc_id;
+  for (int i = 0; i < num_query_terms; ++i) {
+    if ((curr_doc_id = list_data_pointers[i]->NextGEQ(0)) < ListData::kNoMoreDocs) {
+      lists_curr_postings[num_lists_remaining++] = make_pair(curr_doc_id, i);
     }
+  }
 
-    // We use this to get the next lowest docID from all the lists.
-    pair<uint32_t, int> lists_curr_postings[num_query_terms]; // Using a variable length array here.
-    int num_lists_remaining = 0; // The number of lists with postings remaining.
-    uint32_t curr_doc_id;
-    for (int i = 0; i < num_query_terms; ++i) {
-      if ((curr_doc_id = list_data_pointers[i]->NextGEQ(0)) < ListData::kNoMoreDocs) {
-        lists_curr_postings[num_lists_remaining++] = make_pair(curr_doc_id, i);
+  int total_num_results = 0;
+  TopKCollector<Result, ResultCompare> top_k(results, kMaxNumResults);
+  float threshold = KthScoreThreshold(query_term_data, num_query_terms, kMaxNumResults);
+
+  int i, j;
+  int pivot_idx;           // The index of the pivot list in 'lists_curr_postings'.
+  uint32_t pivot_doc_id;
+  float pivot_weight;      // The upperbound score on the pivot docID, from the term upperbounds.
+  float block_max_weight;  // The upperbound score on the pivot docID, from the chunk upperbounds.
+  uint32_t chunk_last_doc_id;
+  uint32_t next_doc_id;    // The next docID that could make it into the top-k, in case the pivot docID doesn't.
+  int skip_list_idx;       // The list we advance in case the pivot docID doesn't make it into the top-k.
+
+  while (num_lists_remaining) {
+    // Sort current postings in non-descending order.
+    sort(lists_curr_postings, lists_curr_postings + num_lists_remaining, ListDocIdCompare());
+
+    // Select a pivot.
+    pivot_weight = 0;
+    pivot_idx = -1;
+    for (i = 0; i < num_lists_remaining; ++i) {
+      pivot_weight += list_thresholds[lists_curr_postings[i].second];
+      if (pivot_weight >= threshold) {
+        pivot_idx = i;
+        break;
       }
     }
 
-    int i, j;
-    pair<uint32_t, int> pivot = make_pair(0, -1);  // The pivot can't be a pointer to the 'lists_curr_postings'
-                                                   // since those values will change when we advance list pointers after scoring a docID.
-    float pivot_weight;                            // The upperbound score on the pivot docID.
+    // No newly encountered docID can make it into the top-k.
+    if (pivot_idx == -1) {
+      break;
+    }
 
-    /*
-     * Two implementation choices here:
-     * * Keep track of the number of lists remaining; requires an if statement after each nextGEQ() to check if we reached the max docID sentinel value (implemented here).
-     * * Don't keep track of the number of lists remaining. Don't need if statement after each nextGEQ(), but need to sort all list postings at every turn.
-     */
-    while (num_lists_remaining) {
-      // Sort current postings in non-descending order.
-      // Can also sort all entries less than or equal to the pivot docID and merge with all higher docIDs.
-      // Although probably won't be faster unless we have a significant number of terms in the query.
-      sort(lists_curr_postings, lists_curr_postings + num_lists_remaining, ListDocIdCompare());
-
-      // Select a pivot.
-      pivot_weight = 0;
-      pivot.second = -1;
-      for (i = 0; i < num_lists_remaining; ++i) {
-        pivot_weight += list_thresholds[lists_curr_postings[i].second];
-        if (pivot_weight >= threshold) {
-          pivot = lists_curr_postings[i];
-          break;
-        }
-      }
+    // Any other lists on the pivot docID can contribute to its score as well.
+    pivot_doc_id = lists_curr_postings[pivot_idx].first;
+    while (pivot_idx + 1 < num_lists_remaining && lists_curr_postings[pivot_idx + 1].first == pivot_doc_id) {
+      ++pivot_idx;
+    }
 
-      /*
-      // If using this, change the while condition to true. Don't need to check for sentinel value after NextGEQ(),
-      // but need to sort all the list postings at each step.
-      if(pivot.first == ListData::kNoMoreDocs) {
-        break;
+    // Shallow move all the lists up to the pivot onto the chunks that could contain the pivot docID, and sum up their upperbounds.
+    // The docIDs we skip over this way are less than the pivot docID, so they couldn't make it into the top-k anyway.
+    block_max_weight = 0;
+    next_doc_id = (pivot_idx + 1 < num_lists_remaining) ? lists_curr_postings[pivot_idx + 1].first : ListData::kNoMoreDocs;
+    skip_list_idx = 0;
+    for (i = 0; i <= pivot_idx; ++i) {
+      ListData* list = list_data_pointers[lists_curr_postings[i].second];
+      if ((chunk_last_doc_id = list->ShallowNextGEQ(pivot_doc_id)) == ListData::kNoMoreDocs)
+        continue;
+
+      block_max_weight += list->GetChunkScoreBound();
+      if (chunk_last_doc_id + 1 < next_doc_id) {
+        next_doc_id = chunk_last_doc_id + 1;
       }
-      */
 
-      // If we don't have a pivot (the pivot list is -1), or if the pivot docID is the sentinel value for no more docs,
-      // it means that no newly encountered docID can make it into the top-k and we can quit.
-      if (pivot.second == -1) {
-        break;
+      if (list_thresholds[lists_curr_postings[i].second] > list_thresholds[lists_curr_postings[skip_list_idx].second]) {
+        skip_list_idx = i;
       }
+    }
 
-      if (pivot.first == lists_curr_postings[0].first) {
-        // We have enough weight on the pivot, so score all docIDs equal to the pivot (these can be beyond the pivot as well).
-        // We know we have enough weight when the docID at the pivot list equals the docID at the first list.
-        bm25_sum = 0;
-        for(i = 0; i < num_lists_remaining && pivot.first == lists_curr_postings[i].first; ++i) {
-          // Compute the BM25 score from frequencies.
-          f_d_t = list_data_pointers[lists_curr_postings[i].second]->GetFreq();
+    if (block_max_weight < threshold) {
+      // Neither the pivot docID, nor any docID before the end of the shortest chunk we moved onto can make it into the top-k.
+      // Advance the list with the highest upperbound past these docIDs.
+      ++thread_query_stats_->num_score_bound_skips;
+      if ((lists_curr_postings[skip_list_idx].first = list_data_pointers[lists_curr_postings[skip_list_idx].second]->NextGEQ(next_doc_id))
+          == ListData::kNoMoreDocs) {
+        // Just swap the current posting with the one at the end of the array.
+        // We'll be sorting at the start of the loop, so we don't need to compact and keep the order of the postings.
+        --num_lists_remaining;
+        pair<uint32_t, int> curr = lists_curr_postings[skip_list_idx];
+        lists_curr_postings[skip_list_idx] = lists_curr_postings[num_lists_remaining];
+        lists_curr_postings[num_lists_remaining] = curr;
+      }
+    } else if (pivot_doc_id == lists_curr_postings[0].first) {
+      // We have enough weight on the pivot, so score all docIDs equal to the pivot.
+      bm25_sum = 0;
+      for (i = 0; i < num_lists_remaining && pivot_doc_id == lists_curr_postings[i].first; ++i) {
+        // Compute the BM25 score from frequencies.
+        f_d_t = list_data_pointers[lists_curr_postings[i].second]->GetFreq();
+        if (index_quantized_impacts_) {
+          bm25_sum += f_d_t * impact_score_;
+        } else {
           doc_len = index_reader_.document_map().GetDocumentLength(lists_curr_postings[i].first);
           bm25_sum += idf_t[lists_curr_postings[i].second] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+        }
 
-          ++num_postings_scored_;
+        ++thread_query_stats_->num_postings_scored;
 
-          // Advance list pointer.
-          if ((lists_curr_postings[i].first = list_data_pointers[lists_curr_postings[i].second]->NextGEQ(lists_curr_postings[i].first + 1)) == ListData::kNoMoreDocs) {
-            // Compact the array. Move the current posting to the end.
-            --num_lists_remaining;
-            pair<uint32_t, int> curr = lists_curr_postings[i];
-            for(j = i; j < num_lists_remaining; ++j) {
-              lists_curr_postings[j] = lists_curr_postings[j+1];
-            }
-            lists_curr_postings[num_lists_remaining] = curr;
-            --i;
+        // Advance list pointer.
+        if ((lists_curr_postings[i].first = list_data_pointers[lists_curr_postings[i].second]->NextGEQ(lists_curr_postings[i].first + 1)) == ListData::kNoMoreDocs) {
+          // Compact the array. Move the current posting to the end.
+          --num_lists_remaining;
+          pair<uint32_t, int> curr = lists_curr_postings[i];
+          for (j = i; j < num_lists_remaining; ++j) {
+            lists_curr_postings[j] = lists_curr_postings[j + 1];
           }
+          lists_curr_postings[num_lists_remaining] = curr;
+          --i;
         }
+      }
 
-        // Decide whether docID makes it into the top-k.
-        if (total_num_results < kMaxNumResults) {
-          // We insert a document if we don't have k documents yet.
-          results[total_num_results] = make_pair(bm25_sum, pivot.first);
-          push_heap(results, results + total_num_results + 1, ResultCompare());
-        } else {
-          if (bm25_sum > results->first) {
-            // We insert a document only if it's score is greater than the minimum scoring document in the heap.
-            pop_heap(results, results + kMaxNumResults, ResultCompare());
-            results[kMaxNumResults - 1].first = bm25_sum;
-            results[kMaxNumResults - 1].second = pivot.first;
-            push_heap(results, results + kMaxNumResults, ResultCompare());
-
-            // Update the threshold.
-            threshold = results->first;
-          }
+      // Decide whether docID makes it into the top-k.
+      START_STAGE_TIMER(top_k_time);
+      if (top_k.Insert(make_pair(bm25_sum, pivot_doc_id))) {
+        ++thread_query_stats_->num_heap_insertions;
+
+        // Update the threshold once we have k documents.
+        if (top_k.full() && top_k.threshold() > threshold) {
+          ++thread_query_stats_->num_threshold_changes;
+          threshold = top_k.threshold();
         }
-        ++total_num_results;
-      } else {
-        // We don't have enough weight on the pivot yet. We know this is true when the docID from the first list != docID at the pivot.
-        // There are two simple strategies that we can employ:
-        // * Advance any one list before the pivot (just choose the first list). This is the original WAND algorithm.
-        // * Advance all lists before the pivot (saves a few sorting operations at the cost of less list skipping). This is the mWAND algorithm.
-        //   Main point is that index accesses are cheaper when the index is in main memory, so we try to do less list pointer sorting operations instead.
-        // In both strategies, we advance the list pointer(s) at least to the pivot docID.
-        if (kMWand) {
-          for (i = 0; i < num_lists_remaining; ++i) {
-            // Advance list pointer.
-            if ((lists_curr_postings[i].first = list_data_pointers[lists_curr_postings[i].second]->NextGEQ(pivot.first)) == ListData::kNoMoreDocs) {
-              // Compact the array. Move the current posting to the end.
-              --num_lists_remaining;
-              pair<uint32_t, int> curr = lists_curr_postings[i];
-              for (j = i; j < num_lists_remaining; ++j) {
-                lists_curr_postings[j] = lists_curr_postings[j + 1];
-              }
-              lists_curr_postings[num_lists_remaining] = curr;
-              --i;
-            }
-          }
-        } else {
-          if ((lists_curr_postings[0].first = list_data_pointers[lists_curr_postings[0].second]->NextGEQ(pivot.first)) == ListData::kNoMoreDocs) {
-            // Just swap the current posting with the one at the end of the array.
-            // We'll be sorting at the start of the loop, so we don't need to compact and keep the order of the postings.
-            --num_lists_remaining;
-            pair<uint32_t, int> curr = lists_curr_postings[0];
-            lists_curr_postings[0] = lists_curr_postings[num_lists_remaining];
-            lists_curr_postings[num_lists_remaining] = curr;
+      }
+      STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+      ++total_num_results;
+    } else {
+      // We don't have enough weight on the pivot yet, so advance all the lists before the pivot to the pivot docID (as in mWAND).
+      for (i = 0; i < num_lists_remaining && lists_curr_postings[i].first < pivot_doc_id; ++i) {
+        // Advance list pointer.
+        if ((lists_curr_postings[i].first = list_data_pointers[lists_curr_postings[i].second]->NextGEQ(pivot_doc_id)) == ListData::kNoMoreDocs) {
+          // Compact the array. Move the current posting to the end.
+          --num_lists_remaining;
+          pair<uint32_t, int> curr = lists_curr_postings[i];
+          for (j = i; j < num_lists_remaining; ++j) {
+            lists_curr_postings[j] = lists_curr_postings[j + 1];
           }
+          lists_curr_postings[num_lists_remaining] = curr;
+          --i;
         }
       }
     }
   }
 
   // Sort top-k results in descending order by document score.
-  sort(results, results + min(kMaxNumResults, total_num_results), ResultCompare());
+  top_k.Sort();
 
   *num_results = min(total_num_results, kMaxNumResults);
   for (int i = 0; i < num_query_terms; ++i) {
@@ -2073,7 +2792,8 @@ int QueryProcessor::MergeListsMaxScore(LexiconData** query_term_data, int num_qu
      * TODO: What are some ways of decreasing the upperbound on the 2nd layers...?
      */
 
-    float threshold = 0;
+    // The kth highest partial scores stored in the lexicon let pruning kick in right away, instead of only after k documents have been scored.
+    float threshold = KthScoreThreshold(query_term_data, num_query_terms, kMaxNumResults);
     if (two_tiered) {
       // It's possible that after processing the top docs, there is an unresolved docID (only present in some of the top docs lists, but not in others)
       // that could have a score higher than the top-k threshold we derive here.
@@ -2085,8 +2805,10 @@ int QueryProcessor::MergeListsMaxScore(LexiconData** query_term_data, int num_qu
 
       // The k-th score in the heap we get from the union of the top docs layers is our starting threshold.
       // It is a lower bound for the score necessary for a new docID to make it into our top-k.
-      // The threshold is 0 if we didn't get k results from the top docs layers, meaning any docID can make it into the top-k.
-      threshold = (top_docs_num_results >= kMaxNumResults) ? results[kMaxNumResults - 1].first : 0;
+      // If we didn't get k results from the top docs layers, we keep the threshold we started with.
+      if (top_docs_num_results >= kMaxNumResults) {
+        threshold = max(threshold, results[kMaxNumResults - 1].first);
+      }
 #ifdef IRTK_DEBUG
       cout << "Threshold from top docs lists: " << threshold << endl;
 #endif
@@ -2115,278 +2837,211 @@ int QueryProcessor::MergeListsMaxScore(LexiconData** query_term_data, int num_qu
 #endif
     }
 
-    // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
-    const float kBm25K1 =  2.0;  // k1
-    const float kBm25B = 0.75;   // b
-
-    // We can precompute a few of the BM25 values here.
-    const float kBm25NumeratorMul = kBm25K1 + 1;
-    const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
-    const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
-
-    // BM25 components.
-    float bm25_sum;  // The BM25 sum for the current document we're processing in the intersection.
-    int doc_len;
-    uint32_t f_d_t;
-
-    // For use with score skipping.
-    float remaining_upperbound;
-
-    // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for each list.
-    float idf_t[num_query_terms];  // Using a variable length array here.
-    int num_docs_t;
-    for (int i = 0; i < num_query_terms; ++i) {
-      num_docs_t = list_data_pointers[i]->num_docs_complete_list();
-      idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
-    }
-
-    // We use this to get the next lowest docID from all the lists.
-    uint32_t lists_curr_postings[num_query_terms];  // Using a variable length array here.
-    for (int i = 0; i < num_query_terms; ++i) {
-      lists_curr_postings[i] = list_data_pointers[i]->NextGEQ(0);
+    if (UseIntraQueryParallelism(list_data_pointers, num_query_terms)) {
+      total_num_results = MergeListsRanges(true, query_term_data, list_data_pointers, num_query_terms, list_thresholds, threshold, results, kMaxNumResults);
+    } else {
+      total_num_results = MergeListsMaxScoreRange(list_data_pointers, num_query_terms, list_thresholds, 0, ListData::kNoMoreDocs, threshold, NULL, results,
+                                                  kMaxNumResults);
     }
+  }
 
-    pair<float, int> list_upperbounds[num_query_terms];  // Using a variable length array here.
-    int num_lists_remaining = 0;  // The number of lists with postings remaining.
-    for (int i = 0; i < num_query_terms; ++i) {
-      if (lists_curr_postings[i] != ListData::kNoMoreDocs) {
-        list_upperbounds[num_lists_remaining++] = make_pair(list_thresholds[i], i);
-      }
-    }
+  // Sort top-k results in descending order by document score.
+  sort(results, results + min(kMaxNumResults, total_num_results), ResultCompare());
 
-    sort(list_upperbounds, list_upperbounds + num_lists_remaining, greater<pair<float, int> > ());
+  *num_results = min(total_num_results, kMaxNumResults);
+  for (int i = 0; i < num_query_terms; ++i) {
+    index_reader_.CloseList(list_data_pointers[i]);
+  }
+  return total_num_results;
+}
 
-    // Precalculate the upperbounds for all possibilities.
-    for (int i = num_lists_remaining - 2; i >= 0; --i) {
-      list_upperbounds[i].first += list_upperbounds[i + 1].first;
-    }
+// Runs WAND over the docIDs in the range ['range_start', 'range_end') of 'lists'. The lists must not be positioned past 'range_start'.
+// 'threshold' is the initial top-k threshold. When 'shared_threshold' is not NULL, other ranges of the same query are being processed concurrently,
+// so we prune with the highest of our own and the shared threshold, and publish our own whenever it rises.
+// Returns the number of docIDs scored; the top-k of these are left in the 'results' heap, unsorted.
+template<int kFixedNumLists>
+int QueryProcessor::MergeListsWandRangeKernel(ListData** lists, int runtime_num_lists, const float* list_thresholds, uint32_t range_start, uint32_t range_end,
+                                              float threshold, SharedThreshold* shared_threshold, Result* results, int num_results) {
+  // See MergeListsKernel() for the fixed number of lists.
+  const int num_lists = (kFixedNumLists > 0) ? kFixedNumLists : runtime_num_lists;
+
+  const int kMaxNumResults = num_results;
+  int total_num_results = 0;
+  TopKCollector<Result, ResultCompare> top_k(results, kMaxNumResults);
 
-    /*// When a list has no more postings remaining, we can remove it right away, or wait until we iterated through the rest of the lists,
-    // and remove any that have no more postings remaining. Removing them after iterating through all lists required an additional if statement.
-    // What's odd is that when we remove the threshold checks (so that we can no longer early terminate), setting this option to 'false'
-    // performs about 2ms faster (we wouldn't expect it to because of the extra if statement). However, when the threshold checks are in place,
-    // setting this option to 'true' performs slightly faster (1-2ms). As far as I can tell, both do the same thing.
-    const bool kCompactArrayRightAway = false;*/
+  const bool kMWand = true;
 
-    // When 'true', enables the use of embedded list score information to provide further efficiency gains
-    // through better list skipping and less scoring computations.
-    const bool kScoreSkipping = false;
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;  // b
 
-    // Defines the score skipping mode to use.
-    // '0' means use block score upperbounds.
-    // '1' means use chunk score upperbounds.
-#define SCORE_SKIPPING_MODE 1
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
 
-    int i, j;
-    int curr_list_idx;
-    pair<float, int>* top;
-    uint32_t curr_doc_id;  // Current docID we're processing the score for.
-    /*bool compact_upperbounds = false;*/
-
-    while (num_lists_remaining) {
-      // Check if we can early terminate. This might happen only after we have finished traversing at least one list.
-      // This is because our upperbounds don't decrease unless we are totally finished traversing one list.
-      // Must check this since we initialize top to point to the first element in the list upperbounds array by default.
-      if (threshold > list_upperbounds[0].first) {
-        break;
-      }
+  // BM25 components.
+  float bm25_sum;  // The BM25 sum for the current document we're processing in the intersection.
+  int doc_len;
+  uint32_t f_d_t;
 
-      top = &list_upperbounds[0];
-      if (kScoreSkipping && threshold > list_upperbounds[1].first) {
-#ifdef MAX_SCORE_DEBUG
-        cout << "Current threshold: " << threshold << endl;
-        cout << "Remaining upperbound: " << list_upperbounds[1].first << endl;
-#endif
-
-        // Only the first (highest scoring) list can contain a docID that can still make it into the top-k,
-        // so we move the first list to the first docID that has an upperbound that will allow it to make it into the top-k.
-#if SCORE_SKIPPING_MODE == 0
-        if ((lists_curr_postings[0] = list_data_pointers[top->second]->NextGreaterBlockScore(threshold - list_upperbounds[1].first)) == ListData::kNoMoreDocs) {
-#elif SCORE_SKIPPING_MODE == 1
-        if ((lists_curr_postings[0] = list_data_pointers[top->second]->NextGreaterChunkScore(threshold - list_upperbounds[1].first)) == ListData::kNoMoreDocs) {
-#endif
-          // Can early terminate at this point.
-          break;
-        }
-      } else {
-        // Find the lowest docID that can still possibly make it into the top-k (while being able to make it into the top-k).
-        for (i = 1; i < num_lists_remaining; ++i) {
-          curr_list_idx = list_upperbounds[i].second;
-          if (threshold > list_upperbounds[i].first) {
-            break;
-          }
-
-          if (lists_curr_postings[curr_list_idx] < lists_curr_postings[top->second]) {
-            top = &list_upperbounds[i];
-          }
-        }
-      }
-
-      // At this point, 'curr_doc_id' can either not be able to exceed the threshold score, or it can be the max possible docID sentinel value.
-      curr_doc_id = lists_curr_postings[top->second];
-
-      // We score a docID fully here, making any necessary lookups right away into other lists.
-      // Disadvantage with this approach is that you'll be doing a NextGEQ() more than once for some lists on the same docID.
-      bm25_sum = 0;
-      for (i = 0; i < num_lists_remaining; ++i) {
-        curr_list_idx = list_upperbounds[i].second;
-
-        // Check if we can early terminate the scoring of this particular docID.
-        if (threshold > bm25_sum + list_upperbounds[i].first) {
-          break;
-        }
+  // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for each list.
+  KernelListArray<float, kFixedNumLists> idf_t(num_lists);
+  int num_docs_t;
+  for (int i = 0; i < num_lists; ++i) {
+    num_docs_t = lists[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  }
 
-        // Move to the curr docID we're scoring.
-        lists_curr_postings[curr_list_idx] = list_data_pointers[curr_list_idx]->NextGEQ(curr_doc_id);
+  // We use this to get the next lowest docID from all the lists.
+  KernelListArray<pair<uint32_t, int>, kFixedNumLists> lists_curr_postings(num_lists);
+  for (int i = 0; i < num_lists; ++i) {
+    if (range_start != 0) {
+      lists[i]->SkipToBlockContaining(range_start);
+    }
 
-        if (lists_curr_postings[curr_list_idx] == curr_doc_id) {
-          // Use the tighter score bound we have on the current list to see if we can early terminate the scoring of this particular docID.
-          if (kScoreSkipping) {
-            // TODO: To avoid the (i == num_lists_remaining - 1) test, can insert a dummy list with upperbound 0.
-            remaining_upperbound = (i == num_lists_remaining - 1) ? 0 : list_upperbounds[i + 1].first;
-#if SCORE_SKIPPING_MODE == 0
-            if (threshold > bm25_sum + list_data_pointers[curr_list_idx]->GetBlockScoreBound() + remaining_upperbound) {
-#elif SCORE_SKIPPING_MODE == 1
-            if (threshold > bm25_sum + list_data_pointers[curr_list_idx]->GetChunkScoreBound() + remaining_upperbound) {
-#endif
-#ifdef MAX_SCORE_DEBUG
-              cout << "Short circuiting evaluation of docID: " << curr_doc_id << " from list with " << list_data_pointers[curr_list_idx]->num_docs()
-                  << " postings" << endl;
-              cout << "Current BM25 sum: " << bm25_sum << endl;
-              cout << "Current chunk bound for docID " << curr_doc_id << " is: " << list_data_pointers[curr_list_idx]->GetChunkScoreBound() << endl;
-              cout << "Current threshold: " << threshold << endl;
-              cout << "Remaining upperbound: " << remaining_upperbound << endl;
-#endif
+    lists_curr_postings[i] = make_pair(lists[i]->NextGEQ(range_start), i);
+  }
 
-              // Can now move the list pointer further.
-              lists_curr_postings[curr_list_idx] = list_data_pointers[curr_list_idx]->NextGEQ(lists_curr_postings[curr_list_idx] + 1);
-              if (lists_curr_postings[curr_list_idx] == ListData::kNoMoreDocs) {
-                /*if (kCompactArrayRightAway) {*/
-                  --num_lists_remaining;
-                  float curr_list_upperbound = list_thresholds[curr_list_idx];
-
-                  // Compact the list upperbounds array.
-                  for (j = i; j < num_lists_remaining; ++j) {
-                    list_upperbounds[j] = list_upperbounds[j + 1];
-                  }
-
-                  // Recalculate the list upperbounds. Note that we only need to recalculate those entries less than i.
-                  for (j = 0; j < i; ++j) {
-                    list_upperbounds[j].first -= curr_list_upperbound;
-                  }
-                  --i;
-                /*} else {
-                  compact_upperbounds = true;
-                }*/
-              }
+  int i, j;
+  pair<uint32_t, int> pivot = make_pair(0, -1);  // The pivot can't be a pointer to the 'lists_curr_postings'
+                                                 // since those values will change when we advance list pointers after scoring a docID.
+  float pivot_weight;                            // The upperbound score on the pivot docID.
+  pair<uint32_t, int> curr_posting;
+
+  /*
+   * Two implementation choices here:
+   * * Keep track of the number of lists remaining; requires an if statement after each nextGEQ() to check if we reached the max docID sentinel value.
+   * * Don't keep track of the number of lists remaining. Don't need if statement after each nextGEQ(), but need to sort all list postings at every turn
+   *   (implemented here). The lists that ran out of postings sort to the end, at the max docID sentinel value, and all the loops run over exactly
+   *   'num_lists' lists, which the compiler can fully unroll in the kernels specialized for a fixed number of lists.
+   */
+  while (true) {
+    // Prune with the highest threshold found by any of the ranges of this query.
+    if (shared_threshold != NULL && shared_threshold->threshold() > threshold) {
+      threshold = shared_threshold->threshold();
+      ++thread_query_stats_->num_threshold_changes;
+    }
 
-              break;
-            }
-          }
+    // Sort current postings in non-descending order. Only the postings of the lists we moved forward are out of place, so an insertion sort does little
+    // work. It's also stable, so the lists positioned at the same docID are always scored in the same order.
+    for (i = 1; i < num_lists; ++i) {
+      curr_posting = lists_curr_postings[i];
+      for (j = i; j > 0 && curr_posting.first < lists_curr_postings[j - 1].first; --j) {
+        lists_curr_postings[j] = lists_curr_postings[j - 1];
+      }
+      lists_curr_postings[j] = curr_posting;
+    }
 
-          // Compute BM25 score from frequencies.
-          f_d_t = list_data_pointers[curr_list_idx]->GetFreq();
-          doc_len = index_reader_.document_map().GetDocumentLength(lists_curr_postings[curr_list_idx]);
-          bm25_sum += idf_t[curr_list_idx] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+    // Select a pivot.
+    pivot_weight = 0;
+    pivot.second = -1;
+    for (i = 0; i < num_lists; ++i) {
+      pivot_weight += list_thresholds[lists_curr_postings[i].second];
+      if (pivot_weight >= threshold) {
+        pivot = lists_curr_postings[i];
+        break;
+      }
+    }
 
-          ++num_postings_scored_;
+    // If we don't have a pivot (the pivot list is -1), or if the pivot docID is the sentinel value for no more docs,
+    // it means that no newly encountered docID can make it into the top-k and we can quit.
+    // The same goes for a pivot beyond the end of our range.
+    if (pivot.second == -1 || pivot.first == ListData::kNoMoreDocs || pivot.first >= range_end) {
+      break;
+    }
 
-          // Can now move the list pointer further.
-          lists_curr_postings[curr_list_idx] = list_data_pointers[curr_list_idx]->NextGEQ(lists_curr_postings[curr_list_idx] + 1);
+    if (pivot.first == lists_curr_postings[0].first) {
+      // We have enough weight on the pivot, so score all docIDs equal to the pivot (these can be beyond the pivot as well).
+      // We know we have enough weight when the docID at the pivot list equals the docID at the first list.
+      bm25_sum = 0;
+      for (i = 0; i < num_lists && pivot.first == lists_curr_postings[i].first; ++i) {
+        // Compute the BM25 score from frequencies.
+        f_d_t = lists[lists_curr_postings[i].second]->GetFreq();
+        if (index_quantized_impacts_) {
+          bm25_sum += f_d_t * impact_score_;
+        } else {
+          doc_len = index_reader_.document_map().GetDocumentLength(lists_curr_postings[i].first);
+          bm25_sum += idf_t[lists_curr_postings[i].second] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
         }
 
-        if (lists_curr_postings[curr_list_idx] == ListData::kNoMoreDocs) {
-          /*if (kCompactArrayRightAway) {*/
-            --num_lists_remaining;
-            float curr_list_upperbound = list_thresholds[curr_list_idx];
-
-            // Compact the list upperbounds array.
-            for (j = i; j < num_lists_remaining; ++j) {
-              list_upperbounds[j] = list_upperbounds[j + 1];
-            }
-
-            // Recalculate the list upperbounds. Note that we only need to recalculate those entries less than i.
-            for (j = 0; j < i; ++j) {
-              list_upperbounds[j].first -= curr_list_upperbound;
-            }
-            --i;
-          /*} else {
-            compact_upperbounds = true;
-          }*/
-        }
-      }
+        ++thread_query_stats_->num_postings_scored;
 
-      // Need to keep track of the top-k documents.
-      if (total_num_results < kMaxNumResults) {
-        // We insert a document if we don't have k documents yet.
-        results[total_num_results] = make_pair(bm25_sum, curr_doc_id);
-        push_heap(results, results + total_num_results + 1, ResultCompare());
-      } else {
-        if (bm25_sum > results->first) {
-          // We insert a document only if it's score is greater than the minimum scoring document in the heap.
-          pop_heap(results, results + kMaxNumResults, ResultCompare());
-          results[kMaxNumResults - 1].first = bm25_sum;
-          results[kMaxNumResults - 1].second = curr_doc_id;
-          push_heap(results, results + kMaxNumResults, ResultCompare());
-
-          // Update the threshold.
-          threshold = results->first;
-        }
+        // Advance list pointer.
+        lists_curr_postings[i].first = lists[lists_curr_postings[i].second]->NextGEQ(lists_curr_postings[i].first + 1);
       }
-      ++total_num_results;
 
-      /*if (!kCompactArrayRightAway) {
-        if (compact_upperbounds) {
-          int num_lists = num_lists_remaining;
-          num_lists_remaining = 0;
-          for (i = 0; i < num_lists; ++i) {
-            curr_list_idx = list_upperbounds[i].second;
-            if (lists_curr_postings[curr_list_idx] != ListData::kNoMoreDocs) {
-              list_upperbounds[num_lists_remaining++] = make_pair(list_thresholds[curr_list_idx], curr_list_idx);
-            }
-          }
+      // Decide whether docID makes it into the top-k.
+      START_STAGE_TIMER(top_k_time);
+      if (top_k.Insert(make_pair(bm25_sum, pivot.first))) {
+        ++thread_query_stats_->num_heap_insertions;
 
-          sort(list_upperbounds, list_upperbounds + num_lists_remaining, greater<pair<float, int> > ());
+        // Update the threshold once we have k documents.
+        if (top_k.full() && top_k.threshold() > threshold) {
+          ++thread_query_stats_->num_threshold_changes;
+          threshold = top_k.threshold();
 
-          // Precalculate the upperbounds for all possibilities.
-          for (i = num_lists_remaining - 2; i >= 0; --i) {
-            list_upperbounds[i].first += list_upperbounds[i + 1].first;
+          // The other ranges can prune with our k-th score.
+          if (shared_threshold != NULL) {
+            shared_threshold->Raise(threshold);
           }
-
-          compact_upperbounds = false;
         }
-      }*/
+      }
+      STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+      ++total_num_results;
+    } else {
+      // We don't have enough weight on the pivot yet. We know this is true when the docID from the first list != docID at the pivot.
+      // There are two simple strategies that we can employ:
+      // * Advance any one list before the pivot (just choose the first list). This is the original WAND algorithm.
+      // * Advance all lists before the pivot (saves a few sorting operations at the cost of less list skipping). This is the mWAND algorithm.
+      //   Main point is that index accesses are cheaper when the index is in main memory, so we try to do less list pointer sorting operations instead.
+      // In both strategies, we advance the list pointer(s) at least to the pivot docID.
+      if (kMWand) {
+        // The lists that ran out of postings are at the end.
+        for (i = 0; i < num_lists && lists_curr_postings[i].first != ListData::kNoMoreDocs; ++i) {
+          // Advance list pointer.
+          lists_curr_postings[i].first = lists[lists_curr_postings[i].second]->NextGEQ(pivot.first);
+        }
+      } else {
+        lists_curr_postings[0].first = lists[lists_curr_postings[0].second]->NextGEQ(pivot.first);
+      }
     }
   }
 
-  // Sort top-k results in descending order by document score.
-  sort(results, results + min(kMaxNumResults, total_num_results), ResultCompare());
-
-  *num_results = min(total_num_results, kMaxNumResults);
-  for (int i = 0; i < num_query_terms; ++i) {
-    index_reader_.CloseList(list_data_pointers[i]);
-  }
   return total_num_results;
 }
 
-int QueryProcessor::IntersectLists(ListData** lists, int num_lists, Result* results, int num_results) {
-  return IntersectLists(NULL, 0, lists, num_lists, results, num_results);
+// Dispatches to the kernel specialized for the number of lists (see MergeLists()).
+int QueryProcessor::MergeListsWandRange(ListData** lists, int num_lists, const float* list_thresholds, uint32_t range_start, uint32_t range_end,
+                                        float threshold, SharedThreshold* shared_threshold, Result* results, int num_results) {
+  switch (num_lists) {
+    case 1:
+      return MergeListsWandRangeKernel<1>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 2:
+      return MergeListsWandRangeKernel<2>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 3:
+      return MergeListsWandRangeKernel<3>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 4:
+      return MergeListsWandRangeKernel<4>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 5:
+      return MergeListsWandRangeKernel<5>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 6:
+      return MergeListsWandRangeKernel<6>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    default:
+      return MergeListsWandRangeKernel<0>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+  }
 }
 
-// Returns the total number of document results found in the intersection.
-// Note that there is not a guaranteed order of same scoring docIDs.
-int QueryProcessor::IntersectLists(ListData** merge_lists, int num_merge_lists, ListData** lists, int num_lists, Result* results, int num_results) {
-  // We have a choice of whether to use a heap (push() / pop() an array) or just search through an array to replace low scoring results
-  // and finally sorting it before returning the top-k results in sorted order.
-  // For k = 10 results, an array performs only slightly better than a heap. As k increases above 10, heap should be faster.
-  // In the general case, a heap should be used (unless k is less than 10), so this option should be 'false'.
-  const bool kUseArrayInsteadOfHeap = false;
+// Runs MaxScore over the docIDs in the range ['range_start', 'range_end') of 'lists'. See MergeListsWandRange() for the meaning of the arguments.
+template<int kFixedNumLists>
+int QueryProcessor::MergeListsMaxScoreRangeKernel(ListData** lists, int runtime_num_lists, const float* list_thresholds, uint32_t range_start,
+                                                  uint32_t range_end, float threshold, SharedThreshold* shared_threshold, Result* results, int num_results) {
+  // See MergeListsKernel() for the fixed number of lists.
+  const int num_lists = (kFixedNumLists > 0) ? kFixedNumLists : runtime_num_lists;
 
+  const int kMaxNumResults = num_results;
   int total_num_results = 0;
-
-  // For the array instead of heap top-k technique.
-  float curr_min_doc_score;
-  Result* min_scoring_result = NULL;
+  TopKCollector<Result, ResultCompare> top_k(results, kMaxNumResults);
 
   // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
   const float kBm25K1 =  2.0;  // k1
@@ -2402,114 +3057,1382 @@ int QueryProcessor::IntersectLists(ListData** merge_lists, int num_merge_lists,
   int doc_len;
   uint32_t f_d_t;
 
-  uint32_t did = 0;
-  uint32_t d;
-  int i;  // Index for various loops.
+  // For use with score skipping.
+  float remaining_upperbound;
 
   // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for each list.
-  float idf_t[num_lists];  // Using a variable length array here.
+  KernelListArray<float, kFixedNumLists> idf_t(num_lists);
   int num_docs_t;
-  for (i = 0; i < num_lists; ++i) {
+  for (int i = 0; i < num_lists; ++i) {
     num_docs_t = lists[i]->num_docs_complete_list();
     idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
   }
 
-  // Necessary for the merge lists.
-  // TODO: Can also try the heap based method here. Can select between heap and array method based on 'num_merge_lists'.
-  uint32_t min_doc_id;
-
-  while (did < ListData::kNoMoreDocs) {
-    if (merge_lists != NULL) { // For the lists which we are merging.
-      // This will select the lowest docID (ignoring duplicates among the merge lists and any docIDs we have skipped past through AND mode operation).
-      min_doc_id = ListData::kNoMoreDocs;
-      for (i = 0; i < num_merge_lists; ++i) {
-        if ((d = merge_lists[i]->NextGEQ(did)) < min_doc_id) {
-          min_doc_id = d;
-        }
-      }
+  // We use this to get the next lowest docID from all the lists.
+  KernelListArray<uint32_t, kFixedNumLists> lists_curr_postings(num_lists);
+  for (int i = 0; i < num_lists; ++i) {
+    if (range_start != 0) {
+      lists[i]->SkipToBlockContaining(range_start);
+    }
 
-      assert(min_doc_id >= did);
+    lists_curr_postings[i] = lists[i]->NextGEQ(range_start);
+  }
 
-      did = min_doc_id;
-      i = 0;
+  // The lists in order of their upperbounds, along with the sum of the upperbounds of each list and all the lists after it. The lists that run out of
+  // postings stay in place (at the 'kNoMoreDocs' sentinel), and are skipped from then on, so that every loop runs over exactly 'num_lists' lists.
+  // The lists that have no postings to begin with don't add to the upperbounds.
+  KernelListArray<pair<float, int>, kFixedNumLists> list_upperbounds(num_lists);
+  int num_lists_remaining = 0;  // The number of lists with postings remaining.
+  for (int i = 0; i < num_lists; ++i) {
+    if (lists_curr_postings[i] != ListData::kNoMoreDocs) {
+      list_upperbounds[i] = make_pair(list_thresholds[i], i);
+      ++num_lists_remaining;
     } else {
-      // Get next element from shortest list.
-      did = lists[0]->NextGEQ(did);
-      i = 1;
+      list_upperbounds[i] = make_pair(0.0f, i);
     }
+  }
 
-    if (did == ListData::kNoMoreDocs)
-      break;
+  sort(&list_upperbounds[0], &list_upperbounds[0] + num_lists, greater<pair<float, int> > ());
 
-    d = did;
+  // Precalculate the upperbounds for all possibilities.
+  for (int i = num_lists - 2; i >= 0; --i) {
+    list_upperbounds[i].first += list_upperbounds[i + 1].first;
+  }
 
-    // Try to find entries with same docID in other lists.
-    for (; (i < num_lists) && ((d = lists[i]->NextGEQ(did)) == did); ++i) {
-      continue;
+  // When 'true', enables the use of embedded list score information to provide further efficiency gains
+  // through better list skipping and less scoring computations.
+  const bool kScoreSkipping = false;
+
+  // Defines the score skipping mode to use.
+  // '0' means use block score upperbounds.
+  // '1' means use chunk score upperbounds.
+#define SCORE_SKIPPING_MODE 1
+
+  int i, j;
+  int first;  // The position in 'list_upperbounds' of the first list with postings remaining.
+  int curr_list_idx;
+  pair<float, int>* top;
+  uint32_t curr_doc_id;  // Current docID we're processing the score for.
+  float curr_list_upperbound;
+
+  while (num_lists_remaining) {
+    // Prune with the highest threshold found by any of the ranges of this query.
+    if (shared_threshold != NULL && shared_threshold->threshold() > threshold) {
+      threshold = shared_threshold->threshold();
+      ++thread_query_stats_->num_threshold_changes;
     }
 
-    if (d > did) {
-      // Not in intersection.
-      did = d;
+    first = 0;
+    while (lists_curr_postings[list_upperbounds[first].second] == ListData::kNoMoreDocs) {
+      ++first;
+    }
+
+    // Check if we can early terminate. This might happen only after we have finished traversing at least one list.
+    // This is because our upperbounds don't decrease unless we are totally finished traversing one list.
+    if (threshold > list_upperbounds[first].first) {
+      break;
+    }
+
+    top = &list_upperbounds[first];
+    if (kScoreSkipping && first + 1 < num_lists && threshold > list_upperbounds[first + 1].first) {
+#ifdef MAX_SCORE_DEBUG
+      cout << "Current threshold: " << threshold << endl;
+      cout << "Remaining upperbound: " << list_upperbounds[first + 1].first << endl;
+#endif
+
+      // Only the first (highest scoring) list can contain a docID that can still make it into the top-k,
+      // so we move the first list to the first docID that has an upperbound that will allow it to make it into the top-k.
+#if SCORE_SKIPPING_MODE == 0
+      if ((lists_curr_postings[top->second] = lists[top->second]->NextGreaterBlockScore(threshold - list_upperbounds[first + 1].first)) == ListData::kNoMoreDocs) {
+#elif SCORE_SKIPPING_MODE == 1
+      if ((lists_curr_postings[top->second] = lists[top->second]->NextGreaterChunkScore(threshold - list_upperbounds[first + 1].first)) == ListData::kNoMoreDocs) {
+#endif
+        // Can early terminate at this point.
+        break;
+      }
     } else {
-      assert(d == did);
+      // Find the lowest docID that can still possibly make it into the top-k (while being able to make it into the top-k).
+      for (i = first + 1; i < num_lists; ++i) {
+        curr_list_idx = list_upperbounds[i].second;
+        if (lists_curr_postings[curr_list_idx] == ListData::kNoMoreDocs) {
+          continue;
+        }
 
-      // Compute BM25 score from frequencies.
-      bm25_sum = 0;
-      for (i = 0; i < num_lists; ++i) {
-        f_d_t = lists[i]->GetFreq();
-        doc_len = index_reader_.document_map().GetDocumentLength(did);
-        bm25_sum += idf_t[i] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+        if (threshold > list_upperbounds[i].first) {
+          break;
+        }
+
+        if (lists_curr_postings[curr_list_idx] < lists_curr_postings[top->second]) {
+          top = &list_upperbounds[i];
+        }
       }
+    }
 
-      if (kUseArrayInsteadOfHeap) {
-        // Use an array to maintain the top-k documents.
-        if (total_num_results < num_results) {
-          results[total_num_results] = make_pair(bm25_sum, did);
-          if (min_scoring_result == NULL || bm25_sum < min_scoring_result->first)
-            min_scoring_result = results + total_num_results;
-        } else {
-          if (bm25_sum > min_scoring_result->first) {
-            // Replace the min scoring result with the current (higher scoring) result.
-            min_scoring_result->first = bm25_sum;
-            min_scoring_result->second = did;
+    // At this point, 'curr_doc_id' can either not be able to exceed the threshold score, or it can be the max possible docID sentinel value.
+    curr_doc_id = lists_curr_postings[top->second];
 
-            // Find the new min scoring document.
-            curr_min_doc_score = numeric_limits<float>::max();
-            for (i = 0; i < num_results; ++i) {
-              if (results[i].first < curr_min_doc_score) {
-                curr_min_doc_score = results[i].first;
-                min_scoring_result = results + i;
+    // No docID left in our range can make it into the top-k.
+    if (curr_doc_id >= range_end) {
+      break;
+    }
+
+    // We score a docID fully here, making any necessary lookups right away into other lists.
+    // Disadvantage with this approach is that you'll be doing a NextGEQ() more than once for some lists on the same docID.
+    bm25_sum = 0;
+    for (i = first; i < num_lists; ++i) {
+      curr_list_idx = list_upperbounds[i].second;
+      if (lists_curr_postings[curr_list_idx] == ListData::kNoMoreDocs) {
+        continue;
+      }
+
+      // Check if we can early terminate the scoring of this particular docID.
+      if (threshold > bm25_sum + list_upperbounds[i].first) {
+        break;
+      }
+
+      // Move to the curr docID we're scoring.
+      lists_curr_postings[curr_list_idx] = lists[curr_list_idx]->NextGEQ(curr_doc_id);
+
+      if (lists_curr_postings[curr_list_idx] == curr_doc_id) {
+        // Use the tighter score bound we have on the current list to see if we can early terminate the scoring of this particular docID.
+        if (kScoreSkipping) {
+          remaining_upperbound = (i == num_lists - 1) ? 0 : list_upperbounds[i + 1].first;
+#if SCORE_SKIPPING_MODE == 0
+          if (threshold > bm25_sum + lists[curr_list_idx]->GetBlockScoreBound() + remaining_upperbound) {
+#elif SCORE_SKIPPING_MODE == 1
+          if (threshold > bm25_sum + lists[curr_list_idx]->GetChunkScoreBound() + remaining_upperbound) {
+#endif
+#ifdef MAX_SCORE_DEBUG
+            cout << "Short circuiting evaluation of docID: " << curr_doc_id << " from list with " << lists[curr_list_idx]->num_docs()
+                << " postings" << endl;
+            cout << "Current BM25 sum: " << bm25_sum << endl;
+            cout << "Current chunk bound for docID " << curr_doc_id << " is: " << lists[curr_list_idx]->GetChunkScoreBound() << endl;
+            cout << "Current threshold: " << threshold << endl;
+            cout << "Remaining upperbound: " << remaining_upperbound << endl;
+#endif
+            ++thread_query_stats_->num_score_bound_skips;
+
+            // Can now move the list pointer further.
+            lists_curr_postings[curr_list_idx] = lists[curr_list_idx]->NextGEQ(lists_curr_postings[curr_list_idx] + 1);
+            if (lists_curr_postings[curr_list_idx] == ListData::kNoMoreDocs) {
+              // The list stays in place, but no longer adds to the upperbounds.
+              --num_lists_remaining;
+              curr_list_upperbound = list_thresholds[curr_list_idx];
+              for (j = 0; j <= i; ++j) {
+                list_upperbounds[j].first -= curr_list_upperbound;
               }
             }
+
+            break;
           }
         }
-      } else {
-        // Use a heap to maintain the top-k documents. This has to be a min heap,
-        // where the lowest scoring document is on top, so that we can easily pop it,
-        // and push a higher scoring document if need be.
-        if (total_num_results < num_results) {
-          // We insert a document if we don't have k documents yet.
-          results[total_num_results] = make_pair(bm25_sum, did);
-          push_heap(results, results + total_num_results + 1, ResultCompare());
+
+        // Compute BM25 score from frequencies.
+        f_d_t = lists[curr_list_idx]->GetFreq();
+        if (index_quantized_impacts_) {
+          bm25_sum += f_d_t * impact_score_;
         } else {
-          if (bm25_sum > results->first) {
-            // We insert a document only if it's score is greater than the minimum scoring document in the heap.
-            pop_heap(results, results + num_results, ResultCompare());
-            results[num_results - 1].first = bm25_sum;
-            results[num_results - 1].second = did;
-            push_heap(results, results + num_results, ResultCompare());
-          }
+          doc_len = index_reader_.document_map().GetDocumentLength(lists_curr_postings[curr_list_idx]);
+          bm25_sum += idf_t[curr_list_idx] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
         }
+
+        ++thread_query_stats_->num_postings_scored;
+
+        // Can now move the list pointer further.
+        lists_curr_postings[curr_list_idx] = lists[curr_list_idx]->NextGEQ(lists_curr_postings[curr_list_idx] + 1);
       }
 
-      ++total_num_results;
-      ++did;  // Search for next docID.
+      if (lists_curr_postings[curr_list_idx] == ListData::kNoMoreDocs) {
+        // The list stays in place, but no longer adds to the upperbounds. Note that we only need to recalculate the entries up to i.
+        --num_lists_remaining;
+        curr_list_upperbound = list_thresholds[curr_list_idx];
+        for (j = 0; j <= i; ++j) {
+          list_upperbounds[j].first -= curr_list_upperbound;
+        }
+      }
+    }
+
+    // Need to keep track of the top-k documents.
+    START_STAGE_TIMER(top_k_time);
+    if (top_k.Insert(make_pair(bm25_sum, curr_doc_id))) {
+      ++thread_query_stats_->num_heap_insertions;
+
+      // Update the threshold once we have k documents.
+      if (top_k.full() && top_k.threshold() > threshold) {
+        ++thread_query_stats_->num_threshold_changes;
+        threshold = top_k.threshold();
+
+        // The other ranges can prune with our k-th score.
+        if (shared_threshold != NULL) {
+          shared_threshold->Raise(threshold);
+        }
+      }
     }
+    STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+    ++total_num_results;
+  }
+
+  return total_num_results;
+}
+
+// Dispatches to the kernel specialized for the number of lists (see MergeLists()).
+int QueryProcessor::MergeListsMaxScoreRange(ListData** lists, int num_lists, const float* list_thresholds, uint32_t range_start, uint32_t range_end,
+                                            float threshold, SharedThreshold* shared_threshold, Result* results, int num_results) {
+  switch (num_lists) {
+    case 1:
+      return MergeListsMaxScoreRangeKernel<1>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 2:
+      return MergeListsMaxScoreRangeKernel<2>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 3:
+      return MergeListsMaxScoreRangeKernel<3>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 4:
+      return MergeListsMaxScoreRangeKernel<4>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 5:
+      return MergeListsMaxScoreRangeKernel<5>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    case 6:
+      return MergeListsMaxScoreRangeKernel<6>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+    default:
+      return MergeListsMaxScoreRangeKernel<0>(lists, num_lists, list_thresholds, range_start, range_end, threshold, shared_threshold, results, num_results);
+  }
+}
+
+// Decides whether the WAND or MaxScore query on 'lists' should be split into docID ranges processed on separate threads.
+// Only worth it for queries with long lists, where the cost of opening the lists for each range and starting the threads is small in comparison.
+bool QueryProcessor::UseIntraQueryParallelism(ListData** lists, int num_lists) const {
+  if (num_intra_query_threads_ <= 1)
+    return false;
+
+  long int total_num_postings = 0;
+  for (int i = 0; i < num_lists; ++i) {
+    total_num_postings += lists[i]->num_docs();
+  }
+  return total_num_postings >= intra_query_min_postings_;
+}
+
+// Splits the docID space into 'num_intra_query_threads_' equally sized ranges, and runs WAND (or MaxScore, if 'max_score' is true) on each range in its own
+// thread. 'list_data_pointers' are the (already opened and not yet traversed) lists of the query; they are used for the first range, which is processed by
+// the calling thread. The lists for the other ranges are opened on the same layers, and skip ahead to the start of their range through the block level
+// index (which is always built when intra-query parallelism is enabled). All the ranges share the top-k threshold, so a high scoring docID found in one
+// range tightens the pruning in all the others. The per range top-k heaps are merged at the end, and the top-k results overall are placed at the front of
+// 'results'.
+// Returns the total number of docIDs scored in all the ranges.
+int QueryProcessor::MergeListsRanges(bool max_score, LexiconData** query_term_data, ListData** list_data_pointers, int num_query_terms,
+                                     const float* list_thresholds, float threshold, Result* results, int num_results) {
+  const int kNumRanges = num_intra_query_threads_;
+
+  SharedThreshold shared_threshold(threshold);
+
+  vector<Result> range_results(kNumRanges * num_results);
+  ListData* range_lists[kNumRanges][num_query_terms];  // Using a variable length array here.
+  vector<RangeQueryThreadArgs> range_thread_args(kNumRanges);
+  vector<pthread_t> range_threads(kNumRanges);
+
+  for (int i = 0; i < kNumRanges; ++i) {
+    for (int j = 0; j < num_query_terms; ++j) {
+      // The lists for the other ranges can't be opened as single term query lists, since those don't do any block skipping.
+      range_lists[i][j] = (i == 0) ? list_data_pointers[j] : index_reader_.OpenList(*query_term_data[j], list_data_pointers[j]->layer_num(), false);
+    }
+
+    RangeQueryThreadArgs& args = range_thread_args[i];
+    args.query_processor = this;
+    args.max_score = max_score;
+    args.lists = range_lists[i];
+    args.num_lists = num_query_terms;
+    args.list_thresholds = list_thresholds;
+    args.range_start = static_cast<uint64_t> (collection_total_num_docs_) * i / kNumRanges;
+    // The last range is open ended, in case there are any docIDs beyond the number of documents in the collection.
+    args.range_end = (i == kNumRanges - 1) ? ListData::kNoMoreDocs : static_cast<uint64_t> (collection_total_num_docs_) * (i + 1) / kNumRanges;
+    args.threshold = threshold;
+    args.shared_threshold = &shared_threshold;
+    args.results = &range_results[i * num_results];
+    args.num_results = num_results;
+    args.total_num_results = 0;
+  }
+
+  for (int i = 1; i < kNumRanges; ++i) {
+    int pthread_ret = pthread_create(&range_threads[i], NULL, RangeQueryThread, &range_thread_args[i]);
+    if (pthread_ret != 0) {
+      GetErrorLogger().LogErrno("pthread_create() in QueryProcessor::MergeListsRanges()", pthread_ret, true);
+    }
+  }
+
+  // The first range is processed by the calling thread, which already has its statistics set up.
+  RunRangeQuery(&range_thread_args[0]);
+
+  for (int i = 1; i < kNumRanges; ++i) {
+    int pthread_ret = pthread_join(range_threads[i], NULL);
+    if (pthread_ret != 0) {
+      GetErrorLogger().LogErrno("pthread_join() in QueryProcessor::MergeListsRanges()", pthread_ret, true);
+    }
+  }
+
+  // Merge the top-k heaps of all the ranges. The lists of the first range are closed by the caller.
+  int total_num_results = 0;
+  int num_range_results = 0;
+  for (int i = 0; i < kNumRanges; ++i) {
+    const RangeQueryThreadArgs& args = range_thread_args[i];
+    total_num_results += args.total_num_results;
+
+    int range_num_results = min(args.total_num_results, num_results);
+    copy(args.results, args.results + range_num_results, range_results.begin() + num_range_results);
+    num_range_results += range_num_results;
+
+    if (i != 0) {
+      thread_query_stats_->Add(args.query_stats);
+
+      for (int j = 0; j < num_query_terms; ++j) {
+        index_reader_.CloseList(args.lists[j]);
+      }
+    }
+  }
+
+  // Each range has its own top-k; the top-k of the query is the best of these.
+  TopKCollector<Result, ResultCompare> top_k(results, num_results);
+  top_k.InsertBatch(range_results.begin(), range_results.begin() + num_range_results);
+  top_k.Sort();
+
+  return total_num_results;
+}
+
+void* QueryProcessor::RangeQueryThread(void* args) {
+  RangeQueryThreadArgs* range_thread_args = static_cast<RangeQueryThreadArgs*> (args);
+  QueryProcessor* query_processor = range_thread_args->query_processor;
+
+  // Any statistics gathered while processing this range go to the range's own copy, to be combined by the thread that issued the query.
+  thread_query_stats_ = &range_thread_args->query_stats;
+
+  query_processor->RunRangeQuery(range_thread_args);
+
+  return NULL;
+}
+
+// Processes the docID range described by 'args' with the query algorithm it specifies.
+void QueryProcessor::RunRangeQuery(RangeQueryThreadArgs* args) {
+  if (args->max_score) {
+    args->total_num_results = MergeListsMaxScoreRange(args->lists, args->num_lists, args->list_thresholds, args->range_start, args->range_end,
+                                                      args->threshold, args->shared_threshold, args->results, args->num_results);
+  } else {
+    args->total_num_results = MergeListsWandRange(args->lists, args->num_lists, args->list_thresholds, args->range_start, args->range_end, args->threshold,
+                                                  args->shared_threshold, args->results, args->num_results);
+  }
+}
+
+// Score-at-a-time processing on an impact ordered index. Each list is made up of segments (stored as layers) of postings with similar impacts. We process the
+// segments of all the lists in order of decreasing impact, adding the impacts of each posting into a dense array of accumulators indexed by docID.
+// The highest impact postings contribute the most to the final scores, so if we stop before all the segments are processed, the top-k selected from the
+// accumulators will be a good approximation of the exact results. This allows us to bound the amount of work done for each query: processing stops as soon
+// as the postings budget or the time budget is used up. With no budgets, all postings are processed and the results are exact (up to the quantization).
+int QueryProcessor::ProcessSaatAnytimeQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results) {
+  // Constraints on the type of index we expect.
+  assert(index_impact_ordered_);
+
+  const int kMaxLayers = MAX_LIST_LAYERS;  // Assume our lists can contain this many layers.
+  const int kMaxNumResults = *num_results;
+  const int kTimeCheckInterval = 1024;  // Checking the time is relatively expensive, so only do it once every this many postings.
+
+  ListData* list_data_pointers[num_query_terms][kMaxLayers];  // Using a variable length array here.
+  bool single_term_query;
+  int single_layer_list_idx;
+  int total_num_layers;
+  OpenListLayers(query_term_data, num_query_terms, kMaxLayers, list_data_pointers, &single_term_query, &single_layer_list_idx, &total_num_layers);
+
+  // The layer threshold is the score of the highest impact in the segment, so sorting by it gives us the order in which to process the segments.
+  ListData* impact_sorted_segments[total_num_layers];  // Using a variable length array here.
+  int curr_segment = 0;
+  for (int i = 0; i < num_query_terms; ++i) {
+    for (int j = 0; j < query_term_data[i]->num_layers(); ++j) {
+      impact_sorted_segments[curr_segment++] = list_data_pointers[i][j];
+    }
+  }
+  assert(curr_segment == total_num_layers);
+  sort(impact_sorted_segments, impact_sorted_segments + total_num_layers, ListLayerMaxScoreCompare());
+
+  uint32_t* accumulators = AcquireDenseAccumulators();
+  vector<uint32_t> touched_doc_ids;  // The docIDs whose accumulators are non-zero; we only need to look at (and later clear) these.
+
+  Timer budget_time;
+  long int num_postings_processed = 0;
+  bool budget_exhausted = false;
+  for (int i = 0; i < total_num_layers && !budget_exhausted; ++i) {
+    ListData* segment = impact_sorted_segments[i];
+
+    uint32_t doc_id = 0;
+    while ((doc_id = segment->NextGEQ(doc_id)) < ListData::kNoMoreDocs) {
+      assert(doc_id < num_dense_accumulators_);
+      if (accumulators[doc_id] == 0)
+        touched_doc_ids.push_back(doc_id);
+      accumulators[doc_id] += segment->GetFreq();  // The frequency holds the impact.
+
+      ++doc_id;
+      ++num_postings_processed;
+
+      if (saat_postings_budget_ != 0 && num_postings_processed >= saat_postings_budget_) {
+        budget_exhausted = true;
+        break;
+      }
+
+      if (saat_time_budget_ != 0 && (num_postings_processed % kTimeCheckInterval) == 0
+          && (budget_time.GetElapsedTime() * 1000) >= saat_time_budget_) {
+        budget_exhausted = true;
+        break;
+      }
+    }
+  }
+
+  thread_query_stats_->num_postings_scored += num_postings_processed;
+  if (budget_exhausted)
+    ++thread_query_stats_->num_early_terminated_queries;
+
+  // Select the top-k documents from the accumulators, converting the impacts back into scores.
+  int total_num_results = touched_doc_ids.size();
+  TopKCollector<Result, ResultCompare> top_k(results, kMaxNumResults);
+  START_STAGE_TIMER(top_k_time);
+  for (int i = 0; i < total_num_results; ++i) {
+    uint32_t curr_doc_id = touched_doc_ids[i];
+    if (top_k.Insert(make_pair(accumulators[curr_doc_id] * impact_score_, curr_doc_id)))
+      ++thread_query_stats_->num_heap_insertions;
+  }
+  STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+
+  ReleaseDenseAccumulators(accumulators, touched_doc_ids);
+
+  // Sort top-k results in descending order by document score.
+  top_k.Sort();
+
+  *num_results = min(total_num_results, kMaxNumResults);
+  CloseListLayers(num_query_terms, kMaxLayers, list_data_pointers);
+  return total_num_results;
+}
+
+const int QueryProcessor::kAccumulatorPageShift;  // Initialized in the class definition.
+
+// Returns a zeroed accumulator array with an entry for every docID in the index. Allocating and zeroing such an array for every query would be too expensive,
+// so the arrays are kept around and reused; there is at most one array per query thread.
+uint32_t* QueryProcessor::AcquireDenseAccumulators() {
+  uint32_t* accumulators = NULL;
+
+  pthread_mutex_lock(&dense_accumulators_mutex_);
+  if (!free_dense_accumulators_.empty()) {
+    accumulators = free_dense_accumulators_.back();
+    free_dense_accumulators_.pop_back();
+  }
+  pthread_mutex_unlock(&dense_accumulators_mutex_);
+
+  if (accumulators == NULL) {
+    accumulators = new uint32_t[num_dense_accumulators_];
+    memset(accumulators, 0, num_dense_accumulators_ * sizeof(*accumulators));
+  }
+  return accumulators;
+}
+
+// Returns the accumulator array to the pool. Only the accumulators that were touched by the query need to be cleared.
+void QueryProcessor::ReleaseDenseAccumulators(uint32_t* accumulators, const vector<uint32_t>& touched_doc_ids) {
+  for (size_t i = 0; i < touched_doc_ids.size(); ++i) {
+    accumulators[touched_doc_ids[i]] = 0;
+  }
+
+  pthread_mutex_lock(&dense_accumulators_mutex_);
+  free_dense_accumulators_.push_back(accumulators);
+  pthread_mutex_unlock(&dense_accumulators_mutex_);
+}
+
+// Returns the accumulator array to the pool, clearing only the pages of accumulators marked in the 'touched_pages' bitmap.
+void QueryProcessor::ReleaseDenseAccumulators(uint32_t* accumulators, const vector<uint64_t>& touched_pages) {
+  const uint32_t kPageSize = 1 << kAccumulatorPageShift;
+  for (size_t i = 0; i < touched_pages.size(); ++i) {
+    uint64_t page_bits = touched_pages[i];
+    while (page_bits != 0) {
+      uint32_t page = (i << 6) + __builtin_ctzll(page_bits);
+      page_bits &= page_bits - 1;
+
+      uint32_t page_start = page << kAccumulatorPageShift;
+      memset(accumulators + page_start, 0, min(kPageSize, num_dense_accumulators_ - page_start) * sizeof(*accumulators));
+    }
+  }
+
+  pthread_mutex_lock(&dense_accumulators_mutex_);
+  free_dense_accumulators_.push_back(accumulators);
+  pthread_mutex_unlock(&dense_accumulators_mutex_);
+}
+
+// Term-at-a-time processing with OR semantics. The lists are traversed one at a time in order of decreasing idf, adding the partial BM25 score of every
+// posting into a dense array of accumulators indexed by docID (reused across queries). The scores are accumulated in fixed point, scaled so that no document
+// score can overflow, which makes the additions exact and lets the accumulators be compared as integers.
+// Lists are scored a chunk at a time: the docIDs and frequencies of the chunk are copied out and the document lengths gathered, so that the scores of the whole
+// chunk are computed in a loop the compiler can vectorize. Every posting marks its page of accumulators in a bitmap; only the marked pages are scanned for the
+// top-k and cleared afterwards. The scan first compares a whole group of accumulators against the current top-k threshold, and only looks at the individual
+// accumulators of a group that has one beating it.
+// There is no skipping, so every posting is scored. This pays off for short queries on long lists, where DAAT OR spends most of its time selecting the next
+// docID to score among the lists.
+int QueryProcessor::ProcessTaatOrQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results) {
+  const int kMaxNumResults = *num_results;
+  const int kScanGroupSize = 16;  // The number of accumulators compared against the top-k threshold at once.
+  const uint32_t kPageSize = 1 << kAccumulatorPageShift;
+
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  // In a layered index with non-overlapping layers, the layers together make up the list. Otherwise, the last layer holds the whole list.
+  // We never skip, so block skipping is turned off by opening the lists as for a single term query.
+  ListData* lists[num_query_terms * MAX_LIST_LAYERS];  // Using a variable length array here.
+  int num_lists = 0;
+  for (int i = 0; i < num_query_terms; ++i) {
+    int first_layer = (index_layered_ && !index_overlapping_layers_) ? 0 : query_term_data[i]->num_layers() - 1;
+    for (int j = first_layer; j < query_term_data[i]->num_layers(); ++j) {
+      lists[num_lists++] = index_reader_.OpenList(*query_term_data[i], j, true);
+    }
+  }
+  sort(lists, lists + num_lists, ListIdfCompare());
+
+  // With quantized impacts, the impacts themselves are the fixed point scores. Otherwise, the scale is chosen so that even a document scoring the BM25
+  // upperbound of (k1 + 1) * idf in every list fits in 31 bits, which leaves the fixed point scores far more precise than the float scores.
+  float idf_t[num_lists];  // Using a variable length array here.
+  float max_score = 0;
+  for (int i = 0; i < num_lists; ++i) {
+    int num_docs_t = lists[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+    max_score += idf_t[i] * kBm25NumeratorMul;
+  }
+  float fixed_point_scale = (1U << 30) / max(max_score, 1.0f);
+  float fixed_point_unit = index_quantized_impacts_ ? impact_score_ : (1 / fixed_point_scale);  // The score a single unit of an accumulator stands for.
+
+  uint32_t* accumulators = AcquireDenseAccumulators();
+  vector<uint64_t> touched_pages(((num_dense_accumulators_ >> kAccumulatorPageShift) >> 6) + 1);  // One bit per page of accumulators.
+
+  uint32_t doc_ids[ChunkDecoder::kChunkSize] __attribute__((aligned(16)));
+  uint32_t frequencies[ChunkDecoder::kChunkSize] __attribute__((aligned(16)));
+  float doc_lens[ChunkDecoder::kChunkSize] __attribute__((aligned(16)));
+  uint32_t scores[ChunkDecoder::kChunkSize] __attribute__((aligned(16)));
+
+  long int num_postings_processed = 0;
+  for (int i = 0; i < num_lists; ++i) {
+    ListData* list = lists[i];
+    float idf_scale = idf_t[i] * kBm25NumeratorMul * fixed_point_scale;
+
+    int num_chunk_docs;
+    uint32_t doc_id = 0;
+    while ((num_chunk_docs = list->NextGEQChunk(doc_id, doc_ids, frequencies)) > 0) {
+      if (index_quantized_impacts_) {
+        // The frequencies hold the impacts.
+        for (int j = 0; j < num_chunk_docs; ++j) {
+          scores[j] = frequencies[j];
+        }
+      } else {
+        for (int j = 0; j < num_chunk_docs; ++j) {
+          doc_lens[j] = index_reader_.document_map().GetDocumentLength(doc_ids[j]);
+        }
+        // Every posting gets at least one unit, so that a non-zero accumulator means the document matched the query.
+        for (int j = 0; j < num_chunk_docs; ++j) {
+          float f_d_t = frequencies[j];
+          int score = static_cast<int> (idf_scale * f_d_t / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_lens[j]) + 0.5f);
+          scores[j] = max(score, 1);
+        }
+      }
+
+      for (int j = 0; j < num_chunk_docs; ++j) {
+        assert(doc_ids[j] < num_dense_accumulators_);
+        accumulators[doc_ids[j]] += scores[j];
+        uint32_t page = doc_ids[j] >> kAccumulatorPageShift;
+        touched_pages[page >> 6] |= 1ULL << (page & 63);
+      }
+
+      num_postings_processed += num_chunk_docs;
+      doc_id = doc_ids[num_chunk_docs - 1] + 1;
+    }
+  }
+
+  thread_query_stats_->num_postings_scored += num_postings_processed;
+
+  // Select the top-k documents from the touched pages of accumulators. The accumulators are non-zero exactly for the documents that matched, and no
+  // accumulator can reach 2^31, so they can be compared as signed integers (which vectorizes better). Until the top-k is full, any matching document is
+  // accepted. Since the pages are scanned in docID order and documents with the same score as the k-th one are not accepted, a document can only be
+  // accepted if its accumulator is greater than that of the k-th document. Each group of accumulators is compared against zero and the threshold with SSE2
+  // compares, and only the accumulators above the threshold are looked at individually.
+  START_STAGE_TIMER(top_k_time);
+  TopKCollector<Result, ResultCompare> top_k(results, kMaxNumResults);
+  int32_t threshold = 0;
+  int total_num_results = 0;
+  for (size_t i = 0; i < touched_pages.size(); ++i) {
+    uint64_t page_bits = touched_pages[i];
+    while (page_bits != 0) {
+      uint32_t page = (i << 6) + __builtin_ctzll(page_bits);
+      page_bits &= page_bits - 1;
+
+      uint32_t page_start = page << kAccumulatorPageShift;
+      uint32_t page_end = min(page_start + kPageSize, num_dense_accumulators_);
+      for (uint32_t group_start = page_start; group_start < page_end; group_start += kScanGroupSize) {
+        const int32_t* group = reinterpret_cast<const int32_t*> (accumulators + group_start);
+        int group_size = min(static_cast<uint32_t> (kScanGroupSize), page_end - group_start);
+
+        // Bit 'j' of the masks is set if the accumulator 'j' of the group is zero, or above the threshold.
+        int zero_mask = 0;
+        int above_threshold_mask = 0;
+#ifdef __SSE2__
+        if (group_size == kScanGroupSize) {
+          const __m128i kZeros = _mm_setzero_si128();
+          __m128i threshold_block = _mm_set1_epi32(threshold);
+          for (int j = 0; j < kScanGroupSize; j += 4) {
+            __m128i accumulator_block = _mm_loadu_si128(reinterpret_cast<const __m128i*> (group + j));
+            zero_mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(accumulator_block, kZeros))) << j;
+            above_threshold_mask |= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(accumulator_block, threshold_block))) << j;
+          }
+        } else
+#endif
+        {
+          for (int j = 0; j < group_size; ++j) {
+            zero_mask |= (group[j] == 0) << j;
+            above_threshold_mask |= (group[j] > threshold) << j;
+          }
+        }
+        total_num_results += group_size - __builtin_popcount(zero_mask);
+
+        while (above_threshold_mask != 0) {
+          int j = __builtin_ctz(above_threshold_mask);
+          above_threshold_mask &= above_threshold_mask - 1;
+          // The threshold might have gone up since the group was compared against it.
+          if (group[j] > threshold) {
+            uint32_t curr_doc_id = group_start + j;
+            if (top_k.Insert(make_pair(group[j] * fixed_point_unit, curr_doc_id))) {
+              ++thread_query_stats_->num_heap_insertions;
+              if (top_k.full())
+                threshold = accumulators[top_k.top().second];
+            }
+          }
+        }
+      }
+    }
+  }
+  STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+
+  ReleaseDenseAccumulators(accumulators, touched_pages);
+
+  // Sort top-k results in descending order by document score.
+  top_k.Sort();
+
+  *num_results = min(total_num_results, kMaxNumResults);
+  for (int i = 0; i < num_lists; ++i) {
+    index_reader_.CloseList(lists[i]);
+  }
+  return total_num_results;
+}
+
+int QueryProcessor::IntersectLists(ListData** lists, int num_lists, Result* results, int num_results) {
+  return IntersectLists(NULL, 0, lists, num_lists, results, num_results);
+}
+
+// Returns the total number of document results found in the intersection.
+// Note that there is not a guaranteed order of same scoring docIDs.
+template<int kFixedNumLists>
+int QueryProcessor::IntersectListsKernel(ListData** merge_lists, int num_merge_lists, ListData** lists, int runtime_num_lists, Result* results,
+                                         int num_results) {
+  // In the kernels specialized for a fixed number of lists, this is a compile time constant, which bounds all the loops over the lists.
+  const int num_lists = (kFixedNumLists > 0) ? kFixedNumLists : runtime_num_lists;
+
+  // We have a choice of whether to use a heap (push() / pop() an array) or just search through an array to replace low scoring results
+  // and finally sorting it before returning the top-k results in sorted order.
+  // For k = 10 results, an array performs only slightly better than a heap. As k increases above 10, heap should be faster.
+  // In the general case, a heap should be used (unless k is less than 10), so this option should be 'false'.
+  const bool kUseArrayInsteadOfHeap = false;
+
+  int total_num_results = 0;
+  TopKCollector<Result, ResultCompare> top_k(results, num_results);
+
+  // For the array instead of heap top-k technique.
+  float curr_min_doc_score;
+  Result* min_scoring_result = NULL;
+
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  // BM25 components.
+  float bm25_sum;  // The BM25 sum for the current document we're processing in the intersection.
+  int doc_len;
+  uint32_t f_d_t;
+
+  uint32_t did = 0;
+  uint32_t d;
+  int i;  // Index for various loops.
+
+  // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for each list.
+  KernelListArray<float, kFixedNumLists> idf_t(num_lists);
+  int num_docs_t;
+  for (i = 0; i < num_lists; ++i) {
+    num_docs_t = lists[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  }
+
+  // Necessary for the merge lists.
+  // TODO: Can also try the heap based method here. Can select between heap and array method based on 'num_merge_lists'.
+  uint32_t min_doc_id;
+
+  while (did < ListData::kNoMoreDocs) {
+    if (merge_lists != NULL) { // For the lists which we are merging.
+      // This will select the lowest docID (ignoring duplicates among the merge lists and any docIDs we have skipped past through AND mode operation).
+      min_doc_id = ListData::kNoMoreDocs;
+      for (i = 0; i < num_merge_lists; ++i) {
+        if ((d = merge_lists[i]->NextGEQ(did)) < min_doc_id) {
+          min_doc_id = d;
+        }
+      }
+
+      assert(min_doc_id >= did);
+
+      did = min_doc_id;
+      i = 0;
+    } else {
+      // Get next element from shortest list.
+      did = lists[0]->NextGEQ(did);
+      i = 1;
+    }
+
+    if (did == ListData::kNoMoreDocs)
+      break;
+
+    d = did;
+
+    // Try to find entries with same docID in other lists.
+    for (; (i < num_lists) && ((d = lists[i]->NextGEQ(did)) == did); ++i) {
+      continue;
+    }
+
+    if (d > did) {
+      // Not in intersection.
+      did = d;
+    } else {
+      assert(d == did);
+
+      // Compute BM25 score from frequencies.
+      bm25_sum = 0;
+      for (i = 0; i < num_lists; ++i) {
+        f_d_t = lists[i]->GetFreq();
+        if (index_quantized_impacts_) {
+          bm25_sum += f_d_t * impact_score_;
+        } else {
+          doc_len = index_reader_.document_map().GetDocumentLength(did);
+          bm25_sum += idf_t[i] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+        }
+      }
+      thread_query_stats_->num_postings_scored += num_lists;
+
+      if (kUseArrayInsteadOfHeap) {
+        // Use an array to maintain the top-k documents.
+        START_STAGE_TIMER(top_k_time);
+        if (total_num_results < num_results) {
+          ++thread_query_stats_->num_heap_insertions;
+          results[total_num_results] = make_pair(bm25_sum, did);
+          if (min_scoring_result == NULL || bm25_sum < min_scoring_result->first)
+            min_scoring_result = results + total_num_results;
+        } else {
+          if (bm25_sum > min_scoring_result->first) {
+            // Replace the min scoring result with the current (higher scoring) result.
+            ++thread_query_stats_->num_heap_insertions;
+            min_scoring_result->first = bm25_sum;
+            min_scoring_result->second = did;
+
+            // Find the new min scoring document.
+            curr_min_doc_score = numeric_limits<float>::max();
+            for (i = 0; i < num_results; ++i) {
+              if (results[i].first < curr_min_doc_score) {
+                curr_min_doc_score = results[i].first;
+                min_scoring_result = results + i;
+              }
+            }
+          }
+        }
+        STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+      } else {
+        // Use a heap to maintain the top-k documents. This has to be a min heap,
+        // where the lowest scoring document is on top, so that we can easily pop it,
+        // and push a higher scoring document if need be.
+        START_STAGE_TIMER(top_k_time);
+        if (top_k.Insert(make_pair(bm25_sum, did)))
+          ++thread_query_stats_->num_heap_insertions;
+        STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+      }
+
+      ++total_num_results;
+      ++did;  // Search for next docID.
+    }
+  }
+
+  // Sort top-k results in descending order by document score.
+  top_k.Sort();
+
+  return total_num_results;
+}
+
+// Dispatches to the kernel specialized for the number of lists (see MergeLists()).
+int QueryProcessor::IntersectLists(ListData** merge_lists, int num_merge_lists, ListData** lists, int num_lists, Result* results, int num_results) {
+  switch (num_lists) {
+    case 1:
+      return IntersectListsKernel<1>(merge_lists, num_merge_lists, lists, num_lists, results, num_results);
+    case 2:
+      return IntersectListsKernel<2>(merge_lists, num_merge_lists, lists, num_lists, results, num_results);
+    case 3:
+      return IntersectListsKernel<3>(merge_lists, num_merge_lists, lists, num_lists, results, num_results);
+    case 4:
+      return IntersectListsKernel<4>(merge_lists, num_merge_lists, lists, num_lists, results, num_results);
+    case 5:
+      return IntersectListsKernel<5>(merge_lists, num_merge_lists, lists, num_lists, results, num_results);
+    case 6:
+      return IntersectListsKernel<6>(merge_lists, num_merge_lists, lists, num_lists, results, num_results);
+    default:
+      return IntersectListsKernel<0>(merge_lists, num_merge_lists, lists, num_lists, results, num_results);
+  }
+}
+
+// Finishes a dual layered query whose first layers did not allow it to early terminate, without starting over. 'lists' are the last layers of the query
+// terms (sorted from shortest to longest) and the first 'num_candidate_results' entries of 'results' hold the results of the first layer intersections, which
+// are fully scored. 'remainder_score_upperbounds' holds, for each of 'lists', the highest partial score of a posting that is not in that term's first layer.
+//
+// Any document with a posting in some first layer was already considered by the first layer intersections: either it's one of the candidates, or the
+// intersection that found it produced k higher scoring documents. So here we only look for the documents that are in none of the first layers. We recognize
+// (and skip) a document that is in a first layer by a partial score above the upperbound of that term. The upperbounds also bound the score of the documents
+// we're looking for, so we stop scoring a document as soon as it can't beat the current kth result.
+// Returns the number of candidates plus the number of documents found here. Since documents are skipped without being fully looked up, this is a lower bound
+// on the number of documents in the intersection.
+int QueryProcessor::IntersectRemainingLists(ListData** lists, int num_lists, const float* remainder_score_upperbounds, Result* results,
+                                            int num_candidate_results, int num_results) {
+  // A posting is only taken to be in the first layer when its score is clearly above the upperbound, so that a difference in floating point rounding
+  // between the index build and here can't make us skip a document we're looking for.
+  const float kUpperboundSlack = 1.0001f;
+
+  // The candidates, sorted by docID for the duplicate lookups. The merge of the first layer intersections only removes adjacent duplicate docIDs,
+  // so we remove any others here.
+  Result candidates[max(num_candidate_results, 1)];  // Using a variable length array here.
+  copy(results, results + num_candidate_results, candidates);
+  sort(candidates, candidates + num_candidate_results, ResultDocIdCompare());
+  int num_candidates = 0;
+  for (int i = 0; i < num_candidate_results; ++i) {
+    if (num_candidates == 0 || candidates[num_candidates - 1].second != candidates[i].second)
+      candidates[num_candidates++] = candidates[i];
+  }
+
+  TopKCollector<Result, ResultCompare> top_k(results, num_results);
+  top_k.InsertBatch(candidates, candidates + num_candidates);
+
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  // The inverse document frequency components, the first layer score thresholds, and the sums of the upperbounds of the lists following each list.
+  float idf_t[num_lists];                          // Using a variable length array here.
+  float first_layer_thresholds[num_lists];         // Using a variable length array here.
+  float remaining_score_upperbounds[num_lists + 1];  // Using a variable length array here.
+  remaining_score_upperbounds[num_lists] = 0;
+  for (int i = num_lists - 1; i >= 0; --i) {
+    int num_docs_t = lists[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+    first_layer_thresholds[i] = remainder_score_upperbounds[i] * kUpperboundSlack;
+    remaining_score_upperbounds[i] = remaining_score_upperbounds[i + 1] + first_layer_thresholds[i];
+  }
+
+  int total_num_results = num_candidates;
+  float bm25_sum;
+  float partial_bm25;
+  int doc_len = 0;
+  uint32_t f_d_t;
+  uint32_t did = 0;
+  uint32_t d = 0;
+  int i;
+
+  while (did < ListData::kNoMoreDocs) {
+    // Get next element from shortest list.
+    if ((did = lists[0]->NextGEQ(did)) == ListData::kNoMoreDocs)
+      break;
+
+    // Each list is scored as soon as the document is found in it, so that we don't look the document up in the rest of the (longer) lists once we know
+    // it's in a first layer, or that it can't make it into the top-k.
+    const float threshold = top_k.threshold();
+    if (!index_quantized_impacts_)
+      doc_len = index_reader_.document_map().GetDocumentLength(did);
+    bm25_sum = 0;
+    d = did;
+    for (i = 0; i < num_lists; ++i) {
+      if (i > 0 && (d = lists[i]->NextGEQ(did)) != did)
+        break;  // Not in intersection.
+
+      f_d_t = lists[i]->GetFreq();
+      if (index_quantized_impacts_) {
+        partial_bm25 = f_d_t * impact_score_;
+      } else {
+        partial_bm25 = idf_t[i] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+      }
+      ++thread_query_stats_->num_postings_scored;
+
+      if (partial_bm25 > first_layer_thresholds[i])
+        break;
+      bm25_sum += partial_bm25;
+      if (bm25_sum + remaining_score_upperbounds[i + 1] <= threshold)
+        break;
+    }
+
+    // A document with partial scores right at the upperbounds could still be one of the candidates.
+    Result result = make_pair(bm25_sum, did);
+    if (i == num_lists && !binary_search(candidates, candidates + num_candidates, result, ResultDocIdCompare())) {
+      ++total_num_results;
+
+      START_STAGE_TIMER(top_k_time);
+      if (top_k.Insert(result))
+        ++thread_query_stats_->num_heap_insertions;
+      STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+    }
+
+    // Search for next docID.
+    did = (d > did) ? d : did + 1;
+  }
+
+  // Sort top-k results in descending order by document score.
+  top_k.Sort();
+
+  return total_num_results;
+}
+
+// Intersects the ascending docID arrays 'a' and 'b', starting from the offsets '*a_idx' and '*b_idx', until either of the arrays is used up.
+// The offsets of the common docIDs within 'a' and 'b' are stored into 'a_matches' and 'b_matches', and the offsets are advanced past the processed docIDs.
+// Returns the number of common docIDs found.
+static int IntersectDocIdArrays(const uint32_t* a, int a_len, int* a_idx, const uint32_t* b, int b_len, int* b_idx, int* a_matches, int* b_matches) {
+  int i = *a_idx;
+  int j = *b_idx;
+  int num_matches = 0;
+
+#ifdef __AVX2__
+  // The same as the SSE2 kernel below, but on blocks of 8 docIDs (all 64 pairs, by rotating the block from 'b' one lane at a time). The SSE2 kernel then
+  // handles what's left over.
+  const __m256i kRotateLanes = _mm256_set_epi32(0, 7, 6, 5, 4, 3, 2, 1);
+  while (i + 8 <= a_len && j + 8 <= b_len) {
+    __m256i a_block = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (a + i));
+    __m256i b_block = _mm256_loadu_si256(reinterpret_cast<const __m256i*> (b + j));
+    __m256i cmp = _mm256_cmpeq_epi32(a_block, b_block);
+    for (int rotation = 1; rotation < 8; ++rotation) {
+      b_block = _mm256_permutevar8x32_epi32(b_block, kRotateLanes);
+      cmp = _mm256_or_si256(cmp, _mm256_cmpeq_epi32(a_block, b_block));
+    }
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(cmp));
+
+    while (mask != 0) {
+      int a_offset = i + __builtin_ctz(mask);
+      int b_offset = j;
+      while (b[b_offset] != a[a_offset]) {
+        ++b_offset;
+      }
+      a_matches[num_matches] = a_offset;
+      b_matches[num_matches] = b_offset;
+      ++num_matches;
+      mask &= mask - 1;
+    }
+
+    uint32_t a_block_last = a[i + 7];
+    uint32_t b_block_last = b[j + 7];
+    if (a_block_last <= b_block_last)
+      i += 8;
+    if (b_block_last <= a_block_last)
+      j += 8;
+  }
+#endif
+
+#ifdef __SSE2__
+  // Compares a block of 4 docIDs from 'a' against a block of 4 docIDs from 'b' (all 16 pairs, by rotating the block from 'b'), and then moves past the block
+  // with the smaller last docID (or both blocks, if they end with the same docID). Since matches are comparatively rare, we only search for the offset
+  // of the matching docID within the block from 'b' when the comparison mask tells us there is one.
+  while (i + 4 <= a_len && j + 4 <= b_len) {
+    __m128i a_block = _mm_loadu_si128(reinterpret_cast<const __m128i*> (a + i));
+    __m128i b_block = _mm_loadu_si128(reinterpret_cast<const __m128i*> (b + j));
+    __m128i cmp_0 = _mm_or_si128(_mm_cmpeq_epi32(a_block, b_block), _mm_cmpeq_epi32(a_block, _mm_shuffle_epi32(b_block, _MM_SHUFFLE(0, 3, 2, 1))));
+    __m128i cmp_1 = _mm_or_si128(_mm_cmpeq_epi32(a_block, _mm_shuffle_epi32(b_block, _MM_SHUFFLE(1, 0, 3, 2))),
+                                 _mm_cmpeq_epi32(a_block, _mm_shuffle_epi32(b_block, _MM_SHUFFLE(2, 1, 0, 3))));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(cmp_0, cmp_1)));
+
+    while (mask != 0) {
+      int a_offset = i + __builtin_ctz(mask);
+      int b_offset = j;
+      while (b[b_offset] != a[a_offset]) {
+        ++b_offset;
+      }
+      a_matches[num_matches] = a_offset;
+      b_matches[num_matches] = b_offset;
+      ++num_matches;
+      mask &= mask - 1;
+    }
+
+    uint32_t a_block_last = a[i + 3];
+    uint32_t b_block_last = b[j + 3];
+    if (a_block_last <= b_block_last)
+      i += 4;
+    if (b_block_last <= a_block_last)
+      j += 4;
+  }
+#endif
+
+  // Standard merge for the docIDs that don't fill a whole block.
+  while (i < a_len && j < b_len) {
+    if (a[i] < b[j]) {
+      ++i;
+    } else if (b[j] < a[i]) {
+      ++j;
+    } else {
+      a_matches[num_matches] = i;
+      b_matches[num_matches] = j;
+      ++num_matches;
+      ++i;
+      ++j;
+    }
+  }
+
+  *a_idx = i;
+  *b_idx = j;
+  return num_matches;
+}
+
+// Intersects two lists a whole chunk at a time: the docIDs of a chunk from each list are decoded into arrays, which are intersected with a SIMD kernel.
+// Frequencies are only looked up for the docIDs in the intersection. Works best when the lists are of comparable length; when 'short_list' is much shorter,
+// it's better to skip through 'long_list' with NextGEQ(), as IntersectLists() does, since most of the chunks of 'long_list' don't need to be decoded.
+// Returns the total number of document results found in the intersection.
+int QueryProcessor::IntersectTwoListsChunked(ListData* short_list, ListData* long_list, Result* results, int num_results) {
+  int total_num_results = 0;
+  TopKCollector<Result, ResultCompare> top_k(results, num_results);
+
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  // BM25 components.
+  float bm25_sum;
+  int doc_len;
+  uint32_t f_d_t;
+
+  ListData* lists[2] = { short_list, long_list };
+  float idf_t[2];
+  int num_docs_t;
+  for (int i = 0; i < 2; ++i) {
+    num_docs_t = lists[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  }
+
+  // The decoded docIDs of the current chunk of each list (from the first docID not skipped over, up to the end of the chunk).
+  uint32_t short_doc_ids[ChunkDecoder::kChunkSize] __attribute__((aligned(16)));
+  uint32_t long_doc_ids[ChunkDecoder::kChunkSize] __attribute__((aligned(16)));
+  int short_matches[ChunkDecoder::kChunkSize];
+  int long_matches[ChunkDecoder::kChunkSize];
+
+  int num_short_doc_ids = short_list->NextGEQChunk(0, short_doc_ids);
+  int num_long_doc_ids = (num_short_doc_ids > 0) ? long_list->NextGEQChunk(short_doc_ids[0], long_doc_ids) : 0;
+  int short_idx = 0;
+  int long_idx = 0;
+
+  uint32_t did;
+  uint32_t next_doc_id;
+  while (num_short_doc_ids > 0 && num_long_doc_ids > 0) {
+    int num_matches = IntersectDocIdArrays(short_doc_ids, num_short_doc_ids, &short_idx, long_doc_ids, num_long_doc_ids, &long_idx, short_matches,
+                                           long_matches);
+
+    for (int m = 0; m < num_matches; ++m) {
+      did = short_doc_ids[short_matches[m]];
+      short_list->SkipToChunkDoc(short_matches[m]);
+      long_list->SkipToChunkDoc(long_matches[m]);
+
+      // Compute BM25 score from frequencies.
+      bm25_sum = 0;
+      for (int i = 0; i < 2; ++i) {
+        f_d_t = lists[i]->GetFreq();
+        if (index_quantized_impacts_) {
+          bm25_sum += f_d_t * impact_score_;
+        } else {
+          doc_len = index_reader_.document_map().GetDocumentLength(did);
+          bm25_sum += idf_t[i] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+        }
+      }
+      thread_query_stats_->num_postings_scored += 2;
+
+      // Use a heap to maintain the top-k documents.
+      START_STAGE_TIMER(top_k_time);
+      if (top_k.Insert(make_pair(bm25_sum, did)))
+        ++thread_query_stats_->num_heap_insertions;
+      STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+
+      ++total_num_results;
+    }
+
+    // Move on to the next chunk of whichever list (or both) we've used up. Any docIDs in between that are less than the next docID of the other list can't
+    // be in the intersection, so we skip past them.
+    bool short_used_up = (short_idx == num_short_doc_ids);
+    bool long_used_up = (long_idx == num_long_doc_ids);
+    if (short_used_up) {
+      next_doc_id = short_doc_ids[num_short_doc_ids - 1] + 1;
+      if (!long_used_up)
+        next_doc_id = max(next_doc_id, long_doc_ids[long_idx]);
+      num_short_doc_ids = short_list->NextGEQChunk(next_doc_id, short_doc_ids);
+      short_idx = 0;
+    }
+    if (long_used_up && num_short_doc_ids > 0) {
+      next_doc_id = max(long_doc_ids[num_long_doc_ids - 1] + 1, short_doc_ids[short_idx]);
+      num_long_doc_ids = long_list->NextGEQChunk(next_doc_id, long_doc_ids);
+      long_idx = 0;
+    }
+  }
+
+  // Sort top-k results in descending order by document score.
+  top_k.Sort();
+
+  return total_num_results;
+}
+
+// Answers an AND mode query with the help of the intersection cache. Looks for a cached intersection of a pair of the query terms (first admitting a frequent
+// pair into the cache, if none is cached yet), and intersects it as a virtual list with the lists of the remaining terms.
+// The 'lists' must be in order from shortest list to longest list, and their term numbers must index into 'query_term_data'.
+// Returns false if no cached intersection could be used, in which case the lists are left at their start for a regular intersection.
+bool QueryProcessor::IntersectListsCached(LexiconData** query_term_data, ListData** lists, int num_lists, Result* results, int num_results,
+                                          int* total_num_results) {
+  if (num_lists < 2)
+    return false;
+
+  // Count the appearance of all the term pairs of the query, while looking for one that is cached. If none are cached, we'll admit a pair that has now
+  // appeared in enough queries, preferring the pair with the longest lists, since it'll save the most decoding work.
+  string cached_key;
+  const IntersectionCache::Intersection* cached_intersection = NULL;
+  int cached_first = -1, cached_second = -1;
+  string admitted_key;
+  int admitted_first = -1, admitted_second = -1;
+  for (int i = 0; i < num_lists; ++i) {
+    for (int j = i + 1; j < num_lists; ++j) {
+      string key = IntersectionCache::GetKey(*query_term_data[lists[i]->term_num()], *query_term_data[lists[j]->term_num()]);
+      if (intersection_cache_.RecordPair(key)) {
+        if (admitted_first == -1 || lists[i]->num_docs() + lists[j]->num_docs() > lists[admitted_first]->num_docs() + lists[admitted_second]->num_docs()) {
+          admitted_key = key;
+          admitted_first = i;
+          admitted_second = j;
+        }
+      }
+
+      if (cached_intersection == NULL && (cached_intersection = intersection_cache_.Lookup(key)) != NULL) {
+        cached_key = key;
+        cached_first = i;
+        cached_second = j;
+      }
+    }
+  }
+
+  // The partial scores in the intersections are in the order of the terms in the cache key.
+  if (cached_intersection != NULL
+      && !IntersectionCache::InKeyOrder(*query_term_data[lists[cached_first]->term_num()], *query_term_data[lists[cached_second]->term_num()])) {
+    swap(cached_first, cached_second);
+  }
+  if (admitted_first != -1
+      && !IntersectionCache::InKeyOrder(*query_term_data[lists[admitted_first]->term_num()], *query_term_data[lists[admitted_second]->term_num()])) {
+    swap(admitted_first, admitted_second);
+  }
+
+  if (cached_intersection != NULL) {
+    ++thread_query_stats_->num_intersection_cache_hits;
+  } else {
+    ++thread_query_stats_->num_intersection_cache_misses;
+
+    if (admitted_first == -1)
+      return false;
+
+    IntersectionCache::Intersection intersection;
+    IntersectPair(lists[admitted_first], lists[admitted_second], &intersection);
+
+    int num_evictions;
+    cached_intersection = intersection_cache_.Insert(admitted_key, &intersection, &num_evictions);
+    thread_query_stats_->num_intersection_cache_evictions += num_evictions;
+
+    if (cached_intersection == NULL) {
+      // The intersection is too large to cache, so we'll do a regular intersection after all.
+      lists[admitted_first]->ResetList(false);
+      lists[admitted_second]->ResetList(false);
+      return false;
+    }
+
+    ++thread_query_stats_->num_intersection_cache_admissions;
+    cached_key = admitted_key;
+    cached_first = admitted_first;
+    cached_second = admitted_second;
+  }
+
+  int pair_list_nums[2] = { cached_first, cached_second };
+  *total_num_results = IntersectCachedPair(*cached_intersection, pair_list_nums, lists, num_lists, results, num_results);
+  intersection_cache_.Release(cached_key);
+  return true;
+}
+
+// Computes the complete intersection of two lists, storing each docID in the intersection along with its partial BM25 scores for 'first_list' and
+// 'second_list', in that order.
+void QueryProcessor::IntersectPair(ListData* first_list, ListData* second_list, IntersectionCache::Intersection* intersection) {
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  ListData* lists[2] = { first_list, second_list };
+  // The shorter list drives the intersection.
+  int short_list_num = (second_list->num_docs() < first_list->num_docs()) ? 1 : 0;
+  ListData* short_list = lists[short_list_num];
+  ListData* long_list = lists[1 - short_list_num];
+
+  float idf_t[2];
+  int num_docs_t;
+  for (int i = 0; i < 2; ++i) {
+    num_docs_t = lists[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  }
+
+  IntersectionCache::Posting posting;
+  int doc_len;
+  uint32_t f_d_t;
+  uint32_t did = 0;
+  uint32_t d;
+  while ((did = short_list->NextGEQ(did)) < ListData::kNoMoreDocs) {
+    if ((d = long_list->NextGEQ(did)) != did) {
+      if (d == ListData::kNoMoreDocs)
+        break;
+      // Not in intersection.
+      did = d;
+      continue;
+    }
+
+    posting.doc_id = did;
+    for (int i = 0; i < 2; ++i) {
+      f_d_t = lists[i]->GetFreq();
+      if (index_quantized_impacts_) {
+        posting.scores[i] = f_d_t * impact_score_;
+      } else {
+        doc_len = index_reader_.document_map().GetDocumentLength(did);
+        posting.scores[i] = idf_t[i] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+      }
+    }
+    thread_query_stats_->num_postings_scored += 2;
+
+    intersection->push_back(posting);
+    ++did;  // Search for next docID.
+  }
+}
+
+// Compares an entry of a cached intersection against a docID.
+struct IntersectionDocIdCompare {
+  bool operator()(const IntersectionCache::Posting& l, uint32_t r) const {
+    return l.doc_id < r;
+  }
+};
+
+// Intersects a cached intersection of a pair of the 'lists' (in order from shortest list to longest list) with the rest of the lists.
+// 'pair_list_nums' are the indices of the lists of the pair, in the order of their partial scores in the cached intersection.
+// The docIDs of the cached intersection drive the intersection, as the shortest list would in IntersectLists(). The scores are summed in the order of
+// the 'lists', as in IntersectLists(), so that the results are the same as without the cache.
+// Returns the total number of document results found in the intersection.
+int QueryProcessor::IntersectCachedPair(const IntersectionCache::Intersection& pair_intersection, const int* pair_list_nums, ListData** lists,
+                                        int num_lists, Result* results, int num_results) {
+  int total_num_results = 0;
+  TopKCollector<Result, ResultCompare> top_k(results, num_results);
+
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  float idf_t[num_lists];  // Using a variable length array here.
+  int num_docs_t;
+  for (int i = 0; i < num_lists; ++i) {
+    num_docs_t = lists[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  }
+
+  // For each list, the index of its partial score in the cached intersection, or -1 if it's not one of the pair.
+  int pair_score_nums[num_lists];  // Using a variable length array here.
+  // The rest of the lists, which are still in order from shortest list to longest list.
+  ListData* remaining_lists[num_lists];  // Using a variable length array here.
+  int num_remaining_lists = 0;
+  for (int i = 0; i < num_lists; ++i) {
+    pair_score_nums[i] = (i == pair_list_nums[0]) ? 0 : ((i == pair_list_nums[1]) ? 1 : -1);
+    if (pair_score_nums[i] == -1)
+      remaining_lists[num_remaining_lists++] = lists[i];
+  }
+
+  float bm25_sum;
+  int doc_len;
+  uint32_t f_d_t;
+  uint32_t did;
+  uint32_t d;
+  int i;
+
+  IntersectionCache::Intersection::const_iterator pair_itr = pair_intersection.begin();
+  while (pair_itr != pair_intersection.end()) {
+    did = pair_itr->doc_id;
+
+    // Try to find entries with same docID in other lists.
+    for (i = 0; (i < num_remaining_lists) && ((d = remaining_lists[i]->NextGEQ(did)) == did); ++i) {
+      continue;
+    }
+
+    if (i < num_remaining_lists) {
+      // Not in intersection.
+      if (d == ListData::kNoMoreDocs)
+        break;
+      pair_itr = lower_bound(pair_itr + 1, pair_intersection.end(), d, IntersectionDocIdCompare());
+      continue;
+    }
+
+    // The partial BM25 scores of the pair are already computed.
+    bm25_sum = 0;
+    for (i = 0; i < num_lists; ++i) {
+      if (pair_score_nums[i] != -1) {
+        bm25_sum += pair_itr->scores[pair_score_nums[i]];
+        continue;
+      }
+
+      f_d_t = lists[i]->GetFreq();
+      if (index_quantized_impacts_) {
+        bm25_sum += f_d_t * impact_score_;
+      } else {
+        doc_len = index_reader_.document_map().GetDocumentLength(did);
+        bm25_sum += idf_t[i] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+      }
+    }
+    // Only the lists other than those of the pair were scored here.
+    thread_query_stats_->num_postings_scored += num_remaining_lists;
+
+    // Use a heap to maintain the top-k documents.
+    START_STAGE_TIMER(top_k_time);
+    if (top_k.Insert(make_pair(bm25_sum, did)))
+      ++thread_query_stats_->num_heap_insertions;
+    STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+
+    ++total_num_results;
+    ++pair_itr;
   }
 
   // Sort top-k results in descending order by document score.
-  sort(results, results + min(num_results, total_num_results), ResultCompare());
+  top_k.Sort();
 
   return total_num_results;
 }
@@ -2540,6 +4463,8 @@ int QueryProcessor::IntersectListsTopPositions(ListData** lists, int num_lists,
 
   // The k temporary docID, score, and position pointer tuples, with a score comparator to maintain the top-k results.
   ResultPositionTuple* result_position_tuples = new ResultPositionTuple[kNumTopPositionsToScore];
+  TopKCollector<ResultPositionTuple, ResultPositionTuple> top_candidates(result_position_tuples, kNumTopPositionsToScore);
+  ResultPositionTuple candidate;
 
   int total_num_results = 0;
 
@@ -2557,7 +4482,7 @@ int QueryProcessor::IntersectListsTopPositions(ListData** lists, int num_lists,
   int doc_len_d;   // The length for the current document we're processing in the intersection.
   // Using variable length arrays here.
   uint32_t f_d_t[kNumLists];                 // The document term frequencies, one per list.
-  const uint32_t* positions_d_t[kNumLists];  // The document position pointers, one per list.
+  const uint32_t* positions_d_t;              // The document position pointer, for the list being copied.
   float acc_d_t[kNumLists];                  // The term proximity accumulators, one per list.
   float idf_t[kNumLists];                    // The inverse document frequencies, one per list.
 
@@ -2598,41 +4523,29 @@ int QueryProcessor::IntersectListsTopPositions(ListData** lists, int num_lists,
       doc_len_d = index_reader_.document_map().GetDocumentLength(did);
       for (i = 0; i < kNumLists; ++i) {
         f_d_t[i] = lists[i]->GetFreq();
-        positions_d_t[i] = lists[i]->curr_chunk_decoder().current_positions();
         bm25_sum += idf_t[i] * (f_d_t[i] * kBm25NumeratorMul) / (f_d_t[i] + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len_d);
       }
-
-      // Use a heap to maintain the top-k documents. This has to be a min heap,
-      // where the lowest scoring document is on top, so that we can easily pop it,
-      // and push a higher scoring document if need be.
-      if (total_num_results < kNumTopPositionsToScore) {
-        // We insert a document if we don't have k documents yet.
-        result_position_tuples[total_num_results].doc_id = did;
-        result_position_tuples[total_num_results].doc_len = doc_len_d;
-        result_position_tuples[total_num_results].score = bm25_sum;
-        result_position_tuples[total_num_results].positions = &position_pool[total_num_results * kResultStride];
+      thread_query_stats_->num_postings_scored += kNumLists;
+
+      // Maintain the top candidate documents. The positions are only decoded and copied for the candidates that make it.
+      START_STAGE_TIMER(top_k_time);
+      candidate.doc_id = did;
+      candidate.doc_len = doc_len_d;
+      candidate.score = bm25_sum;
+      if (top_candidates.Accepts(candidate)) {
+        // Until the heap is full, each candidate gets the next free slot in the position pool; afterwards, a candidate takes over the positions of the
+        // candidate it pushes out of the heap.
+        candidate.positions = top_candidates.full() ? top_candidates.top().positions : &position_pool[top_candidates.size() * kResultStride];
         for (i = 0; i < kNumLists; ++i) {
           num_positions = min(f_d_t[i], static_cast<uint32_t>(kMaxPositions));
-          result_position_tuples[total_num_results].positions[i * kResultPositionStride] = num_positions;
-          memcpy(&result_position_tuples[total_num_results].positions[(i * kResultPositionStride) + 1], positions_d_t[i], num_positions * sizeof(*positions_d_t[i]));
-        }
-        push_heap(result_position_tuples, result_position_tuples + total_num_results + 1);
-      } else {
-        if (bm25_sum > result_position_tuples[0].score) {
-          // We insert a document only if it's score is greater than the minimum scoring document in the heap.
-          pop_heap(result_position_tuples, result_position_tuples + kNumTopPositionsToScore);
-          result_position_tuples[kNumTopPositionsToScore - 1].doc_id = did;
-          result_position_tuples[kNumTopPositionsToScore - 1].doc_len = doc_len_d;
-          result_position_tuples[kNumTopPositionsToScore - 1].score = bm25_sum;
-          // Replace the positions.
-          for (i = 0; i < kNumLists; ++i) {
-            num_positions = min(f_d_t[i], static_cast<uint32_t>(kMaxPositions));
-            result_position_tuples[kNumTopPositionsToScore - 1].positions[i * kResultPositionStride] = num_positions;
-            memcpy(&result_position_tuples[kNumTopPositionsToScore - 1].positions[(i * kResultPositionStride) + 1], positions_d_t[i], num_positions * sizeof(*positions_d_t[i]));
-          }
-          push_heap(result_position_tuples, result_position_tuples + num_results);
+          positions_d_t = lists[i]->GetPositions();
+          candidate.positions[i * kResultPositionStride] = num_positions;
+          memcpy(&candidate.positions[(i * kResultPositionStride) + 1], positions_d_t, num_positions * sizeof(*positions_d_t));
         }
+        top_candidates.Insert(candidate);
+        ++thread_query_stats_->num_heap_insertions;
       }
+      STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
 
       ++total_num_results;
       ++did;  // Search for next docID.
@@ -2642,7 +4555,7 @@ int QueryProcessor::IntersectListsTopPositions(ListData** lists, int num_lists,
   // Utilize positions and prepare final result set.
   // Note that positions are stored in gap coded form.
   // We use a formula that rewards proximity of the query terms. It's too slow to run on all possible candidates.
-  const int kNumReturnedResults = min(kNumTopPositionsToScore, total_num_results);
+  const int kNumReturnedResults = top_candidates.size();
 
   for (i = 0; i < kNumLists; ++i) {
     acc_d_t[i] = 0;
@@ -2657,115 +4570,624 @@ int QueryProcessor::IntersectListsTopPositions(ListData** lists, int num_lists,
   int dist;
   float ids;
 
-  for (r = 0; r < kNumReturnedResults; ++r) {
-    for (i = 0; i < kNumLists; ++i) {
-      num_positions_top = result_position_tuples[r].positions[i * kResultPositionStride];
-      positions_top = &result_position_tuples[r].positions[i * kResultPositionStride + 1];
+  for (r = 0; r < kNumReturnedResults; ++r) {
+    for (i = 0; i < kNumLists; ++i) {
+      num_positions_top = result_position_tuples[r].positions[i * kResultPositionStride];
+      positions_top = &result_position_tuples[r].positions[i * kResultPositionStride + 1];
+
+      for (j = i + 1; j < kNumLists; ++j) {
+        num_positions_bottom = result_position_tuples[r].positions[j * kResultPositionStride];
+        positions_bottom = &result_position_tuples[r].positions[j * kResultPositionStride + 1];
+
+        positions_top_actual = 0;  // Positions are stored gap coded for each document and we need to decode the gaps on the fly.
+        for (k = 0; k < num_positions_top; ++k) {
+          positions_top_actual += positions_top[k];
+
+          positions_bottom_actual = 0;  // Positions are stored gap coded for each document and we need to decode the gaps on the fly.
+          for (l = 0; l < num_positions_bottom; ++l) {
+            positions_bottom_actual += positions_bottom[l];
+
+            dist = positions_top_actual - positions_bottom_actual;
+            assert(dist != 0);  // This is an indication of a bug in the program.
+
+            ids = 1.0 / (dist * dist);
+
+            acc_d_t[i] += idf_t[i] * ids;
+            acc_d_t[j] += idf_t[j] * ids;
+          }
+        }
+      }
+
+      // Include the normalized proximity score.
+      result_position_tuples[r].score += min(1.0f, idf_t[i]) * (acc_d_t[i] * kBm25NumeratorMul) / (acc_d_t[i] + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * result_position_tuples[r].doc_len);
+    }
+  }
+
+  // This just iterates through all the positions for each list of each result.
+  /*for (i = 0; i < kNumReturnedResults; ++i) {
+    cout << "docID: " << result_position_tuples[i].doc_id << endl;
+    for (j = 0; j < kNumLists; ++j) {
+      cout << "Positions for list: " << j << endl;
+      const uint32_t* positions = &result_position_tuples[i].positions[j * kResultPositionStride];
+      uint32_t num_positions = positions[0];
+      ++positions;
+      for (k = 0; k < num_positions; ++k) {
+        cout << positions[k] << endl;
+      }
+    }
+  }*/
+
+  // Sort top results in descending order by document score.
+  sort(result_position_tuples, result_position_tuples + kNumReturnedResults, ResultPositionTuple());
+
+  // Copy the top scoring documents into the final result set.
+  const int kNumFinalResultSet = min(kMaxNumResults, kNumReturnedResults);
+  for (i = 0; i < kNumFinalResultSet; ++i) {
+    results[i].first = result_position_tuples[i].score;
+    results[i].second = result_position_tuples[i].doc_id;
+  }
+
+  delete[] result_position_tuples;
+  delete[] position_pool;
+
+  return total_num_results;
+}
+
+// Returns true if the current document of the lists contains the phrase. The phrase terms are taken in order of their number of positions in the document;
+// the candidate start positions of the phrase are those of the first term, less its offset, and they're narrowed down by merging them with the positions of
+// each of the other terms, less their offsets. Only the positions of the terms that are needed to rule the document out are decoded.
+static bool MatchPhrase(ListData** term_lists, const QueryPhrase& phrase) {
+  const int kNumPhraseTerms = phrase.term_nums.size();
+
+  int phrase_term_order[kNumPhraseTerms];  // Using a variable length array here.
+  uint32_t num_positions[kNumPhraseTerms];  // Using a variable length array here.
+  for (int i = 0; i < kNumPhraseTerms; ++i) {
+    num_positions[i] = term_lists[phrase.term_nums[i]]->GetNumDocProperties();
+
+    // Insertion sort, since phrases are short.
+    int j = i;
+    for (; j > 0 && num_positions[phrase_term_order[j - 1]] > num_positions[i]; --j) {
+      phrase_term_order[j] = phrase_term_order[j - 1];
+    }
+    phrase_term_order[j] = i;
+  }
+
+  // The positions are gap coded within each document.
+  uint32_t phrase_starts[ChunkDecoder::kMaxProperties];
+  int num_phrase_starts = 0;
+  int first_term = phrase_term_order[0];
+  uint32_t first_offset = phrase.offsets[first_term];
+  const uint32_t* positions = term_lists[phrase.term_nums[first_term]]->GetPositions();
+  uint32_t position = 0;
+  for (uint32_t i = 0; i < num_positions[first_term]; ++i) {
+    position += positions[i];
+    if (position >= first_offset)
+      phrase_starts[num_phrase_starts++] = position - first_offset;
+  }
+
+  for (int i = 1; i < kNumPhraseTerms && num_phrase_starts > 0; ++i) {
+    int term = phrase_term_order[i];
+    uint32_t offset = phrase.offsets[term];
+    uint32_t term_num_positions = num_positions[term];
+    positions = term_lists[phrase.term_nums[term]]->GetPositions();
+
+    int num_matches = 0;
+    uint32_t k = 0;
+    position = positions[0];
+    for (int j = 0; j < num_phrase_starts; ++j) {
+      uint32_t target_position = phrase_starts[j] + offset;
+      while (position < target_position && ++k < term_num_positions) {
+        position += positions[k];
+      }
+      if (k == term_num_positions)
+        break;
+      if (position == target_position)
+        phrase_starts[num_matches++] = phrase_starts[j];
+    }
+    num_phrase_starts = num_matches;
+  }
+
+  return num_phrase_starts > 0;
+}
+
+// Answers a query containing quoted phrases. The documents containing all the query terms are found by intersecting the lists (as with standard DAAT AND
+// processing), and only these candidates are checked for the phrases, by merging the positions of the phrase terms offset by where they are in the phrase.
+// The positions of a chunk are only decoded when it holds such a candidate. The documents containing all the phrases are ranked by their BM25 score over all
+// the query terms.
+//
+// Only the first 'ChunkDecoder::kMaxProperties' positions of a term are stored for a document, so occurrences of a phrase beyond those are missed.
+int QueryProcessor::ProcessPhraseQuery(LexiconData** query_term_data, int num_query_terms, const vector<QueryPhrase>& phrases, Result* results,
+                                       int* num_results) {
+  assert(phrase_queries_);
+
+  const int kMaxNumResults = *num_results;
+  ListData* list_data_pointers[num_query_terms];  // Using a variable length array here.
+  ListData* term_lists[num_query_terms];          // The list of each query term, in query term order (as referred to by the phrases).
+
+  // The last layer of a list holds all of its postings (we only match phrases with indices where this is true).
+  for (int i = 0; i < num_query_terms; ++i) {
+    list_data_pointers[i] = index_reader_.OpenList(*query_term_data[i], query_term_data[i]->num_layers() - 1, false);
+    list_data_pointers[i]->set_term_num(i);
+    term_lists[i] = list_data_pointers[i];
+  }
+
+  // Query terms must be arranged in order from shortest list to longest list.
+  sort(list_data_pointers, list_data_pointers + num_query_terms, ListCompare());
+
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  // Compute the inverse document frequency component. It is not document dependent, so we can compute it just once for each list.
+  float idf_t[num_query_terms];  // Using a variable length array here.
+  for (int i = 0; i < num_query_terms; ++i) {
+    int num_docs_t = list_data_pointers[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  }
+
+  int total_num_results = 0;
+  TopKCollector<Result, ResultCompare> top_k(results, kMaxNumResults);
+
+  uint32_t did = 0;
+  uint32_t d;
+  while ((did = list_data_pointers[0]->NextGEQ(did)) < ListData::kNoMoreDocs) {
+    // Try to find entries with same docID in other lists.
+    d = did;
+    for (int i = 1; (i < num_query_terms) && ((d = list_data_pointers[i]->NextGEQ(did)) == did); ++i) {
+      continue;
+    }
+
+    if (d > did) {
+      // Not in intersection.
+      did = d;
+      continue;
+    }
+
+    bool phrases_matched = true;
+    for (size_t i = 0; i < phrases.size() && phrases_matched; ++i) {
+      phrases_matched = MatchPhrase(term_lists, phrases[i]);
+    }
+
+    if (phrases_matched) {
+      // Compute BM25 score from frequencies.
+      float bm25_sum = 0;
+      int doc_len = index_reader_.document_map().GetDocumentLength(did);
+      for (int i = 0; i < num_query_terms; ++i) {
+        uint32_t f_d_t = list_data_pointers[i]->GetFreq();
+        bm25_sum += idf_t[i] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+      }
+      thread_query_stats_->num_postings_scored += num_query_terms;
+
+      START_STAGE_TIMER(top_k_time);
+      if (top_k.Insert(make_pair(bm25_sum, did)))
+        ++thread_query_stats_->num_heap_insertions;
+      STOP_STAGE_TIMER(top_k_time, thread_query_stats_->top_k_cycles);
+
+      ++total_num_results;
+    }
+    ++did;  // Search for next docID.
+  }
+
+  // Sort top-k results in descending order by document score.
+  top_k.Sort();
+
+  *num_results = min(total_num_results, kMaxNumResults);
+  for (int i = 0; i < num_query_terms; ++i) {
+    index_reader_.CloseList(list_data_pointers[i]);
+  }
+  return total_num_results;
+}
+
+// Answers an OR mode query in two phases, for better quality results on an index with positions. The query algorithm first finds the 'proximity_pool_size_'
+// highest scoring documents by BM25, which are then rescored by the proximity of the query terms in them (see RescoreProximity()). The top-k of the rescored
+// documents are returned. This way, positions are only decoded for the candidate documents, instead of for every posting of the lists.
+int QueryProcessor::ProcessProximityQuery(QueryAlgorithm query_algorithm, LexiconData** query_term_data, int num_query_terms, Result* results,
+                                          int* num_results) {
+  const int kMaxNumResults = *num_results;
+
+  // The pool can be much larger than k, so it's kept off the stack.
+  int num_candidates = max(kMaxNumResults, static_cast<int> (proximity_pool_size_));
+  vector<Result> candidates(num_candidates);
+  int total_num_results = RunQueryAlgorithm(query_algorithm, query_term_data, num_query_terms, &candidates[0], &num_candidates);
+
+  RescoreProximity(query_term_data, num_query_terms, &candidates[0], num_candidates);
+
+  TopKCollector<Result, ResultCompare> top_k(results, kMaxNumResults);
+  top_k.InsertBatch(candidates.begin(), candidates.begin() + num_candidates);
+  *num_results = top_k.Sort();
+  return total_num_results;
+}
+
+// Adds the weighted BM25TP term proximity score (see Buttcher, Clarke, and Lushman, "Term Proximity Scoring for Ad-Hoc Retrieval on Very Large Text
+// Collections") to the scores of the 'num_results' 'results'. Going through the occurrences of the query terms in a document in order of position, each pair
+// of adjacent occurrences of two different terms, at a distance d, adds the idf of either term divided by d^2 to the proximity accumulator of the other.
+// The accumulators are then saturated like the BM25 term frequencies and weighted by the idfs of their terms (capped at 1).
+//
+// The lists are skipped through in docID order of the results, so positions are only decoded for the chunks holding them. The results are left in docID order.
+void QueryProcessor::RescoreProximity(LexiconData** query_term_data, int num_query_terms, Result* results, int num_results) {
+  const int kMaxPositions = ChunkDecoder::kMaxProperties;  // The maximum number of positions for a docID in any list.
+
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  // The last layer of a list holds all of its postings (we only rescore with indices where this is true).
+  ListData* list_data_pointers[num_query_terms];  // Using a variable length array here.
+  float idf_t[num_query_terms];                   // Using a variable length array here.
+  for (int i = 0; i < num_query_terms; ++i) {
+    list_data_pointers[i] = index_reader_.OpenList(*query_term_data[i], query_term_data[i]->num_layers() - 1, false);
+    list_data_pointers[i]->set_term_num(i);
+
+    int num_docs_t = list_data_pointers[i]->num_docs_complete_list();
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  }
+
+  bool term_in_doc[num_query_terms];  // Using a variable length array here.
+  float proximity_t[num_query_terms];  // Using a variable length array here.
+
+  // The occurrences of the query terms in the current document, as (position, term) pairs.
+  vector<pair<uint32_t, int> > occurrences;
+  occurrences.reserve(num_query_terms * kMaxPositions);
+
+  sort(results, results + num_results, ResultDocIdCompare());
+  for (int r = 0; r < num_results; ++r) {
+    uint32_t did = results[r].second;
+
+    // Documents with fewer than two of the query terms have no term proximity, so their positions aren't needed.
+    int num_terms_in_doc = 0;
+    for (int i = 0; i < num_query_terms; ++i) {
+      term_in_doc[i] = (list_data_pointers[i]->NextGEQ(did) == did);
+      if (term_in_doc[i])
+        ++num_terms_in_doc;
+    }
+    if (num_terms_in_doc < 2)
+      continue;
+
+    // The positions are gap coded within each document.
+    occurrences.clear();
+    for (int i = 0; i < num_query_terms; ++i) {
+      if (!term_in_doc[i])
+        continue;
+
+      uint32_t num_positions = list_data_pointers[i]->GetNumDocProperties();
+      const uint32_t* positions = list_data_pointers[i]->GetPositions();
+      uint32_t position = 0;
+      for (uint32_t j = 0; j < num_positions; ++j) {
+        position += positions[j];
+        occurrences.push_back(make_pair(position, i));
+      }
+      proximity_t[i] = 0;
+    }
+    sort(occurrences.begin(), occurrences.end());
+
+    for (size_t j = 1; j < occurrences.size(); ++j) {
+      int prev_term = occurrences[j - 1].second;
+      int curr_term = occurrences[j].second;
+      if (curr_term == prev_term)
+        continue;
+
+      float distance = occurrences[j].first - occurrences[j - 1].first;
+      proximity_t[prev_term] += idf_t[curr_term] / (distance * distance);
+      proximity_t[curr_term] += idf_t[prev_term] / (distance * distance);
+    }
+
+    int doc_len = index_reader_.document_map().GetDocumentLength(did);
+    float proximity_score = 0;
+    for (int i = 0; i < num_query_terms; ++i) {
+      if (term_in_doc[i]) {
+        proximity_score += min(1.0f, idf_t[i]) * (proximity_t[i] * kBm25NumeratorMul)
+            / (proximity_t[i] + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+      }
+    }
+    results[r].first += proximity_weight_ * proximity_score;
+  }
+
+  for (int i = 0; i < num_query_terms; ++i) {
+    index_reader_.CloseList(list_data_pointers[i]);
+  }
+}
+
+// Extracts the features of the 'results' of a query for second stage ranking, into 'features', which holds a dense vector of 'kNumFeatures' features for each
+// of the results, in the same order as the results. The features are computed from the forward index, so the (possibly long) query lists aren't traversed
+// a second time; the cost is one forward index record decoded per result, regardless of the query.
+void QueryProcessor::ExtractFeatures(LexiconData** query_term_data, int num_query_terms, const Result* results, int num_results, float* features) {
+  assert(forward_index_reader_ != NULL);
+
+  // BM25 parameters: see 'http://en.wikipedia.org/wiki/Okapi_BM25'.
+  const float kBm25K1 =  2.0;  // k1
+  const float kBm25B = 0.75;   // b
+
+  // We can precompute a few of the BM25 values here.
+  const float kBm25NumeratorMul = kBm25K1 + 1;
+  const float kBm25DenominatorAdd = kBm25K1 * (1 - kBm25B);
+  const float kBm25DenominatorDocLenMul = kBm25K1 * kBm25B / collection_average_doc_len_;
+
+  // The last layer of a list holds all of its postings (the forward index is only generated for single layered indices anyway).
+  float idf_t[num_query_terms];  // Using a variable length array here.
+  for (int i = 0; i < num_query_terms; ++i) {
+    int num_docs_t = query_term_data[i]->layer_num_docs(query_term_data[i]->num_layers() - 1);
+    idf_t[i] = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+  }
+
+  vector<uint32_t> doc_term_ids;
+  vector<uint32_t> doc_frequencies;
+  for (int r = 0; r < num_results; ++r) {
+    float* feature_vector = features + r * kNumFeatures;
+    fill(feature_vector, feature_vector + kNumFeatures, 0.0f);
 
-      for (j = i + 1; j < kNumLists; ++j) {
-        num_positions_bottom = result_position_tuples[r].positions[j * kResultPositionStride];
-        positions_bottom = &result_position_tuples[r].positions[j * kResultPositionStride + 1];
+    uint32_t did = results[r].second;
+    int doc_num_terms = forward_index_reader_->GetDocumentTerms(did, &doc_term_ids, &doc_frequencies);
+    int doc_len = index_reader_.document_map().GetDocumentLength(did);
 
-        positions_top_actual = 0;  // Positions are stored gap coded for each document and we need to decode the gaps on the fly.
-        for (k = 0; k < num_positions_top; ++k) {
-          positions_top_actual += positions_top[k];
+    feature_vector[kFeatureScore] = results[r].first;
+    feature_vector[kFeatureDocLength] = doc_len;
+    feature_vector[kFeatureDocNumTerms] = doc_num_terms;
+    if (doc_num_terms == 0)
+      continue;
 
-          positions_bottom_actual = 0;  // Positions are stored gap coded for each document and we need to decode the gaps on the fly.
-          for (l = 0; l < num_positions_bottom; ++l) {
-            positions_bottom_actual += positions_bottom[l];
+    // The termIDs of a document are in ascending order.
+    vector<uint32_t>::iterator doc_term_ids_end = doc_term_ids.begin() + doc_num_terms;
+    for (int i = 0; i < num_query_terms; ++i) {
+      vector<uint32_t>::iterator doc_term = lower_bound(doc_term_ids.begin(), doc_term_ids_end, query_term_data[i]->term_id());
+      if (doc_term == doc_term_ids_end || *doc_term != query_term_data[i]->term_id())
+        continue;
+
+      uint32_t f_d_t = doc_frequencies[doc_term - doc_term_ids.begin()];
+      float partial_bm25 = idf_t[i] * (f_d_t * kBm25NumeratorMul) / (f_d_t + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * doc_len);
+
+      feature_vector[kFeatureNumQueryTermsMatched] += 1;
+      feature_vector[kFeatureQueryTermFrequencySum] += f_d_t;
+      feature_vector[kFeatureBm25] += partial_bm25;
+      if (i < kMaxFeatureQueryTerms) {
+        feature_vector[kFeatureQueryTermFrequencies + i] = f_d_t;
+        feature_vector[kFeatureQueryTermBm25 + i] = partial_bm25;
+      }
+    }
+  }
+}
 
-            dist = positions_top_actual - positions_bottom_actual;
-            assert(dist != 0);  // This is an indication of a bug in the program.
+// In case of AND queries, we only count queries for which all terms are in the lexicon as part of the number of queries executed and the total elapsed querying
+// time. A query that contains terms which are not in the lexicon will just terminate with 0 results and 0 running time, so we ignore these for our benchmarking
+// purposes.
+void QueryProcessor::ExecuteQuery(string query_line, int qid) {
+  // The output of this query is buffered and written out all at once, since there might be other queries executing concurrently.
+  ostringstream query_output;
+  ExecuteQuery(query_line, qid, &query_output);
+  OutputQuery(query_output);
+}
 
-            ids = 1.0 / (dist * dist);
+// Normalizes the 'query_line' in place and sets 'words' to its unique terms (in sorted order), excluding any stop words.
+void QueryProcessor::GetQueryTerms(string* query_line, vector<string>* words) const {
+  NormalizeQueryLine(query_line);
 
-            acc_d_t[i] += idf_t[i] * ids;
-            acc_d_t[j] += idf_t[j] * ids;
-          }
-        }
+  istringstream qss(*query_line);
+  string term;
+  while (qss >> term) {
+    // Apply query time word stop list.
+    // Remove words that appear in our stop list.
+    if (!stop_words_.empty()) {
+      if (stop_words_.find(term) == stop_words_.end()) {
+        words->push_back(term);
       }
-
-      // Include the normalized proximity score.
-      result_position_tuples[r].score += min(1.0f, idf_t[i]) * (acc_d_t[i] * kBm25NumeratorMul) / (acc_d_t[i] + kBm25DenominatorAdd + kBm25DenominatorDocLenMul * result_position_tuples[r].doc_len);
+    } else {
+      words->push_back(term);
     }
   }
 
-  // This just iterates through all the positions for each list of each result.
-  /*for (i = 0; i < kNumReturnedResults; ++i) {
-    cout << "docID: " << result_position_tuples[i].doc_id << endl;
-    for (j = 0; j < kNumLists; ++j) {
-      cout << "Positions for list: " << j << endl;
-      const uint32_t* positions = &result_position_tuples[i].positions[j * kResultPositionStride];
-      uint32_t num_positions = positions[0];
-      ++positions;
-      for (k = 0; k < num_positions; ++k) {
-        cout << positions[k] << endl;
+  // Remove duplicate words, since there is no point in traversing lists for the same word multiple times.
+  sort(words->begin(), words->end());
+  words->erase(unique(words->begin(), words->end()), words->end());
+}
+
+// Sets 'phrases' to the quoted phrases of the original 'query_line', whose normalized terms are 'words'. Stop words are left out of a phrase, but still
+// count towards the offsets of the terms following them. A phrase of less than two terms doesn't constrain the query any more than AND mode semantics already
+// do, so it's dropped. An unmatched quote is ignored.
+void QueryProcessor::GetQueryPhrases(const string& query_line, const vector<string>& words, vector<QueryPhrase>* phrases) const {
+  size_t phrase_start;
+  size_t phrase_end = 0;
+  while ((phrase_start = query_line.find('"', phrase_end)) != string::npos && (phrase_end = query_line.find('"', phrase_start + 1)) != string::npos) {
+    string phrase_line = query_line.substr(phrase_start + 1, phrase_end - phrase_start - 1);
+    NormalizeQueryLine(&phrase_line);
+    ++phrase_end;
+
+    QueryPhrase phrase;
+    istringstream pss(phrase_line);
+    string term;
+    for (int offset = 0; pss >> term; ++offset) {
+      if (stop_words_.find(term) == stop_words_.end()) {
+        assert(binary_search(words.begin(), words.end(), term));
+        phrase.term_nums.push_back(lower_bound(words.begin(), words.end(), term) - words.begin());
+        phrase.offsets.push_back(offset);
       }
     }
-  }*/
-
-  // Sort top results in descending order by document score.
-  sort(result_position_tuples, result_position_tuples + kNumReturnedResults, ResultPositionTuple());
 
-  // Copy the top scoring documents into the final result set.
-  const int kNumFinalResultSet = min(kMaxNumResults, kNumReturnedResults);
-  for (i = 0; i < kNumFinalResultSet; ++i) {
-    results[i].first = result_position_tuples[i].score;
-    results[i].second = result_position_tuples[i].doc_id;
+    if (phrase.term_nums.size() >= 2)
+      phrases->push_back(phrase);
   }
-
-  delete[] result_position_tuples;
-  delete[] position_pool;
-
-  return total_num_results;
 }
 
-// In case of AND queries, we only count queries for which all terms are in the lexicon as part of the number of queries executed and the total elapsed querying
-// time. A query that contains terms which are not in the lexicon will just terminate with 0 results and 0 running time, so we ignore these for our benchmarking
-// purposes.
-void QueryProcessor::ExecuteQuery(string query_line, int qid) {
+// Converts the 'query_line' to lower case and replaces any punctuation with spaces.
+void QueryProcessor::NormalizeQueryLine(string* query_line) {
   // All the words in the lexicon are lower case, so queries must be too, convert them to lower case.
-  for (size_t i = 0; i < query_line.size(); i++) {
-    if (isupper(query_line[i]))
-      query_line[i] = tolower(query_line[i]);
+  for (size_t i = 0; i < query_line->size(); i++) {
+    if (isupper((*query_line)[i]))
+      (*query_line)[i] = tolower((*query_line)[i]);
 
     // We need to remove punctuation from the queries, since we only index alphanumeric characters and anything separated by a non-alphanumeric
     // character is considered a token separator by our parser. Not removing punctuation will result in the token not being found in the lexicon.
-    int int_val = query_line[i];
+    int int_val = (*query_line)[i];
     if (!((int_val >= 48 && int_val < 58) || (int_val >= 65 && int_val < 91) || (int_val >= 97 && int_val < 123) || (int_val == 32))) {
-      query_line[i] = ' ';  // Replace it with a space.
+      (*query_line)[i] = ' ';  // Replace it with a space.
     }
   }
+}
 
-  if (query_mode_ == kBatch) {
-    if (!silent_mode_)
-      cout << "\nSearch: " << query_line << endl;
+// Answers the query with the given algorithm, which must be appropriate for the loaded index.
+int QueryProcessor::RunQueryAlgorithm(QueryAlgorithm query_algorithm, LexiconData** query_term_data, int num_query_terms, Result* results,
+                                      int* num_results) {
+  int total_num_results;
+  switch (query_algorithm) {
+    case kDaatAnd:
+    case kDaatOr:
+    case kDaatAndTopPositions:
+      total_num_results = ProcessQuery(query_algorithm, query_term_data, num_query_terms, results, num_results);
+      break;
+    case kDualLayeredOverlappingDaat:
+    case kDualLayeredOverlappingMergeDaat:
+      total_num_results = ProcessLayeredQuery(query_term_data, num_query_terms, results, num_results);
+      break;
+    case kMultiLayeredDaatOr:
+      total_num_results = ProcessMultiLayeredDaatOrQuery(query_term_data, num_query_terms, results, num_results);
+      break;
+    case kMultiLayeredDaatOrMaxScore:
+      total_num_results = ProcessMultiLayeredDaatOrMaxScoreQuery(query_term_data, num_query_terms, results, num_results);
+      break;
+    case kLayeredTaatOrEarlyTerminated:
+      total_num_results = ProcessLayeredTaatPrunedEarlyTerminatedQuery(query_term_data, num_query_terms, results, num_results);
+      break;
+    case kWand:
+      total_num_results = MergeListsWand(query_term_data, num_query_terms, results, num_results, false);
+      break;
+    case kDualLayeredWand:
+      total_num_results = MergeListsWand(query_term_data, num_query_terms, results, num_results, true);
+      break;
+    case kBlockMaxWand:
+      total_num_results = MergeListsBlockMaxWand(query_term_data, num_query_terms, results, num_results);
+      break;
+    case kMaxScore:
+      total_num_results = MergeListsMaxScore(query_term_data, num_query_terms, results, num_results, false);
+      break;
+    case kDualLayeredMaxScore:
+      total_num_results = MergeListsMaxScore(query_term_data, num_query_terms, results, num_results, true);
+      break;
+    case kSaatAnytime:
+      total_num_results = ProcessSaatAnytimeQuery(query_term_data, num_query_terms, results, num_results);
+      break;
+    case kTaatOr:
+      total_num_results = ProcessTaatOrQuery(query_term_data, num_query_terms, results, num_results);
+      break;
+    default:
+      total_num_results = 0;
+      assert(false);
   }
+  return total_num_results;
+}
 
-  istringstream qss(query_line);
-  vector<string> words;
-  string term;
-  while (qss >> term) {
-    // Apply query time word stop list.
-    // Remove words that appear in our stop list.
-    if (!stop_words_.empty()) {
-      if (stop_words_.find(term) == stop_words_.end()) {
-        words.push_back(term);
+// The score upperbound of a term is that of BM25 with an unbounded frequency and a zero document length, so the spread of the upperbounds only depends on
+// the idfs of the terms.
+AlgorithmCostModel::QueryShape QueryProcessor::GetQueryShape(LexiconData** query_term_data, int num_query_terms) const {
+  AlgorithmCostModel::QueryShape query_shape;
+  query_shape.num_terms = num_query_terms;
+  query_shape.num_postings = 0;
+  query_shape.multi_layered = true;
+
+  float min_idf = numeric_limits<float>::max();
+  float max_idf = 0;
+  for (int i = 0; i < num_query_terms; ++i) {
+    const LexiconData& lex_data = *query_term_data[i];
+
+    // The last layer of an overlapping layered index holds the complete list; otherwise, the layers are disjoint.
+    int num_docs_t = lex_data.layer_num_docs(lex_data.num_layers() - 1);
+    if (index_layered_ && !index_overlapping_layers_) {
+      for (int j = 0; j < lex_data.num_layers() - 1; ++j) {
+        num_docs_t += lex_data.layer_num_docs(j);
       }
-    } else {
-      words.push_back(term);
     }
+
+    query_shape.num_postings += num_docs_t;
+    if (lex_data.num_layers() == 1)
+      query_shape.multi_layered = false;
+
+    float idf_t = log10(1 + (collection_total_num_docs_ - num_docs_t + 0.5) / (num_docs_t + 0.5));
+    min_idf = min(min_idf, idf_t);
+    max_idf = max(max_idf, idf_t);
+  }
+
+  query_shape.score_spread = (num_query_terms > 0 && min_idf > 0) ? (max_idf / min_idf) : 1;
+  return query_shape;
+}
+
+// Executes the query, appending its output (in the configured result format) to 'query_output'.
+void QueryProcessor::ExecuteQuery(string query_line, int qid, ostringstream* query_output_buffer) {
+  ostringstream& query_output = *query_output_buffer;
+
+  // The quoted phrases have to be picked out before the quotes are stripped from the query.
+  string phrase_query_line;
+  if (phrase_queries_)
+    phrase_query_line = query_line;
+
+  vector<string> words;
+  GetQueryTerms(&query_line, &words);
+
+  vector<QueryPhrase> phrases;
+  if (phrase_queries_)
+    GetQueryPhrases(phrase_query_line, words, &phrases);
+
+  if (query_mode_ == kBatch) {
+    if (!silent_mode_)
+      query_output << "\nSearch: " << query_line << "\n";
   }
 
   if (words.size() == 0) {
     if (!silent_mode_)
-      cout << "Please enter a query.\n" << endl;
+      query_output << "Please enter a query.\n\n";
     return;
   }
 
-  // Remove duplicate words, since there is no point in traversing lists for the same word multiple times.
-  sort(words.begin(), words.end());
-  words.erase(unique(words.begin(), words.end()), words.end());
+  thread_query_output_ = query_output_buffer;
+
+  // Tracing is only turned on for the timed batch query runs.
+  bool trace_query = query_trace_stream_.is_open() && !warm_up_mode_;
+  QueryTrace query_trace;
+  if (trace_query)
+    StartQueryTrace(&query_trace);
+
+  int results_size = max_num_results_;
+  int total_num_results = 0;
+  double query_elapsed_time = 0;
+
+  // These results are ranked from highest BM25 score to lowest.
+  // Aligned to a cache line, since the query algorithms maintain their top-k heap in here.
+  Result ranked_results[max_num_results_] __attribute__((aligned(64)));  // Using a variable length array here.
+
+  // Repeated queries are answered straight from the result cache, without looking up the lexicon or traversing any lists. Since the query terms were
+  // normalized, deduplicated, and sorted above, all queries with the same set of terms map to the same cache entry.
+  string result_cache_key;
+  bool result_cache_hit = false;
+  if (result_cache_.capacity() > 0) {
+    Timer result_cache_time;
+    // The phrases are part of the key (as the quoted phrase terms, each with its offset), so that a phrase query doesn't share its results with the same terms
+    // queried without (or with other) phrases.
+    vector<string> key_terms(words);
+    for (size_t i = 0; i < phrases.size(); ++i) {
+      ostringstream phrase_key;
+      phrase_key << '"';
+      for (size_t j = 0; j < phrases[i].term_nums.size(); ++j) {
+        phrase_key << words[phrases[i].term_nums[j]] << '/' << phrases[i].offsets[j] << (j + 1 < phrases[i].term_nums.size() ? "," : "\"");
+      }
+      key_terms.push_back(phrase_key.str());
+    }
+    result_cache_key = QueryResultCache::GetKey(key_terms, query_algorithm_, max_num_results_);
+    result_cache_hit = result_cache_.Lookup(result_cache_key, ranked_results, &results_size, &total_num_results);
+    if (result_cache_hit)
+      query_elapsed_time = result_cache_time.GetElapsedTime();
+
+    if (result_cache_hit) {
+      ++thread_query_stats_->num_result_cache_hits;
+    } else {
+      ++thread_query_stats_->num_result_cache_misses;
+    }
+  }
 
   int num_query_terms = words.size();
   LexiconData* query_term_data[num_query_terms];  // Using a variable length array here.
@@ -2789,8 +5211,12 @@ void QueryProcessor::ExecuteQuery(string query_line, int qid) {
     case kLayeredTaatOrEarlyTerminated:
     case kWand:
     case kDualLayeredWand:
+    case kBlockMaxWand:
     case kMaxScore:
     case kDualLayeredMaxScore:
+    case kSaatAnytime:
+    case kTaatOr:
+    case kAuto:  // All the algorithms picked from have OR mode semantics.
       processing_semantics = kOr;
       break;
     default:
@@ -2798,163 +5224,803 @@ void QueryProcessor::ExecuteQuery(string query_line, int qid) {
       assert(false);
   }
 
-  if (result_format_ == kCompare) {
-    // Print the query.
-    for (int i = 0; i < num_query_terms; ++i) {
-      cout << words[i] << ((i != num_query_terms - 1) ? ' ' : '\n');
+  // All the terms of a phrase query must be in a document for it to contain the phrases.
+  if (!phrases.empty())
+    processing_semantics = kAnd;
+
+  if (result_format_ == kCompare) {
+    // Print the query.
+    for (int i = 0; i < num_query_terms; ++i) {
+      query_output << words[i] << ((i != num_query_terms - 1) ? ' ' : '\n');
+    }
+  }
+
+  int curr_query_term_num = 0;
+  if (!result_cache_hit) {
+    CycleTimer lexicon_lookup_time;
+    for (int i = 0; i < num_query_terms; ++i) {
+      LexiconData* lex_data = index_reader_.lexicon().GetEntry(words[i].c_str(), words[i].length());
+      if (lex_data != NULL)
+        query_term_data[curr_query_term_num++] = lex_data;
+    }
+    thread_query_stats_->lexicon_lookup_cycles += lexicon_lookup_time.GetElapsedCycles();
+
+    if (processing_semantics == kOr) {
+      num_query_terms = curr_query_term_num;
+    }
+  }
+
+  // In 'kAuto' mode, the algorithm is picked for each query once its terms have been looked up, and the query is counted under the algorithm picked.
+  // Phrase queries are counted under the algorithm actually run instead of the one configured.
+  QueryAlgorithm query_algorithm = query_algorithm_;
+
+  START_PERF_COUNTERS(query_counters);
+  if (result_cache_hit || curr_query_term_num == num_query_terms) {
+    if (!result_cache_hit) {
+      Timer query_time;  // Time how long it takes to answer a query.
+      if (!phrases.empty()) {
+        // Phrase queries are answered the same way regardless of the query algorithm, so they're counted under DAAT AND, which their processing is based on.
+        query_algorithm = kDaatAnd;
+        total_num_results = ProcessPhraseQuery(query_term_data, num_query_terms, phrases, ranked_results, &results_size);
+      } else {
+        if (query_algorithm == kAuto) {
+          query_algorithm = static_cast<QueryAlgorithm> (algorithm_cost_model_.SelectAlgorithm(GetQueryShape(query_term_data, num_query_terms),
+                                                                                               auto_algorithms_));
+        }
+        // With proximity rescoring, OR mode queries of more than one term are answered in two phases.
+        if (proximity_rescoring_ && processing_semantics == kOr && num_query_terms > 1) {
+          total_num_results = ProcessProximityQuery(query_algorithm, query_term_data, num_query_terms, ranked_results, &results_size);
+        } else {
+          total_num_results = RunQueryAlgorithm(query_algorithm, query_term_data, num_query_terms, ranked_results, &results_size);
+        }
+      }
+      query_elapsed_time = query_time.GetElapsedTime();
+      STOP_PERF_COUNTERS(query_counters, PerfCounters::kQueryPhase);
+
+      if (result_cache_.Insert(result_cache_key, ranked_results, results_size, total_num_results)) {
+        ++thread_query_stats_->num_result_cache_evictions;
+      }
+    }
+
+    thread_query_stats_->total_querying_time += query_elapsed_time;
+    ++thread_query_stats_->total_num_queries;
+    thread_query_stats_->latencies.Add(query_elapsed_time);
+    thread_query_stats_->latencies_by_num_terms[words.size()].Add(query_elapsed_time);
+    thread_query_stats_->latencies_by_algorithm[query_algorithm].Add(query_elapsed_time);
+
+    query_output.setf(ios::fixed, ios::floatfield);
+    query_output.setf(ios::showpoint);
+
+    if (result_format_ == kCompare) {
+      query_output << "num results: " << results_size << "\n";
+    }
+
+    // The features are extracted for all the results at once. The query terms are looked up again, since they aren't on a result cache hit.
+    vector<float> features;
+    if (result_format_ == kFeatures && results_size > 0) {
+      LexiconData* feature_term_data[words.size()];  // Using a variable length array here.
+      int num_feature_terms = 0;
+      for (size_t i = 0; i < words.size(); ++i) {
+        LexiconData* lex_data = index_reader_.lexicon().GetEntry(words[i].c_str(), words[i].length());
+        if (lex_data != NULL)
+          feature_term_data[num_feature_terms++] = lex_data;
+      }
+
+      features.resize(results_size * kNumFeatures);
+      ExtractFeatures(feature_term_data, num_feature_terms, ranked_results, results_size, &features[0]);
+    }
+
+    for (int i = 0; i < results_size; ++i) {
+      switch (result_format_) {
+        case kNormal:
+          if (!silent_mode_)
+            query_output << setprecision(2) << setw(2) << "Score: " << ranked_results[i].first << "\tDocID: " << ranked_results[i].second << "\tURL: "
+                << index_reader_.document_map().GetDocumentUrl(ranked_results[i].second) << setprecision(6) << "\n";
+          break;
+        case kTrec:
+          query_output << qid << '\t' << "Q0" << '\t' << index_reader_.document_map().GetDocumentNumber(ranked_results[i].second) << '\t' << i << '\t'
+              << ranked_results[i].first << '\t' << "PolyIRTK" << "\n";
+          break;
+        case kCompare:
+          query_output << setprecision(2) << setw(2) << ranked_results[i].first << "\t" << ranked_results[i].second << setprecision(6) << "\n";
+          break;
+        case kDiscard:
+          break;
+        case kFeatures:
+          // The relevance label isn't known, so it's always 0. The feature numbers start at 1.
+          query_output << 0 << " qid:" << qid;
+          for (int j = 0; j < kNumFeatures; ++j) {
+            query_output << ' ' << (j + 1) << ':' << features[i * kNumFeatures + j];
+          }
+          query_output << " # " << index_reader_.document_map().GetDocumentNumber(ranked_results[i].second) << "\n";
+          break;
+        default:
+          assert(false);
+      }
+    }
+  } else {
+    // One of the query terms did not exist in the lexicon.
+    results_size = 0;
+    total_num_results = 0;
+    query_elapsed_time = 0;
+  }
+
+  if (result_format_ == kNormal)
+    if (!silent_mode_)
+      query_output << "\nShowing " << results_size << " results out of " << total_num_results << ". (" << setprecision(1) << (query_elapsed_time * 1000)
+          << setprecision(6) << " ms)\n";
+
+  if (trace_query)
+    FinishQueryTrace(query_trace, qid, query_line, query_algorithm, words.size(), result_cache_hit, results_size, total_num_results, query_elapsed_time);
+
+#ifdef IRTK_PERF_COUNTERS
+  if (result_format_ == kNormal && !silent_mode_ && !result_cache_hit && curr_query_term_num == num_query_terms) {
+    query_output << "Hardware counters: ";
+    PerfCounters::PrintSample(query_counters, query_output);
+    query_output << "\n";
+  }
+#endif
+
+  thread_query_output_ = NULL;
+}
+
+void QueryProcessor::StartQueryTrace(QueryTrace* query_trace) {
+  query_trace->num_postings_scored = thread_query_stats_->num_postings_scored;
+  query_trace->num_heap_insertions = thread_query_stats_->num_heap_insertions;
+  query_trace->num_threshold_changes = thread_query_stats_->num_threshold_changes;
+  query_trace->num_score_bound_skips = thread_query_stats_->num_score_bound_skips;
+
+  // The lists of the query are all closed by this thread (including those of any intra-query threads).
+  IndexReader::SetThreadListAccessStatistics(&query_trace->list_access_stats);
+}
+
+// Writes out the trace of the query as a single line JSON record. The 'query_line' has already been normalized to lower case alphanumeric characters and spaces,
+// so it doesn't need any escaping.
+void QueryProcessor::FinishQueryTrace(const QueryTrace& query_trace, int qid, const string& query_line, QueryAlgorithm query_algorithm, int num_query_terms,
+                                      bool result_cache_hit, int num_results, int total_num_results, double query_elapsed_time) {
+  IndexReader::SetThreadListAccessStatistics(NULL);
+
+  const ListAccessStatistics& list_access_stats = query_trace.list_access_stats;
+  ostringstream record;
+  record << "{\"qid\": " << qid
+      << ", \"query\": \"" << query_line << "\""
+      << ", \"algorithm\": \"" << GetQueryAlgorithmName(query_algorithm) << "\""
+      << ", \"num_terms\": " << num_query_terms
+      << ", \"result_cache_hit\": " << (result_cache_hit ? "true" : "false")
+      << ", \"num_results\": " << num_results
+      << ", \"total_num_results\": " << total_num_results
+      << ", \"latency_ms\": " << (query_elapsed_time * 1000)
+      << ", \"next_geq_calls\": " << list_access_stats.num_next_geq_calls
+      << ", \"chunks_decoded\": " << list_access_stats.num_chunks_decoded
+      << ", \"blocks_skipped\": " << list_access_stats.num_blocks_skipped
+      << ", \"score_bound_skips\": " << (thread_query_stats_->num_score_bound_skips - query_trace.num_score_bound_skips)
+      << ", \"postings_scored\": " << (thread_query_stats_->num_postings_scored - query_trace.num_postings_scored)
+      << ", \"heap_insertions\": " << (thread_query_stats_->num_heap_insertions - query_trace.num_heap_insertions)
+      << ", \"threshold_changes\": " << (thread_query_stats_->num_threshold_changes - query_trace.num_threshold_changes)
+      << ", \"cached_bytes_read\": " << list_access_stats.cached_bytes_read
+      << ", \"disk_bytes_read\": " << list_access_stats.disk_bytes_read
+      << "}\n";
+
+  pthread_mutex_lock(&query_trace_mutex_);
+  query_trace_stream_ << record.str();
+  pthread_mutex_unlock(&query_trace_mutex_);
+}
+
+void QueryProcessor::OutputQuery(const ostringstream& query_output) {
+  pthread_mutex_lock(&output_mutex_);
+  cout << query_output.str() << flush;
+  pthread_mutex_unlock(&output_mutex_);
+}
+
+// Query lines are of the form 'qid:query' or just 'query', in which case the query id is 0.
+static pair<int, string> ParseQueryLine(const string& query_line) {
+  size_t colon_pos = query_line.find(':');
+  if (colon_pos != string::npos && colon_pos < (query_line.size() - 1)) {
+    return make_pair(atoi(query_line.substr(0, colon_pos).c_str()), query_line.substr(colon_pos + 1));
+  }
+  return make_pair(0, query_line);
+}
+
+void QueryProcessor::RunBatchQueries(const string& input_source, bool warmup, int num_timed_runs) {
+  ifstream batch_query_file_stream;
+  if (!(input_source.empty() || input_source == "stdin" || input_source == "cin")) {
+    batch_query_file_stream.open(input_source.c_str());
+    if (!batch_query_file_stream) {
+      GetErrorLogger().Log("Could not open batch query file '" + input_source + "'.", true);
+    }
+  }
+
+  istream& is = batch_query_file_stream.is_open() ? batch_query_file_stream : cin;
+
+  string query_trace_file = IndexConfiguration::GetResultValue(Configuration::GetConfiguration().GetStringValue(config_properties::kQueryTraceFile), false);
+  if (!(query_trace_file.empty() || query_trace_file == "none")) {
+    query_trace_stream_.open(query_trace_file.c_str());
+    if (!query_trace_stream_) {
+      GetErrorLogger().Log("Could not open query trace file '" + query_trace_file + "'.", true);
+    }
+  }
+
+  vector<pair<int, string> > queries;
+  string query_line;
+  while (getline(is, query_line)) {
+    queries.push_back(ParseQueryLine(query_line));
+  }
+
+  if (warmup) {
+    // The statistics of the warm-up run are discarded. With a single query thread, the queries would otherwise add to 'query_stats_' directly.
+    QueryStatistics warm_up_query_stats;
+    QueryStatistics* query_stats = thread_query_stats_;
+    thread_query_stats_ = &warm_up_query_stats;
+    warm_up_mode_ = true;
+    ExecuteBatchQueries(queries);
+    thread_query_stats_ = query_stats;
+    index_reader_.ResetStats();
+    PerfCounters::ResetPhaseTotals();
+    // Otherwise the timed runs would be answered from the results (and intersections, and decoded chunks) cached during the warm-up. Only the block cache
+    // is meant to be warmed up.
+    ClearQueryCaches();
+  }
+
+  warm_up_mode_ = false;
+  Timer batch_time;
+  while (num_timed_runs-- > 0) {
+    ExecuteBatchQueries(queries);
+  }
+  batch_querying_time_ += batch_time.GetElapsedTime();
+
+  if (query_trace_stream_.is_open())
+    query_trace_stream_.close();
+}
+
+// Executes all the queries in the batch once. With a single query thread, queries are executed in order from the calling thread.
+// Otherwise, the query threads each pick up the next query in the batch that hasn't been executed yet, until there are none left.
+// The index reader, lexicon, document map, and cache policies are shared between the query threads; all the per query state (the lists, the top-k results,
+// the timers) is local to the query being executed.
+void QueryProcessor::ExecuteBatchQueries(const vector<pair<int, string> >& queries) {
+  if (num_query_threads_ == 1 && query_pipeline_depth_ == 1) {
+    for (int i = 0; i < static_cast<int> (queries.size()); ++i) {
+#ifdef IRTK_DEBUG
+      cout << queries[i].first << ":" << queries[i].second << endl;
+#endif
+      ExecuteQuery(queries[i].second, queries[i].first);
+    }
+    return;
+  }
+
+  next_batch_query_ = 0;
+
+  vector<pthread_t> query_threads(num_query_threads_);
+  vector<BatchQueryThreadArgs> query_thread_args(num_query_threads_);
+  vector<QueryStatistics> run_query_stats(num_query_threads_);
+
+  for (int i = 0; i < num_query_threads_; ++i) {
+    query_thread_args[i].query_processor = this;
+    query_thread_args[i].queries = &queries;
+    query_thread_args[i].query_stats = &run_query_stats[i];
+
+    int pthread_ret = pthread_create(&query_threads[i], NULL, BatchQueryThread, &query_thread_args[i]);
+    if (pthread_ret != 0) {
+      GetErrorLogger().LogErrno("pthread_create() in QueryProcessor::ExecuteBatchQueries()", pthread_ret, true);
     }
   }
 
-  int curr_query_term_num = 0;
-  for (int i = 0; i < num_query_terms; ++i) {
-    LexiconData* lex_data = index_reader_.lexicon().GetEntry(words[i].c_str(), words[i].length());
-    if (lex_data != NULL)
-      query_term_data[curr_query_term_num++] = lex_data;
+  for (int i = 0; i < num_query_threads_; ++i) {
+    int pthread_ret = pthread_join(query_threads[i], NULL);
+    if (pthread_ret != 0) {
+      GetErrorLogger().LogErrno("pthread_join() in QueryProcessor::ExecuteBatchQueries()", pthread_ret, true);
+    }
+  }
+
+  // The statistics of the warm-up run are discarded.
+  if (warm_up_mode_)
+    return;
+
+  // Combine the statistics of this run from each of the threads.
+  query_thread_stats_.resize(num_query_threads_);
+  for (int i = 0; i < num_query_threads_; ++i) {
+    query_thread_stats_[i].Add(run_query_stats[i]);
+    query_stats_.Add(run_query_stats[i]);
   }
+}
 
-  if (processing_semantics == kOr) {
-    num_query_terms = curr_query_term_num;
+void* QueryProcessor::BatchQueryThread(void* args) {
+  BatchQueryThreadArgs* query_thread_args = static_cast<BatchQueryThreadArgs*> (args);
+  QueryProcessor* query_processor = query_thread_args->query_processor;
+  const vector<pair<int, string> >& queries = *query_thread_args->queries;
+
+  // Any statistics gathered by queries executing in this thread go to this thread's own copy.
+  thread_query_stats_ = query_thread_args->query_stats;
+
+  if (query_processor->query_pipeline_depth_ > 1) {
+    query_processor->ExecutePipelinedBatchQueries(queries);
+    return NULL;
   }
 
-  int results_size;
-  int total_num_results;
-  double query_elapsed_time;
+  int query_num;
+  while (query_processor->NextBatchQuery(&query_num, queries.size())) {
+    query_processor->ExecuteQuery(queries[query_num].second, queries[query_num].first);
+  }
+
+  return NULL;
+}
+
+// Returns true and sets 'query_num' to the next query in the batch that should be executed; returns false when all queries have been picked up.
+bool QueryProcessor::NextBatchQuery(int* query_num, int num_queries) {
+  pthread_mutex_lock(&batch_query_mutex_);
+  *query_num = next_batch_query_;
+  bool more_queries = (next_batch_query_ < num_queries);
+  if (more_queries)
+    ++next_batch_query_;
+  pthread_mutex_unlock(&batch_query_mutex_);
+  return more_queries;
+}
+
+// Executes the batch queries picked up by the calling query thread through a pipeline of up to 'query_pipeline_depth_' staged queries. When a query is staged,
+// the first blocks of its lists are queued up to be read in asynchronously. The thread then executes whichever staged query has all its blocks in the cache,
+// so that instead of waiting on the disk for one query, it does the CPU work of another. Only when none of the staged queries are ready does the thread wait,
+// on the oldest one. Note that blocks a query needs past the prefetched ones are still waited on as usual.
+// Queries can thus complete out of order (even with a single query thread). The block cache must be large enough to hold the read ahead blocks of all the
+// staged queries.
+void QueryProcessor::ExecutePipelinedBatchQueries(const vector<pair<int, string> >& queries) {
+  deque<StagedQuery> staged_queries;
+  bool more_queries = true;
+  while (true) {
+    // Fill up the pipeline.
+    while (more_queries && static_cast<long int> (staged_queries.size()) < query_pipeline_depth_) {
+      int query_num;
+      more_queries = NextBatchQuery(&query_num, queries.size());
+      if (more_queries) {
+        staged_queries.push_back(StagedQuery());
+        staged_queries.back().query_num = query_num;
+        StageQuery(queries[query_num].second, &staged_queries.back());
+      }
+    }
 
-  if (curr_query_term_num == num_query_terms) {
-    results_size = max_num_results_;
+    if (staged_queries.empty())
+      break;
+
+    deque<StagedQuery>::iterator next_query = staged_queries.begin();
+    while (next_query != staged_queries.end() && !StagedQueryReady(*next_query)) {
+      ++next_query;
+    }
+
+    if (next_query == staged_queries.end()) {
+      next_query = staged_queries.begin();
+      ++thread_query_stats_->num_pipeline_stalls;
+    } else if (next_query != staged_queries.begin()) {
+      ++thread_query_stats_->num_pipeline_reorders;
+    }
+
+    const pair<int, string>& query = queries[next_query->query_num];
+    ExecuteQuery(query.second, query.first);
+    UnstageQuery(*next_query);
+    staged_queries.erase(next_query);
+  }
+}
 
-    // These results are ranked from highest BM25 score to lowest.
-    Result ranked_results[max_num_results_];  // Using a variable length array here.
+// Prefetches the list layers that the query algorithm opens first for each of the query terms.
+void QueryProcessor::StageQuery(const string& query_line, StagedQuery* staged_query) {
+  string normalized_query_line = query_line;
+  vector<string> words;
+  GetQueryTerms(&normalized_query_line, &words);
+
+  for (size_t i = 0; i < words.size(); ++i) {
+    LexiconData* lex_data = index_reader_.lexicon().GetEntry(words[i].c_str(), words[i].length());
+    if (lex_data == NULL)
+      continue;
 
-    Timer query_time;  // Time how long it takes to answer a query.
+    int first_layer, last_layer;
     switch (query_algorithm_) {
+      // These open only the last layer.
       case kDaatAnd:
       case kDaatOr:
       case kDaatAndTopPositions:
-        total_num_results = ProcessQuery(query_term_data, num_query_terms, ranked_results, &results_size);
+        first_layer = last_layer = lex_data->num_layers() - 1;
         break;
+      // This opens the last layer, unless the layers are non-overlapping.
+      case kTaatOr:
+        first_layer = (index_layered_ && !index_overlapping_layers_) ? 0 : lex_data->num_layers() - 1;
+        last_layer = lex_data->num_layers() - 1;
+        break;
+      // These start out with only the first layer.
       case kDualLayeredOverlappingDaat:
       case kDualLayeredOverlappingMergeDaat:
-        total_num_results = ProcessLayeredQuery(query_term_data, num_query_terms, ranked_results, &results_size);
-        break;
-      case kMultiLayeredDaatOr:
-        total_num_results = ProcessMultiLayeredDaatOrQuery(query_term_data, num_query_terms, ranked_results, &results_size);
-        break;
-      case kMultiLayeredDaatOrMaxScore:
-        total_num_results = ProcessMultiLayeredDaatOrMaxScoreQuery(query_term_data, num_query_terms, ranked_results, &results_size);
-        break;
-      case kLayeredTaatOrEarlyTerminated:
-        total_num_results = ProcessLayeredTaatPrunedEarlyTerminatedQuery(query_term_data, num_query_terms, ranked_results, &results_size);
-        break;
-      case kWand:
-        total_num_results = MergeListsWand(query_term_data, num_query_terms, ranked_results, &results_size, false);
-        break;
-      case kDualLayeredWand:
-        total_num_results = MergeListsWand(query_term_data, num_query_terms, ranked_results, &results_size, true);
-        break;
-      case kMaxScore:
-        total_num_results = MergeListsMaxScore(query_term_data, num_query_terms, ranked_results, &results_size, false);
-        break;
-      case kDualLayeredMaxScore:
-        total_num_results = MergeListsMaxScore(query_term_data, num_query_terms, ranked_results, &results_size, true);
+        first_layer = last_layer = 0;
         break;
       default:
-        total_num_results = 0;
-        assert(false);
+        first_layer = 0;
+        last_layer = lex_data->num_layers() - 1;
+        break;
     }
-    query_elapsed_time = query_time.GetElapsedTime();
 
-    if (!warm_up_mode_) {
-      total_querying_time_ += query_elapsed_time;
-      ++total_num_queries_;
+    for (int j = first_layer; j <= last_layer; ++j) {
+      IndexReader::BlockRange blocks;
+      int disk_blocks_read = index_reader_.PrefetchList(*lex_data, j, &blocks);
+      staged_query->prefetched_blocks.push_back(blocks);
+      thread_query_stats_->num_prefetched_disk_blocks += disk_blocks_read;
     }
+  }
+}
 
-    cout.setf(ios::fixed, ios::floatfield);
-    cout.setf(ios::showpoint);
+bool QueryProcessor::StagedQueryReady(const StagedQuery& staged_query) {
+  for (size_t i = 0; i < staged_query.prefetched_blocks.size(); ++i) {
+    if (!index_reader_.PrefetchedBlocksReady(staged_query.prefetched_blocks[i]))
+      return false;
+  }
+  return true;
+}
 
-    if (result_format_ == kCompare) {
-      cout << "num results: " << results_size << endl;
+void QueryProcessor::UnstageQuery(const StagedQuery& staged_query) {
+  for (size_t i = 0; i < staged_query.prefetched_blocks.size(); ++i) {
+    index_reader_.FreePrefetchedBlocks(staged_query.prefetched_blocks[i]);
+  }
+}
+
+/**************************************************************************************************************************************************************
+ * Query Server
+ *
+ * Clients connect to the server address, which is either a Unix domain socket or a TCP port on the loopback interface, and send queries one per line, in the
+ * same format as the batch query file. The output of each query (in the configured result format) is sent back followed by a line holding a single '.', so
+ * that clients know where the output of one query ends (it's empty when no results were found in the TREC format). A connection can be used for any number
+ * of queries. The serving thread polls the listening socket and all the idle connections. Whenever a request arrives on a connection, it's queued up for
+ * the query threads, which form a worker pool. A query thread answers the queries received on the connection so far, and hands the connection back to be
+ * polled again, so that idle clients never tie up a query thread. The server shuts down on SIGINT or SIGTERM.
+ **************************************************************************************************************************************************************/
+// The signal handler writes to this pipe when the server should shut down, which wakes up the serving thread from poll().
+static int server_interrupt_pipe[2] = { -1, -1 };
+
+static void ServerInterruptHandler(int signal_num) {
+  int saved_errno = errno;
+  ssize_t write_ret = write(server_interrupt_pipe[1], "", 1);
+  (void) write_ret;  // If the pipe is full, the serving thread will be woken up anyway.
+  errno = saved_errno;
+}
+
+// Creates a pipe whose ends are both non-blocking.
+static void OpenNonBlockingPipe(int pipe_fds[2]) {
+  if (pipe(pipe_fds) < 0) {
+    GetErrorLogger().LogErrno("pipe() in OpenNonBlockingPipe()", errno, true);
+  }
+  for (int i = 0; i < 2; ++i) {
+    if (fcntl(pipe_fds[i], F_SETFL, fcntl(pipe_fds[i], F_GETFL) | O_NONBLOCK) < 0) {
+      GetErrorLogger().LogErrno("fcntl() in OpenNonBlockingPipe()", errno, true);
     }
+  }
+}
 
-    for (int i = 0; i < results_size; ++i) {
-      switch (result_format_) {
-        case kNormal:
-          if (!silent_mode_)
-            cout << setprecision(2) << setw(2) << "Score: " << ranked_results[i].first << "\tDocID: " << ranked_results[i].second << "\tURL: "
-                << index_reader_.document_map().GetDocumentUrl(ranked_results[i].second) << setprecision(6) << "\n";
-          break;
-        case kTrec:
-          cout << qid << '\t' << "Q0" << '\t' << index_reader_.document_map().GetDocumentNumber(ranked_results[i].second) << '\t' << i << '\t'
-              << ranked_results[i].first << '\t' << "PolyIRTK" << "\n";
-          break;
-        case kCompare:
-          cout << setprecision(2) << setw(2) << ranked_results[i].first << "\t" << ranked_results[i].second << setprecision(6) << "\n";
-          break;
-        case kDiscard:
-          break;
-        default:
-          assert(false);
-      }
+// Reads everything that's been written to the (non-blocking) pipe so far.
+static void DrainPipe(int pipe_fd) {
+  char drain_buffer[64];
+  while (read(pipe_fd, drain_buffer, sizeof(drain_buffer)) > 0) {
+  }
+}
+
+// Writes out the whole buffer to the client. Returns false if the client went away.
+static bool WriteToClient(int client_fd, const char* buffer, size_t buffer_len) {
+  while (buffer_len > 0) {
+    ssize_t write_ret = write(client_fd, buffer, buffer_len);
+    if (write_ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buffer += write_ret;
+    buffer_len -= write_ret;
+  }
+  return true;
+}
+
+// Creates the listening socket for the server address. An address made up of only digits is a TCP port number on the loopback interface; anything else is
+// the path of a Unix domain socket.
+static int OpenServerSocket(const string& server_address) {
+  bool tcp_port = !server_address.empty() && server_address.find_first_not_of("0123456789") == string::npos;
+
+  int listen_fd;
+  if (tcp_port) {
+    int port = atoi(server_address.c_str());
+    if (port <= 0 || port > 65535) {
+      Configuration::ErroneousValue(config_properties::kServerAddress, server_address);
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+      GetErrorLogger().LogErrno("socket() in OpenServerSocket()", errno, true);
+    }
+
+    int reuse_addr = 1;
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr)) < 0) {
+      GetErrorLogger().LogErrno("setsockopt() in OpenServerSocket()", errno, true);
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr*> (&addr), sizeof(addr)) < 0) {
+      GetErrorLogger().LogErrno("bind() in OpenServerSocket(), trying to bind to port " + server_address, errno, true);
     }
   } else {
-    // One of the query terms did not exist in the lexicon.
-    results_size = 0;
-    total_num_results = 0;
-    query_elapsed_time = 0;
+    struct sockaddr_un addr;
+    if (server_address.empty() || server_address.size() >= sizeof(addr.sun_path)) {
+      Configuration::ErroneousValue(config_properties::kServerAddress, server_address);
+    }
+
+    // Remove the socket left behind by a previous server that didn't shut down cleanly. We don't touch anything that's not a socket.
+    struct stat stat_buf;
+    if (stat(server_address.c_str(), &stat_buf) == 0 && S_ISSOCK(stat_buf.st_mode)) {
+      unlink(server_address.c_str());
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+      GetErrorLogger().LogErrno("socket() in OpenServerSocket()", errno, true);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, server_address.c_str());
+    if (bind(listen_fd, reinterpret_cast<struct sockaddr*> (&addr), sizeof(addr)) < 0) {
+      GetErrorLogger().LogErrno("bind() in OpenServerSocket(), trying to bind to '" + server_address + "'", errno, true);
+    }
   }
 
-  if (result_format_ == kNormal)
-    if (!silent_mode_)
-      cout << "\nShowing " << results_size << " results out of " << total_num_results << ". (" << setprecision(1) << (query_elapsed_time * 1000)
-          << setprecision(6) << " ms)\n";
+  if (listen(listen_fd, SOMAXCONN) < 0) {
+    GetErrorLogger().LogErrno("listen() in OpenServerSocket()", errno, true);
+  }
+  return listen_fd;
 }
 
-void QueryProcessor::RunBatchQueries(const string& input_source, bool warmup, int num_timed_runs) {
-  ifstream batch_query_file_stream;
-  if (!(input_source.empty() || input_source == "stdin" || input_source == "cin")) {
-    batch_query_file_stream.open(input_source.c_str());
-    if (!batch_query_file_stream) {
-      GetErrorLogger().Log("Could not open batch query file '" + input_source + "'.", true);
+void QueryProcessor::ServeQueries(const string& server_address) {
+  int listen_fd = OpenServerSocket(server_address);
+  // The listening socket is only accepted from once poll() reports a pending connection, but the client might have given up on it by then.
+  if (fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) < 0) {
+    GetErrorLogger().LogErrno("fcntl() in QueryProcessor::ServeQueries()", errno, true);
+  }
+
+  // A client closing its connection early must not kill the server.
+  signal(SIGPIPE, SIG_IGN);
+
+  // The interrupt signals are turned into a write to a pipe polled along with the connections, so that a signal arriving at any point can't be missed.
+  OpenNonBlockingPipe(server_interrupt_pipe);
+  struct sigaction interrupt_action;
+  memset(&interrupt_action, 0, sizeof(interrupt_action));
+  interrupt_action.sa_handler = ServerInterruptHandler;
+  interrupt_action.sa_flags = SA_RESTART;
+  sigemptyset(&interrupt_action.sa_mask);
+  sigaction(SIGINT, &interrupt_action, NULL);
+  sigaction(SIGTERM, &interrupt_action, NULL);
+
+  int wakeup_pipe[2];
+  OpenNonBlockingPipe(wakeup_pipe);
+  server_wakeup_fd_ = wakeup_pipe[1];
+
+  vector<pthread_t> server_threads(num_query_threads_);
+  vector<ServerThreadArgs> server_thread_args(num_query_threads_);
+  vector<QueryStatistics> server_query_stats(num_query_threads_);
+
+  for (int i = 0; i < num_query_threads_; ++i) {
+    server_thread_args[i].query_processor = this;
+    server_thread_args[i].query_stats = &server_query_stats[i];
+
+    int pthread_ret = pthread_create(&server_threads[i], NULL, ServerThread, &server_thread_args[i]);
+    if (pthread_ret != 0) {
+      GetErrorLogger().LogErrno("pthread_create() in QueryProcessor::ServeQueries()", pthread_ret, true);
     }
   }
 
-  istream& is = batch_query_file_stream.is_open() ? batch_query_file_stream : cin;
+  cout << "Serving queries on '" << server_address << "' with " << num_query_threads_ << " query threads." << endl;
 
-  vector<pair<int, string> > queries;
-  string query_line;
-  while (getline(is, query_line)) {
-    size_t colon_pos = query_line.find(':');
-    if (colon_pos != string::npos && colon_pos < (query_line.size() - 1)) {
-      queries.push_back(make_pair(atoi(query_line.substr(0, colon_pos).c_str()), query_line.substr(colon_pos + 1)));
-    } else {
-      queries.push_back(make_pair(0, query_line));
+  // The connections waiting for a request, which only the serving thread touches.
+  vector<ServerConnection*> idle_connections;
+  // The first entries polled are the interrupt pipe, the wakeup pipe, and the listening socket; the idle connections follow.
+  const int kNumServerFds = 3;
+  vector<struct pollfd> poll_fds;
+  while (true) {
+    pthread_mutex_lock(&server_mutex_);
+    idle_connections.insert(idle_connections.end(), served_connections_.begin(), served_connections_.end());
+    served_connections_.clear();
+    pthread_mutex_unlock(&server_mutex_);
+
+    poll_fds.resize(kNumServerFds + idle_connections.size());
+    poll_fds[0].fd = server_interrupt_pipe[0];
+    poll_fds[1].fd = wakeup_pipe[0];
+    poll_fds[2].fd = listen_fd;
+    for (size_t i = 0; i < idle_connections.size(); ++i) {
+      poll_fds[kNumServerFds + i].fd = idle_connections[i]->fd;
+    }
+    for (size_t i = 0; i < poll_fds.size(); ++i) {
+      poll_fds[i].events = POLLIN;
+      poll_fds[i].revents = 0;
     }
-  }
 
-  if (warmup) {
-    warm_up_mode_ = true;
-    for (int i = 0; i < static_cast<int> (queries.size()); ++i) {
-#ifdef IRTK_DEBUG
-      cout << queries[i].first << ":" << queries[i].second << endl;
-#endif
-      ExecuteQuery(queries[i].second, queries[i].first);
+    if (poll(&poll_fds[0], poll_fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      GetErrorLogger().LogErrno("poll() in QueryProcessor::ServeQueries()", errno, false);
+      break;
     }
 
-    index_reader_.ResetStats();
+    if (poll_fds[0].revents != 0)
+      break;
+
+    if (poll_fds[1].revents != 0)
+      DrainPipe(wakeup_pipe[0]);
+
+    // Queue up the connections with a request waiting (or that were closed by the client, which the query thread will find out about).
+    pthread_mutex_lock(&server_mutex_);
+    size_t num_idle_connections = 0;
+    for (size_t i = 0; i < idle_connections.size(); ++i) {
+      if (poll_fds[kNumServerFds + i].revents != 0) {
+        ready_connections_.push_back(idle_connections[i]);
+        pthread_cond_signal(&server_cond_);
+      } else {
+        idle_connections[num_idle_connections++] = idle_connections[i];
+      }
+    }
+    idle_connections.resize(num_idle_connections);
+    pthread_mutex_unlock(&server_mutex_);
+
+    if (poll_fds[2].revents != 0) {
+      int client_fd = accept(listen_fd, NULL, NULL);
+      if (client_fd >= 0) {
+        idle_connections.push_back(new ServerConnection(client_fd));
+        pthread_mutex_lock(&server_mutex_);
+        ++num_server_connections_;
+        pthread_mutex_unlock(&server_mutex_);
+      } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+        GetErrorLogger().LogErrno("accept() in QueryProcessor::ServeQueries()", errno, false);
+        break;
+      }
+    }
   }
 
-  warm_up_mode_ = false;
-  while (num_timed_runs-- > 0) {
-    for (int i = 0; i < static_cast<int> (queries.size()); ++i) {
-#ifdef IRTK_DEBUG
-      cout << queries[i].first << ":" << queries[i].second << endl;
-#endif
-      ExecuteQuery(queries[i].second, queries[i].first);
+  cout << "Shutting down the query server." << endl;
+  close(listen_fd);
+  if (server_address.find_first_not_of("0123456789") != string::npos) {
+    unlink(server_address.c_str());
+  }
+
+  // The connections being served are shut down, so that the query threads don't block writing to clients that aren't reading; any query being executed
+  // still completes.
+  pthread_mutex_lock(&server_mutex_);
+  server_stopping_ = true;
+  for (set<int>::iterator itr = active_connections_.begin(); itr != active_connections_.end(); ++itr) {
+    shutdown(*itr, SHUT_RDWR);
+  }
+  pthread_cond_broadcast(&server_cond_);
+  pthread_mutex_unlock(&server_mutex_);
+
+  for (int i = 0; i < num_query_threads_; ++i) {
+    int pthread_ret = pthread_join(server_threads[i], NULL);
+    if (pthread_ret != 0) {
+      GetErrorLogger().LogErrno("pthread_join() in QueryProcessor::ServeQueries()", pthread_ret, true);
     }
   }
+
+  // All the remaining connections are dropped; the query threads have closed the ones they were serving.
+  idle_connections.insert(idle_connections.end(), ready_connections_.begin(), ready_connections_.end());
+  idle_connections.insert(idle_connections.end(), served_connections_.begin(), served_connections_.end());
+  ready_connections_.clear();
+  served_connections_.clear();
+  for (size_t i = 0; i < idle_connections.size(); ++i) {
+    close(idle_connections[i]->fd);
+    delete idle_connections[i];
+  }
+
+  server_wakeup_fd_ = -1;
+  close(wakeup_pipe[0]);
+  close(wakeup_pipe[1]);
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  close(server_interrupt_pipe[0]);
+  close(server_interrupt_pipe[1]);
+  server_interrupt_pipe[0] = server_interrupt_pipe[1] = -1;
+
+  // Combine the statistics from each of the threads.
+  query_thread_stats_.resize(num_query_threads_);
+  for (int i = 0; i < num_query_threads_; ++i) {
+    query_thread_stats_[i].Add(server_query_stats[i]);
+    query_stats_.Add(server_query_stats[i]);
+  }
+}
+
+void* QueryProcessor::ServerThread(void* args) {
+  ServerThreadArgs* server_thread_args = static_cast<ServerThreadArgs*> (args);
+  QueryProcessor* query_processor = server_thread_args->query_processor;
+
+  // Any statistics gathered by queries executing in this thread go to this thread's own copy.
+  thread_query_stats_ = server_thread_args->query_stats;
+
+  ServerConnection* connection;
+  while (query_processor->NextServerConnection(&connection)) {
+    bool keep_open = query_processor->ServeRequest(connection);
+    query_processor->ReturnServerConnection(connection, keep_open);
+  }
+
+  return NULL;
+}
+
+// Blocks until there is a client connection with a request waiting and sets 'connection' to it; returns false when the server is shutting down.
+bool QueryProcessor::NextServerConnection(ServerConnection** connection) {
+  pthread_mutex_lock(&server_mutex_);
+  while (ready_connections_.empty() && !server_stopping_) {
+    pthread_cond_wait(&server_cond_, &server_mutex_);
+  }
+
+  bool have_connection = !server_stopping_;
+  if (have_connection) {
+    *connection = ready_connections_.front();
+    ready_connections_.pop_front();
+    active_connections_.insert((*connection)->fd);
+  }
+  pthread_mutex_unlock(&server_mutex_);
+  return have_connection;
+}
+
+// Hands the connection back to the serving thread to wait for the next request on it, or closes it if it shouldn't be kept open.
+void QueryProcessor::ReturnServerConnection(ServerConnection* connection, bool keep_open) {
+  pthread_mutex_lock(&server_mutex_);
+  active_connections_.erase(connection->fd);
+  keep_open = keep_open && !server_stopping_;
+  if (keep_open) {
+    served_connections_.push_back(connection);
+    ssize_t write_ret = write(server_wakeup_fd_, "", 1);
+    (void) write_ret;  // If the pipe is full, the serving thread will be woken up anyway.
+  }
+  pthread_mutex_unlock(&server_mutex_);
+
+  if (!keep_open) {
+    close(connection->fd);
+    delete connection;
+  }
+}
+
+// Answers all the complete queries received on the client connection, with a single read, since only that one is known not to block.
+// Returns false if the connection should be closed, because the client closed it or misbehaved.
+bool QueryProcessor::ServeRequest(ServerConnection* connection) {
+  // A client sending a longer line than this without a newline is considered broken, and is disconnected.
+  const size_t kMaxQueryLineLen = 1 << 16;
+
+  char read_buffer[4096];
+  ssize_t read_ret;
+  do {
+    read_ret = read(connection->fd, read_buffer, sizeof(read_buffer));
+  } while (read_ret < 0 && errno == EINTR);
+  if (read_ret <= 0)
+    return false;
+
+  string& input = connection->input;
+  input.append(read_buffer, read_ret);
+
+  size_t line_start = 0;
+  size_t line_end;
+  while ((line_end = input.find('\n', line_start)) != string::npos) {
+    string query_line = input.substr(line_start, line_end - line_start);
+    line_start = line_end + 1;
+
+    if (!query_line.empty() && query_line[query_line.size() - 1] == '\r')
+      query_line.erase(query_line.size() - 1);
+
+    pair<int, string> query = ParseQueryLine(query_line);
+    ostringstream query_output;
+    ExecuteQuery(query.second, query.first, &query_output);
+    query_output << ".\n";
+
+    string response = query_output.str();
+    if (!WriteToClient(connection->fd, response.c_str(), response.size()))
+      return false;
+  }
+  input.erase(0, line_start);
+
+  return input.size() <= kMaxQueryLineLen;
 }
 
 void QueryProcessor::LoadIndexProperties() {
+  // Any cached results and intersections are for a previously loaded index.
+  ClearQueryCaches();
+
   collection_total_num_docs_ = atol(index_reader_.meta_info().GetValue(meta_properties::kTotalNumDocs).c_str());
   if (collection_total_num_docs_ <= 0) {
     GetErrorLogger().Log("The '" + string(meta_properties::kTotalNumDocs) + "' value in the loaded index meta file seems to be incorrect.", false);
@@ -2988,9 +6054,40 @@ void QueryProcessor::LoadIndexProperties() {
   index_overlapping_layers_ = overlapping_layers_res.error() ? false : overlapping_layers_res.value_t();
   index_num_layers_ = num_layers_res.error() ? 1 : num_layers_res.value_t();
 
+  // When the index stores quantized scores (impacts) in place of the frequencies, a posting is scored by multiplying its impact by a constant,
+  // instead of computing BM25 (which requires the document length).
+  KeyValueStore::KeyValueResult<long int> quantized_impacts_res = index_reader_.meta_info().GetNumericalValue(meta_properties::kQuantizedImpacts);
+  index_quantized_impacts_ = quantized_impacts_res.error() ? false : quantized_impacts_res.value_t();
+  if (index_quantized_impacts_) {
+    long int impact_bits = IndexConfiguration::GetResultValue(index_reader_.meta_info().GetNumericalValue(meta_properties::kImpactQuantizationBits), true);
+    double impact_score_upperbound = IndexConfiguration::GetResultValue(index_reader_.meta_info().GetFloatingValue(meta_properties::kImpactScoreUpperbound),
+                                                                        true);
+    if (impact_bits <= 0 || impact_bits > 16 || impact_score_upperbound <= 0) {
+      GetErrorLogger().Log("The impact quantization properties in the loaded index meta file seem to be incorrect.", true);
+    }
+    impact_score_ = impact_score_upperbound / ((1 << impact_bits) - 1);
+  }
+
+  // An impact ordered index also stores impacts, but it can only be used with the score-at-a-time algorithm.
+  KeyValueStore::KeyValueResult<long int> impact_ordered_res = index_reader_.meta_info().GetNumericalValue(meta_properties::kImpactOrdered);
+  index_impact_ordered_ = impact_ordered_res.error() ? false : impact_ordered_res.value_t();
+  if (index_impact_ordered_) {
+    if (!index_quantized_impacts_) {
+      GetErrorLogger().Log("The loaded index is impact ordered, but the index meta file does not indicate quantized impacts.", true);
+    }
+  }
+
   bool inappropriate_algorithm = false;
+  if (index_impact_ordered_ && query_algorithm_ != kDefault && query_algorithm_ != kSaatAnytime && query_algorithm_ != kAuto) {
+    inappropriate_algorithm = true;
+  }
+
   switch (query_algorithm_) {
     case kDefault:  // Choose a conservative algorithm based on the index properties.
+      if (index_impact_ordered_) {
+        query_algorithm_ = kSaatAnytime;
+        break;
+      }
       // Note that for a layered index with overlapping layers, we can do non-layered processing
       // by just opening the last layer from each list (which contains all the docIDs in the entire list).
       if (!index_layered_ || index_overlapping_layers_) {
@@ -3006,13 +6103,19 @@ void QueryProcessor::LoadIndexProperties() {
     case kDaatOr:
     case kWand:  // TODO: For WAND, only need a single layered index, but need term upperbounds, which is not yet supported.
     case kDualLayeredWand:
+    case kBlockMaxWand:
     case kMaxScore:  // TODO: For MaxScore, only need a single layered index, but need term upperbounds, which is not yet supported.
     case kDualLayeredMaxScore:
-    case kDaatAndTopPositions:
       if (index_layered_ && !index_overlapping_layers_) {
         inappropriate_algorithm = true;
       }
       break;
+    case kDaatAndTopPositions:
+      // Scoring with positions requires the actual frequencies.
+      if ((index_layered_ && !index_overlapping_layers_) || index_quantized_impacts_) {
+        inappropriate_algorithm = true;
+      }
+      break;
     case kDualLayeredOverlappingDaat:
     case kDualLayeredOverlappingMergeDaat:
       if (!index_layered_ || !index_overlapping_layers_ || index_num_layers_ != 2) {
@@ -3026,8 +6129,37 @@ void QueryProcessor::LoadIndexProperties() {
         inappropriate_algorithm = true;
       }
       break;
-    case kTaatOr:
-      GetErrorLogger().Log("The selected query algorithm is not yet supported.", true);
+    case kSaatAnytime:
+      if (!index_impact_ordered_) {
+        inappropriate_algorithm = true;
+      }
+      break;
+    case kTaatOr:  // Works with any index that is not impact ordered: for non-overlapping layers, all the layers of a list are traversed.
+      break;
+    case kAuto:  // Pick from the OR mode algorithms that work with this index. The first one is used when the cost model has nothing to go by.
+      auto_algorithms_.clear();
+      if (index_impact_ordered_) {
+        auto_algorithms_.push_back(kSaatAnytime);
+      } else if (index_layered_ && !index_overlapping_layers_) {
+        auto_algorithms_.push_back(kLayeredTaatOrEarlyTerminated);
+        auto_algorithms_.push_back(kMultiLayeredDaatOr);
+        auto_algorithms_.push_back(kMultiLayeredDaatOrMaxScore);
+        auto_algorithms_.push_back(kTaatOr);
+      } else if (index_layered_ && index_num_layers_ == 2) {
+        auto_algorithms_.push_back(kWand);
+        auto_algorithms_.push_back(kDualLayeredWand);
+        auto_algorithms_.push_back(kDaatOr);
+        auto_algorithms_.push_back(kTaatOr);
+        // These need the chunk and block score upperbounds, which are only there if the index has an external index.
+        if (external_index_reader_ != NULL) {
+          auto_algorithms_.push_back(kMaxScore);
+          auto_algorithms_.push_back(kDualLayeredMaxScore);
+          auto_algorithms_.push_back(kBlockMaxWand);
+        }
+      } else {
+        auto_algorithms_.push_back(kDaatOr);
+        auto_algorithms_.push_back(kTaatOr);
+      }
       break;
     default:
       assert(false);
@@ -3036,6 +6168,146 @@ void QueryProcessor::LoadIndexProperties() {
   if (inappropriate_algorithm) {
     GetErrorLogger().Log("The selected query algorithm is not appropriate for this index type.", true);
   }
+
+  // Phrases are matched on the last layers of the lists, which must hold all the postings (along with their positions).
+  phrase_queries_ = use_positions_ && !index_quantized_impacts_ && (!index_layered_ || index_overlapping_layers_);
+
+  // The term proximity of the rescored results is computed on the last layers as well.
+  proximity_rescoring_ = proximity_pool_size_ > 0 && phrase_queries_;
+
+  // The dense accumulators are indexed by docID, so they must cover the whole docID range of the index.
+  if (query_algorithm_ == kSaatAnytime || query_algorithm_ == kTaatOr || query_algorithm_ == kAuto) {
+    uint32_t last_doc_id = IndexConfiguration::GetResultValue(index_reader_.meta_info().GetNumericalValue(meta_properties::kLastDocId), true);
+    num_dense_accumulators_ = max(collection_total_num_docs_, last_doc_id + 1);
+  }
+}
+
+void QueryProcessor::ClearQueryCaches() {
+  result_cache_.Clear();
+  intersection_cache_.Clear();
+  index_reader_.ClearDecodedChunkCache();
+}
+
+// Calibrates the cost model for 'kAuto' mode with a built-in benchmark: each of the sample queries is answered with each of the candidate algorithms, and the
+// running times are recorded by the shape of the query. Each algorithm answers a query twice, and only the second run is timed, so that the model reflects
+// the processing cost of the algorithm and not which algorithm happened to bring the lists into the cache first. The calibration queries are run in warm up
+// mode and their statistics are discarded, and anything they cached is dropped, so they're not counted towards the queries that follow.
+void QueryProcessor::CalibrateAlgorithmCostModel() {
+  assert(auto_algorithms_.size() > 0);
+
+  string calibration_queries_filename = IndexConfiguration::GetResultValue(
+      Configuration::GetConfiguration().GetStringValue(config_properties::kAutoAlgorithmCalibrationQueries), false);
+  if (calibration_queries_filename.empty() || calibration_queries_filename == "none") {
+    cout << "No calibration queries for the query algorithm cost model; answering all queries with '"
+        << GetQueryAlgorithmName(static_cast<QueryAlgorithm> (auto_algorithms_[0])) << "'." << endl << endl;
+    return;
+  }
+
+  long int max_calibration_queries = Configuration::GetResultValue<long int>(
+      Configuration::GetConfiguration().GetNumericalValue(config_properties::kAutoAlgorithmCalibrationMaxQueries));
+  if (max_calibration_queries <= 0) {
+    Configuration::ErroneousValue(config_properties::kAutoAlgorithmCalibrationMaxQueries,
+                                  Configuration::GetConfiguration().GetValue(config_properties::kAutoAlgorithmCalibrationMaxQueries));
+  }
+
+  ifstream calibration_queries_stream(calibration_queries_filename.c_str());
+  if (!calibration_queries_stream) {
+    GetErrorLogger().Log("Could not open calibration query file '" + calibration_queries_filename + "'.", true);
+  }
+
+  QueryStatistics calibration_query_stats;
+  QueryStatistics* query_stats = thread_query_stats_;
+  bool warm_up_mode = warm_up_mode_;
+  thread_query_stats_ = &calibration_query_stats;
+  warm_up_mode_ = true;
+
+  Result results[max_num_results_] __attribute__((aligned(64)));  // Using a variable length array here.
+
+  long int num_calibration_queries = 0;
+  string query_line;
+  while (num_calibration_queries < max_calibration_queries && getline(calibration_queries_stream, query_line)) {
+    string query = ParseQueryLine(query_line).second;
+    vector<string> words;
+    GetQueryTerms(&query, &words);
+
+    // With OR mode semantics, the terms that aren't in the lexicon are just left out.
+    vector<LexiconData*> query_term_data;
+    for (size_t i = 0; i < words.size(); ++i) {
+      LexiconData* lex_data = index_reader_.lexicon().GetEntry(words[i].c_str(), words[i].length());
+      if (lex_data != NULL)
+        query_term_data.push_back(lex_data);
+    }
+    if (query_term_data.empty())
+      continue;
+
+    int num_query_terms = query_term_data.size();
+    AlgorithmCostModel::QueryShape query_shape = GetQueryShape(&query_term_data[0], num_query_terms);
+    for (size_t i = 0; i < auto_algorithms_.size(); ++i) {
+      QueryAlgorithm query_algorithm = static_cast<QueryAlgorithm> (auto_algorithms_[i]);
+      for (int run = 0; run < 2; ++run) {
+        int num_results = max_num_results_;
+        Timer query_time;
+        RunQueryAlgorithm(query_algorithm, &query_term_data[0], num_query_terms, results, &num_results);
+        if (run == 1)
+          algorithm_cost_model_.AddSample(query_shape, query_algorithm, query_time.GetElapsedTime());
+      }
+    }
+    ++num_calibration_queries;
+  }
+
+  thread_query_stats_ = query_stats;
+  warm_up_mode_ = warm_up_mode;
+  index_reader_.ResetStats();
+  ClearQueryCaches();
+
+  cout << "Calibrated the query algorithm cost model with " << num_calibration_queries << " queries." << endl;
+  for (size_t i = 0; i < auto_algorithms_.size(); ++i) {
+    cout << "  Algorithm '" << GetQueryAlgorithmName(static_cast<QueryAlgorithm> (auto_algorithms_[i])) << "': "
+        << (algorithm_cost_model_.AverageCost(auto_algorithms_[i]) * 1000) << " ms average" << endl;
+  }
+  cout << endl;
+}
+
+const char* QueryProcessor::GetQueryAlgorithmName(QueryAlgorithm query_algorithm) {
+  switch (query_algorithm) {
+    case kDefault:
+      return "default";
+    case kDaatAnd:
+      return "daat-and";
+    case kDaatOr:
+      return "daat-or";
+    case kTaatOr:
+      return "taat-or";
+    case kDualLayeredOverlappingDaat:
+      return "dual-layered-overlapping-daat";
+    case kDualLayeredOverlappingMergeDaat:
+      return "dual-layered-overlapping-merge-daat";
+    case kLayeredTaatOrEarlyTerminated:
+      return "layered-taat-or-early-terminated";
+    case kMultiLayeredDaatOr:
+      return "multi-layered-daat-or";
+    case kMultiLayeredDaatOrMaxScore:
+      return "multi-layered-daat-or-max-score";
+    case kWand:
+      return "wand";
+    case kDualLayeredWand:
+      return "dual-layered-wand";
+    case kBlockMaxWand:
+      return "block-max-wand";
+    case kMaxScore:
+      return "max-score";
+    case kDualLayeredMaxScore:
+      return "dual-layered-max-score";
+    case kDaatAndTopPositions:
+      return "daat-and-top-positions";
+    case kSaatAnytime:
+      return "saat-anytime";
+    case kAuto:
+      return "auto";
+    default:
+      assert(false);
+      return "unknown";
+  }
 }
 
 void QueryProcessor::PrintQueryingParameters() {
@@ -3060,9 +6332,12 @@ CacheManager* QueryProcessor::GetCacheManager(const char* index_filename) const
 
 const ExternalIndexReader* QueryProcessor::GetExternalIndexReader(QueryAlgorithm query_algorithm, const char* external_index_filename) const {
   switch (query_algorithm) {
+    case kBlockMaxWand:
     case kMaxScore:
     case kDualLayeredMaxScore:
       return new ExternalIndexReader(external_index_filename);
+    case kAuto:  // The algorithms needing the external index are only picked from when the index has one.
+      return (access(external_index_filename, R_OK) == 0) ? new ExternalIndexReader(external_index_filename) : NULL;
     default:
       return NULL;
   }
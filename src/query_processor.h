@@ -46,10 +46,16 @@
 #include <cassert>
 #include <stdint.h>
 
+#include <pthread.h>
+
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <list>
+#include <map>
 #include <queue>
 #include <set>
+#include <sstream>
 #include <string>
 #include <utility>
 #include <vector>
@@ -57,6 +63,7 @@
 #include "index_layout_parameters.h"
 #include "index_reader.h"
 #include "index_util.h"
+#include "top_k_collector.h"
 #ifdef CUSTOM_HASH
 #include "integer_hash_table.h"
 #else
@@ -70,10 +77,392 @@
  **************************************************************************************************************************************************************/
 class CacheManager;
 class ExternalIndexReader;
+class ForwardIndexReader;
 struct Accumulator;
+struct DocIdScorePairScoreDescendingCompare;
 
 typedef std::pair<float, uint32_t> Result;
 
+/**************************************************************************************************************************************************************
+ * LatencyDistribution
+ *
+ * Holds the running times of a set of queries, so that latency percentiles can be reported. Averages hide the slow queries in the tail, which are the ones
+ * that matter the most for serving. All the latencies are kept, so the percentiles are exact; this is a few bytes per query.
+ **************************************************************************************************************************************************************/
+class LatencyDistribution {
+public:
+  LatencyDistribution() :
+    sorted_(true) {
+  }
+
+  void Add(double latency) {
+    latencies_.push_back(latency);
+    sorted_ = false;
+  }
+
+  void Add(const LatencyDistribution& latency_distribution);
+
+  // Returns the latency at the given percentile (between 0 and 100), or 0 if there are no latencies.
+  double Percentile(double percentile);
+
+  // Prints the number of latencies and the main percentiles (in milliseconds).
+  void Print(std::ostream& os);
+
+  size_t size() const {
+    return latencies_.size();
+  }
+
+private:
+  std::vector<double> latencies_;
+  bool sorted_;
+};
+
+/**************************************************************************************************************************************************************
+ * QueryStatistics
+ *
+ * Statistics gathered while processing queries. When running batch queries with multiple query threads, each thread keeps its own copy, so that the query
+ * algorithms can update them without any locking. The per thread copies are then combined once all the threads have finished.
+ **************************************************************************************************************************************************************/
+struct QueryStatistics {
+  QueryStatistics();
+
+  void Add(const QueryStatistics& query_stats);
+
+  double total_querying_time;             // Keeps track of the total elapsed query times.
+  uint64_t total_num_queries;             // Keeps track of the number of queries issued.
+  uint64_t num_early_terminated_queries;  // Keeps track of the number of queries which were able to early terminate (when using a layered index).
+  uint64_t num_single_term_queries;       // Keeps track of the number of single term queries issued.
+
+  // Statistics related to various query processing strategies.
+  uint64_t not_enough_results_definitely;
+  uint64_t not_enough_results_possibly;
+  uint64_t num_queries_containing_single_layered_terms;
+
+  uint64_t num_queries_kth_result_meeting_threshold;
+  uint64_t num_queries_kth_result_not_meeting_threshold;
+
+  uint64_t num_postings_scored;
+  uint64_t num_postings_skipped;
+
+  uint64_t num_heap_insertions;    // The number of results inserted into a top-k heap.
+  uint64_t num_threshold_changes;  // The number of times the top-k threshold used for pruning was raised.
+  uint64_t num_score_bound_skips;  // The number of times lists were skipped ahead (or a docID left unscored) because of a block or chunk score bound.
+
+  // Query result cache statistics.
+  uint64_t num_result_cache_hits;
+  uint64_t num_result_cache_misses;
+  uint64_t num_result_cache_evictions;
+
+  // Intersection cache statistics.
+  uint64_t num_intersection_cache_hits;
+  uint64_t num_intersection_cache_misses;
+  uint64_t num_intersection_cache_admissions;
+  uint64_t num_intersection_cache_evictions;
+
+  // Query pipeline statistics.
+  uint64_t num_prefetched_disk_blocks;  // The number of blocks read in from the disk while staging queries.
+  uint64_t num_pipeline_reorders;       // The number of queries executed ahead of an older staged query that was still waiting on its blocks.
+  uint64_t num_pipeline_stalls;         // The number of times none of the staged queries had their blocks ready, so the oldest one had to wait on them.
+
+  // Query latency distributions: overall, by the number of (unique) query terms, and by the query algorithm.
+  LatencyDistribution latencies;
+  std::map<int, LatencyDistribution> latencies_by_num_terms;
+  std::map<int, LatencyDistribution> latencies_by_algorithm;
+
+  // Time spent in query processing stages (in cycles, see 'CycleTimer'). The list stages are timed by the index reader.
+  uint64_t lexicon_lookup_cycles;  // Looking up the query terms in the lexicon.
+  uint64_t top_k_cycles;           // Maintaining the top-k results (only timed when compiled with 'IRTK_STAGE_TIMING').
+};
+
+/**************************************************************************************************************************************************************
+ * QueryTrace
+ *
+ * The work done by a single query, written out as a JSON record per query when tracing is turned on. The query statistics counters are those of the query's
+ * thread when the query started; the difference to their values when it finishes is what the query did.
+ **************************************************************************************************************************************************************/
+struct QueryTrace {
+  ListAccessStatistics list_access_stats;  // Collected from the lists as they are closed.
+
+  uint64_t num_postings_scored;
+  uint64_t num_heap_insertions;
+  uint64_t num_threshold_changes;
+  uint64_t num_score_bound_skips;
+};
+
+/**************************************************************************************************************************************************************
+ * QueryPhrase
+ *
+ * A quoted phrase of a query. Each phrase term is given by its index into the (sorted and deduplicated) query terms, along with its offset from the start
+ * of the phrase, so that a document contains the phrase if, for some position p, every phrase term occurs at position p + offset.
+ **************************************************************************************************************************************************************/
+struct QueryPhrase {
+  std::vector<int> term_nums;
+  std::vector<int> offsets;
+};
+
+/**************************************************************************************************************************************************************
+ * LoserTree
+ *
+ * A tournament tree for picking the list with the lowest current docID out of many lists. Each internal node holds the loser of the match played between
+ * the winners of its two subtrees, so when the list that won advances to its next docID, only the matches on the path from its leaf up to the root have to be
+ * replayed. This takes O(log n) comparisons per posting, instead of the O(n) for scanning the docIDs of all the lists.
+ *
+ * The leaves are stored implicitly after the 'num_lists' - 1 internal nodes, as in a binary heap. Ties between equal docIDs go to the lower list index.
+ **************************************************************************************************************************************************************/
+class LoserTree {
+public:
+  // The lists start out positioned at the docIDs 'doc_ids'. Exhausted lists have a docID of 'ListData::kNoMoreDocs'.
+  LoserTree(const uint32_t* doc_ids, int num_lists);
+
+  // The index of the list with the lowest current docID.
+  int winner() const {
+    return winner_;
+  }
+
+  uint32_t winner_doc_id() const {
+    return doc_ids_[winner_];
+  }
+
+  // Moves the winning list to 'doc_id' and finds the new winner.
+  void ReplaceWinner(uint32_t doc_id) {
+    doc_ids_[winner_] = doc_id;
+    int winner = winner_;
+    for (int node = (winner + num_lists_) >> 1; node > 0; node >>= 1) {
+      if (Beats(losers_[node], winner)) {
+        std::swap(losers_[node], winner);
+      }
+    }
+    winner_ = winner;
+  }
+
+private:
+  bool Beats(int list_a, int list_b) const {
+    return doc_ids_[list_a] < doc_ids_[list_b] || (doc_ids_[list_a] == doc_ids_[list_b] && list_a < list_b);
+  }
+
+  int num_lists_;
+  std::vector<uint32_t> doc_ids_;  // The current docID of each list.
+  std::vector<int> losers_;        // The loser of the match at each internal node (index 0 is unused).
+  int winner_;                     // The overall winner.
+};
+
+/**************************************************************************************************************************************************************
+ * SharedThreshold
+ *
+ * The top-k threshold shared by the threads processing the docID ranges of a single query. Each thread keeps its own top-k heap, and publishes the k-th
+ * score of its heap whenever it improves on the shared threshold. Since any docID has to beat the k-th score of every one of the heaps to make it into the
+ * final top-k, each thread can prune with the highest threshold found so far by any of the threads.
+ **************************************************************************************************************************************************************/
+class SharedThreshold {
+public:
+  SharedThreshold(float threshold);
+  ~SharedThreshold();
+
+  // Raises the shared threshold to 'threshold' if it's higher than the current one.
+  void Raise(float threshold);
+
+  // Reading the threshold is not synchronized. A float is read atomically, and a stale value only means a thread prunes a little less than it could.
+  float threshold() const {
+    return threshold_;
+  }
+
+private:
+  volatile float threshold_;
+  pthread_mutex_t mutex_;
+};
+
+/**************************************************************************************************************************************************************
+ * QueryResultCache
+ *
+ * Caches the top-k results of recently executed queries, so that repeated queries can be answered without looking up the lexicon or traversing any lists.
+ * Entries are keyed by the normalized set of query terms, the query algorithm, and k. Holds up to a fixed number of queries, evicting the least recently used
+ * query when full. It is concurrent safe for multiple queries running simultaneously.
+ **************************************************************************************************************************************************************/
+class QueryResultCache {
+public:
+  QueryResultCache(int capacity);
+  ~QueryResultCache();
+
+  // Returns the cache key for a query with the sorted and deduplicated 'terms'.
+  static std::string GetKey(const std::vector<std::string>& terms, int query_algorithm, int num_results);
+
+  // On a cache hit, copies the cached results into 'results' (which must be able to hold 'num_results' results), sets 'num_results' and 'total_num_results',
+  // and returns true. Returns false on a cache miss.
+  bool Lookup(const std::string& key, Result* results, int* num_results, int* total_num_results);
+
+  // Caches the 'num_results' results of the query with the cache key 'key'. Returns true if another query had to be evicted to make room for it.
+  bool Insert(const std::string& key, const Result* results, int num_results, int total_num_results);
+
+  // Removes all the cached queries.
+  void Clear();
+
+  int capacity() const {
+    return kCapacity;
+  }
+
+private:
+  struct CacheEntry {
+    std::string key;
+    std::vector<Result> results;
+    int total_num_results;
+  };
+
+  typedef std::list<CacheEntry> LruList;
+  typedef std::map<std::string, LruList::iterator> CacheMap;
+
+  const int kCapacity;  // The max number of queries that can be cached. A value of 0 disables the cache.
+
+  // Access to the cache must be concurrent safe.
+  pthread_mutex_t mutex_;
+
+  // Stores the cached queries, in LRU order (the most recently used is at the back).
+  LruList lru_list_;
+
+  // Maps a cache key to the cached query.
+  CacheMap cache_map_;
+};
+
+/**************************************************************************************************************************************************************
+ * IntersectionCache
+ *
+ * Caches the complete intersections of the lists of frequently co-occurring query term pairs, as arrays of docIDs along with the partial BM25 score of the
+ * pair for each docID. AND mode queries containing a cached pair use its intersection as a virtual list, instead of decoding and intersecting the two lists
+ * again. A pair is admitted into the cache once it has appeared in enough queries. The size of the cache is bounded by the total number of cached docIDs;
+ * the least recently used intersections are evicted to make room, as long as no query is using them. It is concurrent safe for multiple queries running
+ * simultaneously.
+ **************************************************************************************************************************************************************/
+class IntersectionCache {
+public:
+  // A docID in the intersection, along with the partial BM25 scores of the two terms (in the order the terms appear in the cache key), which are kept
+  // apart so that queries can add them up in the same order as when intersecting the lists themselves.
+  struct Posting {
+    uint32_t doc_id;
+    float scores[2];
+  };
+
+  typedef std::vector<Posting> Intersection;
+
+  IntersectionCache(long int capacity, int admission_count);
+  ~IntersectionCache();
+
+  // Returns the cache key for the pair of terms.
+  static std::string GetKey(const LexiconData& first_term, const LexiconData& second_term);
+
+  // Returns true if 'first_term' comes first in the cache key of the pair of terms.
+  static bool InKeyOrder(const LexiconData& first_term, const LexiconData& second_term);
+
+  // Counts another query containing the term pair 'key'. Returns true if the pair has appeared in enough queries to be admitted.
+  // A pair whose intersection is evicted has to make up its count again, and a pair whose intersection is too large to ever be cached is never admitted.
+  bool RecordPair(const std::string& key);
+
+  // Returns the cached intersection of the term pair 'key', or NULL if it's not cached. The returned intersection is pinned in the cache, so that it can't
+  // be evicted, until it's released with Release().
+  const Intersection* Lookup(const std::string& key);
+
+  // Caches the intersection of the term pair 'key', taking over the contents of 'intersection'. Returns the cached intersection, pinned as with Lookup(),
+  // or NULL if it doesn't fit into the cache. 'num_evictions' is set to the number of intersections that were evicted to make room for it.
+  const Intersection* Insert(const std::string& key, Intersection* intersection, int* num_evictions);
+
+  // Unpins the intersection of the term pair 'key'.
+  void Release(const std::string& key);
+
+  // Removes all the cached intersections and forgets how often the pairs have appeared. The pairs too large to cache are remembered, since they still won't
+  // fit. No intersection may be pinned.
+  void Clear();
+
+  long int capacity() const {
+    return kCapacity;
+  }
+
+private:
+  struct CacheEntry {
+    std::string key;
+    Intersection intersection;
+    int num_pins;
+  };
+
+  typedef std::list<CacheEntry> LruList;
+  typedef std::map<std::string, LruList::iterator> CacheMap;
+
+  // Bounds the memory used for counting how often the pairs have appeared.
+  static const size_t kMaxTrackedPairs = 1 << 20;
+
+  const long int kCapacity;   // The max total number of docIDs in the cached intersections. A value of 0 disables the cache.
+  const int kAdmissionCount;  // The number of queries a pair has to appear in to be admitted into the cache.
+
+  long int size_;  // The total number of docIDs in the cached intersections.
+
+  // Access to the cache must be concurrent safe.
+  pthread_mutex_t mutex_;
+
+  // Stores the cached intersections, in LRU order (the most recently used is at the back).
+  LruList lru_list_;
+
+  // Maps a cache key to the cached intersection.
+  CacheMap cache_map_;
+
+  // The number of queries each pair has appeared in so far.
+  std::map<std::string, int> pair_counts_;
+
+  // The pairs whose intersections are too large to ever be cached. These are not counted, and kept when the counts are cleared.
+  std::set<std::string> oversized_pairs_;
+};
+
+/**************************************************************************************************************************************************************
+ * AlgorithmCostModel
+ *
+ * Estimates how long each query algorithm takes to answer a query, from the shape of the query: its number of terms, the total length of its lists, the
+ * spread of its term score upperbounds, and whether all its terms have multiple layers. Queries are grouped into classes by their (bucketed) shape, and the
+ * model holds the running times of each algorithm over the calibration queries falling into each class. When a class has too few samples, the estimate comes
+ * from a coarser class instead (ignoring the score spread and layers, then also the list lengths, then everything). Once calibrated, it is only read from,
+ * so multiple queries can use it simultaneously.
+ **************************************************************************************************************************************************************/
+class AlgorithmCostModel {
+public:
+  struct QueryShape {
+    int num_terms;
+    uint64_t num_postings;  // The total number of postings in the complete lists of the query terms.
+    float score_spread;     // The ratio of the largest to the smallest term score upperbound.
+    bool multi_layered;     // Whether all the query terms have more than a single layer.
+  };
+
+  // Records that 'query_algorithm' took 'elapsed_time' seconds to answer a query with the shape 'query_shape'.
+  void AddSample(const QueryShape& query_shape, int query_algorithm, double elapsed_time);
+
+  // Returns the algorithm out of 'candidate_algorithms' with the lowest estimated running time for a query with the shape 'query_shape'.
+  // Returns the first candidate when there are no samples to go by.
+  int SelectAlgorithm(const QueryShape& query_shape, const std::vector<int>& candidate_algorithms) const;
+
+  // Returns the average running time (in seconds) of 'query_algorithm' over all its samples, or 0 if there are none.
+  double AverageCost(int query_algorithm) const;
+
+private:
+  struct Cost {
+    Cost() :
+      total_time(0), num_samples(0) {
+    }
+
+    double total_time;
+    int num_samples;
+  };
+
+  // Maps a (query class, query algorithm) pair to the running times of the algorithm on the queries of that class.
+  typedef std::map<std::pair<uint32_t, int>, Cost> CostMap;
+
+  // The number of class levels, from the finest (level 0) to the coarsest (a single class for all queries).
+  static const int kNumClassLevels = 4;
+
+  // The min number of samples every candidate algorithm needs in a class for its estimates to be used.
+  static const int kMinClassSamples = 3;
+
+  // Queries with more terms than this fall into the same classes.
+  static const int kMaxClassTerms = 8;
+
+  static uint32_t GetClassKey(const QueryShape& query_shape, int class_level);
+
+  CostMap costs_[kNumClassLevels];
+};
+
 class QueryProcessor {
 public:
 #ifdef CUSTOM_HASH
@@ -83,6 +472,8 @@ public:
 #else
   typedef std::tr1::unordered_set<uint32_t> TopKTable;
 #endif
+  // The top-k (docID, score) accumulators, used alongside the 'TopKTable'.
+  typedef TopKCollector<std::pair<uint32_t, float>, DocIdScorePairScoreDescendingCompare> AccumulatorTopK;
 
   enum QueryAlgorithm {
     kDefault,  // The query algorithm to use will be the default one used for the type of index that's being queried.
@@ -102,19 +493,50 @@ public:
 
     kWand,
     kDualLayeredWand,
+    kBlockMaxWand,  // WAND with additional skipping based on the chunk score upperbounds from the external index.
 
     kMaxScore,
     kDualLayeredMaxScore,
 
-    kDaatAndTopPositions
+    kDaatAndTopPositions,
+
+    // Score-at-a-time processing on an impact ordered index. The impact segments of all the lists are processed from the highest impact to the lowest.
+    // Processing stops early (with approximate results) when the configured postings or time budget is used up.
+    kSaatAnytime,
+
+    // Picks the algorithm for each query, out of the OR mode algorithms that are appropriate for the index, by the lowest running time estimated by the
+    // 'AlgorithmCostModel'. The cost model is calibrated when the index is loaded, by running a sample of queries with each of the algorithms.
+    kAuto
   };
 
   enum QueryMode {
-    kInteractive, kInteractiveSingle, kBatch, kBatchBench
+    kInteractive, kInteractiveSingle, kBatch, kBatchBench,
+
+    // Loads the index once and answers queries from clients connecting over a Unix domain socket or a loopback TCP port, until interrupted.
+    kServe
   };
 
   enum ResultFormat {
-    kTrec, kNormal, kCompare, kDiscard
+    kTrec, kNormal, kCompare, kDiscard,
+
+    // Outputs the feature vector of each result (see ExtractFeatures()), in the SVMlight ranking format. Requires the index to have a forward index.
+    kFeatures
+  };
+
+  // The features are only broken down by query term for this many query terms.
+  static const int kMaxFeatureQueryTerms = 8;
+
+  // The features of a document extracted by ExtractFeatures(), in the order they're laid out in its feature vector.
+  enum Feature {
+    kFeatureScore,                  // The score of the document from the query algorithm.
+    kFeatureDocLength,              // The length of the document.
+    kFeatureDocNumTerms,            // The number of unique terms in the document.
+    kFeatureNumQueryTermsMatched,   // The number of query terms in the document.
+    kFeatureQueryTermFrequencySum,  // The sum of the frequencies of the query terms in the document.
+    kFeatureBm25,                   // The BM25 score of the document.
+    kFeatureQueryTermFrequencies,   // The frequency of each of the first 'kMaxFeatureQueryTerms' query terms in the document (0 for missing query terms).
+    kFeatureQueryTermBm25 = kFeatureQueryTermFrequencies + kMaxFeatureQueryTerms,  // The partial BM25 score of each of the first query terms.
+    kNumFeatures = kFeatureQueryTermBm25 + kMaxFeatureQueryTerms
   };
 
   QueryProcessor(const IndexFiles& input_index_files, const char* stop_words_list_filename, QueryAlgorithm query_algorithm, QueryMode query_mode,
@@ -127,46 +549,185 @@ public:
 
   void AcceptQuery();
 
+  void ExtractFeatures(LexiconData** query_term_data, int num_query_terms, const Result* results, int num_results, float* features);
+
   void OpenListLayers(LexiconData** query_term_data, int num_query_terms, int max_layers, ListData* list_data_pointers[][MAX_LIST_LAYERS],
                       bool* single_term_query, int* single_layer_list_idx, int* total_num_layers);
 
   void CloseListLayers(int num_query_terms, int max_layers, ListData* list_data_pointers[][MAX_LIST_LAYERS]);
 
-  int ProcessQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
+  int ProcessQuery(QueryAlgorithm query_algorithm, LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
 
   int ProcessMultiLayeredDaatOrQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
   int ProcessMultiLayeredDaatOrMaxScoreQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
 
   int ProcessLayeredTaatPrunedEarlyTerminatedQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
   float ProcessListLayerOr(ListData* list, Accumulator** accumulators_array, int* accumulators_array_size, int* num_accumulators,
-                           std::pair<uint32_t, float>* top_k, int& num_top_k, TopKTable& top_k_table, int k, int* total_num_accumulators_created);
-  float ProcessListLayerAnd(ListData* list, Accumulator* accumulators, int num_accumulators, std::pair<uint32_t, float>* top_k, int& num_top_k,
-                            TopKTable& top_k_table, int k);
+                           AccumulatorTopK& top_k, TopKTable& top_k_table, int* total_num_accumulators_created);
+  float ProcessListLayerAnd(ListData* list, Accumulator* accumulators, int num_accumulators, AccumulatorTopK& top_k, TopKTable& top_k_table);
 
   int ProcessLayeredQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
 
-  void KthAccumulator(const Accumulator& new_accumulator, std::pair<uint32_t, float>* accumulators, int num_accumulators, TopKTable& top_k_table, int kth_score);
-  void BubbleDownHeap(std::pair<uint32_t, float>* top_k, int top_k_size, int node_idx);
-  void KthScore(float new_score, float* scores, int num_scores, int kth_score);
+  void KthAccumulator(const Accumulator& new_accumulator, AccumulatorTopK& top_k, TopKTable& top_k_table);
 
   int IntersectLists(ListData** lists, int num_lists, Result* results, int num_results);
   int IntersectLists(ListData** merge_lists, int num_merge_lists, ListData** lists, int num_lists, Result* results, int num_results);
+  int IntersectTwoListsChunked(ListData* short_list, ListData* long_list, Result* results, int num_results);
+  bool IntersectListsCached(LexiconData** query_term_data, ListData** lists, int num_lists, Result* results, int num_results, int* total_num_results);
+  int IntersectRemainingLists(ListData** lists, int num_lists, const float* remainder_score_upperbounds, Result* results, int num_candidate_results,
+                              int num_results);
+  void IntersectPair(ListData* first_list, ListData* second_list, IntersectionCache::Intersection* intersection);
+  int IntersectCachedPair(const IntersectionCache::Intersection& pair_intersection, const int* pair_list_nums, ListData** lists, int num_lists,
+                          Result* results, int num_results);
   int IntersectListsTopPositions(ListData** lists, int num_lists, Result* results, int num_results);
 
   int MergeLists(ListData** lists, int num_lists, uint32_t* merged_doc_ids, int max_merged_doc_ids);
   int MergeLists(ListData** lists, int num_lists, Result* results, int num_results);
+  int MergeListsLoserTree(ListData** lists, int num_lists, Result* results, int num_results);
   int MergeListsWand(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results, bool two_tiered);
+  int MergeListsBlockMaxWand(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
   int MergeListsMaxScore(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results, bool two_tiered);
+  float KthScoreThreshold(LexiconData** query_term_data, int num_query_terms, int k) const;
+
+  int ProcessPhraseQuery(LexiconData** query_term_data, int num_query_terms, const std::vector<QueryPhrase>& phrases, Result* results, int* num_results);
+
+  int ProcessProximityQuery(QueryAlgorithm query_algorithm, LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
+  void RescoreProximity(LexiconData** query_term_data, int num_query_terms, Result* results, int num_results);
+
+  int ProcessSaatAnytimeQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
+  int ProcessTaatOrQuery(LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
+
+  int RunQueryAlgorithm(QueryAlgorithm query_algorithm, LexiconData** query_term_data, int num_query_terms, Result* results, int* num_results);
+  AlgorithmCostModel::QueryShape GetQueryShape(LexiconData** query_term_data, int num_query_terms) const;
 
   void ExecuteQuery(std::string query_line, int qid);
+  void ExecuteQuery(std::string query_line, int qid, std::ostringstream* query_output);
+  void GetQueryTerms(std::string* query_line, std::vector<std::string>* words) const;
+  void GetQueryPhrases(const std::string& query_line, const std::vector<std::string>& words, std::vector<QueryPhrase>* phrases) const;
+  static void NormalizeQueryLine(std::string* query_line);
+
+  void StartQueryTrace(QueryTrace* query_trace);
+  void FinishQueryTrace(const QueryTrace& query_trace, int qid, const std::string& query_line, QueryAlgorithm query_algorithm, int num_query_terms,
+                        bool result_cache_hit, int num_results, int total_num_results, double query_elapsed_time);
+
+  // Returns the output buffer of the query currently executing in the calling thread, so that any diagnostic output of the query algorithms is kept together
+  // with the rest of the query's output. Outside of a query, this is standard output.
+  std::ostream& QueryOutput() const {
+    return (thread_query_output_ != NULL) ? *thread_query_output_ : std::cout;
+  }
+
+  // Returns the name of the query algorithm, as used on the command line.
+  static const char* GetQueryAlgorithmName(QueryAlgorithm query_algorithm);
 
   void RunBatchQueries(const std::string& input_source, bool warmup, int num_timed_runs);
+  void ExecuteBatchQueries(const std::vector<std::pair<int, std::string> >& queries);
+
+  void ServeQueries(const std::string& server_address);
 
   void LoadIndexProperties();
 
+  // Drops everything cached from the queries run so far (results, intersections, and decoded chunks), but not the blocks in the block cache.
+  void ClearQueryCaches();
+
+  void CalibrateAlgorithmCostModel();
+
   void PrintQueryingParameters();
 
 private:
+  // Arguments for each of the threads executing batch queries.
+  struct BatchQueryThreadArgs {
+    QueryProcessor* query_processor;
+    const std::vector<std::pair<int, std::string> >* queries;
+    QueryStatistics* query_stats;
+  };
+
+  static void* BatchQueryThread(void* args);
+  bool NextBatchQuery(int* query_num, int num_queries);
+
+  // A batch query picked up by a query thread, whose first list blocks are being read in ahead of its execution.
+  struct StagedQuery {
+    int query_num;                                        // The query's position in the batch.
+    std::vector<IndexReader::BlockRange> prefetched_blocks;  // The blocks prefetched for the query's lists; pinned until the query is unstaged.
+  };
+
+  void ExecutePipelinedBatchQueries(const std::vector<std::pair<int, std::string> >& queries);
+  void StageQuery(const std::string& query_line, StagedQuery* staged_query);
+  bool StagedQueryReady(const StagedQuery& staged_query);
+  void UnstageQuery(const StagedQuery& staged_query);
+
+  // Arguments for each of the threads processing a docID range of a single query.
+  struct RangeQueryThreadArgs {
+    QueryProcessor* query_processor;
+    bool max_score;                     // Run MaxScore on the range if true, WAND otherwise.
+    ListData** lists;                   // The lists opened for this range.
+    int num_lists;
+    const float* list_thresholds;       // The score upperbounds on the lists.
+    uint32_t range_start;               // The first docID of the range.
+    uint32_t range_end;                 // One past the last docID of the range.
+    float threshold;                    // The initial top-k threshold.
+    SharedThreshold* shared_threshold;  // The top-k threshold shared with the other ranges.
+    Result* results;                    // The top-k heap for this range.
+    int num_results;                    // The size of the top-k heap.
+    int total_num_results;              // Set to the number of docIDs scored in this range.
+    QueryStatistics query_stats;        // Statistics gathered in this range.
+  };
+
+  // Arguments for each of the threads serving client connections.
+  struct ServerThreadArgs {
+    QueryProcessor* query_processor;
+    QueryStatistics* query_stats;
+  };
+
+  // A client connection, along with the input received on it that doesn't make up a complete query line yet.
+  struct ServerConnection {
+    ServerConnection(int client_fd) :
+      fd(client_fd) {
+    }
+
+    int fd;
+    std::string input;
+  };
+
+  static void* ServerThread(void* args);
+  bool NextServerConnection(ServerConnection** connection);
+  bool ServeRequest(ServerConnection* connection);
+  void ReturnServerConnection(ServerConnection* connection, bool keep_open);
+
+  static void* RangeQueryThread(void* args);
+  void RunRangeQuery(RangeQueryThreadArgs* args);
+
+  bool UseIntraQueryParallelism(ListData** lists, int num_lists) const;
+  int MergeListsRanges(bool max_score, LexiconData** query_term_data, ListData** list_data_pointers, int num_query_terms, const float* list_thresholds,
+                       float threshold, Result* results, int num_results);
+  int MergeListsWandRange(ListData** lists, int num_lists, const float* list_thresholds, uint32_t range_start, uint32_t range_end, float threshold,
+                          SharedThreshold* shared_threshold, Result* results, int num_results);
+  int MergeListsMaxScoreRange(ListData** lists, int num_lists, const float* list_thresholds, uint32_t range_start, uint32_t range_end, float threshold,
+                              SharedThreshold* shared_threshold, Result* results, int num_results);
+
+  // The query kernels behind IntersectLists(), MergeLists(), MergeListsWandRange(), and MergeListsMaxScoreRange(). They're instantiated for a fixed number
+  // of lists (1 to 6), with 0 being the generic kernel for any number of lists. In the fixed ones, the per list state is in fixed size arrays and every
+  // loop over the lists is bounded by 'kFixedNumLists'; lists that run out of postings stay in place at the 'kNoMoreDocs' sentinel.
+  template<int kFixedNumLists>
+  int IntersectListsKernel(ListData** merge_lists, int num_merge_lists, ListData** lists, int runtime_num_lists, Result* results, int num_results);
+  template<int kFixedNumLists>
+  int MergeListsKernel(ListData** lists, int runtime_num_lists, Result* results, int num_results);
+  template<int kFixedNumLists>
+  int MergeListsWandRangeKernel(ListData** lists, int runtime_num_lists, const float* list_thresholds, uint32_t range_start, uint32_t range_end,
+                                float threshold, SharedThreshold* shared_threshold, Result* results, int num_results);
+  template<int kFixedNumLists>
+  int MergeListsMaxScoreRangeKernel(ListData** lists, int runtime_num_lists, const float* list_thresholds, uint32_t range_start, uint32_t range_end,
+                                    float threshold, SharedThreshold* shared_threshold, Result* results, int num_results);
+
+  // Dense accumulator arrays are divided into pages of 2^'kAccumulatorPageShift' accumulators. Term-at-a-time processing marks the pages it touches in a
+  // bitmap, so that only those pages need to be scanned for the top-k and cleared afterwards.
+  static const int kAccumulatorPageShift = 10;
+
+  uint32_t* AcquireDenseAccumulators();
+  void ReleaseDenseAccumulators(uint32_t* accumulators, const std::vector<uint32_t>& touched_doc_ids);
+  void ReleaseDenseAccumulators(uint32_t* accumulators, const std::vector<uint64_t>& touched_pages);
+
+  void OutputQuery(const std::ostringstream& query_output);
+
   CacheManager* GetCacheManager(const char* index_filename) const;
   const ExternalIndexReader* GetExternalIndexReader(QueryAlgorithm query_algorithm, const char* external_index_filename) const;
 
@@ -180,12 +741,15 @@ private:
   bool silent_mode_;     // When true, don't produce any output.
   bool warm_up_mode_;    // When true, don't time or count the queries. Queries issued during this time will be used for warming up the cache.
   bool use_positions_;   // Whether positions will be utilized during ranking (requires index built with positions).
+  bool phrase_queries_;  // Whether quoted phrases in queries are matched (requires positions and the complete lists in the last layers).
+  bool proximity_rescoring_;  // Whether OR mode queries are rescored by term proximity (has the same requirements as phrase queries).
 
   uint32_t collection_average_doc_len_;  // The average document length of a document in the indexed collection.
                                          // This plays a role in the ranking function (for document length normalization).
   uint32_t collection_total_num_docs_;   // The total number of documents in the indexed collection.
 
   const ExternalIndexReader* external_index_reader_;  // Only used for certain querying algorithms.
+  const ForwardIndexReader* forward_index_reader_;    // Only used for extracting features.
 
   CacheManager* cache_policy_;
 
@@ -195,23 +759,68 @@ private:
   bool index_layered_;
   bool index_overlapping_layers_;
   int index_num_layers_;  // This is really the max number of layers, since small inverted lists might have less layers.
-
-  // Query statistics.
-  double total_querying_time_;             // Keeps track of the total elapsed query times.
-  uint64_t total_num_queries_;             // Keeps track of the number of queries issued.
-  uint64_t num_early_terminated_queries_;  // Keeps track of the number of queries which were able to early terminate (when using a layered index).
-  uint64_t num_single_term_queries_;       // Keeps track of the number of single term queries issued.
-
-  // Statistics related to various query processing strategies.
-  uint64_t not_enough_results_definitely_;
-  uint64_t not_enough_results_possibly_;
-  uint64_t num_queries_containing_single_layered_terms_;
-
-  uint64_t num_queries_kth_result_meeting_threshold_;
-  uint64_t num_queries_kth_result_not_meeting_threshold_;
-
-  uint64_t num_postings_scored_;
-  uint64_t num_postings_skipped_;
+  bool index_impact_ordered_;
+  bool index_quantized_impacts_;      // Whether the frequencies in the index have been replaced by quantized scores (impacts).
+  float impact_score_;                // The score that a single unit of impact stands for (only for indices with quantized impacts).
+  uint32_t num_dense_accumulators_;   // The size of the dense accumulator arrays (covers all docIDs in the index).
+
+  // Batch query execution with multiple query threads.
+  int num_query_threads_;                               // The number of threads that will be executing batch queries concurrently.
+  int next_batch_query_;                                // The next query from the batch to be picked up by a query thread.
+  pthread_mutex_t batch_query_mutex_;                   // Protects 'next_batch_query_'.
+  pthread_mutex_t output_mutex_;                        // Makes sure that the output of concurrently running queries doesn't get interleaved.
+  double batch_querying_time_;                          // The wall clock time it took to execute the timed batch query runs.
+  std::vector<QueryStatistics> query_thread_stats_;     // The statistics for each query thread.
+  long int query_pipeline_depth_;                       // The max number of batch queries each query thread has staged (1 disables the pipeline).
+  std::ofstream query_trace_stream_;                    // Where a JSON record is written for each batch query (only open when tracing).
+  pthread_mutex_t query_trace_mutex_;                   // Makes sure that the records of concurrently running queries don't get interleaved.
+
+  // Query server ('kServe' mode). The serving thread polls the idle client connections, and queues up each connection that has a request waiting on it. The
+  // query threads form the worker pool, each answering the request of one connection at a time, and then handing the connection back to be polled again.
+  std::deque<ServerConnection*> ready_connections_;     // Connections with a request waiting, not yet picked up by a query thread.
+  std::vector<ServerConnection*> served_connections_;   // Connections whose requests have been answered, to be polled again by the serving thread.
+  std::set<int> active_connections_;                    // Client connections currently being served by a query thread.
+  bool server_stopping_;                                // Set when the server is shutting down; the query threads exit once they see it.
+  uint64_t num_server_connections_;                     // The number of client connections accepted.
+  int server_wakeup_fd_;                                // Written to when a connection is handed back, to wake up the serving thread.
+  pthread_mutex_t server_mutex_;                        // Protects the above server state.
+  pthread_cond_t server_cond_;                          // Signaled when a connection is queued or the server is shutting down.
+
+  // Intra-query parallelism for WAND and MaxScore (by docID range partitioning).
+  int num_intra_query_threads_;                         // The number of docID ranges (and threads) a single query is split into.
+  long int intra_query_min_postings_;                   // The minimum total number of postings in the lists of a query for it to be split up.
+
+  // Score-at-a-time processing budgets and state.
+  long int saat_postings_budget_;                       // The max number of postings processed per query (0 means no limit).
+  long int saat_time_budget_;                           // The max time in milliseconds spent processing postings per query (0 means no limit).
+  std::vector<uint32_t*> free_dense_accumulators_;      // Dense accumulator arrays (one entry per docID) not in use by any query; reused across queries.
+  pthread_mutex_t dense_accumulators_mutex_;            // Protects 'free_dense_accumulators_'.
+
+  // Two term list intersection.
+  long int simd_intersection_max_ratio_;                // The max list length ratio for intersecting a chunk at a time with SIMD (0 disables).
+
+  // Term proximity rescoring of OR mode queries.
+  long int proximity_pool_size_;                        // The number of top BM25 results that are rescored (0 disables proximity rescoring).
+  float proximity_weight_;                              // The weight of the term proximity score added to the BM25 score.
+
+  // Caches the results of repeated queries. It's cleared whenever an index is loaded.
+  QueryResultCache result_cache_;
+
+  // Caches the intersections of frequent query term pairs. It's cleared whenever an index is loaded.
+  IntersectionCache intersection_cache_;
+
+  // Per query algorithm selection ('kAuto' mode).
+  std::vector<int> auto_algorithms_;                    // The algorithms appropriate for the index that a query can be answered with.
+  AlgorithmCostModel algorithm_cost_model_;             // Estimates the running time of each of these algorithms on a query.
+
+  // Query statistics (combined from all the query threads).
+  QueryStatistics query_stats_;
+
+  // Points to the statistics that should be updated by the query currently executing in the calling thread.
+  static __thread QueryStatistics* thread_query_stats_;
+
+  // Points to the output buffer of the query currently executing in the calling thread (NULL when no query is executing).
+  static __thread std::ostringstream* thread_query_output_;
 };
 
 /**************************************************************************************************************************************************************
@@ -224,12 +833,7 @@ struct ResultPositionTuple {
   float score;
   uint32_t* positions;
 
-  // Used to implement min heap for candidate documents.
-  bool operator<(const ResultPositionTuple& rhs) const {
-    return score > rhs.score;
-  }
-
-  // Used to sort documents in descending order by score.
+  // Used to maintain the top candidate documents and to sort documents in descending order by score.
   bool operator()(const ResultPositionTuple& l, const ResultPositionTuple& r) const {
     return l.score > r.score;
   }
@@ -290,6 +894,16 @@ struct ResultCompare {
   }
 };
 
+/**************************************************************************************************************************************************************
+ * ResultDocIdCompare
+ *
+ **************************************************************************************************************************************************************/
+struct ResultDocIdCompare {
+  bool operator()(const Result& l, const Result& r) const {
+    return l.second < r.second;
+  }
+};
+
 /**************************************************************************************************************************************************************
  * ListLayerMaxScoreCompare
  *
@@ -301,6 +915,17 @@ struct ListLayerMaxScoreCompare {
   }
 };
 
+/**************************************************************************************************************************************************************
+ * ListIdfCompare
+ *
+ * Compares lists by the number of documents in their complete lists, used to sort lists in order of decreasing idf (the rarest terms first).
+ **************************************************************************************************************************************************************/
+struct ListIdfCompare {
+  bool operator()(const ListData* l, const ListData* r) const {
+    return l->num_docs_complete_list() < r->num_docs_complete_list();
+  }
+};
+
 /**************************************************************************************************************************************************************
  * ListDocIdCompare
  *
@@ -54,3 +54,21 @@ double Timer::GetElapsedTimeSys() {
   double time_diff = time_diff_sys.tv_sec + time_diff_sys.tv_usec / 1000000.0;  // 10^6 usec per second.
   return time_diff;
 }
+
+/**************************************************************************************************************************************************************
+ * CycleTimer
+ *
+ **************************************************************************************************************************************************************/
+// The cycle count and time when the program started, from which the cycle rate is measured.
+static uint64_t program_start_cycles = CycleTimer::GetCycles();
+static Timer program_start_time;
+
+double CycleTimer::CyclesToSeconds(uint64_t cycles) {
+  // The rate is only accurate once a bit of time has passed (which is always the case after running some queries).
+  double elapsed_time;
+  while ((elapsed_time = program_start_time.GetElapsedTime()) < 0.01) {
+  }
+
+  double cycles_per_second = (GetCycles() - program_start_cycles) / elapsed_time;
+  return cycles / cycles_per_second;
+}
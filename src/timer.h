@@ -34,6 +34,7 @@
 
 #include <cstdlib>
 #include <ctime>
+#include <stdint.h>
 
 #include <sys/time.h>
 
@@ -50,4 +51,50 @@ private:
   timeval start_time_sys_;
 };
 
+/**************************************************************************************************************************************************************
+ * CycleTimer
+ *
+ * A low overhead timer for timing short sections of code, such as the decoding of a single chunk, where the system calls made by 'Timer' would cost more than
+ * the code being timed. It reads the processor's time stamp counter (or a monotonic clock on other architectures). The elapsed cycles are meant to be summed
+ * up and only converted into seconds at the end.
+ **************************************************************************************************************************************************************/
+class CycleTimer {
+public:
+  CycleTimer() :
+    start_cycles_(GetCycles()) {
+  }
+
+  uint64_t GetElapsedCycles() const {
+    return GetCycles() - start_cycles_;
+  }
+
+  static uint64_t GetCycles() {
+#if defined(__i386__) || defined(__x86_64__)
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+    return (static_cast<uint64_t> (high) << 32) | low;
+#else
+    timespec curr_time;
+    clock_gettime(CLOCK_MONOTONIC, &curr_time);
+    return static_cast<uint64_t> (curr_time.tv_sec) * 1000000000 + curr_time.tv_nsec;
+#endif
+  }
+
+  // Converts a number of cycles into seconds, using the cycle rate measured since the program started.
+  static double CyclesToSeconds(uint64_t cycles);
+
+private:
+  uint64_t start_cycles_;
+};
+
+// Compiling with 'make STAGE_TIMING=YES' times the fine grained query processing stages, like chunk decoding and top-k maintenance. These happen so often that
+// even a 'CycleTimer' adds noticeable overhead, so they're not timed by default.
+#ifdef IRTK_STAGE_TIMING
+#define START_STAGE_TIMER(timer) CycleTimer timer
+#define STOP_STAGE_TIMER(timer, total_cycles) (total_cycles) += timer.GetElapsedCycles()
+#else
+#define START_STAGE_TIMER(timer)
+#define STOP_STAGE_TIMER(timer, total_cycles)
+#endif
+
 #endif /* TIMER_H_ */
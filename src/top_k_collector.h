@@ -0,0 +1,229 @@
+// Copyright (c) 2010, Roman Khmelichek
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//  2. Redistributions in binary form must reproduce the above copyright notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//  3. Neither the name of Roman Khmelichek nor the names of its contributors
+//     may be used to endorse or promote products derived from this software
+//     without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE AUTHOR "AS IS" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+// EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+//==============================================================================================================================================================
+// Author(s): Roman Khmelichek
+//
+// A bounded min-heap that keeps the k best entries seen so far; used by all the query algorithms to maintain their top-k results and thresholds.
+//==============================================================================================================================================================
+
+#ifndef TOP_K_COLLECTOR_H_
+#define TOP_K_COLLECTOR_H_
+
+#include <cassert>
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+/**************************************************************************************************************************************************************
+ * TopKScore
+ *
+ * The score of a top-k entry, which is what the threshold of a 'TopKCollector' is expressed in. Entry types other than the ones here can be supported by
+ * overloading this function (it's found through argument dependent lookup).
+ **************************************************************************************************************************************************************/
+// A (score, docID) result.
+inline float TopKScore(const std::pair<float, uint32_t>& entry) {
+  return entry.first;
+}
+
+// A (docID, score) pair.
+inline float TopKScore(const std::pair<uint32_t, float>& entry) {
+  return entry.second;
+}
+
+// Just the score.
+inline float TopKScore(float entry) {
+  return entry;
+}
+
+/**************************************************************************************************************************************************************
+ * TopKCollector
+ *
+ * Keeps the best 'capacity' entries offered to it in a min-heap, so that the worst of them (the k-th best entry, whose score is the threshold) is always at the
+ * top. 'Compare' has the same semantics as the comparators given to the standard heap algorithms for making a min-heap: 'Compare()(a, b)' is true when 'a' is
+ * strictly better than 'b'.
+ *
+ * The heap is kept in an array owned by the caller, usually the results array that is returned from the query algorithm, so no copying is necessary after the
+ * final sort. Callers should align the array to a cache line; every insertion touches the top levels of the heap, and with 8 byte entries, the first three
+ * levels then fit in a single line.
+ *
+ * Once the heap is full, most entries offered are worse than the threshold; these are rejected with a single comparison against the top of the heap. An
+ * accepted entry replaces the top in place, instead of the separate pop and push the standard heap algorithms would require.
+ **************************************************************************************************************************************************************/
+template<class T, class Compare>
+class TopKCollector {
+public:
+  TopKCollector(T* entries, int capacity, Compare compare = Compare()) :
+    entries_(entries), capacity_(capacity), size_(0), compare_(compare) {
+    assert(capacity_ > 0);
+  }
+
+  // Offers 'entry' to the collector. Returns true if it was inserted (it's one of the best 'capacity' entries so far).
+  bool Insert(const T& entry) {
+    if (size_ == capacity_) {
+      // The fast path; most entries don't make it.
+      if (!compare_(entry, entries_[0]))
+        return false;
+
+      ReplaceTop(entry);
+      return true;
+    }
+
+    SiftUp(size_++, entry);
+    return true;
+  }
+
+  // Offers all the entries in the range ['first', 'last'). Entries that fill up the free space in the heap are copied in without maintaining the heap
+  // property, and the heap is then built in a single linear time pass. Returns the number of entries that were inserted.
+  template<class InputIterator>
+  int InsertBatch(InputIterator first, InputIterator last) {
+    int num_inserted = 0;
+    if (size_ < capacity_ && first != last) {
+      while (size_ < capacity_ && first != last) {
+        entries_[size_++] = *first;
+        ++first;
+        ++num_inserted;
+      }
+      std::make_heap(entries_, entries_ + size_, compare_);
+    }
+
+    for (; first != last; ++first) {
+      if (Insert(*first))
+        ++num_inserted;
+    }
+    return num_inserted;
+  }
+
+  // Returns true if 'entry' would be inserted. Useful when building the entry is expensive.
+  bool Accepts(const T& entry) const {
+    return size_ < capacity_ || compare_(entry, entries_[0]);
+  }
+
+  // Restores the heap property after the entry at 'index' was improved in place (e.g. an accumulator that is in the heap had its score increased).
+  void SiftDown(int index) {
+    T* entries = entries_;
+    const int size = size_;
+    const T entry = entries[index];
+    int child;
+    while ((child = (index << 1) + 1) < size) {
+      // Pick the worse of the two children.
+      if (child + 1 < size && compare_(entries[child], entries[child + 1]))
+        ++child;
+      if (!compare_(entry, entries[child]))
+        break;
+      entries[index] = entries[child];
+      index = child;
+    }
+    entries[index] = entry;
+  }
+
+  // Sorts the entries from best to worst, which destroys the heap. Returns the number of entries.
+  int Sort() {
+    std::sort(entries_, entries_ + size_, compare_);
+    return size_;
+  }
+
+  void Clear() {
+    size_ = 0;
+  }
+
+  // The score an entry has to beat to be inserted. This is the lowest possible score until the heap fills up.
+  float threshold() const {
+    return (size_ < capacity_) ? -std::numeric_limits<float>::max() : TopKScore(entries_[0]);
+  }
+
+  // The worst entry in the heap; only valid if the heap isn't empty.
+  const T& top() const {
+    return entries_[0];
+  }
+
+  T* entries() const {
+    return entries_;
+  }
+
+  bool full() const {
+    return size_ == capacity_;
+  }
+
+  int size() const {
+    return size_;
+  }
+
+  int capacity() const {
+    return capacity_;
+  }
+
+private:
+  // Walks the hole left by the top entry down to a leaf, always promoting the worse child, and then sifts 'entry' up from there. A new entry usually belongs
+  // near the bottom of the heap, so this takes about half the comparisons of sifting it down from the top.
+  // The heap members are copied into locals in the loops below; since the entries can contain integers, the compiler would otherwise have to assume that
+  // storing an entry could change 'size_', and reload it on every iteration.
+  void ReplaceTop(const T& entry) {
+    T* entries = entries_;
+    const int size = size_;
+    const T value = entry;
+    int index = 0;
+    int child;
+    // Nodes before 'last_parent' have two children.
+    const int last_parent = (size - 1) >> 1;
+    while (index < last_parent) {
+      // Pick the worse of the two children.
+      child = (index + 1) << 1;
+      if (!compare_(entries[child - 1], entries[child]))
+        --child;
+      entries[index] = entries[child];
+      index = child;
+    }
+    // With an even number of entries, the last parent has a single child.
+    if ((size & 1) == 0 && index == last_parent) {
+      child = (index << 1) + 1;
+      entries[index] = entries[child];
+      index = child;
+    }
+    SiftUp(index, value);
+  }
+
+  // Places 'entry' into the hole at 'index' and moves it up to where it belongs.
+  void SiftUp(int index, const T& entry) {
+    T* entries = entries_;
+    const T value = entry;
+    int parent;
+    while (index > 0 && compare_(entries[parent = (index - 1) >> 1], value)) {
+      entries[index] = entries[parent];
+      index = parent;
+    }
+    entries[index] = value;
+  }
+
+  T* entries_;
+  int capacity_;
+  int size_;
+  Compare compare_;
+};
+
+#endif /* TOP_K_COLLECTOR_H_ */